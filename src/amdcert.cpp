@@ -15,6 +15,8 @@
  **************************************************************************/
 
 #include "amdcert.h"
+#include "certformat.h"
+#include "metrics.h"
 #include "utilities.h"  // reverse_bytes
 #include <cstring>      // memset
 #include <openssl/ts.h> // SHA256_CTX
@@ -24,37 +26,15 @@
  */
 void print_amd_cert_readable(const amd_cert *cert, std::string &out_str)
 {
-    char out[sizeof(amd_cert)*3+500];   // 2 chars per byte + 1 space + ~500 extra chars for text
-
-    sprintf(out, "%-15s%08x\n", "Version:", cert->version);                               // uint32_t
-    sprintf(out+strlen(out), "%-15s%016lx\n", "key_id_0:", cert->key_id_0);               // uint64_t
-    sprintf(out+strlen(out), "%-15s%016lx\n", "key_id_1:", cert->key_id_1);               // uint64_t
-    sprintf(out+strlen(out), "%-15s%016lx\n", "certifying_id_0:", cert->certifying_id_0); // uint64_t
-    sprintf(out+strlen(out), "%-15s%016lx\n", "certifying_id_1:", cert->certifying_id_1); // uint64_t
-    sprintf(out+strlen(out), "%-15s%08x\n", "key_usage:", cert->key_usage);               // uint32_t
-    sprintf(out+strlen(out), "%-15s%016lx\n", "reserved_0:", cert->reserved_0);           // uint64_t
-    sprintf(out+strlen(out), "%-15s%016lx\n", "reserved_1:", cert->reserved_1);           // uint64_t
-    sprintf(out+strlen(out), "%-15s%08x\n", "pub_exp_size:", cert->pub_exp_size);         // uint32_t
-    sprintf(out+strlen(out), "%-15s%08x\n", "modulus_size:", cert->modulus_size);         // uint32_t
-    sprintf(out+strlen(out), "\nPubExp:\n");
-    for (size_t i = 0; i < (size_t)(cert->pub_exp_size/8); i++) {    // bytes to uint8
-        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->pub_exp)[i] );
-    }
-    sprintf(out+strlen(out), "\nModulus:\n");
-    for (size_t i = 0; i < (size_t)(cert->modulus_size/8); i++) {    // bytes to uint8
-        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->modulus)[i] );
-    }
-    sprintf(out+strlen(out), "\nSig:\n");
-    for (size_t i = 0; i < (size_t)(cert->modulus_size/8); i++) {    // bytes to uint8
-        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->sig)[i] );
-    }
-    sprintf(out+strlen(out), "\n");
-
     if (out_str == "NULL") {
-        printf("%s\n", out);
+        sev::FormatBuffer out(stdout);
+        sev::format_amd_cert_readable(&out, cert);
+        printf("\n");
     }
     else {
-        out_str += out;
+        sev::FormatBuffer out(sev::amd_cert_readable_size(cert) + 1);
+        if (sev::format_amd_cert_readable(&out, cert))
+            out_str.append(out.data(), out.size());
     }
 }
 
@@ -62,38 +42,20 @@ void print_amd_cert_readable(const amd_cert *cert, std::string &out_str)
  * AMD Certs are unions because key sizes can be different. So, you can't just
  * print out the memory, you need to print each parameter based off its correct
  * size
- * Note: there are no spaces in this printout because this function is also used
- *       to write to a .cert file, not just printing to the screen
+ * Note: there are no spaces in this printout. To write a .cert file, use
+ *       sev::write_amd_cert_binary() instead of converting this back
  */
 void print_amd_cert_hex(const amd_cert *cert, std::string &out_str)
 {
-    char out[sizeof(amd_cert)*2];   // 2 chars per byte
-    size_t fixed_offset = offsetof(amd_cert, pub_exp);      // 64 bytes
-
-    out[0] = '\0';       // Gotta get the sprintf started
-
-    // Print fixed parameters
-    for (size_t i = 0; i < fixed_offset; i++) {
-        sprintf(out+strlen(out), "%02X", ((uint8_t *)&cert->version)[i] );
-    }
-    // Print pub_exp
-    for (size_t i = 0; i < (size_t)(cert->pub_exp_size/8); i++) {    // bytes to uint8
-        sprintf(out+strlen(out), "%02X", ((uint8_t *)&cert->pub_exp)[i] );
-    }
-    // Print nModulus
-    for (size_t i = 0; i < (size_t)(cert->modulus_size/8); i++) {    // bytes to uint8
-        sprintf(out+strlen(out), "%02X", ((uint8_t *)&cert->modulus)[i] );
-    }
-    // Print Sig
-    for (size_t i = 0; i < (size_t)(cert->modulus_size/8); i++) {    // bytes to uint8
-        sprintf(out+strlen(out), "%02X", ((uint8_t *)&cert->sig)[i] );
-    }
-
     if (out_str == "NULL") {
-        printf("%s\n\n\n", out);
+        sev::FormatBuffer out(stdout);
+        sev::format_amd_cert_hex(&out, cert);
+        printf("\n\n\n");
     }
     else {
-        out_str += out;
+        sev::FormatBuffer out(sev::amd_cert_hex_size(cert) + 1);
+        if (sev::format_amd_cert_hex(&out, cert))
+            out_str.append(out.data(), out.size());
     }
 }
 
@@ -108,6 +70,7 @@ bool AMDCert::key_size_is_valid(size_t size)
 SEV_ERROR_CODE AMDCert::amd_cert_validate_sig(const amd_cert *cert,
                                               const amd_cert *parent)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_VERIFY, "amd_cert_signature");
     SEV_ERROR_CODE cmd_ret = ERROR_INVALID_CERTIFICATE;
     hmac_sha_256 sha_digest_256;
     hmac_sha_512 sha_digest_384;
@@ -125,7 +88,7 @@ SEV_ERROR_CODE AMDCert::amd_cert_validate_sig(const amd_cert *cert,
     uint8_t decrypted[AMD_CERT_KEY_BYTES_4K] = {0}; // TODO wrong length
     uint8_t signature[AMD_CERT_KEY_BYTES_4K] = {0};
     uint32_t fixed_offset = offsetof(amd_cert, pub_exp);    // 64 bytes
-    ePSP_DEVICE_TYPE device_type = m_sev_device->get_device_type();
+    ePSP_DEVICE_TYPE device_type = SEVDevice::get_device_type();
 
     do {
         if (!cert || !parent) {
@@ -256,7 +219,7 @@ SEV_ERROR_CODE AMDCert::amd_cert_validate(const amd_cert *cert,
         key_id = parent ? (uint8_t *)&parent->key_id_0 : (uint8_t *)&cert->key_id_0;
 
         if (cert->key_usage != expected_usage ||
-            memcmp(&cert->certifying_id_0, key_id, sizeof(cert->certifying_id_0 + cert->certifying_id_1)) != 0)
+            memcmp(&cert->certifying_id_0, key_id, AMD_CERT_ID_SIZE_BYTES) != 0)
         {
             cmd_ret = ERROR_INVALID_CERTIFICATE;
         }
@@ -309,11 +272,12 @@ SEV_ERROR_CODE AMDCert::amd_cert_public_key_hash(const amd_cert *cert,
 
 SEV_ERROR_CODE AMDCert::amd_cert_validate_ark(const amd_cert *ark)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_VERIFY, "ark");
     SEV_ERROR_CODE cmd_ret = STATUS_SUCCESS;
     hmac_sha_256 hash;
     hmac_sha_256 fused_hash;
     const uint8_t *amd_root_key_id = NULL;
-    ePSP_DEVICE_TYPE device_type = m_sev_device->get_device_type();
+    ePSP_DEVICE_TYPE device_type = SEVDevice::get_device_type();
 
     do {
         if (!ark) {
@@ -338,7 +302,7 @@ SEV_ERROR_CODE AMDCert::amd_cert_validate_ark(const amd_cert *ark)
         else //if (device_type == PSP_DEVICE_TYPE_ROME)
             amd_root_key_id = amd_root_key_id_rome;
 
-        if (memcmp(&ark->key_id_0, amd_root_key_id, sizeof(ark->key_id_0 + ark->key_id_1)) != 0)
+        if (memcmp(&ark->key_id_0, amd_root_key_id, AMD_CERT_ID_SIZE_BYTES) != 0)
         {
             cmd_ret = ERROR_INVALID_CERTIFICATE;
             break;
@@ -354,6 +318,7 @@ SEV_ERROR_CODE AMDCert::amd_cert_validate_ark(const amd_cert *ark)
 
 SEV_ERROR_CODE AMDCert::amd_cert_validate_ask(const amd_cert *ask, const amd_cert *ark)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_VERIFY, "ask");
     return amd_cert_validate(ask, ark, AMD_USAGE_ASK);      // ASK
 }
 
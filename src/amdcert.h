@@ -43,7 +43,6 @@ void print_amd_cert_hex(const amd_cert *cert, std::string &out_str = amd_empty);
 
 class AMDCert {
 private:
-    SEVDevice *m_sev_device;
     SEV_ERROR_CODE amd_cert_validate_sig(const amd_cert *cert,
                                          const amd_cert *parent);
     SEV_ERROR_CODE amd_cert_validate_common(const amd_cert *cert);
@@ -0,0 +1,980 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifdef __linux__
+#include "attestserver.h"
+#include "amdcert.h"
+#include "crypto.h"             // for digest_sha
+#include "libsevtool.h"
+#include "metrics.h"
+#include "securemem.h"
+#include <arpa/inet.h>          // for inet_pton
+#include <cerrno>
+#include <cstring>
+#include <netinet/in.h>
+#include <netinet/tcp.h>        // for TCP_NODELAY
+#include <new>                  // for std::nothrow
+#include <openssl/crypto.h>     // for CRYPTO_memcmp, OPENSSL_cleanse
+#include <openssl/rand.h>
+#include <stdio.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static constexpr int      ATTEST_MAX_EVENTS  = 64;
+static constexpr int      ATTEST_POLL_MS     = 1000;
+static constexpr uint64_t ATTEST_TAG_LISTEN  = ~0ULL;       // epoll data for the non-connection fds
+static constexpr uint64_t ATTEST_TAG_WAKE    = ~0ULL - 1;
+static constexpr size_t   ATTEST_TOKEN_SIZE  = sev::ATTEST_SESSION_ID_SIZE - sizeof(uint32_t);
+static constexpr size_t   ATTEST_MAX_REQUEST = sizeof(sev::attest_msg_hdr) +
+                                               sizeof(sev::attest_start_req);
+static constexpr size_t   ATTEST_MIN_SECRET_SIZE = 8;
+static constexpr uint8_t  ATTEST_MEAS_CTX    = 0x04;
+
+struct sev::attest_session {
+    bool in_use;
+    uint8_t token[ATTEST_TOKEN_SIZE];   // The rest of the session id is the slot
+    uint64_t expires_ns;
+    tek_tik *tk;                        // In m_key_arena
+    int prev;                           // Expiry order, while in use
+    int next;                           // Expiry order while in use, else the free list
+};
+
+struct sev::attest_conn {
+    int fd;                             // -1 if the slot is free
+    uint8_t *in;                        // ATTEST_MAX_REQUEST bytes, then room for the reply
+    size_t in_length;
+    uint8_t *out;
+    size_t out_length;                  // Non-zero while a reply is going out
+    size_t out_sent;
+    bool want_write;                    // Waiting for EPOLLOUT instead of EPOLLIN
+    uint64_t last_used_ns;
+    int prev;                           // Last-used order, while open
+    int next;                           // Last-used order while open, else the free list
+};
+
+// The lists are threaded through the tables by slot, -1 ends them
+template <typename T>
+static void list_append(T *table, int *oldest, int *newest, int slot)
+{
+    table[slot].prev = *newest;
+    table[slot].next = -1;
+    if (*newest >= 0)
+        table[*newest].next = slot;
+    else
+        *oldest = slot;
+    *newest = slot;
+}
+
+template <typename T>
+static void list_remove(T *table, int *oldest, int *newest, int slot)
+{
+    if (table[slot].prev >= 0)
+        table[table[slot].prev].next = table[slot].next;
+    else
+        *oldest = table[slot].next;
+    if (table[slot].next >= 0)
+        table[table[slot].next].prev = table[slot].prev;
+    else
+        *newest = table[slot].prev;
+}
+
+/**
+ * "port" or "host:port" is TCP (IPv4), anything else is a Unix socket path.
+ * A bare port listens on all addresses, and connects to localhost
+ */
+static bool parse_address(const std::string address, bool listening,
+                          sockaddr_storage *addr, socklen_t *addr_length)
+{
+    size_t colon = address.rfind(':');
+    bool port_only = !address.empty() &&
+                     address.find_first_not_of("0123456789") == std::string::npos;
+
+    memset(addr, 0, sizeof(*addr));
+    if (port_only || colon != std::string::npos) {
+        sockaddr_in *in = (sockaddr_in *)addr;
+        std::string host = port_only ? (listening ? "0.0.0.0" : "127.0.0.1")
+                                     : address.substr(0, colon);
+        unsigned long port = strtoul(address.c_str() + (port_only ? 0 : colon + 1), NULL, 10);
+        if (port == 0 || port > 65535)
+            return false;
+        in->sin_family = AF_INET;
+        in->sin_port = htons((uint16_t)port);
+        if (inet_pton(AF_INET, host.c_str(), &in->sin_addr) != 1)
+            return false;
+        *addr_length = sizeof(sockaddr_in);
+    }
+    else {
+        sockaddr_un *un = (sockaddr_un *)addr;
+        if (address.empty() || address.size() >= sizeof(un->sun_path))
+            return false;
+        un->sun_family = AF_UNIX;
+        memcpy(un->sun_path, address.c_str(), address.size());
+        *addr_length = sizeof(sockaddr_un);
+    }
+    return true;
+}
+
+// Everything a reply can need, past the attest_msg_hdr
+static size_t max_reply_body(const sev::attest_server_config *config)
+{
+    size_t secret = sizeof(sev_hdr_buf) + config->secret_size;
+    return (secret > sizeof(sev::attest_launch_blob)) ? secret : sizeof(sev::attest_launch_blob);
+}
+
+void sev::attest_server_defaults(attest_server_config *config)
+{
+    config->policy = 0;
+    config->secret = NULL;
+    config->secret_size = 0;
+    config->ask = NULL;
+    config->ask_size = 0;
+    config->ark = NULL;
+    config->ark_size = 0;
+    config->max_sessions = ATTEST_DEF_MAX_SESSIONS;
+    config->max_connections = ATTEST_DEF_MAX_CONNECTIONS;
+    config->session_timeout_ms = ATTEST_DEF_SESSION_MS;
+    config->idle_timeout_ms = ATTEST_DEF_IDLE_MS;
+    config->digests = NULL;
+    config->digest_count = 0;
+}
+
+sev::AttestServer::AttestServer(const attest_server_config *config)
+                 : m_config(*config),
+                   m_epoll_fd(-1),
+                   m_listen_fd(-1),
+                   m_wake_fd(-1),
+                   m_stop(false),
+                   m_sessions(NULL),
+                   m_session_free(-1),
+                   m_session_oldest(-1),
+                   m_session_newest(-1),
+                   m_session_count(0),
+                   m_key_arena(NULL),
+                   m_conns(NULL),
+                   m_conn_free(-1),
+                   m_conn_oldest(-1),
+                   m_conn_newest(-1),
+                   m_valid_chain_count(0),
+                   m_next_flush_ns(0)
+{
+    // Intentionally Empty
+}
+
+sev::AttestServer::~AttestServer()
+{
+    if (m_conns) {
+        for (uint32_t i = 0; i < m_config.max_connections; i++) {
+            if (m_conns[i].fd >= 0)
+                conn_close((int)i);
+        }
+        delete[] m_conns;
+    }
+    if (m_sessions) {
+        OPENSSL_cleanse(m_sessions, sizeof(attest_session) * m_config.max_sessions);
+        delete[] m_sessions;
+    }
+    delete m_key_arena;                 // Wipes the keys
+
+    if (m_listen_fd >= 0) {
+        sockaddr_storage addr;
+        socklen_t addr_length = 0;
+        ::close(m_listen_fd);
+        if (parse_address(m_config.listen, true, &addr, &addr_length) &&
+            addr.ss_family == AF_UNIX)
+            unlink(m_config.listen.c_str());
+    }
+    if (m_wake_fd >= 0)
+        ::close(m_wake_fd);
+    if (m_epoll_fd >= 0)
+        ::close(m_epoll_fd);
+}
+
+bool sev::AttestServer::open(void)
+{
+    bool ret = false;
+    sockaddr_storage addr;
+    socklen_t addr_length = 0;
+    epoll_event event;
+    int one = 1;
+
+    do {
+        if (!m_config.secret || m_config.secret_size < ATTEST_MIN_SECRET_SIZE ||
+            m_config.secret_size > ATTEST_MAX_SECRET_SIZE) {
+            fprintf(stderr, "Error: the secret has to be %zu to %zu bytes\n",
+                            ATTEST_MIN_SECRET_SIZE, ATTEST_MAX_SECRET_SIZE);
+            break;
+        }
+        if (!m_config.digests || m_config.digest_count == 0 ||
+            m_config.digest_count > ATTEST_MAX_DIGESTS) {
+            fprintf(stderr, "Error: the server needs 1 to %zu approved launch digests\n",
+                            ATTEST_MAX_DIGESTS);
+            break;
+        }
+        if (!trusted_chain_valid()) {
+            fprintf(stderr, "Error: the server needs a valid ASK/ARK from the KDS\n");
+            break;
+        }
+        if (m_config.max_sessions == 0 || m_config.max_sessions > INT32_MAX ||
+            m_config.max_connections == 0 || m_config.max_connections > INT32_MAX) {
+            fprintf(stderr, "Error: invalid session or connection limit\n");
+            break;
+        }
+        if (!parse_address(m_config.listen, true, &addr, &addr_length)) {
+            fprintf(stderr, "Error: %s isn't a port, host:port or socket path\n", m_config.listen.c_str());
+            break;
+        }
+
+        m_sessions = new (std::nothrow) attest_session[m_config.max_sessions];
+        m_conns = new (std::nothrow) attest_conn[m_config.max_connections];
+        if (!m_sessions || !m_conns) {
+            fprintf(stderr, "Error: unable to allocate the session table\n");
+            break;
+        }
+        memset(m_sessions, 0, sizeof(attest_session) * m_config.max_sessions);
+        for (uint32_t i = m_config.max_sessions; i-- > 0; ) {
+            m_sessions[i].next = m_session_free;
+            m_session_free = (int)i;
+        }
+
+        // A slab of exactly max_sessions TEK/TIKs, taken up front
+        uint32_t counts[SECURE_ARENA_CLASSES] = {0};
+        for (size_t i = 0; i < SECURE_ARENA_CLASSES; i++) {
+            if (SECURE_ARENA_BLOCK_SIZES[i] >= sizeof(tek_tik)) {
+                counts[i] = m_config.max_sessions;
+                break;
+            }
+        }
+        m_key_arena = new SecureArena(counts);
+        bool keys_ok = true;
+        for (uint32_t i = 0; i < m_config.max_sessions && keys_ok; i++) {
+            m_sessions[i].tk = (tek_tik *)m_key_arena->alloc(sizeof(tek_tik));
+            keys_ok = (m_sessions[i].tk != NULL);
+        }
+        if (!keys_ok) {
+            fprintf(stderr, "Error: unable to allocate the session keys\n");
+            break;
+        }
+        memset(m_conns, 0, sizeof(attest_conn) * m_config.max_connections);
+        for (uint32_t i = m_config.max_connections; i-- > 0; ) {
+            m_conns[i].fd = -1;
+            m_conns[i].next = m_conn_free;
+            m_conn_free = (int)i;
+        }
+
+        m_listen_fd = socket(addr.ss_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (m_listen_fd < 0)
+            break;
+        if (addr.ss_family == AF_INET) {
+            setsockopt(m_listen_fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        }
+        else {
+            // Left behind by a server that didn't shut down cleanly
+            struct stat st;
+            if (lstat(m_config.listen.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+                unlink(m_config.listen.c_str());
+        }
+        if (bind(m_listen_fd, (sockaddr *)&addr, addr_length) != 0 ||
+            listen(m_listen_fd, SOMAXCONN) != 0) {
+            fprintf(stderr, "Error: unable to listen on %s: %s\n", m_config.listen.c_str(), strerror(errno));
+            ::close(m_listen_fd);
+            m_listen_fd = -1;
+            break;
+        }
+
+        m_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        m_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+        if (m_wake_fd < 0 || m_epoll_fd < 0)
+            break;
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = ATTEST_TAG_LISTEN;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_listen_fd, &event) != 0)
+            break;
+        event.data.u64 = ATTEST_TAG_WAKE;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, m_wake_fd, &event) != 0)
+            break;
+
+        m_next_flush_ns = sev::Metrics::now_ns() + ATTEST_METRICS_FLUSH_MS * 1000000ULL;
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+bool sev::AttestServer::poll(int timeout_ms)
+{
+    epoll_event events[ATTEST_MAX_EVENTS];
+    int count = epoll_wait(m_epoll_fd, events, ATTEST_MAX_EVENTS, timeout_ms);
+
+    if (count < 0 && errno != EINTR) {
+        fprintf(stderr, "Error: epoll_wait failed: %s\n", strerror(errno));
+        return false;
+    }
+
+    for (int i = 0; i < count; i++) {
+        uint64_t tag = events[i].data.u64;
+        if (tag == ATTEST_TAG_LISTEN) {
+            conn_accept();
+            continue;
+        }
+        if (tag == ATTEST_TAG_WAKE) {
+            uint64_t value;
+            if (read(m_wake_fd, &value, sizeof(value)) < 0) {
+                // Only there to wake us up, m_stop is checked below
+            }
+            continue;
+        }
+
+        int slot = (int)tag;
+        if (m_conns[slot].fd < 0)
+            continue;
+        if ((events[i].events & (EPOLLERR | EPOLLHUP)) && !(events[i].events & EPOLLIN)) {
+            conn_close(slot);
+            continue;
+        }
+        if (events[i].events & EPOLLIN)
+            conn_read(slot);
+        if (m_conns[slot].fd >= 0 && (events[i].events & EPOLLOUT))
+            conn_write(slot);
+    }
+
+    uint64_t now = sev::Metrics::now_ns();
+    expire_sessions(now);
+    expire_conns(now);
+
+    // Long running, so the --trace/--metrics files can't wait until exit
+    if (now >= m_next_flush_ns) {
+        sev::Metrics::flush();
+        m_next_flush_ns = now + ATTEST_METRICS_FLUSH_MS * 1000000ULL;
+    }
+
+    return !m_stop.load();
+}
+
+void sev::AttestServer::run(void)
+{
+    int timeout_ms = ATTEST_POLL_MS;
+
+    // Often enough that nothing outlives its timeout by much
+    if (m_config.session_timeout_ms < (uint32_t)timeout_ms)
+        timeout_ms = (int)m_config.session_timeout_ms;
+    if (m_config.idle_timeout_ms < (uint32_t)timeout_ms)
+        timeout_ms = (int)m_config.idle_timeout_ms;
+    if (timeout_ms < 1)
+        timeout_ms = 1;
+
+    while (poll(timeout_ms)) {
+        // Intentionally Empty
+    }
+    sev::Metrics::flush();
+}
+
+void sev::AttestServer::stop(void)
+{
+    uint64_t one = 1;
+
+    m_stop = true;
+    if (m_wake_fd >= 0 && write(m_wake_fd, &one, sizeof(one)) < 0) {
+        // Already woken
+    }
+}
+
+int sev::AttestServer::session_alloc(void)
+{
+    int slot = m_session_free;
+    if (slot < 0)
+        return -1;
+
+    attest_session *session = &m_sessions[slot];
+    if (RAND_bytes(session->token, sizeof(session->token)) != 1)
+        return -1;
+
+    m_session_free = session->next;
+    session->in_use = true;
+    session->expires_ns = sev::Metrics::now_ns() +
+                          (uint64_t)m_config.session_timeout_ms * 1000000ULL;
+    list_append(m_sessions, &m_session_oldest, &m_session_newest, slot);
+    m_session_count++;
+
+    return slot;
+}
+
+void sev::AttestServer::session_free(int slot)
+{
+    attest_session *session = &m_sessions[slot];
+
+    list_remove(m_sessions, &m_session_oldest, &m_session_newest, slot);
+    OPENSSL_cleanse(session->tk, sizeof(tek_tik));
+    session->in_use = false;
+    session->next = m_session_free;
+    m_session_free = slot;
+    m_session_count--;
+}
+
+int sev::AttestServer::session_find(const uint8_t *session_id)
+{
+    uint32_t slot;
+    memcpy(&slot, session_id, sizeof(slot));
+    if (slot >= m_config.max_sessions)
+        return -1;
+
+    attest_session *session = &m_sessions[slot];
+    if (!session->in_use ||
+        CRYPTO_memcmp(session->token, session_id + sizeof(slot), sizeof(session->token)) != 0)
+        return -1;
+    if (session->expires_ns <= sev::Metrics::now_ns()) {
+        session_free((int)slot);
+        return -1;
+    }
+    return (int)slot;
+}
+
+void sev::AttestServer::expire_sessions(uint64_t now)
+{
+    while (m_session_oldest >= 0 && m_sessions[m_session_oldest].expires_ns <= now)
+        session_free(m_session_oldest);
+}
+
+void sev::AttestServer::conn_accept(void)
+{
+    size_t buf_size = ATTEST_MAX_REQUEST + sizeof(attest_msg_hdr) + max_reply_body(&m_config);
+    epoll_event event;
+    int one = 1;
+
+    while (true) {
+        int fd = accept4(m_listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (fd < 0) {
+            if (errno == EINTR)
+                continue;
+            break;              // EAGAIN, or out of fds until something closes
+        }
+
+        int slot = m_conn_free;
+        uint8_t *buf = (slot >= 0) ? new (std::nothrow) uint8_t[buf_size] : NULL;
+        if (!buf) {             // Full
+            ::close(fd);
+            continue;
+        }
+
+        // The replies are one write each, don't hold them back
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+        memset(&event, 0, sizeof(event));
+        event.events = EPOLLIN;
+        event.data.u64 = (uint64_t)slot;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_ADD, fd, &event) != 0) {
+            delete[] buf;
+            ::close(fd);
+            continue;
+        }
+
+        attest_conn *conn = &m_conns[slot];
+        m_conn_free = conn->next;
+        conn->fd = fd;
+        conn->in = buf;
+        conn->in_length = 0;
+        conn->out = buf + ATTEST_MAX_REQUEST;
+        conn->out_length = 0;
+        conn->out_sent = 0;
+        conn->want_write = false;
+        conn->last_used_ns = sev::Metrics::now_ns();
+        list_append(m_conns, &m_conn_oldest, &m_conn_newest, slot);
+    }
+}
+
+void sev::AttestServer::conn_close(int slot)
+{
+    attest_conn *conn = &m_conns[slot];
+
+    ::close(conn->fd);          // Also takes it out of the epoll set
+    delete[] conn->in;
+    list_remove(m_conns, &m_conn_oldest, &m_conn_newest, slot);
+    conn->fd = -1;
+    conn->in = NULL;
+    conn->out = NULL;
+    conn->next = m_conn_free;
+    m_conn_free = slot;
+}
+
+void sev::AttestServer::conn_touch(int slot)
+{
+    m_conns[slot].last_used_ns = sev::Metrics::now_ns();
+    list_remove(m_conns, &m_conn_oldest, &m_conn_newest, slot);
+    list_append(m_conns, &m_conn_oldest, &m_conn_newest, slot);
+}
+
+void sev::AttestServer::expire_conns(uint64_t now)
+{
+    uint64_t idle_ns = (uint64_t)m_config.idle_timeout_ms * 1000000ULL;
+
+    while (m_conn_oldest >= 0 && m_conns[m_conn_oldest].last_used_ns + idle_ns <= now)
+        conn_close(m_conn_oldest);
+}
+
+/**
+ * Reads until a whole request is in, then handles it. Nothing more is read
+ * from the connection until the reply has gone out
+ */
+void sev::AttestServer::conn_read(int slot)
+{
+    attest_conn *conn = &m_conns[slot];
+    const attest_msg_hdr *hdr = (const attest_msg_hdr *)conn->in;
+
+    if (conn->out_length != 0)
+        return;
+
+    while (true) {
+        size_t want = sizeof(attest_msg_hdr);
+        if (conn->in_length >= sizeof(attest_msg_hdr)) {
+            want += hdr->length;
+            if (conn->in_length == want) {
+                handle_request(slot);
+                return;
+            }
+        }
+
+        ssize_t length = read(conn->fd, conn->in + conn->in_length, want - conn->in_length);
+        if (length == 0) {
+            conn_close(slot);
+            return;
+        }
+        if (length < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                conn_close(slot);
+            return;
+        }
+        conn->in_length += (size_t)length;
+        conn_touch(slot);
+
+        // Not ours, or too big for any request
+        if (conn->in_length == sizeof(attest_msg_hdr) &&
+            (hdr->magic != ATTEST_MAGIC ||
+             hdr->length > ATTEST_MAX_REQUEST - sizeof(attest_msg_hdr))) {
+            conn_close(slot);
+            return;
+        }
+    }
+}
+
+void sev::AttestServer::conn_write(int slot)
+{
+    attest_conn *conn = &m_conns[slot];
+    epoll_event event;
+
+    memset(&event, 0, sizeof(event));
+    event.data.u64 = (uint64_t)slot;
+
+    while (conn->out_sent < conn->out_length) {
+        ssize_t length = send(conn->fd, conn->out + conn->out_sent,
+                              conn->out_length - conn->out_sent, MSG_NOSIGNAL);
+        if (length < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                conn_close(slot);
+            }
+            else if (!conn->want_write) {
+                event.events = EPOLLOUT;
+                conn->want_write = true;
+                if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) != 0)
+                    conn_close(slot);
+            }
+            return;
+        }
+        conn->out_sent += (size_t)length;
+    }
+
+    conn->out_length = 0;
+    conn->out_sent = 0;
+    conn_touch(slot);
+    if (conn->want_write) {
+        event.events = EPOLLIN;
+        conn->want_write = false;
+        if (epoll_ctl(m_epoll_fd, EPOLL_CTL_MOD, conn->fd, &event) != 0)
+            conn_close(slot);
+    }
+}
+
+void sev::AttestServer::reply(int slot, uint16_t type, uint32_t status,
+                              const uint8_t *session_id, const void *body,
+                              size_t length, const void *body2, size_t length2,
+                              uint16_t digest_index)
+{
+    attest_conn *conn = &m_conns[slot];
+    attest_msg_hdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = ATTEST_MAGIC;
+    hdr.type = type;
+    hdr.digest_index = digest_index;
+    hdr.status = status;
+    hdr.length = (uint32_t)(length + length2);
+    if (session_id)
+        memcpy(hdr.session_id, session_id, sizeof(hdr.session_id));
+
+    memcpy(conn->out, &hdr, sizeof(hdr));
+    if (length)
+        memcpy(conn->out + sizeof(hdr), body, length);
+    if (length2)
+        memcpy(conn->out + sizeof(hdr) + length, body2, length2);
+    conn->out_length = sizeof(hdr) + length + length2;
+    conn->out_sent = 0;
+
+    conn_write(slot);
+}
+
+void sev::AttestServer::handle_request(int slot)
+{
+    attest_conn *conn = &m_conns[slot];
+    attest_msg_hdr hdr;
+    const uint8_t *body = conn->in + sizeof(attest_msg_hdr);
+    uint32_t status = ERROR_INVALID_COMMAND;
+
+    memcpy(&hdr, conn->in, sizeof(hdr));
+    conn->in_length = 0;        // The body stays put until the next read
+
+    if (hdr.type == ATTEST_MSG_START) {
+        attest_launch_blob blob;
+        uint8_t session_id[ATTEST_SESSION_ID_SIZE];
+        status = ERROR_INVALID_LENGTH;
+        if (hdr.length == sizeof(attest_start_req))
+            status = handle_start((const attest_start_req *)body, &blob, session_id);
+        if (status == STATUS_SUCCESS) {
+            reply(slot, ATTEST_MSG_LAUNCH_BLOB, status, session_id, &blob, sizeof(blob), NULL, 0);
+            return;
+        }
+    }
+    else if (hdr.type == ATTEST_MSG_MEASURE) {
+        sev_hdr_buf header;
+        uint8_t packaged[ATTEST_MAX_SECRET_SIZE];
+        uint16_t digest_index = 0;
+        status = ERROR_INVALID_LENGTH;
+        if (hdr.length == sizeof(attest_measure_req))
+            status = handle_measure(hdr.session_id, (const attest_measure_req *)body,
+                                    &header, packaged, &digest_index);
+        if (status == STATUS_SUCCESS) {
+            reply(slot, ATTEST_MSG_SECRET, status, hdr.session_id, &header, sizeof(header),
+                  packaged, m_config.secret_size, digest_index);
+            return;
+        }
+    }
+
+    reply(slot, ATTEST_MSG_ERROR, status, hdr.session_id, NULL, 0, NULL, 0);
+}
+
+bool sev::AttestServer::trusted_chain_valid(void)
+{
+    AMDCert tmp_amd;
+    amd_cert ask;
+    amd_cert ark;
+
+    if (!m_config.ask || m_config.ask_size == 0 || m_config.ask_size > sizeof(amd_cert) ||
+        !m_config.ark || m_config.ark_size == 0 || m_config.ark_size > sizeof(amd_cert))
+        return false;
+    if (tmp_amd.amd_cert_init(&ask, m_config.ask) != STATUS_SUCCESS ||
+        tmp_amd.amd_cert_get_size(&ask) != m_config.ask_size ||
+        tmp_amd.amd_cert_init(&ark, m_config.ark) != STATUS_SUCCESS ||
+        tmp_amd.amd_cert_get_size(&ark) != m_config.ark_size)
+        return false;
+    return tmp_amd.amd_cert_validate_ark(&ark) == STATUS_SUCCESS &&
+           tmp_amd.amd_cert_validate_ask(&ask, &ark) == STATUS_SUCCESS;
+}
+
+uint32_t sev::AttestServer::validate_chain(const attest_start_req *req)
+{
+    struct sevtool_cert_chain chain;
+    uint8_t digest[32];
+    uint32_t status = ERROR_INVALID_CERTIFICATE;
+
+    if (req->ask_size > sizeof(amd_cert) || req->ark_size > sizeof(amd_cert))
+        return ERROR_INVALID_LENGTH;
+
+    // The ASK/ARK are only on the wire so the chain can be checked whole.
+    // They're the host's word, so they have to be the ones we trust
+    if (req->ask_size != m_config.ask_size || req->ark_size != m_config.ark_size ||
+        memcmp(req->ask, m_config.ask, m_config.ask_size) != 0 ||
+        memcmp(req->ark, m_config.ark, m_config.ark_size) != 0)
+        return status;
+
+    if (!digest_sha(req, sizeof(*req), digest, sizeof(digest), SHA_TYPE_256))
+        return status;
+    size_t cached = (m_valid_chain_count < ATTEST_CHAIN_CACHE_SIZE) ? m_valid_chain_count
+                                                                    : ATTEST_CHAIN_CACHE_SIZE;
+    for (size_t i = 0; i < cached; i++) {
+        if (memcmp(m_valid_chains[i], digest, sizeof(digest)) == 0)
+            return STATUS_SUCCESS;
+    }
+
+    memcpy(chain.pdh, &req->pdh, sizeof(sev_cert));
+    memcpy(chain.pek, &req->pek, sizeof(sev_cert));
+    memcpy(chain.oca, &req->oca, sizeof(sev_cert));
+    memcpy(chain.cek, &req->cek, sizeof(sev_cert));
+    memcpy(chain.ask, req->ask, sizeof(chain.ask));
+    memcpy(chain.ark, req->ark, sizeof(chain.ark));
+    chain.ask_size = req->ask_size;
+    chain.ark_size = req->ark_size;
+
+    status = (uint32_t)sevtool_validate_cert_chain(&chain);
+    if (status == STATUS_SUCCESS) {
+        memcpy(m_valid_chains[m_valid_chain_count % ATTEST_CHAIN_CACHE_SIZE], digest, sizeof(digest));
+        m_valid_chain_count++;
+    }
+    return status;
+}
+
+uint32_t sev::AttestServer::handle_start(const attest_start_req *req,
+                                         attest_launch_blob *blob,
+                                         uint8_t *session_id)
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "attest_start");
+    struct sevtool_launch_blob launch_blob;
+    uint32_t status = ERROR_RESOURCE_LIMIT;
+    int slot = -1;
+
+    do {
+        if (m_session_free < 0)
+            break;
+
+        status = validate_chain(req);
+        if (status != STATUS_SUCCESS)
+            break;
+
+        status = (uint32_t)sevtool_generate_launch_blob((const uint8_t *)&req->pdh,
+                                                        sizeof(sev_cert), m_config.policy,
+                                                        &launch_blob);
+        if (status != STATUS_SUCCESS)
+            break;
+
+        slot = session_alloc();
+        if (slot < 0) {
+            status = ERROR_RESOURCE_LIMIT;
+            break;
+        }
+
+        attest_session *session = &m_sessions[slot];
+        uint32_t id_slot = (uint32_t)slot;
+        memcpy(session->tk, launch_blob.tk, sizeof(tek_tik));
+        memcpy(session_id, &id_slot, sizeof(id_slot));
+        memcpy(session_id + sizeof(id_slot), session->token, sizeof(session->token));
+
+        blob->policy = m_config.policy;
+        memcpy(&blob->session, launch_blob.session, sizeof(sev_session_buf));
+        memcpy(&blob->godh_cert, launch_blob.godh_cert, sizeof(sev_cert));
+    } while (0);
+
+    OPENSSL_cleanse(&launch_blob, sizeof(launch_blob));
+
+    return status;
+}
+
+uint32_t sev::AttestServer::handle_measure(const uint8_t *session_id,
+                                           const attest_measure_req *req,
+                                           sev_hdr_buf *header, uint8_t *packaged,
+                                           uint16_t *digest_index)
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "attest_measure");
+    struct sevtool_measurement meas;
+    size_t index = 0;
+    uint32_t status = ERROR_INVALID_GUEST;
+    int slot = session_find(session_id);
+
+    if (slot < 0)
+        return status;
+
+    attest_session *session = &m_sessions[slot];
+    do {
+        meas.meas_ctx  = ATTEST_MEAS_CTX;
+        meas.api_major = req->api_major;
+        meas.api_minor = req->api_minor;
+        meas.build_id  = req->build_id;
+        meas.policy    = m_config.policy;
+        memset(meas.digest, 0, sizeof(meas.digest));
+        memcpy(meas.mnonce, req->measure.m_nonce, sizeof(meas.mnonce));
+        memcpy(meas.tik, session->tk->tik, sizeof(meas.tik));
+
+        status = (uint32_t)sevtool_match_measurement(&meas, m_config.digests,
+                                                     m_config.digest_count,
+                                                     req->measure.measurement, &index);
+        if (status != STATUS_SUCCESS)
+            break;
+        *digest_index = (uint16_t)index;
+
+        status = (uint32_t)sevtool_package_secret((const uint8_t *)session->tk,
+                                                  req->measure.measurement, req->api_minor,
+                                                  m_config.secret, m_config.secret_size,
+                                                  packaged, m_config.secret_size,
+                                                  (uint8_t *)header);
+    } while (0);
+
+    // One try per session, so a guest can't be measured again with the same keys
+    session_free(slot);
+    OPENSSL_cleanse(&meas, sizeof(meas));
+
+    return status;
+}
+
+sev::AttestClient::~AttestClient()
+{
+    close();
+}
+
+bool sev::AttestClient::connect(const std::string address)
+{
+    sockaddr_storage addr;
+    socklen_t addr_length = 0;
+    int one = 1;
+
+    close();
+    if (!parse_address(address, false, &addr, &addr_length))
+        return false;
+
+    m_fd = socket(addr.ss_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (m_fd < 0)
+        return false;
+    if (::connect(m_fd, (sockaddr *)&addr, addr_length) != 0) {
+        close();
+        return false;
+    }
+    if (addr.ss_family == AF_INET)
+        setsockopt(m_fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    return true;
+}
+
+void sev::AttestClient::close(void)
+{
+    if (m_fd >= 0)
+        ::close(m_fd);
+    m_fd = -1;
+}
+
+static bool send_all(int fd, const uint8_t *buf, size_t length)
+{
+    while (length) {
+        ssize_t sent = send(fd, buf, length, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR)
+            continue;
+        if (sent <= 0)
+            return false;
+        buf += sent;
+        length -= (size_t)sent;
+    }
+    return true;
+}
+
+static bool recv_all(int fd, uint8_t *buf, size_t length)
+{
+    while (length) {
+        ssize_t got = recv(fd, buf, length, 0);
+        if (got < 0 && errno == EINTR)
+            continue;
+        if (got <= 0)
+            return false;
+        buf += got;
+        length -= (size_t)got;
+    }
+    return true;
+}
+
+bool sev::AttestClient::exchange(uint16_t type, const uint8_t *session_id,
+                                 const void *body, size_t length,
+                                 attest_msg_hdr *reply, void *reply_body,
+                                 size_t reply_size)
+{
+    bool ret = false;
+    uint8_t *request = new uint8_t[sizeof(attest_msg_hdr) + length];
+    attest_msg_hdr hdr;
+
+    memset(&hdr, 0, sizeof(hdr));
+    hdr.magic = ATTEST_MAGIC;
+    hdr.type = type;
+    hdr.length = (uint32_t)length;
+    if (session_id)
+        memcpy(hdr.session_id, session_id, sizeof(hdr.session_id));
+    memcpy(request, &hdr, sizeof(hdr));
+    memcpy(request + sizeof(hdr), body, length);
+
+    do {
+        // One send, so the header and body go out together
+        if (m_fd < 0 || !send_all(m_fd, request, sizeof(hdr) + length))
+            break;
+        if (!recv_all(m_fd, (uint8_t *)reply, sizeof(*reply)))
+            break;
+        if (reply->magic != ATTEST_MAGIC || reply->length > reply_size)
+            break;
+        if (!recv_all(m_fd, (uint8_t *)reply_body, reply->length))
+            break;
+        ret = true;
+    } while (0);
+
+    if (!ret)
+        close();
+    delete[] request;
+    return ret;
+}
+
+int sev::AttestClient::start(const attest_start_req *req, attest_launch_blob *blob,
+                             uint8_t *session_id)
+{
+    attest_msg_hdr reply;
+
+    if (!exchange(ATTEST_MSG_START, NULL, req, sizeof(*req), &reply, blob, sizeof(*blob)))
+        return -1;
+    if (reply.status == STATUS_SUCCESS &&
+        (reply.type != ATTEST_MSG_LAUNCH_BLOB || reply.length != sizeof(*blob)))
+        return -1;
+
+    memcpy(session_id, reply.session_id, ATTEST_SESSION_ID_SIZE);
+    return (int)reply.status;
+}
+
+int sev::AttestClient::measure(const uint8_t *session_id, const attest_measure_req *req,
+                               sev_hdr_buf *header, uint8_t *packaged, size_t packaged_size,
+                               uint16_t *digest_index)
+{
+    int ret = -1;
+    attest_msg_hdr reply;
+    size_t body_size = sizeof(sev_hdr_buf) + packaged_size;
+    uint8_t *body = new uint8_t[body_size];
+
+    do {
+        if (!exchange(ATTEST_MSG_MEASURE, session_id, req, sizeof(*req), &reply, body, body_size))
+            break;
+        if (reply.status != STATUS_SUCCESS) {
+            ret = (int)reply.status;
+            break;
+        }
+        if (reply.type != ATTEST_MSG_SECRET || reply.length != body_size)
+            break;
+
+        memcpy(header, body, sizeof(sev_hdr_buf));
+        memcpy(packaged, body + sizeof(sev_hdr_buf), packaged_size);
+        if (digest_index)
+            *digest_index = reply.digest_index;
+        ret = STATUS_SUCCESS;
+    } while (0);
+
+    delete[] body;
+    return ret;
+}
+
+#endif
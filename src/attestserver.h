@@ -0,0 +1,236 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+/**
+ * The guest owner side of a launch as a server, so one guest owner can
+ * attest any number of guests at once instead of one per output folder.
+ *
+ * Each launch is a session, and takes two requests:
+ *   START:   the platform's cert chain. The chain is validated, and a new
+ *            GODH key and TEK/TIK are made for the server's guest policy.
+ *            The reply is the LAUNCH_START session buffer and GODH cert,
+ *            with the session id in the header.
+ *   MEASURE: the LAUNCH_MEASURE output of that guest, for the session id.
+ *            If it matches any of the approved launch digests, the reply is
+ *            the LAUNCH_SECRET header and the secret, encrypted with the
+ *            TEK, with which digest it was in the header's digest_index.
+ * A session ends after its MEASURE, or when it times out. The TEK/TIK never
+ * leave the server.
+ *
+ * Messages are an attest_msg_hdr followed by length bytes of body, in host
+ * (little endian) byte order. Any number of requests can be sent over one
+ * connection, and the MEASURE doesn't have to come over the same one as the
+ * START.
+ */
+
+#ifndef ATTESTSERVER_H
+#define ATTESTSERVER_H
+
+#include "sevapi.h"
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace sev
+{
+    constexpr uint32_t ATTEST_MAGIC           = 0x54544153;    // "SATT" on the wire
+    constexpr size_t   ATTEST_SESSION_ID_SIZE = 16;
+    constexpr size_t   ATTEST_MAX_SECRET_SIZE = 16*1024;
+    constexpr size_t   ATTEST_MAX_DIGESTS     = 4096;        // Fits digest_index
+
+    constexpr uint32_t ATTEST_DEF_MAX_SESSIONS    = 4096;
+    constexpr uint32_t ATTEST_DEF_MAX_CONNECTIONS = 1024;
+    constexpr uint32_t ATTEST_DEF_SESSION_MS      = 10*60*1000;    // Launch to LAUNCH_MEASURE
+    constexpr uint32_t ATTEST_DEF_IDLE_MS         = 30*1000;       // Per connection
+    constexpr uint32_t ATTEST_METRICS_FLUSH_MS    = 10*1000;
+    constexpr size_t   ATTEST_CHAIN_CACHE_SIZE    = 16;
+
+    enum ATTEST_MSG_TYPE {
+        ATTEST_MSG_START       = 1,     // attest_start_req
+        ATTEST_MSG_LAUNCH_BLOB = 2,     // attest_launch_blob
+        ATTEST_MSG_MEASURE     = 3,     // attest_measure_req
+        ATTEST_MSG_SECRET      = 4,     // sev_hdr_buf, then the packaged secret
+        ATTEST_MSG_ERROR       = 5,     // No body. status says why
+    };
+
+    typedef struct __attribute__ ((__packed__)) attest_msg_hdr_t
+    {
+        uint32_t magic;
+        uint16_t type;                  // ATTEST_MSG_TYPE
+        uint16_t digest_index;          // SECRET replies: the approved digest that matched
+        uint32_t status;                // SEV_ERROR_CODE, in replies
+        uint32_t length;                // Of the body
+        uint8_t  session_id[ATTEST_SESSION_ID_SIZE];    // Zero for START
+    } attest_msg_hdr;
+
+    typedef struct __attribute__ ((__packed__)) attest_start_req_t
+    {
+        sev_cert pdh;
+        sev_cert pek;
+        sev_cert oca;
+        sev_cert cek;                   // Signed by the ASK, from the KDS
+        uint32_t ask_size;
+        uint32_t ark_size;
+        uint8_t  ask[sizeof(amd_cert)];
+        uint8_t  ark[sizeof(amd_cert)];
+    } attest_start_req;
+
+    typedef struct __attribute__ ((__packed__)) attest_launch_blob_t
+    {
+        uint32_t        policy;         // The guest has to be launched with this
+        sev_session_buf session;
+        sev_cert        godh_cert;
+    } attest_launch_blob;
+
+    typedef struct __attribute__ ((__packed__)) attest_measure_req_t
+    {
+        uint8_t         api_major;      // From PLATFORM_STATUS
+        uint8_t         api_minor;
+        uint8_t         build_id;
+        uint8_t         reserved;
+        sev_measure_buf measure;        // LAUNCH_MEASURE
+    } attest_measure_req;
+
+    struct attest_server_config {
+        std::string listen;             // A port number, or a Unix socket path
+        uint32_t policy;
+        const uint8_t (*digests)[32];   // Approved launch digests. Not copied
+        size_t   digest_count;
+        const uint8_t *secret;          // Not copied
+        size_t   secret_size;
+        const uint8_t *ask;             // The guest owner's ASK and ARK, from the
+        size_t   ask_size;              // KDS. Not copied. Every START has to send
+        const uint8_t *ark;             // these exact certs, so a host can't
+        size_t   ark_size;              // swap in its own root
+        uint32_t max_sessions;
+        uint32_t max_connections;
+        uint32_t session_timeout_ms;
+        uint32_t idle_timeout_ms;
+    };
+
+    // Defaults for everything but listen, the digests, the secret and the ASK/ARK
+    void attest_server_defaults(attest_server_config *config);
+
+    struct attest_session;
+    struct attest_conn;
+    class SecureArena;
+
+    /**
+     * Single threaded and driven by epoll. Sessions and connections live in
+     * tables that are allocated once, at open(). Session ids are the table
+     * slot plus a random token, so finding a session is one compare. Every
+     * session has the same timeout, so they expire in the order they were
+     * made and only the oldest ever has to be looked at. Connections are
+     * kept in last-used order for the same reason.
+     */
+    class AttestServer {
+    private:
+        attest_server_config m_config;
+        int m_epoll_fd;
+        int m_listen_fd;
+        int m_wake_fd;                  // eventfd, for stop()
+        std::atomic<bool> m_stop;
+
+        attest_session *m_sessions;
+        int m_session_free;             // Free list
+        int m_session_oldest;           // Expiry order
+        int m_session_newest;
+        uint32_t m_session_count;
+        SecureArena *m_key_arena;       // Every session's TEK/TIK, page-locked
+
+        attest_conn *m_conns;
+        int m_conn_free;
+        int m_conn_oldest;              // Last-used order
+        int m_conn_newest;
+
+        // Chains that validated, by SHA-256, so one platform starting many
+        // guests doesn't redo the RSA checks every time
+        uint8_t m_valid_chains[ATTEST_CHAIN_CACHE_SIZE][32];
+        size_t m_valid_chain_count;
+
+        uint64_t m_next_flush_ns;
+
+        int session_alloc(void);
+        void session_free(int slot);
+        int session_find(const uint8_t *session_id);
+        void expire_sessions(uint64_t now);
+
+        void conn_accept(void);
+        void conn_close(int slot);
+        void conn_touch(int slot);
+        void conn_read(int slot);
+        void conn_write(int slot);
+        void expire_conns(uint64_t now);
+
+        void handle_request(int slot);
+        void reply(int slot, uint16_t type, uint32_t status, const uint8_t *session_id,
+                   const void *body, size_t length, const void *body2, size_t length2,
+                   uint16_t digest_index = 0);
+        uint32_t handle_start(const attest_start_req *req, attest_launch_blob *blob,
+                              uint8_t *session_id);
+        uint32_t handle_measure(const uint8_t *session_id, const attest_measure_req *req,
+                                sev_hdr_buf *header, uint8_t *packaged,
+                                uint16_t *digest_index);
+        bool trusted_chain_valid(void);
+        uint32_t validate_chain(const attest_start_req *req);
+
+        AttestServer(const AttestServer&) = delete;
+        AttestServer& operator=(const AttestServer&) = delete;
+
+    public:
+        explicit AttestServer(const attest_server_config *config);
+        ~AttestServer();
+
+        bool open(void);
+        // One round of epoll_wait, for up to timeout_ms. False once stopped
+        bool poll(int timeout_ms);
+        // poll() until stop()
+        void run(void);
+        // Safe to call from another thread or a signal handler
+        void stop(void);
+
+        uint32_t session_count(void) const { return m_session_count; }
+    };
+
+    /**
+     * A blocking client, standing in for the host that launches the guests.
+     * Used by the tests
+     */
+    class AttestClient {
+    private:
+        int m_fd;
+        bool exchange(uint16_t type, const uint8_t *session_id, const void *body,
+                      size_t length, attest_msg_hdr *reply, void *reply_body,
+                      size_t reply_size);
+
+    public:
+        AttestClient(void) : m_fd(-1) {}
+        ~AttestClient();
+
+        bool connect(const std::string address);
+        void close(void);
+
+        // Return the server's status, or -1 if the connection failed
+        int start(const attest_start_req *req, attest_launch_blob *blob,
+                  uint8_t *session_id);
+        int measure(const uint8_t *session_id, const attest_measure_req *req,
+                    sev_hdr_buf *header, uint8_t *packaged, size_t packaged_size,
+                    uint16_t *digest_index = NULL);
+    };
+}
+
+#endif /* ATTESTSERVER_H */
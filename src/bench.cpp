@@ -0,0 +1,1327 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+/**
+ * sevtool-bench: microbenchmarks for the crypto and cert primitives.
+ *
+ * Each benchmark is calibrated so one sample takes at least --min_time_ms,
+ * then --samples samples are taken and the per-op median, MAD, mean and 95%
+ * confidence interval are reported. The certs come from the firmware
+ * simulator, so no SEV hardware or network access is needed.
+ *
+ * Ex) sevtool-bench --cpu 2 --json new.json --baseline old.json
+ *     Exits with 1 if any benchmark is slower than the baseline by more than
+ *     --threshold percent and by more than the noise (3x MAD) of both runs.
+ *
+ * The *_legacy cert printers are the sprintf/std::string versions the
+ * certformat.h formatters replaced, kept here as the baseline. The MB/s
+ * column is text (or cert file) bytes written per second.
+ *
+ * --guest_flow runs the whole guest owner flow instead (see bench_scenario.h)
+ * Ex) sevtool-bench --guest_flow 200 --concurrency 4 --ofolder ./flow
+ *
+ * --startup times whole sevtool processes, from fork to exit, and their peak
+ * RSS. --samples and the --json/--baseline comparison work the same way
+ * Ex) sevtool-bench --startup ./sevtool --samples 50
+ */
+
+#include "amdcert.h"
+#include "bench_scenario.h"
+#include "certformat.h"
+#include "crypto.h"
+#include "csprng.h"
+#include "launchdigest.h"
+#include "libsevtool.h"
+#include "measurematch.h"
+#include "migration.h"
+#include "metrics.h"        // for Metrics::now_ns
+#include "secretpack.h"
+#include "securemem.h"
+#include "sevcert.h"
+#include "sevsim.h"
+#include "snpverify.h"
+#include "utilities.h"
+#include "psp-sev.h"
+#include <algorithm>        // for std::sort
+#include <cmath>
+#include <cstddef>          // for offsetof
+#include <fcntl.h>          // for open
+#include <getopt.h>
+#include <openssl/crypto.h> // for OPENSSL_malloc
+#include <sched.h>          // for sched_setaffinity
+#include <stdio.h>
+#include <string>
+#include <sys/random.h>     // for getrandom
+#include <sys/resource.h>   // for struct rusage
+#include <sys/stat.h>       // for mkdir
+#include <sys/wait.h>       // for wait4
+#include <unistd.h>         // for fork, execv
+
+constexpr size_t BENCH_MAX_CASES      = 64;
+constexpr size_t BENCH_MAX_SAMPLES    = 1000;
+constexpr size_t BENCH_BUFFER_SIZE    = 4096;
+constexpr size_t BENCH_CANDIDATES     = 256;    // Approved launch digests
+constexpr size_t BENCH_MATCH_INDEX    = 200;    // The one the guest was launched with
+constexpr size_t BENCH_OVMF_SIZE      = 4*1024*1024;
+constexpr size_t BENCH_SNP_REPORTS    = 64;     // Per verify_batch
+constexpr size_t BENCH_FANOUT_SESSIONS = 256;   // Of a BENCH_BUFFER_SIZE secret
+constexpr size_t STARTUP_MAX_ARGS     = 16;
+constexpr uint32_t BENCH_DEF_SAMPLES  = 30;
+constexpr uint32_t BENCH_DEF_MIN_MS   = 10;
+constexpr double BENCH_DEF_THRESHOLD  = 5.0;    // Percent
+constexpr double BENCH_NOISE_MADS     = 3.0;
+
+const char bench_help[] = "sevtool-bench [options]\n" \
+                          "  --list                 list the benchmarks and exit\n" \
+                          "  --filter [substring]   only run benchmarks with this in their name\n" \
+                          "  --samples [n]          samples per benchmark (default 30)\n" \
+                          "  --min_time_ms [ms]     minimum length of each sample (default 10)\n" \
+                          "  --cpu [n]              pin the process to this CPU\n" \
+                          "  --json [file]          write the results as JSON\n" \
+                          "  --baseline [file]      compare against a file written by --json\n" \
+                          "  --threshold [percent]  allowed slowdown vs the baseline (default 5)\n" \
+                          "  --guest_flow [n]       run the guest owner flow n times instead\n" \
+                          "  --concurrency [n]      guest_flow worker threads (default 1)\n" \
+                          "  --policy [hex]         guest_flow guest policy (default 0)\n" \
+                          "  --ofolder [folder]     guest_flow/startup working folder (default ./guest_flow)\n" \
+                          "  --startup [path]       time starting the sevtool at path instead\n";
+
+// Everything the benchmarks work on, set up once before any are run
+struct bench_fixture {
+    uint8_t key_in[16];
+    uint8_t context[16];
+    aes_128_key aes_key;
+    uint8_t gcm_key[32];
+    uint8_t iv[16];
+    uint8_t aad[16];
+    uint8_t tag[16];
+    uint8_t plain[BENCH_BUFFER_SIZE];
+    uint8_t cipher[BENCH_BUFFER_SIZE];
+    uint8_t out[BENCH_BUFFER_SIZE];
+    char hex_str[BENCH_BUFFER_SIZE*2+1];
+
+    EVP_PKEY *ecdh_key;
+    EVP_PKEY *godh_key;
+    sev_cert godh;
+    sev_sig sig;
+
+    sev_cert pdh;
+    sev_cert_chain_buf chain;
+    uint8_t ask_ark[sizeof(amd_cert)*2];
+    size_t ask_length;
+    amd_cert ask;
+    amd_cert ark;
+
+    struct sevtool_measurement meas;
+    uint8_t candidates[BENCH_CANDIDATES][32];
+    uint8_t measurement[32];    // Of candidates[BENCH_MATCH_INDEX]
+
+    uint8_t *ovmf;              // Made up SNP firmware, BENCH_OVMF_SIZE
+    sev::LaunchPageManifest *manifest;  // Of the last ovmf measured
+    size_t patched_page;
+
+    SEVSimBackend *sim;         // Also the KDS for the VCEKs
+    snp_attestation_report *snp_reports;    // BENCH_SNP_REPORTS, at two TCBs
+    sev::SNPReportVerifier *verifier;       // With the VCEKs cached
+
+    sev::secret_session *sessions;          // BENCH_FANOUT_SESSIONS
+    uint8_t *packaged;                      // Their packaged plain[]
+    sev_hdr_buf *headers;
+
+    tek_tik migration_tk;
+    uint8_t *migration;                     // ovmf as a migration stream
+
+    sev::FormatBuffer *text;    // Reused by the formatter benchmarks
+    size_t bytes;               // Output by the last op, for MB/s. 0 if none
+};
+
+struct bench_result {
+    std::string name;
+    uint64_t iterations;        // Per sample
+    uint32_t samples;
+    double median_ns;           // All of these are per op
+    double mad_ns;
+    double mean_ns;
+    double stddev_ns;
+    double ci95_ns;             // Half width of the 95% confidence interval of the mean
+    double min_ns;
+    double max_ns;
+    size_t bytes_per_op;
+};
+
+typedef bool (*bench_fn)(bench_fixture *f);
+
+static bool bench_kdf(bench_fixture *f)
+{
+    return kdf(f->out, sizeof(aes_128_key), f->key_in, sizeof(f->key_in),
+               (const uint8_t *)SEV_MASTER_SECRET_LABEL, sizeof(SEV_MASTER_SECRET_LABEL)-1,
+               f->context, sizeof(f->context));
+}
+
+static bool bench_derive_master_secret(bench_fixture *f)
+{
+    aes_128_key master_secret;
+    return derive_master_secret(master_secret, f->godh_key, &f->pdh, f->context);
+}
+
+// A 48 byte ECDH shared secret, the way calculate_shared_secret got it before
+static bool bench_key_alloc_heap(bench_fixture *f)
+{
+    (void)f;
+    uint8_t *key = (uint8_t *)OPENSSL_malloc(48);
+    if (!key)
+        return false;
+    OPENSSL_cleanse(key, 48);
+    OPENSSL_free(key);
+    return true;
+}
+
+static bool bench_key_alloc_secure(bench_fixture *f)
+{
+    (void)f;
+    void *key = sev::secure_alloc(48);
+    sev::secure_free(key, 48);
+    return key != NULL;
+}
+
+// Random bytes the way gen_random_bytes got them before the CSPRNG
+static bool random_bytes_legacy(uint8_t *bytes, size_t size)
+{
+    while (size--)
+        *bytes++ = (uint8_t)(rand() & 0xff);
+    return true;
+}
+
+// A syscall per request, without the CSPRNG's block
+static bool random_bytes_getrandom(uint8_t *bytes, size_t size)
+{
+    return getrandom(bytes, size, 0) == (ssize_t)size;
+}
+
+static bool bench_random_bytes_16_legacy(bench_fixture *f)
+{
+    f->bytes = sizeof(f->iv);
+    return random_bytes_legacy(f->iv, sizeof(f->iv));
+}
+
+static bool bench_random_bytes_16_getrandom(bench_fixture *f)
+{
+    f->bytes = sizeof(f->iv);
+    return random_bytes_getrandom(f->iv, sizeof(f->iv));
+}
+
+static bool bench_random_bytes_16(bench_fixture *f)
+{
+    f->bytes = sizeof(f->iv);
+    return sev::random_bytes(f->iv, sizeof(f->iv));
+}
+
+static bool bench_random_bytes_4k_legacy(bench_fixture *f)
+{
+    f->bytes = sizeof(f->out);
+    return random_bytes_legacy(f->out, sizeof(f->out));
+}
+
+static bool bench_random_bytes_4k_getrandom(bench_fixture *f)
+{
+    f->bytes = sizeof(f->out);
+    return random_bytes_getrandom(f->out, sizeof(f->out));
+}
+
+static bool bench_random_bytes_4k(bench_fixture *f)
+{
+    f->bytes = sizeof(f->out);
+    return sev::random_bytes(f->out, sizeof(f->out));
+}
+
+// A measurement against every approved digest, the way attest_server did
+// before the midstate matcher: a whole HMAC per candidate
+static bool bench_match_measurement_legacy(bench_fixture *f)
+{
+    struct sevtool_measurement meas = f->meas;
+    uint8_t expected[SEVTOOL_HMAC_SIZE];
+    size_t index = BENCH_CANDIDATES;
+
+    for (size_t i = 0; i < BENCH_CANDIDATES; i++) {
+        memcpy(meas.digest, f->candidates[i], sizeof(meas.digest));
+        if (sevtool_calc_measurement(&meas, expected) != STATUS_SUCCESS)
+            return false;
+        if (CRYPTO_memcmp(expected, f->measurement, sizeof(expected)) == 0 &&
+            index == BENCH_CANDIDATES)
+            index = i;
+    }
+    return index == BENCH_MATCH_INDEX;
+}
+
+static bool bench_match_measurement(bench_fixture *f)
+{
+    size_t index = 0;
+    return sevtool_match_measurement(&f->meas, f->candidates, BENCH_CANDIDATES,
+                                     f->measurement, &index) == STATUS_SUCCESS &&
+           index == BENCH_MATCH_INDEX;
+}
+
+static bool snp_launch_digest(bench_fixture *f, uint32_t threads)
+{
+    sev::launch_vcpus vcpus = {4, 4, 0xA00F11, sev::SNP_SEV_FEATURES};
+    uint8_t digest[1][sev::SNP_DIGEST_SIZE];
+    sev::snp_launch_stats stats;
+
+    f->bytes = BENCH_OVMF_SIZE;
+    return sev::snp_launch_digests(f->ovmf, BENCH_OVMF_SIZE, NULL, &vcpus, threads,
+                                   digest, &stats) == STATUS_SUCCESS;
+}
+
+// Every page hashed on this thread, the way a sequential SNP measurement is
+static bool bench_snp_launch_digest_1_thread(bench_fixture *f)
+{
+    return snp_launch_digest(f, 1);
+}
+
+static bool bench_snp_launch_digest(bench_fixture *f)
+{
+    return snp_launch_digest(f, 0);
+}
+
+// A rebuild that changed one page since the last one
+static bool bench_snp_launch_digest_incremental(bench_fixture *f)
+{
+    sev::launch_vcpus vcpus = {4, 4, 0xA00F11, sev::SNP_SEV_FEATURES};
+    uint8_t digest[1][sev::SNP_DIGEST_SIZE];
+    sev::snp_launch_stats stats;
+
+    f->patched_page = (f->patched_page + 1) % (BENCH_OVMF_SIZE / PAGE_SIZE_4K / 2);
+    f->ovmf[f->patched_page*PAGE_SIZE_4K] ^= 0x01;
+    f->bytes = BENCH_OVMF_SIZE;
+    return sev::snp_launch_digests(f->ovmf, BENCH_OVMF_SIZE, NULL, &vcpus, 0, digest, &stats,
+                                   f->manifest) == STATUS_SUCCESS &&
+           stats.pages_reused == BENCH_OVMF_SIZE / PAGE_SIZE_4K - 1;
+}
+
+static bool bench_verify_snp_report(bench_fixture *f)
+{
+    return f->verifier->verify(&f->snp_reports[0]) == STATUS_SUCCESS;
+}
+
+static bool bench_verify_snp_reports(bench_fixture *f)
+{
+    int results[BENCH_SNP_REPORTS];
+    sev::snp_verify_stats stats;
+    return f->verifier->verify_batch(f->snp_reports, BENCH_SNP_REPORTS, results, 0,
+                                     &stats) == STATUS_SUCCESS;
+}
+
+static bool package_secret_fanout(bench_fixture *f, uint32_t threads)
+{
+    sev::secret_fanout_stats stats;
+    f->bytes = BENCH_FANOUT_SESSIONS*sizeof(f->plain);
+    return sev::package_secret_fanout(f->plain, sizeof(f->plain), f->sessions,
+                                      BENCH_FANOUT_SESSIONS, 17, threads, f->packaged,
+                                      f->headers, &stats) == STATUS_SUCCESS;
+}
+
+static bool bench_package_secret_fanout_1_thread(bench_fixture *f)
+{
+    return package_secret_fanout(f, 1);
+}
+
+static bool bench_package_secret_fanout(bench_fixture *f)
+{
+    return package_secret_fanout(f, 0);
+}
+
+static bool migration_pack(bench_fixture *f, uint32_t threads)
+{
+    sev::migration_stats stats;
+    f->bytes = BENCH_OVMF_SIZE;
+    return sev::migration_pack(&f->migration_tk, f->ovmf, BENCH_OVMF_SIZE, 0, threads,
+                               f->migration, sev::migration_stream_size(BENCH_OVMF_SIZE),
+                               &stats) == STATUS_SUCCESS;
+}
+
+static bool bench_migration_pack_1_thread(bench_fixture *f)
+{
+    return migration_pack(f, 1);
+}
+
+static bool bench_migration_pack(bench_fixture *f)
+{
+    return migration_pack(f, 0);
+}
+
+// MACs and decryption only: the snp_launch_digest benchmarks patch ovmf
+static bool bench_migration_verify(bench_fixture *f)
+{
+    sev::migration_stats stats;
+    f->bytes = BENCH_OVMF_SIZE;
+    return sev::migration_verify(&f->migration_tk, f->migration,
+                                 sev::migration_stream_size(BENCH_OVMF_SIZE), NULL, 0, 0,
+                                 &stats) == STATUS_SUCCESS;
+}
+
+static bool bench_generate_ecdh_key_pair(bench_fixture *f)
+{
+    (void)f;
+    EVP_PKEY *key = NULL;
+    bool ret = generate_ecdh_key_pair(&key);
+    EVP_PKEY_free(key);
+    return ret;
+}
+
+static bool bench_sign_message(bench_fixture *f)
+{
+    sev_sig sig;
+    return sign_message(&sig, &f->ecdh_key, (const uint8_t *)&f->godh,
+                        offsetof(sev_cert, sig_1_usage), SEV_SIG_ALGO_ECDSA_SHA256);
+}
+
+static bool bench_verify_message(bench_fixture *f)
+{
+    return verify_message(&f->sig, &f->ecdh_key, (const uint8_t *)&f->godh,
+                          offsetof(sev_cert, sig_1_usage), SEV_SIG_ALGO_ECDSA_SHA256);
+}
+
+static bool bench_aes_256_gcm_encrypt(bench_fixture *f)
+{
+    return aes_256_gcm_authenticated_encrypt(f->gcm_key, sizeof(f->gcm_key),
+               f->aad, sizeof(f->aad), f->plain, sizeof(f->plain),
+               f->out, f->iv, 12, f->tag) == STATUS_SUCCESS;
+}
+
+static bool bench_aes_256_gcm_decrypt(bench_fixture *f)
+{
+    return aes_256_gcm_authenticated_decrypt(f->gcm_key, sizeof(f->gcm_key),
+               f->aad, sizeof(f->aad), f->cipher, sizeof(f->cipher),
+               f->out, f->iv, 12, f->tag) == STATUS_SUCCESS;
+}
+
+static bool bench_encrypt_aes_128_ctr(bench_fixture *f)
+{
+    return encrypt(f->out, f->plain, sizeof(f->plain), f->aes_key, f->iv);
+}
+
+static bool bench_verify_sev_cert_pdh(bench_fixture *f)
+{
+    SEVCert pdh(f->pdh);
+    return pdh.verify_sev_cert(&f->chain.pek_cert) == STATUS_SUCCESS;
+}
+
+static bool bench_verify_sev_cert_pek(bench_fixture *f)
+{
+    SEVCert pek(f->chain.pek_cert);
+    return pek.verify_sev_cert(&f->chain.oca_cert, &f->chain.cek_cert) == STATUS_SUCCESS;
+}
+
+static bool bench_amd_cert_validate_ask(bench_fixture *f)
+{
+    AMDCert tmp_amd;
+    return tmp_amd.amd_cert_validate_ask(&f->ask, &f->ark) == STATUS_SUCCESS;
+}
+
+static bool bench_amd_cert_init(bench_fixture *f)
+{
+    AMDCert tmp_amd;
+    amd_cert cert;
+    return tmp_amd.amd_cert_init(&cert, f->ask_ark) == STATUS_SUCCESS;
+}
+
+static bool bench_str_to_array(bench_fixture *f)
+{
+    return sev::str_to_array(std::string(f->hex_str), f->out, sizeof(f->out));
+}
+
+static bool bench_ascii_hex_bytes_to_binary(bench_fixture *f)
+{
+    sev::ascii_hex_bytes_to_binary(f->out, f->hex_str, sizeof(f->out));
+    return true;
+}
+
+static bool bench_reverse_bytes(bench_fixture *f)
+{
+    return sev::reverse_bytes(f->out, sizeof(f->out));
+}
+
+/**
+ * The cert printers as they were before certformat.h, so the formatters have
+ * something to be compared against
+ */
+static void legacy_print_sev_cert_readable(const sev_cert *cert, std::string &out_str)
+{
+    char out[sizeof(sev_cert)*3+500];   // 2 chars per byte + 1 spaces + ~500 extra chars for text
+
+    sprintf(out, "%-15s%08x\n", "Version:", cert->version);                         // uint32_t
+    sprintf(out+strlen(out), "%-15s%02x\n", "api_major:", cert->api_major);         // uint8_t
+    sprintf(out+strlen(out), "%-15s%02x\n", "api_minor:", cert->api_minor);         // uint8_t
+    sprintf(out+strlen(out), "%-15s%08x\n", "pub_key_usage:", cert->pub_key_usage); // uint32_t
+    sprintf(out+strlen(out), "%-15s%08x\n", "pub_key_algo:", cert->pub_key_algo);   // uint32_t
+    sprintf(out+strlen(out), "%-15s\n", "pub_key:");                                 // sev_pubkey
+    for (size_t i = 0; i < (size_t)(sizeof(sev_pubkey)); i++) {  //bytes to uint8
+        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->pub_key)[i] );
+    }
+    sprintf(out+strlen(out), "\n");
+    sprintf(out+strlen(out), "%-15s%08x\n", "sig_1_usage:", cert->sig_1_usage);     // uint32_t
+    sprintf(out+strlen(out), "%-15s%08x\n", "sig_1_algo:", cert->sig_1_algo);       // uint32_t
+    sprintf(out+strlen(out), "%-15s\n", "sig_1:");                                   // sev_sig
+    for (size_t i = 0; i < (size_t)(sizeof(sev_sig)); i++) {     //bytes to uint8
+        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->sig_1)[i] );
+    }
+    sprintf(out+strlen(out), "\n");
+    sprintf(out+strlen(out), "%-15s%08x\n", "sig_2_usage:", cert->sig_2_usage);     // uint32_t
+    sprintf(out+strlen(out), "%-15s%08x\n", "sig_2_algo:", cert->sig_2_algo);       // uint32_t
+    sprintf(out+strlen(out), "%-15s\n", "Sig2:");                                   // sev_sig
+    for (size_t i = 0; i < (size_t)(sizeof(sev_sig)); i++) {     //bytes to uint8
+        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->sig_2)[i] );
+    }
+    sprintf(out+strlen(out), "\n");
+
+    out_str += out;
+}
+
+static void legacy_print_cert_chain_buf_readable(const sev_cert_chain_buf *p, std::string &out_str)
+{
+    char out_pek[50];    // Just big enough for string below
+    char out_oca[50];
+    char out_cek[50];
+
+    std::string out_str_local = "";
+
+    sprintf(out_pek, "PEK Memory: %ld bytes\n", sizeof(sev_cert));
+    out_str_local += out_pek;
+    legacy_print_sev_cert_readable(((sev_cert *)PEK_IN_CERT_CHAIN(p)), out_str_local);
+
+    sprintf(out_oca, "\nOCA Memory: %ld bytes\n", sizeof(sev_cert));
+    out_str_local += out_oca;
+    legacy_print_sev_cert_readable(((sev_cert *)OCA_IN_CERT_CHAIN(p)), out_str_local);
+
+    sprintf(out_cek, "\nCEK Memory: %ld bytes\n", sizeof(sev_cert));
+    out_str_local += out_cek;
+    legacy_print_sev_cert_readable(((sev_cert *)CEK_IN_CERT_CHAIN(p)), out_str_local);
+
+    out_str = out_str_local;
+}
+
+static void legacy_print_amd_cert_readable(const amd_cert *cert, std::string &out_str)
+{
+    char out[sizeof(amd_cert)*3+500];   // 2 chars per byte + 1 space + ~500 extra chars for text
+
+    sprintf(out, "%-15s%08x\n", "Version:", cert->version);                               // uint32_t
+    sprintf(out+strlen(out), "%-15s%016lx\n", "key_id_0:", cert->key_id_0);               // uint64_t
+    sprintf(out+strlen(out), "%-15s%016lx\n", "key_id_1:", cert->key_id_1);               // uint64_t
+    sprintf(out+strlen(out), "%-15s%016lx\n", "certifying_id_0:", cert->certifying_id_0); // uint64_t
+    sprintf(out+strlen(out), "%-15s%016lx\n", "certifying_id_1:", cert->certifying_id_1); // uint64_t
+    sprintf(out+strlen(out), "%-15s%08x\n", "key_usage:", cert->key_usage);               // uint32_t
+    sprintf(out+strlen(out), "%-15s%016lx\n", "reserved_0:", cert->reserved_0);           // uint64_t
+    sprintf(out+strlen(out), "%-15s%016lx\n", "reserved_1:", cert->reserved_1);           // uint64_t
+    sprintf(out+strlen(out), "%-15s%08x\n", "pub_exp_size:", cert->pub_exp_size);         // uint32_t
+    sprintf(out+strlen(out), "%-15s%08x\n", "modulus_size:", cert->modulus_size);         // uint32_t
+    sprintf(out+strlen(out), "\nPubExp:\n");
+    for (size_t i = 0; i < (size_t)(cert->pub_exp_size/8); i++) {    // bytes to uint8
+        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->pub_exp)[i] );
+    }
+    sprintf(out+strlen(out), "\nModulus:\n");
+    for (size_t i = 0; i < (size_t)(cert->modulus_size/8); i++) {    // bytes to uint8
+        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->modulus)[i] );
+    }
+    sprintf(out+strlen(out), "\nSig:\n");
+    for (size_t i = 0; i < (size_t)(cert->modulus_size/8); i++) {    // bytes to uint8
+        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->sig)[i] );
+    }
+    sprintf(out+strlen(out), "\n");
+
+    out_str += out;
+}
+
+static void legacy_print_amd_cert_hex(const amd_cert *cert, std::string &out_str)
+{
+    char out[sizeof(amd_cert)*2];   // 2 chars per byte
+    size_t fixed_offset = offsetof(amd_cert, pub_exp);      // 64 bytes
+
+    out[0] = '\0';       // Gotta get the sprintf started
+
+    // Print fixed parameters
+    for (size_t i = 0; i < fixed_offset; i++) {
+        sprintf(out+strlen(out), "%02X", ((uint8_t *)&cert->version)[i] );
+    }
+    // Print pub_exp
+    for (size_t i = 0; i < (size_t)(cert->pub_exp_size/8); i++) {    // bytes to uint8
+        sprintf(out+strlen(out), "%02X", ((uint8_t *)&cert->pub_exp)[i] );
+    }
+    // Print nModulus
+    for (size_t i = 0; i < (size_t)(cert->modulus_size/8); i++) {    // bytes to uint8
+        sprintf(out+strlen(out), "%02X", ((uint8_t *)&cert->modulus)[i] );
+    }
+    // Print Sig
+    for (size_t i = 0; i < (size_t)(cert->modulus_size/8); i++) {    // bytes to uint8
+        sprintf(out+strlen(out), "%02X", ((uint8_t *)&cert->sig)[i] );
+    }
+
+    out_str += out;
+}
+
+static bool bench_sev_cert_readable_legacy(bench_fixture *f)
+{
+    std::string out = "";
+    legacy_print_sev_cert_readable(&f->pdh, out);
+    f->bytes = out.size();
+    return true;
+}
+
+static bool bench_sev_cert_readable(bench_fixture *f)
+{
+    f->text->clear();
+    f->bytes = sev::sev_cert_readable_size();
+    return sev::format_sev_cert_readable(f->text, &f->pdh);
+}
+
+static bool bench_cert_chain_readable_legacy(bench_fixture *f)
+{
+    std::string out = "";
+    legacy_print_cert_chain_buf_readable(&f->chain, out);
+    f->bytes = out.size();
+    return true;
+}
+
+static bool bench_cert_chain_readable(bench_fixture *f)
+{
+    f->text->clear();
+    f->bytes = sev::cert_chain_buf_readable_size();
+    return sev::format_cert_chain_buf_readable(f->text, &f->chain);
+}
+
+static bool bench_amd_cert_readable_legacy(bench_fixture *f)
+{
+    std::string out = "";
+    legacy_print_amd_cert_readable(&f->ask, out);
+    f->bytes = out.size();
+    return true;
+}
+
+static bool bench_amd_cert_readable(bench_fixture *f)
+{
+    f->text->clear();
+    f->bytes = sev::amd_cert_readable_size(&f->ask);
+    return sev::format_amd_cert_readable(f->text, &f->ask);
+}
+
+static bool bench_amd_cert_hex_legacy(bench_fixture *f)
+{
+    std::string out = "";
+    legacy_print_amd_cert_hex(&f->ask, out);
+    f->bytes = out.size();
+    return true;
+}
+
+static bool bench_amd_cert_hex(bench_fixture *f)
+{
+    f->text->clear();
+    f->bytes = sev::amd_cert_hex_size(&f->ask);
+    return sev::format_amd_cert_hex(f->text, &f->ask);
+}
+
+// The .cert file the way write_ask_ark_certs used to make it, through hex
+static bool bench_amd_cert_binary_legacy(bench_fixture *f)
+{
+    AMDCert tmp_amd;
+    std::string out = "";
+    size_t size = tmp_amd.amd_cert_get_size(&f->ask);
+    legacy_print_amd_cert_hex(&f->ask, out);
+    sev::ascii_hex_bytes_to_binary(f->out, out.c_str(), size);
+    f->bytes = size;
+    return true;
+}
+
+static bool bench_amd_cert_binary(bench_fixture *f)
+{
+    f->bytes = sev::write_amd_cert_binary(f->out, sizeof(f->out), &f->ask);
+    return f->bytes != 0;
+}
+
+static const struct {
+    const char *name;
+    bench_fn fn;
+} bench_cases[] = {
+    {"kdf",                        bench_kdf},
+    {"derive_master_secret",       bench_derive_master_secret},
+    {"generate_ecdh_key_pair",     bench_generate_ecdh_key_pair},
+    {"key_alloc_heap",             bench_key_alloc_heap},
+    {"key_alloc_secure",           bench_key_alloc_secure},
+    {"random_bytes_16_legacy",     bench_random_bytes_16_legacy},
+    {"random_bytes_16_getrandom",  bench_random_bytes_16_getrandom},
+    {"random_bytes_16",            bench_random_bytes_16},
+    {"random_bytes_4k_legacy",     bench_random_bytes_4k_legacy},
+    {"random_bytes_4k_getrandom",  bench_random_bytes_4k_getrandom},
+    {"random_bytes_4k",            bench_random_bytes_4k},
+    {"match_measurement_256_legacy", bench_match_measurement_legacy},
+    {"match_measurement_256",      bench_match_measurement},
+    {"snp_launch_digest_4m_1_thread", bench_snp_launch_digest_1_thread},
+    {"snp_launch_digest_4m",       bench_snp_launch_digest},
+    {"snp_launch_digest_4m_1_page", bench_snp_launch_digest_incremental},
+    {"verify_snp_report",          bench_verify_snp_report},
+    {"verify_snp_reports_64",      bench_verify_snp_reports},
+    {"package_secret_fanout_256_1_thread", bench_package_secret_fanout_1_thread},
+    {"package_secret_fanout_256",  bench_package_secret_fanout},
+    {"migration_pack_4m_1_thread", bench_migration_pack_1_thread},
+    {"migration_pack_4m",          bench_migration_pack},
+    {"migration_verify_4m",        bench_migration_verify},
+    {"sign_message",               bench_sign_message},
+    {"verify_message",             bench_verify_message},
+    {"aes_256_gcm_encrypt_4k",     bench_aes_256_gcm_encrypt},
+    {"aes_256_gcm_decrypt_4k",     bench_aes_256_gcm_decrypt},
+    {"encrypt_aes_128_ctr_4k",     bench_encrypt_aes_128_ctr},
+    {"verify_sev_cert_pdh",        bench_verify_sev_cert_pdh},
+    {"verify_sev_cert_pek",        bench_verify_sev_cert_pek},
+    {"amd_cert_validate_ask",      bench_amd_cert_validate_ask},
+    {"amd_cert_init",              bench_amd_cert_init},
+    {"str_to_array_4k",            bench_str_to_array},
+    {"ascii_hex_bytes_to_binary_4k", bench_ascii_hex_bytes_to_binary},
+    {"reverse_bytes_4k",           bench_reverse_bytes},
+    {"sev_cert_readable_legacy",   bench_sev_cert_readable_legacy},
+    {"sev_cert_readable",          bench_sev_cert_readable},
+    {"cert_chain_readable_legacy", bench_cert_chain_readable_legacy},
+    {"cert_chain_readable",        bench_cert_chain_readable},
+    {"amd_cert_readable_legacy",   bench_amd_cert_readable_legacy},
+    {"amd_cert_readable",          bench_amd_cert_readable},
+    {"amd_cert_hex_legacy",        bench_amd_cert_hex_legacy},
+    {"amd_cert_hex",               bench_amd_cert_hex},
+    {"amd_cert_binary_legacy",     bench_amd_cert_binary_legacy},
+    {"amd_cert_binary",            bench_amd_cert_binary},
+};
+
+// --startup runs the sevtool binary with each of these and times the whole
+// process, to catch anything that makes startup slower or the process bigger
+// (e.g. linking in libraries only some commands need). {} is --ofolder
+struct startup_case {
+    const char *name;
+    const char *args;
+};
+
+static const startup_case startup_cases[] = {
+    {"startup_help",               "--help"},
+    {"startup_platform_status",    "--sim --platform_status"},
+    {"startup_calc_measurement",   "--sim --ofolder {} --calc_measurement 04 00 12 0f 00 "
+                                   "e3b0c44298fc1c149afbf4c8996fb92427ae41e4649b934ca495991b7852b855 "
+                                   "4fbe0bedbad6c86ae8f68971d103e554 66320db73158a35a255d051758e95ed4"},
+};
+
+/**
+ * Description: Checks that each formatter writes exactly what the legacy
+ *              printer it is benchmarked against does
+ */
+static bool formats_match(bench_fixture *f)
+{
+    std::string legacy[4] = {"", "", "", ""};
+    bool match = true;
+
+    legacy_print_sev_cert_readable(&f->pdh, legacy[0]);
+    match = match && bench_sev_cert_readable(f) && legacy[0] == f->text->data() &&
+            f->text->size() == f->bytes;
+    legacy_print_cert_chain_buf_readable(&f->chain, legacy[1]);
+    match = match && bench_cert_chain_readable(f) && legacy[1] == f->text->data() &&
+            f->text->size() == f->bytes;
+    legacy_print_amd_cert_readable(&f->ask, legacy[2]);
+    match = match && bench_amd_cert_readable(f) && legacy[2] == f->text->data() &&
+            f->text->size() == f->bytes;
+    legacy_print_amd_cert_hex(&f->ask, legacy[3]);
+    match = match && bench_amd_cert_hex(f) && legacy[3] == f->text->data() &&
+            f->text->size() == f->bytes;
+
+    // The binary writer against the bytes the ASK came from
+    match = match && bench_amd_cert_binary(f) &&
+            memcmp(f->out, f->ask_ark, f->bytes) == 0;
+
+    return match;
+}
+
+/**
+ * Description: Builds the keys, buffers and certs the benchmarks use. The
+ *              PDH/PEK/OCA/CEK and ASK/ARK come from the firmware
+ *              simulator, so the signature checks are run on real chains
+ */
+static bool setup_fixture(bench_fixture *f)
+{
+    bool ret = false;
+    int cmd_ret = -1;
+
+    memset(f, 0, sizeof(*f));
+
+    do {
+        sev::gen_random_bytes(f->key_in, sizeof(f->key_in));
+        sev::gen_random_bytes(f->context, sizeof(f->context));
+        sev::gen_random_bytes(f->aes_key, sizeof(f->aes_key));
+        sev::gen_random_bytes(f->gcm_key, sizeof(f->gcm_key));
+        sev::gen_random_bytes(f->iv, sizeof(f->iv));
+        sev::gen_random_bytes(f->aad, sizeof(f->aad));
+        sev::gen_random_bytes(f->plain, sizeof(f->plain));
+        for (size_t i = 0; i < sizeof(f->plain); i++)
+            sprintf(f->hex_str + i*2, "%02x", f->plain[i]);
+
+        f->meas.meas_ctx = 0x04;
+        f->meas.api_major = SIM_API_MAJOR;
+        f->meas.api_minor = SIM_API_MINOR_ROME;
+        f->meas.build_id = SIM_BUILD_ID;
+        f->meas.policy = 0x1;
+        sev::gen_random_bytes(f->meas.mnonce, sizeof(f->meas.mnonce));
+        sev::gen_random_bytes(f->meas.tik, sizeof(f->meas.tik));
+        sev::gen_random_bytes(f->candidates, sizeof(f->candidates));
+        memcpy(f->meas.digest, f->candidates[BENCH_MATCH_INDEX], sizeof(f->meas.digest));
+        if (sevtool_calc_measurement(&f->meas, f->measurement) != STATUS_SUCCESS)
+            break;
+
+        // Just the footer table entries SNP needs: the SEV metadata, with
+        // one zeroed section, and the AP reset address
+        f->ovmf = new uint8_t[BENCH_OVMF_SIZE];
+        sev::gen_random_bytes(f->ovmf, BENCH_OVMF_SIZE);
+        uint8_t *end = f->ovmf + BENCH_OVMF_SIZE - 32;
+        uint16_t entry_sizes[2] = {18 + 22 + 22, 22};
+        uint32_t meta_offset = 0x1000;
+        uint32_t ap_eip = 0xFFFFB00C;
+        uint32_t meta[4 + 3] = {sev::SEV_METADATA_SIGNATURE, 16 + 12, sev::SEV_METADATA_VERSION, 1,
+                                0x800000, 0x10000, sev::SEV_SECTION_SNP_SEC_MEM};
+        memcpy(end - 16, sev::OVMF_TABLE_FOOTER_GUID, 16);
+        memcpy(end - 18, &entry_sizes[0], 2);
+        memcpy(end - 34, sev::SEV_ES_RESET_BLOCK_GUID, 16);
+        memcpy(end - 36, &entry_sizes[1], 2);
+        memcpy(end - 40, &ap_eip, 4);
+        memcpy(end - 56, sev::SEV_METADATA_GUID, 16);
+        memcpy(end - 58, &entry_sizes[1], 2);
+        memcpy(end - 62, &meta_offset, 4);
+        memcpy(f->ovmf + BENCH_OVMF_SIZE - meta_offset, meta, sizeof(meta));
+        f->manifest = new sev::LaunchPageManifest;
+        sev::launch_vcpus vcpus = {1, 1, 0xA00F11, sev::SNP_SEV_FEATURES};
+        uint8_t digest[1][sev::SNP_DIGEST_SIZE];
+        sev::snp_launch_stats stats;
+        if (sev::snp_launch_digests(f->ovmf, BENCH_OVMF_SIZE, NULL, &vcpus, 1, digest, &stats,
+                                    f->manifest) != STATUS_SUCCESS)
+            break;
+
+        if (aes_256_gcm_authenticated_encrypt(f->gcm_key, sizeof(f->gcm_key),
+                f->aad, sizeof(f->aad), f->plain, sizeof(f->plain),
+                f->cipher, f->iv, 12, f->tag) != STATUS_SUCCESS)
+            break;
+
+        if (!generate_ecdh_key_pair(&f->ecdh_key))
+            break;
+        if (!generate_ecdh_key_pair(&f->godh_key))
+            break;
+        SEVCert godh(f->godh);
+        if (!godh.create_godh_cert(&f->godh_key, 0, SIM_API_MINOR_ROME))
+            break;
+        f->godh = *godh.data();
+        if (!sign_message(&f->sig, &f->ecdh_key, (const uint8_t *)&f->godh,
+                          offsetof(sev_cert, sig_1_usage), SEV_SIG_ALGO_ECDSA_SHA256))
+            break;
+
+        // Real chains from the simulator
+        f->sim = new SEVSimBackend;
+        if (!f->sim->open_device())
+            break;
+        sev_user_data_pdh_cert_export export_buf;
+        memset(&export_buf, 0, sizeof(export_buf));
+        export_buf.pdh_cert_address = (uint64_t)&f->pdh;
+        export_buf.pdh_cert_len = sizeof(f->pdh);
+        export_buf.cert_chain_address = (uint64_t)&f->chain;
+        export_buf.cert_chain_len = sizeof(f->chain);
+        if (f->sim->issue_cmd(SEV_PDH_CERT_EXPORT, &export_buf, &cmd_ret) != 0)
+            break;
+        if (f->sim->kds_get_ask_ark(f->ask_ark, sizeof(f->ask_ark), &f->ask_length) != STATUS_SUCCESS)
+            break;
+
+        AMDCert tmp_amd;
+        if (tmp_amd.amd_cert_init(&f->ask, f->ask_ark) != STATUS_SUCCESS)
+            break;
+        size_t ask_size = tmp_amd.amd_cert_get_size(&f->ask);
+        if (tmp_amd.amd_cert_init(&f->ark, f->ask_ark + ask_size) != STATUS_SUCCESS)
+            break;
+
+        f->snp_reports = new snp_attestation_report[BENCH_SNP_REPORTS];
+        bool failed = false;
+        uint8_t report_data[64];
+        uint8_t measurement[48];
+        sev::gen_random_bytes(measurement, sizeof(measurement));
+        for (size_t i = 0; i < BENCH_SNP_REPORTS && !failed; i++) {
+            sev::gen_random_bytes(report_data, sizeof(report_data));
+            failed = f->sim->snp_guest_report(report_data, measurement, 0x0800000000000003ULL + (i % 2),
+                                              &f->snp_reports[i]) != STATUS_SUCCESS;
+        }
+        if (failed)
+            break;
+        f->verifier = new sev::SNPReportVerifier(f->sim);
+        if (f->verifier->set_amd_chain(&f->ask, &f->ark) != STATUS_SUCCESS)
+            break;
+        sev::snp_verify_stats verify_stats;
+        int results[BENCH_SNP_REPORTS];
+        if (f->verifier->verify_batch(f->snp_reports, BENCH_SNP_REPORTS, results, 1,
+                                      &verify_stats) != STATUS_SUCCESS)
+            break;
+
+        f->sessions = new sev::secret_session[BENCH_FANOUT_SESSIONS];
+        sev::gen_random_bytes(f->sessions, BENCH_FANOUT_SESSIONS*sizeof(sev::secret_session));
+        f->packaged = new uint8_t[BENCH_FANOUT_SESSIONS*sizeof(f->plain)];
+        f->headers = new sev_hdr_buf[BENCH_FANOUT_SESSIONS];
+
+        sev::gen_random_bytes(&f->migration_tk, sizeof(f->migration_tk));
+        f->migration = new uint8_t[sev::migration_stream_size(BENCH_OVMF_SIZE)];
+        if (!migration_pack(f, 1))
+            break;
+
+        f->text = new sev::FormatBuffer(sev::cert_chain_buf_readable_size() + 1);
+        if (!formats_match(f)) {
+            printf("Error: the cert formatters don't match the legacy printers\n");
+            break;
+        }
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+static double median_of(double *values, size_t count)
+{
+    std::sort(values, values + count);
+    if (count % 2)
+        return values[count/2];
+    return (values[count/2 - 1] + values[count/2]) / 2.0;
+}
+
+/**
+ * Description: Fills in result from the per-op times of each sample.
+ *              Sorts per_op
+ */
+static void summarize(const char *name, double *per_op, uint32_t samples,
+                      uint64_t iterations, bench_result *result)
+{
+    double sum = 0, min = per_op[0], max = per_op[0];
+    for (uint32_t s = 0; s < samples; s++) {
+        sum += per_op[s];
+        min = std::min(min, per_op[s]);
+        max = std::max(max, per_op[s]);
+    }
+    double mean = sum / samples;
+    double var = 0;
+    for (uint32_t s = 0; s < samples; s++)
+        var += (per_op[s] - mean) * (per_op[s] - mean);
+    double stddev = (samples > 1) ? sqrt(var / (samples - 1)) : 0;
+
+    double median = median_of(per_op, samples);
+    double deviation[BENCH_MAX_SAMPLES];
+    for (uint32_t s = 0; s < samples; s++)
+        deviation[s] = fabs(per_op[s] - median);
+
+    result->name = name;
+    result->iterations = iterations;
+    result->samples = samples;
+    result->median_ns = median;
+    result->mad_ns = median_of(deviation, samples);
+    result->mean_ns = mean;
+    result->stddev_ns = stddev;
+    result->ci95_ns = 1.96 * stddev / sqrt((double)samples);
+    result->min_ns = min;
+    result->max_ns = max;
+    result->bytes_per_op = 0;
+}
+
+/**
+ * Description: Runs one benchmark. The iteration count is doubled until one
+ *              batch takes min_time_ms, then that many iterations are timed
+ *              per sample. The first (warm up) batch isn't counted
+ */
+static bool run_case(const char *name, bench_fn fn, bench_fixture *f,
+                     uint32_t samples, uint32_t min_time_ms, bench_result *result)
+{
+    uint64_t min_ns = (uint64_t)min_time_ms * 1000000ULL;
+    uint64_t iterations = 1;
+    double per_op[BENCH_MAX_SAMPLES];
+
+    f->bytes = 0;
+
+    // Warm up and calibrate
+    while (true) {
+        uint64_t start = sev::Metrics::now_ns();
+        for (uint64_t i = 0; i < iterations; i++) {
+            if (!fn(f)) {
+                printf("Error: %s failed\n", name);
+                return false;
+            }
+        }
+        if (sev::Metrics::now_ns() - start >= min_ns || iterations >= (1ULL << 40))
+            break;
+        iterations *= 2;
+    }
+
+    for (uint32_t s = 0; s < samples; s++) {
+        uint64_t start = sev::Metrics::now_ns();
+        for (uint64_t i = 0; i < iterations; i++)
+            fn(f);
+        per_op[s] = (double)(sev::Metrics::now_ns() - start) / (double)iterations;
+    }
+
+    summarize(name, per_op, samples, iterations, result);
+    result->bytes_per_op = f->bytes;
+    return true;
+}
+
+/**
+ * Description: Runs sevtool once with its output thrown away. elapsed_ns is
+ *              fork to exit, max_rss_kb is the child's peak RSS
+ */
+static bool run_sevtool(const std::string sevtool, char **args,
+                        uint64_t *elapsed_ns, long *max_rss_kb)
+{
+    uint64_t start = sev::Metrics::now_ns();
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+    if (pid == 0) {
+        int null_fd = open("/dev/null", O_WRONLY);
+        if (null_fd >= 0) {
+            dup2(null_fd, STDOUT_FILENO);
+            dup2(null_fd, STDERR_FILENO);
+        }
+        execv(sevtool.c_str(), args);
+        _exit(127);
+    }
+
+    int status = 0;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) != pid)
+        return false;
+    *elapsed_ns = sev::Metrics::now_ns() - start;
+    *max_rss_kb = usage.ru_maxrss;
+
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0;
+}
+
+/**
+ * Description: Times samples runs of sevtool with the case's arguments,
+ *              after one warm up run. max_rss_kb gets the median peak RSS
+ */
+static bool run_startup_case(const startup_case *c, const std::string sevtool,
+                             const std::string folder, uint32_t samples,
+                             bench_result *result, long *max_rss_kb)
+{
+    double per_op[BENCH_MAX_SAMPLES];
+    double rss[BENCH_MAX_SAMPLES];
+    char *args[STARTUP_MAX_ARGS + 2];
+    size_t num_args = 0;
+
+    // argv[0], then the case's arguments split on spaces with {} -> folder
+    std::string arg_str = c->args;
+    std::string words[STARTUP_MAX_ARGS + 1];
+    words[num_args++] = sevtool;
+    size_t pos = 0;
+    while (pos < arg_str.size() && num_args <= STARTUP_MAX_ARGS) {
+        size_t end = arg_str.find(' ', pos);
+        if (end == std::string::npos)
+            end = arg_str.size();
+        std::string word = arg_str.substr(pos, end - pos);
+        words[num_args++] = (word == "{}") ? folder : word;
+        pos = end + 1;
+    }
+    for (size_t i = 0; i < num_args; i++)
+        args[i] = (char *)words[i].c_str();
+    args[num_args] = NULL;
+
+    uint64_t elapsed = 0;
+    long run_rss = 0;
+    for (uint32_t s = 0; s <= samples; s++) {
+        if (!run_sevtool(sevtool, args, &elapsed, &run_rss)) {
+            printf("Error: %s %s failed\n", sevtool.c_str(), c->args);
+            return false;
+        }
+        if (s == 0)             // Warm up
+            continue;
+        per_op[s-1] = (double)elapsed;
+        rss[s-1] = (double)run_rss;
+    }
+
+    summarize(c->name, per_op, samples, 1, result);
+    *max_rss_kb = (long)median_of(rss, samples);
+    return true;
+}
+
+static bool write_json(const std::string file_name, const bench_result *results,
+                       size_t count, int cpu)
+{
+    FILE *file = fopen(file_name.c_str(), "w");
+    if (!file) {
+        printf("Error: unable to open %s\n", file_name.c_str());
+        return false;
+    }
+
+    // One benchmark per line, so --baseline can read it back without a parser
+    fprintf(file, "{\"tool\":\"sevtool-bench\",\"cpu\":%d,\"benchmarks\":[\n", cpu);
+    for (size_t i = 0; i < count; i++) {
+        const bench_result *r = &results[i];
+        fprintf(file, "{\"name\":\"%s\",\"iterations\":%llu,\"samples\":%u,"
+                "\"median_ns\":%.3f,\"mad_ns\":%.3f,\"mean_ns\":%.3f,"
+                "\"stddev_ns\":%.3f,\"ci95_ns\":%.3f,\"min_ns\":%.3f,\"max_ns\":%.3f,"
+                "\"bytes_per_op\":%zu}%s\n",
+                r->name.c_str(), (unsigned long long)r->iterations, r->samples,
+                r->median_ns, r->mad_ns, r->mean_ns, r->stddev_ns, r->ci95_ns,
+                r->min_ns, r->max_ns, r->bytes_per_op, (i + 1 < count) ? "," : "");
+    }
+    fprintf(file, "]}\n");
+
+    return fclose(file) == 0;
+}
+
+static bool json_number(const std::string &line, const std::string key, double *value)
+{
+    size_t pos = line.find("\"" + key + "\":");
+    if (pos == std::string::npos)
+        return false;
+    *value = strtod(line.c_str() + pos + key.size() + 3, NULL);
+    return true;
+}
+
+/**
+ * Description: Compares the results against a file written by --json.
+ *              A benchmark has regressed if its median got slower by more
+ *              than threshold percent AND by more than BENCH_NOISE_MADS
+ *              times the larger of the two MADs
+ * Returns:     Number of regressions, or -1 if the baseline can't be read
+ */
+static int compare_baseline(const std::string file_name, const bench_result *results,
+                            size_t count, double threshold)
+{
+    FILE *file = fopen(file_name.c_str(), "r");
+    if (!file) {
+        printf("Error: unable to open baseline %s\n", file_name.c_str());
+        return -1;
+    }
+
+    int regressions = 0;
+    char buf[1024];
+    printf("\n%-30s %14s %14s %9s\n", "benchmark", "baseline(ns)", "current(ns)", "change");
+    while (fgets(buf, sizeof(buf), file)) {
+        std::string line = buf;
+        size_t name_pos = line.find("\"name\":\"");
+        if (name_pos == std::string::npos)
+            continue;
+        name_pos += 8;
+        std::string name = line.substr(name_pos, line.find('"', name_pos) - name_pos);
+
+        double base_median = 0, base_mad = 0;
+        if (!json_number(line, "median_ns", &base_median) || base_median <= 0)
+            continue;
+        json_number(line, "mad_ns", &base_mad);
+
+        for (size_t i = 0; i < count; i++) {
+            if (results[i].name != name)
+                continue;
+            double change = (results[i].median_ns - base_median) / base_median * 100.0;
+            double noise = BENCH_NOISE_MADS * std::max(base_mad, results[i].mad_ns);
+            bool regressed = change > threshold &&
+                             (results[i].median_ns - base_median) > noise;
+            printf("%-30s %14.1f %14.1f %+8.1f%%%s\n", name.c_str(), base_median,
+                   results[i].median_ns, change, regressed ? "  REGRESSION" : "");
+            if (regressed)
+                regressions++;
+        }
+    }
+    fclose(file);
+
+    return regressions;
+}
+
+static struct option long_options[] =
+{
+    {"list",        no_argument,       0, 'l'},
+    {"filter",      required_argument, 0, 'f'},
+    {"samples",     required_argument, 0, 's'},
+    {"min_time_ms", required_argument, 0, 'm'},
+    {"cpu",         required_argument, 0, 'c'},
+    {"json",        required_argument, 0, 'j'},
+    {"baseline",    required_argument, 0, 'b'},
+    {"threshold",   required_argument, 0, 't'},
+    {"guest_flow",  required_argument, 0, 'g'},
+    {"concurrency", required_argument, 0, 'n'},
+    {"policy",      required_argument, 0, 'p'},
+    {"ofolder",     required_argument, 0, 'o'},
+    {"startup",     required_argument, 0, 'r'},
+    {"help",        no_argument,       0, 'h'},
+    {0, 0, 0, 0}
+};
+
+int main(int argc, char **argv)
+{
+    int c = 0;
+    int option_index = 0;
+    std::string filter = "";
+    std::string json_file = "";
+    std::string baseline_file = "";
+    std::string startup_sevtool = "";
+    uint32_t samples = BENCH_DEF_SAMPLES;
+    uint32_t min_time_ms = BENCH_DEF_MIN_MS;
+    double threshold = BENCH_DEF_THRESHOLD;
+    int cpu = -1;
+    size_t num_cases = sizeof(bench_cases)/sizeof(bench_cases[0]);
+    scenario_options scenario;
+    scenario.iterations = 0;
+    scenario.concurrency = 1;
+    scenario.policy = 0;
+    scenario.output_folder = "./guest_flow/";
+
+    while ((c = getopt_long(argc, argv, "h", long_options, &option_index)) != -1) {
+        switch (c) {
+            case 'l': {
+                for (size_t i = 0; i < num_cases; i++)
+                    printf("%s\n", bench_cases[i].name);
+                for (size_t i = 0; i < sizeof(startup_cases)/sizeof(startup_cases[0]); i++)
+                    printf("%s\n", startup_cases[i].name);
+                return 0;
+            }
+            case 'f': filter = optarg; break;
+            case 's': samples = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'm': min_time_ms = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'c': cpu = (int)strtol(optarg, NULL, 10); break;
+            case 'j': json_file = optarg; break;
+            case 'b': baseline_file = optarg; break;
+            case 't': threshold = strtod(optarg, NULL); break;
+            case 'g': scenario.iterations = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'n': scenario.concurrency = (uint32_t)strtoul(optarg, NULL, 10); break;
+            case 'p': scenario.policy = (uint32_t)strtoul(optarg, NULL, 16); break;
+            case 'o': scenario.output_folder = std::string(optarg) + "/"; break;
+            case 'r': startup_sevtool = optarg; break;
+            case 'h':
+            default: {
+                printf("%s", bench_help);
+                return (c == 'h') ? 0 : 2;
+            }
+        }
+    }
+
+    if (samples < 2 || samples > BENCH_MAX_SAMPLES) {
+        printf("Error: --samples must be between 2 and %zu\n", BENCH_MAX_SAMPLES);
+        return 2;
+    }
+
+    // Keep the scheduler from moving us between cores mid-sample
+    if (cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpu, &set);
+        if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+            printf("Error: unable to pin to cpu %d\n", cpu);
+            return 2;
+        }
+    }
+
+    if (scenario.iterations != 0) {
+        scenario.json_file = json_file;
+        return run_guest_owner_scenario(&scenario);
+    }
+
+    bench_result *results = new bench_result[BENCH_MAX_CASES];
+    size_t count = 0;
+    bool ok = true;
+    bench_fixture *fixture = NULL;
+
+    if (!startup_sevtool.empty()) {
+        size_t num_startup = sizeof(startup_cases)/sizeof(startup_cases[0]);
+        mkdir(scenario.output_folder.c_str(), 0755);
+        printf("%-30s %12s %10s %12s %10s %14s\n", "benchmark", "median(us)", "mad(us)",
+               "mean(us)", "ci95(us)", "max_rss(KiB)");
+        for (size_t i = 0; i < num_startup && count < BENCH_MAX_CASES; i++) {
+            if (!filter.empty() && std::string(startup_cases[i].name).find(filter) == std::string::npos)
+                continue;
+            bench_result *r = &results[count];
+            long max_rss_kb = 0;
+            if (!run_startup_case(&startup_cases[i], startup_sevtool,
+                                  scenario.output_folder, samples, r, &max_rss_kb)) {
+                ok = false;
+                continue;
+            }
+            printf("%-30s %12.1f %10.1f %12.1f %10.1f %14ld\n", r->name.c_str(),
+                   r->median_ns / 1000, r->mad_ns / 1000, r->mean_ns / 1000,
+                   r->ci95_ns / 1000, max_rss_kb);
+            count++;
+        }
+    }
+    else {
+        fixture = new bench_fixture;
+        if (!setup_fixture(fixture)) {
+            printf("Error: benchmark setup failed\n");
+            delete fixture->text;
+            delete[] fixture->ovmf;
+            delete fixture->manifest;
+            delete fixture->verifier;
+            delete[] fixture->snp_reports;
+            delete[] fixture->sessions;
+            delete[] fixture->packaged;
+            delete[] fixture->headers;
+            delete[] fixture->migration;
+            delete fixture->sim;
+            delete fixture;
+            delete[] results;
+            return 2;
+        }
+
+        printf("%-30s %12s %10s %12s %10s %14s %10s\n", "benchmark", "median(ns)", "mad(ns)",
+               "mean(ns)", "ci95(ns)", "ops/s", "MB/s");
+        for (size_t i = 0; i < num_cases && count < BENCH_MAX_CASES; i++) {
+            if (!filter.empty() && std::string(bench_cases[i].name).find(filter) == std::string::npos)
+                continue;
+            bench_result *r = &results[count];
+            if (!run_case(bench_cases[i].name, bench_cases[i].fn, fixture, samples,
+                          min_time_ms, r)) {
+                ok = false;
+                continue;
+            }
+            printf("%-30s %12.1f %10.1f %12.1f %10.1f %14.0f", r->name.c_str(),
+                   r->median_ns, r->mad_ns, r->mean_ns, r->ci95_ns, 1e9 / r->median_ns);
+            if (r->bytes_per_op)
+                printf(" %10.1f\n", (double)r->bytes_per_op * 1e3 / r->median_ns);
+            else
+                printf(" %10s\n", "-");
+            count++;
+        }
+    }
+
+    if (!json_file.empty() && !write_json(json_file, results, count, cpu))
+        ok = false;
+
+    int regressions = 0;
+    if (!baseline_file.empty()) {
+        regressions = compare_baseline(baseline_file, results, count, threshold);
+        if (regressions < 0)
+            ok = false;
+        else
+            printf("\n%d regression(s) over %.1f%%\n", regressions, threshold);
+    }
+
+    if (fixture) {
+        EVP_PKEY_free(fixture->ecdh_key);
+        EVP_PKEY_free(fixture->godh_key);
+        delete fixture->text;
+        delete[] fixture->ovmf;
+        delete fixture->manifest;
+        delete fixture->verifier;
+        delete[] fixture->snp_reports;
+        delete[] fixture->sessions;
+        delete[] fixture->packaged;
+        delete[] fixture->headers;
+        delete[] fixture->migration;
+        delete fixture->sim;
+        delete fixture;
+    }
+    delete[] results;
+
+    if (!ok)
+        return 2;
+    return (regressions > 0) ? 1 : 0;
+}
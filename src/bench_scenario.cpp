@@ -0,0 +1,251 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "commands.h"
+#include "bench_scenario.h"
+#include "metrics.h"
+#include "sevcore.h"
+#include "sessionstore.h"
+#include "utilities.h"
+#include <atomic>
+#include <cstdio>           // for std::remove
+#include <fcntl.h>          // for open
+#include <stdio.h>
+#include <sys/stat.h>       // for mkdir
+#include <thread>
+#include <unistd.h>         // for dup, dup2
+
+constexpr size_t SCENARIO_SECRET_SIZE = 64;
+
+enum scenario_stage {
+    STAGE_PDH_CERT_EXPORT = 0,  // PDH_CERT_EXPORT plus the CEK/ASK/ARK from the KDS
+    STAGE_VALIDATE_CERT_CHAIN,
+    STAGE_GENERATE_LAUNCH_BLOB,
+    STAGE_CALC_MEASUREMENT,
+    STAGE_PACKAGE_SECRET,
+    STAGE_TOTAL,                // The whole flow
+    STAGE_COUNT,
+};
+
+static const char *stage_names[STAGE_COUNT] = {
+    "pdh_cert_export", "validate_cert_chain", "generate_launch_blob",
+    "calc_measurement", "package_secret", "total",
+};
+
+static const double stage_percentiles[] = {50.0, 99.0, 99.9};
+
+struct scenario_state {
+    const scenario_options *opts;
+    sev::LatencyHistogram *stages[STAGE_COUNT];
+    std::atomic<uint32_t> next_flow;
+    std::atomic<uint32_t> failures;
+    uint8_t api_major;
+    uint8_t api_minor;
+    uint8_t build_id;
+};
+
+/**
+ * Runs one stage and records how long it took. Returns false if the
+ * stage failed, in which case the rest of the flow is skipped
+ */
+template <typename Fn>
+static bool timed_stage(scenario_state *state, scenario_stage stage, Fn fn)
+{
+    uint64_t start = sev::Metrics::now_ns();
+    int ret = fn();
+    state->stages[stage]->record(sev::Metrics::now_ns() - start);
+    return ret == STATUS_SUCCESS;
+}
+
+static void scenario_worker(scenario_state *state, uint32_t worker)
+{
+    std::string folder = state->opts->output_folder + "worker_" +
+                         std::to_string(worker) + "/";
+    mkdir(folder.c_str(), 0755);
+
+    uint8_t secret[SCENARIO_SECRET_SIZE];
+    sev::gen_random_bytes(secret, sizeof(secret));
+    if (sev::write_file(folder + SECRET_FILENAME, secret, sizeof(secret)) != sizeof(secret)) {
+        state->failures += state->opts->iterations;
+        return;
+    }
+
+    while (state->next_flow.fetch_add(1) < state->opts->iterations) {
+        Command cmd(folder, 0);
+        uint64_t start = sev::Metrics::now_ns();
+        bool ok = false;
+
+        // Make every flow go to the KDS, like a fresh guest owner would
+        std::remove((folder + CEK_FILENAME).c_str());
+        std::remove((folder + ASK_ARK_FILENAME).c_str());
+
+        do {
+            if (!timed_stage(state, STAGE_PDH_CERT_EXPORT,
+                             [&]() { return cmd.generate_all_certs(); }))
+                break;
+            if (!timed_stage(state, STAGE_VALIDATE_CERT_CHAIN,
+                             [&]() { return cmd.validate_cert_chain(); }))
+                break;
+            if (!timed_stage(state, STAGE_GENERATE_LAUNCH_BLOB,
+                             [&]() { return cmd.generate_launch_blob(state->opts->policy); }))
+                break;
+
+            // What the guest owner would get back from LAUNCH_MEASURE
+            measurement_t user_data;
+            sev::session_keys keys;
+            memset(&user_data, 0, sizeof(user_data));
+            if (!sev::SessionStore::global().get(folder, &keys))
+                break;
+            user_data.meas_ctx  = LAUNCH_MEASURE_CTX;
+            user_data.api_major = state->api_major;
+            user_data.api_minor = state->api_minor;
+            user_data.build_id  = state->build_id;
+            user_data.policy    = state->opts->policy;
+            sev::gen_random_bytes(user_data.digest, sizeof(user_data.digest));
+            sev::gen_random_bytes(user_data.mnonce, sizeof(user_data.mnonce));
+            memcpy(user_data.tik, keys.tk.tik, sizeof(user_data.tik));
+            if (!timed_stage(state, STAGE_CALC_MEASUREMENT,
+                             [&]() { return cmd.calc_measurement(&user_data); }))
+                break;
+
+            if (!timed_stage(state, STAGE_PACKAGE_SECRET,
+                             [&]() { return cmd.package_secret(); }))
+                break;
+            ok = true;
+        } while (0);
+
+        if (ok)
+            state->stages[STAGE_TOTAL]->record(sev::Metrics::now_ns() - start);
+        else
+            state->failures++;
+    }
+}
+
+static bool write_scenario_json(const scenario_state *state, uint64_t wall_ns)
+{
+    const scenario_options *opts = state->opts;
+    FILE *file = fopen(opts->json_file.c_str(), "w");
+    if (!file) {
+        printf("Error: unable to open %s\n", opts->json_file.c_str());
+        return false;
+    }
+
+    fprintf(file, "{\"scenario\":\"guest_owner\",\"iterations\":%u,\"concurrency\":%u,"
+            "\"failures\":%u,\"wall_ns\":%llu,\"flows_per_sec\":%.3f,\"stages\":[\n",
+            opts->iterations, opts->concurrency, state->failures.load(),
+            (unsigned long long)wall_ns,
+            (double)state->stages[STAGE_TOTAL]->count() * 1e9 / (double)wall_ns);
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const sev::LatencyHistogram *hist = state->stages[i];
+        fprintf(file, "{\"name\":\"%s\",\"count\":%llu,\"mean_ns\":%.1f,"
+                "\"p50_ns\":%llu,\"p99_ns\":%llu,\"p999_ns\":%llu,\"max_ns\":%llu}%s\n",
+                stage_names[i], (unsigned long long)hist->count(),
+                hist->count() ? (double)hist->sum_ns() / (double)hist->count() : 0.0,
+                (unsigned long long)hist->value_at_percentile(50.0),
+                (unsigned long long)hist->value_at_percentile(99.0),
+                (unsigned long long)hist->value_at_percentile(99.9),
+                (unsigned long long)hist->max_ns(), (i + 1 < STAGE_COUNT) ? "," : "");
+    }
+    fprintf(file, "]}\n");
+
+    return fclose(file) == 0;
+}
+
+int run_guest_owner_scenario(const scenario_options *opts)
+{
+    scenario_state state;
+    uint8_t status_data[sizeof(sev_platform_status_cmd_buf)];
+    sev_platform_status_cmd_buf *status = (sev_platform_status_cmd_buf *)&status_data;
+
+    if (opts->iterations == 0 || opts->concurrency == 0) {
+        printf("Error: --guest_flow and --concurrency must be at least 1\n");
+        return 2;
+    }
+
+    SEVDevice::set_backend_type(SEV_BACKEND_SIM);
+    if (SEVDevice::get_sev_device().platform_status(status_data) != STATUS_SUCCESS) {
+        printf("Error: simulator platform_status failed\n");
+        return 2;
+    }
+    mkdir(opts->output_folder.c_str(), 0755);
+
+    state.opts = opts;
+    for (int i = 0; i < STAGE_COUNT; i++)
+        state.stages[i] = new sev::LatencyHistogram("scenario", stage_names[i]);
+    state.next_flow = 0;
+    state.failures = 0;
+    state.api_major = status->api_major;
+    state.api_minor = status->api_minor;
+    state.build_id = status->build_id;
+
+    // Keep anything the commands print off the report
+    fflush(stdout);
+    int saved_stdout = dup(STDOUT_FILENO);
+    int dev_null = open("/dev/null", O_WRONLY);
+    if (saved_stdout >= 0 && dev_null >= 0)
+        dup2(dev_null, STDOUT_FILENO);
+
+    // The simulator makes its ARK/ASK keys the first time the KDS is used.
+    // Get that out of the way so it doesn't end up in the first flow
+    std::string warmup_folder = opts->output_folder + "warmup/";
+    mkdir(warmup_folder.c_str(), 0755);
+    std::remove((warmup_folder + CEK_FILENAME).c_str());
+    std::remove((warmup_folder + ASK_ARK_FILENAME).c_str());
+    Command warmup(warmup_folder, 0);
+    warmup.generate_all_certs();
+
+    uint64_t start = sev::Metrics::now_ns();
+    std::thread *workers = new std::thread[opts->concurrency];
+    for (uint32_t i = 0; i < opts->concurrency; i++)
+        workers[i] = std::thread(scenario_worker, &state, i);
+    for (uint32_t i = 0; i < opts->concurrency; i++)
+        workers[i].join();
+    uint64_t wall_ns = sev::Metrics::now_ns() - start;
+    delete[] workers;
+
+    fflush(stdout);
+    if (saved_stdout >= 0 && dev_null >= 0) {
+        dup2(saved_stdout, STDOUT_FILENO);
+        close(saved_stdout);
+    }
+    if (dev_null >= 0)
+        close(dev_null);
+
+    printf("guest owner flow: %u flows, %u workers, %u failed\n",
+           opts->iterations, opts->concurrency, state.failures.load());
+    printf("%-22s %8s %12s %12s %12s %12s\n", "stage", "count", "mean(ms)",
+           "p50(ms)", "p99(ms)", "p99.9(ms)");
+    for (int i = 0; i < STAGE_COUNT; i++) {
+        const sev::LatencyHistogram *hist = state.stages[i];
+        printf("%-22s %8llu %12.3f", stage_names[i], (unsigned long long)hist->count(),
+               hist->count() ? (double)hist->sum_ns() / (double)hist->count() / 1e6 : 0.0);
+        for (size_t p = 0; p < sizeof(stage_percentiles)/sizeof(stage_percentiles[0]); p++)
+            printf(" %12.3f", (double)hist->value_at_percentile(stage_percentiles[p]) / 1e6);
+        printf("\n");
+    }
+    printf("throughput: %.2f flows/s over %.3f s\n",
+           (double)state.stages[STAGE_TOTAL]->count() * 1e9 / (double)wall_ns,
+           (double)wall_ns / 1e9);
+
+    bool ok = (state.failures == 0);
+    if (!opts->json_file.empty() && !write_scenario_json(&state, wall_ns))
+        ok = false;
+
+    for (int i = 0; i < STAGE_COUNT; i++)
+        delete state.stages[i];
+
+    return ok ? 0 : 1;
+}
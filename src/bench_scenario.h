@@ -0,0 +1,41 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef BENCH_SCENARIO_H
+#define BENCH_SCENARIO_H
+
+#include <cstdint>
+#include <string>
+
+struct scenario_options {
+    uint32_t iterations;        // Number of complete flows, over all workers
+    uint32_t concurrency;       // Number of worker threads
+    uint32_t policy;            // Guest policy for generate_launch_blob
+    std::string output_folder;  // Each worker gets its own subfolder in here
+    std::string json_file;      // Optional
+};
+
+/**
+ * Runs the guest owner flow
+ *   pdh_cert_export -> validate_cert_chain -> generate_launch_blob ->
+ *   calc_measurement -> package_secret
+ * against the firmware simulator and its KDS stand-in, and prints the
+ * p50/p99/p99.9 of each stage and the overall throughput.
+ * Returns 0 if every flow succeeded.
+ */
+int run_guest_owner_scenario(const scenario_options *opts);
+
+#endif /* BENCH_SCENARIO_H */
@@ -0,0 +1,385 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "certformat.h"
+#include <cstring>
+#include <new>          // std::nothrow
+
+static constexpr size_t FORMAT_LABEL_WIDTH  = 15;      // The %-15s of the old sprintf()s
+static constexpr size_t FORMAT_MIN_CAPACITY = 4096;
+
+static const char upper_hex[] = "0123456789ABCDEF";
+static const char lower_hex[] = "0123456789abcdef";
+
+/**
+ * One line of a readable cert. Values print as lowercase hex, zero padded
+ * to 2 digits per byte. Byte arrays go on their own line as "%02X " each
+ */
+struct cert_field {
+    const char *label;
+    size_t offset;
+    size_t size;
+    bool is_bytes;
+};
+
+static const cert_field sev_cert_fields[] = {
+    {"Version:",       offsetof(sev_cert, version),       sizeof(uint32_t),   false},
+    {"api_major:",     offsetof(sev_cert, api_major),     sizeof(uint8_t),    false},
+    {"api_minor:",     offsetof(sev_cert, api_minor),     sizeof(uint8_t),    false},
+    {"pub_key_usage:", offsetof(sev_cert, pub_key_usage), sizeof(uint32_t),   false},
+    {"pub_key_algo:",  offsetof(sev_cert, pub_key_algo),  sizeof(uint32_t),   false},
+    {"pub_key:",       offsetof(sev_cert, pub_key),       sizeof(sev_pubkey), true},
+    {"sig_1_usage:",   offsetof(sev_cert, sig_1_usage),   sizeof(uint32_t),   false},
+    {"sig_1_algo:",    offsetof(sev_cert, sig_1_algo),    sizeof(uint32_t),   false},
+    {"sig_1:",         offsetof(sev_cert, sig_1),         sizeof(sev_sig),    true},
+    {"sig_2_usage:",   offsetof(sev_cert, sig_2_usage),   sizeof(uint32_t),   false},
+    {"sig_2_algo:",    offsetof(sev_cert, sig_2_algo),    sizeof(uint32_t),   false},
+    {"Sig2:",          offsetof(sev_cert, sig_2),         sizeof(sev_sig),    true},
+};
+
+// The fixed part of an amd_cert. pub_exp, modulus and sig follow
+static const cert_field amd_cert_fields[] = {
+    {"Version:",         offsetof(amd_cert, version),         sizeof(uint32_t), false},
+    {"key_id_0:",        offsetof(amd_cert, key_id_0),        sizeof(uint64_t), false},
+    {"key_id_1:",        offsetof(amd_cert, key_id_1),        sizeof(uint64_t), false},
+    {"certifying_id_0:", offsetof(amd_cert, certifying_id_0), sizeof(uint64_t), false},
+    {"certifying_id_1:", offsetof(amd_cert, certifying_id_1), sizeof(uint64_t), false},
+    {"key_usage:",       offsetof(amd_cert, key_usage),       sizeof(uint32_t), false},
+    {"reserved_0:",      offsetof(amd_cert, reserved_0),      sizeof(uint64_t), false},
+    {"reserved_1:",      offsetof(amd_cert, reserved_1),      sizeof(uint64_t), false},
+    {"pub_exp_size:",    offsetof(amd_cert, pub_exp_size),    sizeof(uint32_t), false},
+    {"modulus_size:",    offsetof(amd_cert, modulus_size),    sizeof(uint32_t), false},
+};
+
+static const char pub_exp_header[] = "\nPubExp:\n";
+static const char modulus_header[] = "\nModulus:\n";
+static const char sig_header[]     = "\nSig:\n";
+
+static const char *const chain_names[] = {"PEK", "OCA", "CEK"};
+
+sev::FormatBuffer::FormatBuffer(size_t capacity)
+                : m_buf(NULL),
+                  m_size(0),
+                  m_capacity(0),
+                  m_file(NULL),
+                  m_error(false)
+{
+    if (capacity)
+        grow(capacity);
+}
+
+sev::FormatBuffer::FormatBuffer(FILE *file)
+                : m_buf(NULL),
+                  m_size(0),
+                  m_capacity(0),
+                  m_file(file),
+                  m_error(false)
+{
+}
+
+sev::FormatBuffer::~FormatBuffer()
+{
+    delete[] m_buf;
+}
+
+bool sev::FormatBuffer::grow(size_t capacity)
+{
+    if (capacity <= m_capacity)
+        return true;
+    if (capacity < FORMAT_MIN_CAPACITY)
+        capacity = FORMAT_MIN_CAPACITY;
+    if (capacity < 2*m_capacity)
+        capacity = 2*m_capacity;
+
+    char *buf = new (std::nothrow) char[capacity];
+    if (!buf) {
+        m_error = true;
+        return false;
+    }
+    if (m_buf && !m_file)       // Nothing to keep between commits in FILE mode
+        memcpy(buf, m_buf, m_size + 1);
+    else
+        buf[0] = '\0';
+    delete[] m_buf;
+    m_buf = buf;
+    m_capacity = capacity;
+    return true;
+}
+
+char *sev::FormatBuffer::reserve(size_t length)
+{
+    if (m_file)
+        return grow(length) ? m_buf : NULL;
+    if (!grow(m_size + length + 1))     // +1 to keep data() terminated
+        return NULL;
+    return m_buf + m_size;
+}
+
+void sev::FormatBuffer::commit(size_t length)
+{
+    if (m_file) {
+        if (fwrite(m_buf, 1, length, m_file) != length)
+            m_error = true;
+    }
+    else {
+        m_buf[m_size + length] = '\0';
+    }
+    m_size += length;
+}
+
+bool sev::FormatBuffer::append(const char *str, size_t length)
+{
+    char *dst = reserve(length);
+    if (!dst)
+        return false;
+    memcpy(dst, str, length);
+    commit(length);
+    return true;
+}
+
+static size_t label_size(const char *label)
+{
+    size_t length = strlen(label);
+    return (length < FORMAT_LABEL_WIDTH) ? FORMAT_LABEL_WIDTH : length;
+}
+
+static size_t fields_size(const cert_field *fields, size_t count)
+{
+    size_t size = 0;
+    for (size_t i = 0; i < count; i++) {
+        size += label_size(fields[i].label);
+        if (fields[i].is_bytes)
+            size += 1 + fields[i].size*3 + 1;   // \n, "XX " each, \n
+        else
+            size += fields[i].size*2 + 1;       // Digits, \n
+    }
+    return size;
+}
+
+static char *put_label(char *p, const char *label)
+{
+    size_t length = strlen(label);
+    memcpy(p, label, length);
+    p += length;
+    while (length++ < FORMAT_LABEL_WIDTH)
+        *p++ = ' ';
+    return p;
+}
+
+// "%02X " for each byte
+static char *put_spaced_hex(char *p, const uint8_t *bytes, size_t length)
+{
+    for (size_t i = 0; i < length; i++) {
+        p[0] = upper_hex[bytes[i] >> 4];
+        p[1] = upper_hex[bytes[i] & 0xF];
+        p[2] = ' ';
+        p += 3;
+    }
+    return p;
+}
+
+/**
+ * The fields are little endian in the cert, so the number is printed most
+ * significant byte first, the same as %0Nx on the host
+ */
+static char *put_fields(char *p, const void *cert, const cert_field *fields, size_t count)
+{
+    for (size_t i = 0; i < count; i++) {
+        const uint8_t *value = (const uint8_t *)cert + fields[i].offset;
+        p = put_label(p, fields[i].label);
+        if (fields[i].is_bytes) {
+            *p++ = '\n';
+            p = put_spaced_hex(p, value, fields[i].size);
+        }
+        else {
+            for (size_t j = fields[i].size; j-- > 0; ) {
+                *p++ = lower_hex[value[j] >> 4];
+                *p++ = lower_hex[value[j] & 0xF];
+            }
+        }
+        *p++ = '\n';
+    }
+    return p;
+}
+
+static char *put_string(char *p, const char *str, size_t length)
+{
+    memcpy(p, str, length);
+    return p + length;
+}
+
+static size_t decimal_size(size_t value)
+{
+    size_t digits = 1;
+    while (value >= 10) {
+        value /= 10;
+        digits++;
+    }
+    return digits;
+}
+
+static char *put_decimal(char *p, size_t value)
+{
+    size_t digits = decimal_size(value);
+    for (size_t i = digits; i-- > 0; ) {
+        p[i] = (char)('0' + value % 10);
+        value /= 10;
+    }
+    return p + digits;
+}
+
+// Real sizes of the variable length parts, never more than the union holds
+static size_t amd_pub_exp_bytes(const amd_cert *cert)
+{
+    size_t length = cert->pub_exp_size/8;
+    return (length < sizeof(cert->pub_exp)) ? length : sizeof(cert->pub_exp);
+}
+
+static size_t amd_modulus_bytes(const amd_cert *cert)
+{
+    size_t length = cert->modulus_size/8;
+    return (length < sizeof(cert->modulus)) ? length : sizeof(cert->modulus);
+}
+
+size_t sev::sev_cert_readable_size(void)
+{
+    return fields_size(sev_cert_fields, sizeof(sev_cert_fields)/sizeof(sev_cert_fields[0]));
+}
+
+/**
+ * "PEK Memory: 2084 bytes\n", the PEK, then the same for the OCA and CEK
+ * with a blank line before each
+ */
+size_t sev::cert_chain_buf_readable_size(void)
+{
+    size_t header = sizeof("PEK Memory: ")-1 + decimal_size(sizeof(sev_cert)) +
+                    sizeof(" bytes\n")-1;
+    return 3*(header + sev_cert_readable_size()) + 2;
+}
+
+size_t sev::amd_cert_readable_size(const amd_cert *cert)
+{
+    return fields_size(amd_cert_fields, sizeof(amd_cert_fields)/sizeof(amd_cert_fields[0])) +
+           sizeof(pub_exp_header)-1 + sizeof(modulus_header)-1 + sizeof(sig_header)-1 +
+           3*(amd_pub_exp_bytes(cert) + 2*amd_modulus_bytes(cert)) + 1;
+}
+
+size_t sev::amd_cert_binary_size(const amd_cert *cert)
+{
+    return offsetof(amd_cert, pub_exp) + amd_pub_exp_bytes(cert) + 2*amd_modulus_bytes(cert);
+}
+
+size_t sev::amd_cert_hex_size(const amd_cert *cert)
+{
+    return 2*amd_cert_binary_size(cert);
+}
+
+bool sev::format_sev_cert_readable(FormatBuffer *out, const sev_cert *cert)
+{
+    size_t size = sev_cert_readable_size();
+    char *p = out->reserve(size);
+    if (!p)
+        return false;
+
+    put_fields(p, cert, sev_cert_fields, sizeof(sev_cert_fields)/sizeof(sev_cert_fields[0]));
+    out->commit(size);
+    return out->ok();
+}
+
+bool sev::format_cert_chain_buf_readable(FormatBuffer *out, const sev_cert_chain_buf *p)
+{
+    const sev_cert *certs[] = {
+        (const sev_cert *)PEK_IN_CERT_CHAIN(p),
+        (const sev_cert *)OCA_IN_CERT_CHAIN(p),
+        (const sev_cert *)CEK_IN_CERT_CHAIN(p),
+    };
+    size_t size = cert_chain_buf_readable_size();
+    char *start = out->reserve(size);
+    if (!start)
+        return false;
+
+    char *pos = start;
+    for (size_t i = 0; i < sizeof(certs)/sizeof(certs[0]); i++) {
+        if (i != 0)
+            *pos++ = '\n';
+        pos = put_string(pos, chain_names[i], 3);
+        pos = put_string(pos, " Memory: ", sizeof(" Memory: ")-1);
+        pos = put_decimal(pos, sizeof(sev_cert));
+        pos = put_string(pos, " bytes\n", sizeof(" bytes\n")-1);
+        pos = put_fields(pos, certs[i], sev_cert_fields,
+                         sizeof(sev_cert_fields)/sizeof(sev_cert_fields[0]));
+    }
+    out->commit(size);
+    return out->ok();
+}
+
+bool sev::format_amd_cert_readable(FormatBuffer *out, const amd_cert *cert)
+{
+    size_t pub_exp_bytes = amd_pub_exp_bytes(cert);
+    size_t modulus_bytes = amd_modulus_bytes(cert);
+    size_t size = amd_cert_readable_size(cert);
+    char *p = out->reserve(size);
+    if (!p)
+        return false;
+
+    p = put_fields(p, cert, amd_cert_fields, sizeof(amd_cert_fields)/sizeof(amd_cert_fields[0]));
+    p = put_string(p, pub_exp_header, sizeof(pub_exp_header)-1);
+    p = put_spaced_hex(p, (const uint8_t *)&cert->pub_exp, pub_exp_bytes);
+    p = put_string(p, modulus_header, sizeof(modulus_header)-1);
+    p = put_spaced_hex(p, (const uint8_t *)&cert->modulus, modulus_bytes);
+    p = put_string(p, sig_header, sizeof(sig_header)-1);
+    p = put_spaced_hex(p, (const uint8_t *)&cert->sig, modulus_bytes);
+    *p = '\n';
+    out->commit(size);
+    return out->ok();
+}
+
+bool sev::format_amd_cert_hex(FormatBuffer *out, const amd_cert *cert)
+{
+    uint8_t binary[sizeof(amd_cert)];
+    size_t length = write_amd_cert_binary(binary, sizeof(binary), cert);
+    char *p = out->reserve(2*length);
+    if (!p)
+        return false;
+
+    for (size_t i = 0; i < length; i++) {
+        p[2*i]     = upper_hex[binary[i] >> 4];
+        p[2*i + 1] = upper_hex[binary[i] & 0xF];
+    }
+    out->commit(2*length);
+    return out->ok();
+}
+
+size_t sev::write_amd_cert_binary(void *out, size_t capacity, const amd_cert *cert)
+{
+    size_t fixed_offset = offsetof(amd_cert, pub_exp);      // 64 bytes
+    size_t pub_exp_bytes = amd_pub_exp_bytes(cert);
+    size_t modulus_bytes = amd_modulus_bytes(cert);
+    size_t size = amd_cert_binary_size(cert);
+    uint8_t *p = (uint8_t *)out;
+
+    if (size > capacity)
+        return 0;
+
+    memcpy(p, cert, fixed_offset);
+    p += fixed_offset;
+    memcpy(p, &cert->pub_exp, pub_exp_bytes);
+    p += pub_exp_bytes;
+    memcpy(p, &cert->modulus, modulus_bytes);
+    p += modulus_bytes;
+    memcpy(p, &cert->sig, modulus_bytes);
+    return size;
+}
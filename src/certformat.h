@@ -0,0 +1,88 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef CERTFORMAT_H
+#define CERTFORMAT_H
+
+#include "sevapi.h"
+#include <cstddef>
+#include <cstdint>
+#include <stdio.h>
+
+namespace sev
+{
+    /**
+     * Where the cert formatters write to: either the end of a buffer that
+     * grows as needed, or a FILE. Each formatter works out its exact output
+     * size first, reserves that much and writes the text straight in, so
+     * there are no temporaries and at most one grow per cert.
+     *
+     * In FILE mode the reserved space is a scratch buffer which commit()
+     * writes out, so it's only ever as big as the largest single cert.
+     */
+    class FormatBuffer {
+    private:
+        char *m_buf;
+        size_t m_size;          // Bytes output so far
+        size_t m_capacity;
+        FILE *m_file;
+        bool m_error;
+
+        bool grow(size_t capacity);
+
+        FormatBuffer(const FormatBuffer&) = delete;
+        FormatBuffer& operator=(const FormatBuffer&) = delete;
+
+    public:
+        explicit FormatBuffer(size_t capacity = 0);
+        explicit FormatBuffer(FILE *file);
+        ~FormatBuffer();
+
+        // Space for length bytes, which has to be followed by commit(length).
+        // NULL if it can't be allocated
+        char *reserve(size_t length);
+        void commit(size_t length);
+        bool append(const char *str, size_t length);
+
+        void clear(void) { m_size = 0; m_error = false; }
+        // The text so far, NUL terminated. Empty in FILE mode
+        const char *data(void) const { return (m_buf && !m_file) ? m_buf : ""; }
+        size_t size(void) const { return m_size; }
+        bool ok(void) const { return !m_error; }
+    };
+
+    // Exact sizes of the formatted output, without a terminating NUL
+    size_t sev_cert_readable_size(void);
+    size_t cert_chain_buf_readable_size(void);
+    size_t amd_cert_readable_size(const amd_cert *cert);
+    size_t amd_cert_binary_size(const amd_cert *cert);
+    size_t amd_cert_hex_size(const amd_cert *cert);
+
+    // Same text as the print_*_readable/print_amd_cert_hex functions
+    bool format_sev_cert_readable(FormatBuffer *out, const sev_cert *cert);
+    bool format_cert_chain_buf_readable(FormatBuffer *out, const sev_cert_chain_buf *p);
+    bool format_amd_cert_readable(FormatBuffer *out, const amd_cert *cert);
+    bool format_amd_cert_hex(FormatBuffer *out, const amd_cert *cert);
+
+    /**
+     * The AMD cert as it is on the wire (the .cert file): the fixed fields
+     * then pub_exp, modulus and sig at their real sizes. Returns the number
+     * of bytes written, or 0 if it doesn't fit in capacity
+     */
+    size_t write_amd_cert_binary(void *out, size_t capacity, const amd_cert *cert);
+}
+
+#endif /* CERTFORMAT_H */
@@ -15,35 +15,57 @@
  **************************************************************************/
 
 #include "amdcert.h"
+#ifdef __linux__
+#include "attestserver.h"
+#endif
+#include "certformat.h"
 #include "commands.h"
 #include "crypto.h"
+#include "launchdigest.h"
+#include "metrics.h"
+#include "migration.h"
+#include "secretpack.h"
 #include "sevcert.h"
+#include "securemem.h"
+#include "serializer.h"
+#include "sessionstore.h"
+#ifdef __linux__
+#include "snpverify.h"
+#endif
 #include "utilities.h"      // for WriteToFile
-#include <openssl/hmac.h>   // for calc_measurement
+#include <algorithm>        // for std::min, std::max
+#include <signal.h>         // for attest_server
 #include <stdio.h>          // printf
 #include <stdlib.h>         // malloc
+#include <thread>
 
 Command::Command(void)
-       : m_sev_device(&SEVDevice::get_sev_device())
+       : m_sev_device(&SEVDevice::get_sev_device()),
+         m_tk(*(tek_tik *)sev::secure_alloc(sizeof(tek_tik)))
 {
     // Intentionally Empty
 }
 
-Command::Command(std::string output_folder, int verbose_flag)
+Command::Command(std::string output_folder, int verbose_flag,
+                 sev::Serializer *out)
        : m_sev_device(&SEVDevice::get_sev_device()),
+         m_tk(*(tek_tik *)sev::secure_alloc(sizeof(tek_tik))),
          m_output_folder(output_folder),
-         m_verbose_flag(verbose_flag)
+         m_verbose_flag(verbose_flag),
+         m_out(out)
 {
     // Intentionally Empty
 }
 
 Command::~Command(void)
 {
+    sev::secure_free(&m_tk, sizeof(tek_tik));
     //delete m_sev_device;
 }
 
 int Command::factory_reset(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "factory_reset");
     int cmd_ret = -1;
 
     cmd_ret = m_sev_device->factory_reset();
@@ -53,13 +75,32 @@ int Command::factory_reset(void)
 
 int Command::platform_status(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "platform_status");
     uint8_t data[sizeof(sev_platform_status_cmd_buf)];
     sev_platform_status_cmd_buf *data_buf = (sev_platform_status_cmd_buf *)&data;
     int cmd_ret = -1;
 
     cmd_ret = m_sev_device->platform_status(data);
 
-    if (cmd_ret == STATUS_SUCCESS) {
+    if (cmd_ret == STATUS_SUCCESS && m_out) {
+        m_out->begin_map("platform_status");
+        m_out->add_uint("api_major", data_buf->api_major);
+        m_out->add_uint("api_minor", data_buf->api_minor);
+        m_out->add_uint("platform_state", data_buf->current_platform_state);
+        if (data_buf->api_minor >= 17) {
+            m_out->add_uint("owner", data_buf->owner);
+            m_out->add_uint("config", data_buf->config);
+        }
+        else {
+            m_out->add_uint("flags",
+                    ((data_buf->owner & PLAT_STAT_OWNER_MASK) << PLAT_STAT_OWNER_MASK) +
+                    ((data_buf->config & PLAT_STAT_ES_MASK) << PLAT_STAT_CONFIGES_OFFSET));
+        }
+        m_out->add_uint("build", data_buf->build_id);
+        m_out->add_uint("guest_count", data_buf->guest_count);
+        m_out->end_map();
+    }
+    else if (cmd_ret == STATUS_SUCCESS) {
         // Print ID arrays
         printf("api_major:\t%d\n", data_buf->api_major);
         printf("api_minor:\t%d\n", data_buf->api_minor);
@@ -82,6 +123,7 @@ int Command::platform_status(void)
 
 int Command::pek_gen(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "pek_gen");
     int cmd_ret = -1;
 
     cmd_ret = m_sev_device->pek_gen();
@@ -91,6 +133,7 @@ int Command::pek_gen(void)
 
 int Command::pek_csr(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "pek_csr");
     uint8_t data[sizeof(sev_pek_csr_cmd_buf)];
     int cmd_ret = -1;
 
@@ -104,18 +147,25 @@ int Command::pek_csr(void)
     cmd_ret = m_sev_device->pek_csr(data, pek_mem, &pek_csr);
 
     if (cmd_ret == STATUS_SUCCESS) {
-        if (m_verbose_flag) {            // Print off the cert to stdout
+        if (m_out) {
+            serialize_sev_cert(m_out, "pek_csr", &pek_csr);
+        }
+        else if (m_verbose_flag) {       // Print off the cert to stdout
             // print_sev_cert_hex(&pek_csr);
             print_sev_cert_readable(&pek_csr);
         }
         if (m_output_folder != "") {     // Print off the cert to a text file
-            std::string pek_csr_readable = "";
+            sev::FormatBuffer pek_csr_readable(sev::sev_cert_readable_size() + 1);
             std::string pek_csr_readable_path = m_output_folder+PEK_CSR_READABLE_FILENAME;
             std::string pek_csr_hex_path = m_output_folder+PEK_CSR_HEX_FILENAME;
 
-            print_sev_cert_readable(&pek_csr, pek_csr_readable);
-            sev::write_file(pek_csr_readable_path, (void *)pek_csr_readable.c_str(), pek_csr_readable.size());
-            sev::write_file(pek_csr_hex_path, (void *)&pek_csr, sizeof(pek_csr));
+            sev::FileWriteBatch batch;
+            if (!sev::format_sev_cert_readable(&pek_csr_readable, &pek_csr))
+                cmd_ret = -1;
+            batch.add(pek_csr_readable_path, pek_csr_readable.data(), pek_csr_readable.size());
+            batch.add(pek_csr_hex_path, &pek_csr, sizeof(pek_csr));
+            if (cmd_ret != STATUS_SUCCESS || !batch.commit())
+                cmd_ret = -1;
         }
     }
 
@@ -127,6 +177,7 @@ int Command::pek_csr(void)
 
 int Command::pdh_gen(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "pdh_gen");
     int cmd_ret = -1;
 
     cmd_ret = m_sev_device->pdh_gen();
@@ -136,6 +187,7 @@ int Command::pdh_gen(void)
 
 int Command::pdh_cert_export(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "pdh_cert_export");
     uint8_t data[sizeof(sev_pdh_cert_export_cmd_buf)];
     int cmd_ret = -1;
 
@@ -148,25 +200,35 @@ int Command::pdh_cert_export(void)
     cmd_ret = m_sev_device->pdh_cert_export(data, pdh_cert_mem, cert_chain_mem);
 
     if (cmd_ret == STATUS_SUCCESS) {
-        if (m_verbose_flag) {            // Print off the cert to stdout
+        if (m_out) {
+            m_out->begin_map("pdh_cert_export");
+            serialize_sev_cert(m_out, "pdh", pdh_cert_mem);
+            serialize_cert_chain_buf(m_out, "cert_chain", cert_chain_mem);
+            m_out->end_map();
+        }
+        else if (m_verbose_flag) {       // Print off the cert to stdout
             // print_sev_cert_readable((sev_cert *)pdh_cert_mem); printf("\n");
             print_sev_cert_hex((sev_cert *)pdh_cert_mem); printf("\n");
             print_cert_chain_buf_readable((sev_cert_chain_buf *)cert_chain_mem);
         }
         if (m_output_folder != "") {     // Print off the cert to a text file
-            std::string PDH_readable = "";
-            std::string cc_readable = "";
+            sev::FormatBuffer PDH_readable(sev::sev_cert_readable_size() + 1);
+            sev::FormatBuffer cc_readable(sev::cert_chain_buf_readable_size() + 1);
             std::string PDH_readable_path = m_output_folder+PDH_READABLE_FILENAME;
             std::string PDH_path          = m_output_folder+PDH_FILENAME;
             std::string cc_readable_path  = m_output_folder+CERT_CHAIN_READABLE_FILENAME;
             std::string cc_path           = m_output_folder+CERT_CHAIN_HEX_FILENAME;
 
-            print_sev_cert_readable((sev_cert *)pdh_cert_mem, PDH_readable);
-            print_cert_chain_buf_readable((sev_cert_chain_buf *)cert_chain_mem, cc_readable);
-            sev::write_file(PDH_readable_path, (void *)PDH_readable.c_str(), PDH_readable.size());
-            sev::write_file(PDH_path, pdh_cert_mem, sizeof(sev_cert));
-            sev::write_file(cc_readable_path, (void *)cc_readable.c_str(), cc_readable.size());
-            sev::write_file(cc_path, cert_chain_mem, sizeof(sev_cert_chain_buf));
+            sev::FileWriteBatch batch;
+            if (!sev::format_sev_cert_readable(&PDH_readable, pdh_cert_mem) ||
+                !sev::format_cert_chain_buf_readable(&cc_readable, cert_chain_mem))
+                cmd_ret = -1;
+            batch.add(PDH_readable_path, PDH_readable.data(), PDH_readable.size());
+            batch.add(PDH_path, pdh_cert_mem, sizeof(sev_cert));
+            batch.add(cc_readable_path, cc_readable.data(), cc_readable.size());
+            batch.add(cc_path, cert_chain_mem, sizeof(sev_cert_chain_buf));
+            if (cmd_ret != STATUS_SUCCESS || !batch.commit())
+                cmd_ret = -1;
         }
     }
 
@@ -179,6 +241,7 @@ int Command::pdh_cert_export(void)
 
 int Command::pek_cert_import(std::string oca_priv_key_file)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "pek_cert_import");
     int cmd_ret = -1;
 
     // Initial PDH cert chain export, so we can confirm that it
@@ -236,7 +299,8 @@ int Command::pek_cert_import(std::string oca_priv_key_file)
         if (0 != memcmp(pdh_cert_export_data2, pdh_cert_export_data, sizeof(sev_pdh_cert_export_cmd_buf)))
             break;
 
-        printf("PEK Cert Import SUCCESS!!!\n");
+        if (!m_out)
+            printf("PEK Cert Import SUCCESS!!!\n");
     } while (0);
 
     // Free memory
@@ -253,6 +317,7 @@ int Command::pek_cert_import(std::string oca_priv_key_file)
 // doesn't follow the API
 int Command::get_id(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "get_id");
     uint8_t data[sizeof(sev_get_id_cmd_buf)];
     sev_get_id_cmd_buf *data_buf = (sev_get_id_cmd_buf *)&data;
     int cmd_ret = -1;
@@ -282,7 +347,14 @@ int Command::get_id(void)
             sprintf(id1_buf+strlen(id1_buf), "%02x", ((uint8_t *)(data_buf->id_p_addr))[i+default_id_length]);
         }
 
-        if (m_verbose_flag) {            // Print ID arrays
+        if (m_out) {
+            const uint8_t *ids = (const uint8_t *)data_buf->id_p_addr;
+            m_out->begin_map("get_id");
+            m_out->add_bytes("socket0", ids, default_id_length);
+            m_out->add_bytes("socket1", ids + default_id_length, default_id_length);
+            m_out->end_map();
+        }
+        else if (m_verbose_flag) {       // Print ID arrays
             printf("* GetID Socket0:\n%s", id0_buf);
             printf("\n* GetID Socket1:\n%s", id1_buf);
             printf("\n");
@@ -290,8 +362,11 @@ int Command::get_id(void)
         if (m_output_folder != "") {     // Print the IDs to a text file
             std::string id0_path = m_output_folder+GET_ID_S0_FILENAME;
             std::string id1_path = m_output_folder+GET_ID_S1_FILENAME;
-            sev::write_file(id0_path, (void *)id0_buf, sizeof(id0_buf)-1);  // Don't write null term
-            sev::write_file(id1_path, (void *)id1_buf, sizeof(id1_buf)-1);
+            sev::FileWriteBatch batch;
+            batch.add(id0_path, id0_buf, sizeof(id0_buf)-1);  // Don't write null term
+            batch.add(id1_path, id1_buf, sizeof(id1_buf)-1);
+            if (!batch.commit())
+                cmd_ret = -1;
         }
     }
 
@@ -306,6 +381,7 @@ int Command::get_id(void)
 // ------------------------------------- //
 int Command::sys_info(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "sys_info");
     int cmd_ret = -1;
 
     cmd_ret = m_sev_device->sys_info();
@@ -315,6 +391,7 @@ int Command::sys_info(void)
 
 int Command::get_platform_owner(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "get_platform_owner");
     uint8_t data[sizeof(sev_platform_status_cmd_buf)];
     int cmd_ret = -1;
 
@@ -327,6 +404,7 @@ int Command::get_platform_owner(void)
 
 int Command::get_platform_es(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "get_platform_es");
     uint8_t data[sizeof(sev_platform_status_cmd_buf)];
     int cmd_ret = -1;
 
@@ -339,6 +417,7 @@ int Command::get_platform_es(void)
 
 int Command::set_self_owned(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "set_self_owned");
     int cmd_ret = -1;
 
     cmd_ret = m_sev_device->set_self_owned();
@@ -348,6 +427,7 @@ int Command::set_self_owned(void)
 
 int Command::set_externally_owned(std::string oca_priv_key_file)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "set_externally_owned");
     int cmd_ret = -1;
 
     cmd_ret = m_sev_device->set_externally_owned(oca_priv_key_file);
@@ -357,6 +437,7 @@ int Command::set_externally_owned(std::string oca_priv_key_file)
 
 int Command::generate_cek_ask(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "generate_cek_ask");
     int cmd_ret = -1;
 
     std::string cert_file = CEK_FILENAME;
@@ -368,6 +449,7 @@ int Command::generate_cek_ask(void)
 
 int Command::get_ask_ark(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "get_ask_ark");
     int cmd_ret = -1;
 
     std::string cert_file = ASK_ARK_FILENAME;
@@ -379,25 +461,30 @@ int Command::get_ask_ark(void)
 
 int Command::generate_all_certs(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "generate_all_certs");
     int cmd_ret = -1;
+    int cek_ret = -1;
+    int ask_ark_ret = -1;
     uint8_t pdh_cert_export_data[sizeof(sev_pdh_cert_export_cmd_buf)];  // pdh_cert_export
     sev_cert_t *pdh = new sev_cert_t;
     sev_cert_chain_buf *cert_chain = new sev_cert_chain_buf_t; // PEK, OCA, CEK
-    amd_cert ask;
-    amd_cert ark;
 
     std::string cek_file = CEK_FILENAME;
     std::string ask_ark_file = ASK_ARK_FILENAME;
-    std::string ask_ark_full = m_output_folder + ASK_ARK_FILENAME;
     std::string pdh_full = m_output_folder + PDH_FILENAME;
     std::string pek_full = m_output_folder + PEK_FILENAME;
     std::string oca_full = m_output_folder + OCA_FILENAME;
-    std::string cek_full = m_output_folder + CEK_FILENAME;
-    std::string ask_full = m_output_folder + ASK_FILENAME;
-    std::string ark_full = m_output_folder + ARK_FILENAME;
-    AMDCert tmp_amd;
-    std::string ask_string = ""; // For printing. AMD certs can't just print straight
-    std::string ark_string = ""; // bytes because they're unions based on key sizes
+    sev::FileWriteBatch batch;
+
+    // The cek from the AMD KDS server and the ask_ark from the AMD dev site
+    // don't depend on the firmware or on each other, so download them while
+    // the pdh cert chain is exported and written out
+    std::thread cek_fetch([&]() {
+        cek_ret = m_sev_device->generate_cek_ask(m_output_folder, cek_file);
+    });
+    std::thread ask_ark_fetch([&]() {
+        ask_ark_ret = m_sev_device->get_ask_ark(m_output_folder, ask_ark_file);
+    });
 
     do {
         // Get the pdh Cert Chain (pdh and pek, oca, cek)
@@ -405,16 +492,57 @@ int Command::generate_all_certs(void)
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
-        // Generate the cek from the AMD KDS server
-        cmd_ret = m_sev_device->generate_cek_ask(m_output_folder, cek_file);
+        // Note that the CEK in the cert chain is unsigned, so we want to use
+        //   the one 'cached by the hypervisor' that's signed by the ask
+        //   (the one from the AMD dev site)
+        batch.add(pdh_full, pdh, sizeof(sev_cert));
+        batch.add(pek_full, PEK_IN_CERT_CHAIN(cert_chain), sizeof(sev_cert));
+        batch.add(oca_full, OCA_IN_CERT_CHAIN(cert_chain), sizeof(sev_cert));
+    } while (0);
+
+    cek_fetch.join();
+    ask_ark_fetch.join();
+
+    do {
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+        cmd_ret = cek_ret;
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+        cmd_ret = ask_ark_ret;
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
-        // Get the ask_ark from AMD dev site
-        cmd_ret = m_sev_device->get_ask_ark(m_output_folder, ask_ark_file);
+        cmd_ret = write_ask_ark_certs(&batch);
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
+        if (!batch.commit())
+            cmd_ret = -1;
+    } while (0);
+
+    // Free memory
+    delete pdh;
+    delete cert_chain;
+
+    return (int)cmd_ret;
+}
+
+/**
+ * Splits the downloaded ask_ark into the ask and ark cert files, which are
+ * added to batch
+ */
+int Command::write_ask_ark_certs(sev::FileWriteBatch *batch)
+{
+    int cmd_ret = -1;
+    amd_cert ask;
+    amd_cert ark;
+    std::string ask_ark_full = m_output_folder + ASK_ARK_FILENAME;
+    std::string ask_full = m_output_folder + ASK_FILENAME;
+    std::string ark_full = m_output_folder + ARK_FILENAME;
+    AMDCert tmp_amd;
+
+    do {
         // Read in the ask_ark so we can split it into 2 separate cert files
         uint8_t ask_ark_buf[sizeof(amd_cert)*2] = {0};
         if (sev::read_file(ask_ark_full, ask_ark_buf, sizeof(ask_ark_buf)) == 0)
@@ -433,57 +561,133 @@ int Command::generate_all_certs(void)
             break;
         // print_amd_cert_readable(&ark);
 
-        // Write all certs to individual files
-        // Note that the CEK in the cert chain is unsigned, so we want to use
-        //   the one 'cached by the hypervisor' that's signed by the ask
-        //   (the one from the AMD dev site)
-        size_t ark_size = tmp_amd.amd_cert_get_size(&ark);
-        if (sev::write_file(pdh_full, pdh, sizeof(sev_cert)) != sizeof(sev_cert))
-            break;
-        if (sev::write_file(pek_full, PEK_IN_CERT_CHAIN(cert_chain), sizeof(sev_cert)) != sizeof(sev_cert))
-            break;
-        if (sev::write_file(oca_full, OCA_IN_CERT_CHAIN(cert_chain), sizeof(sev_cert)) != sizeof(sev_cert))
-            break;
-        print_amd_cert_hex(&ask, ask_string);       // TODO refactor this
-        print_amd_cert_hex(&ark, ark_string);
-        uint8_t ask_binary[ask_size*2];
-        uint8_t ark_binary[ark_size*2];
-        sev::ascii_hex_bytes_to_binary(ask_binary, ask_string.c_str(), ask_size);
-        sev::ascii_hex_bytes_to_binary(ark_binary, ark_string.c_str(), ark_size);
-        if (sev::write_file(ask_full, ask_binary, ask_size) != ask_size)
-            break;
-        if (sev::write_file(ark_full, ark_binary, ark_size) != ark_size)
+        // Write the AMD certs to individual files. AMD certs can't just be
+        // written straight from memory because they're unions based on key sizes
+        uint8_t ask_binary[sizeof(amd_cert)];
+        uint8_t ark_binary[sizeof(amd_cert)];
+        ask_size = sev::write_amd_cert_binary(ask_binary, sizeof(ask_binary), &ask);
+        size_t ark_size = sev::write_amd_cert_binary(ark_binary, sizeof(ark_binary), &ark);
+        if (ask_size == 0 || ark_size == 0) {
+            cmd_ret = -1;
             break;
-
-        cmd_ret = STATUS_SUCCESS;
+        }
+        batch->add(ask_full, ask_binary, ask_size);
+        batch->add(ark_full, ark_binary, ark_size);
     } while (0);
 
-    // Free memory
-    delete pdh;
-    delete cert_chain;
-
     return (int)cmd_ret;
 }
 
+/**
+ * Only writes what changed since the last export. The digests of the
+ * exported certs are kept in CERTS_EXPORT_DIGESTS_FILENAME, so a single
+ * pdh_cert_export is enough to tell whether the PDH/PEK/OCA rotated. The
+ * CEK/ASK/ARK only come from the AMD servers, so they're only downloaded
+ * when their files are missing. Returns STATUS_NO_CHANGE if the certs and
+ * the zip were already up to date
+ */
 int Command::export_cert_chain(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "export_cert_chain");
     int cmd_ret = -1;
+    uint8_t pdh_cert_export_data[sizeof(sev_pdh_cert_export_cmd_buf)];
+    sev_cert_t *pdh = new sev_cert_t;
+    sev_cert_chain_buf *cert_chain = new sev_cert_chain_buf_t; // PEK, OCA, CEK
+    cert_export_digests last;
+    cert_export_digests current;
+    std::string digests_full = m_output_folder + CERTS_EXPORT_DIGESTS_FILENAME;
     std::string zip_name = CERTS_ZIP_FILENAME;
-    std::string space = " ";
-    std::string cert_names = m_output_folder + PDH_FILENAME + space +
-                             m_output_folder + PEK_FILENAME + space +
-                             m_output_folder + OCA_FILENAME + space +
-                             m_output_folder + CEK_FILENAME + space +
-                             m_output_folder + ASK_FILENAME + space +
-                             m_output_folder + ARK_FILENAME;
+    std::string zip_full = m_output_folder + CERTS_ZIP_FILENAME + ".zip";
+    const std::string member_files[EXPORT_MEMBER_COUNT] = {
+        PDH_FILENAME, PEK_FILENAME, OCA_FILENAME,
+        CEK_FILENAME, ASK_FILENAME, ARK_FILENAME,
+    };
+    const void *firmware_certs[EXPORT_OCA+1] = {
+        pdh, PEK_IN_CERT_CHAIN(cert_chain), OCA_IN_CERT_CHAIN(cert_chain),
+    };
+    std::string cert_names = "";
+    sev::FileWriteBatch batch;
+    bool have_last = sev::get_file_size(digests_full) == sizeof(last) &&
+                     sev::read_file(digests_full, &last, sizeof(last)) == sizeof(last);
+    bool changed = !have_last || sev::get_file_size(zip_full) == 0;
+
+    for (int i = 0; i < EXPORT_MEMBER_COUNT; i++)
+        cert_names += " " + m_output_folder + member_files[i];
 
     do {
-        cmd_ret = generate_all_certs();
+        // The PDH/PEK/OCA, straight from the firmware
+        cmd_ret = m_sev_device->pdh_cert_export(pdh_cert_export_data, pdh, cert_chain);
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
+        cmd_ret = -1;
+        int i;
+        for (i = EXPORT_PDH; i <= EXPORT_OCA; i++) {
+            std::string file_full = m_output_folder + member_files[i];
+            if (!digest_sha(firmware_certs[i], sizeof(sev_cert), current.digest[i],
+                            SHA256_DIGEST_LENGTH, SHA_TYPE_256))
+                break;
+            if (have_last && memcmp(current.digest[i], last.digest[i], SHA256_DIGEST_LENGTH) == 0 &&
+                sev::get_file_size(file_full) == sizeof(sev_cert))
+                continue;
+            batch.add(file_full, firmware_certs[i], sizeof(sev_cert));
+            changed = true;
+        }
+        if (i != EXPORT_OCA+1)
+            break;
+
+        // The CEK/ASK/ARK. Only go to the AMD servers if one of them is missing
+        if (sev::get_file_size(m_output_folder + CEK_FILENAME) == 0 ||
+            sev::get_file_size(m_output_folder + ASK_FILENAME) == 0 ||
+            sev::get_file_size(m_output_folder + ARK_FILENAME) == 0) {
+            cmd_ret = m_sev_device->generate_cek_ask(m_output_folder, CEK_FILENAME);
+            if (cmd_ret != STATUS_SUCCESS)
+                break;
+            cmd_ret = m_sev_device->get_ask_ark(m_output_folder, ASK_ARK_FILENAME);
+            if (cmd_ret != STATUS_SUCCESS)
+                break;
+            cmd_ret = write_ask_ark_certs(&batch);
+            if (cmd_ret != STATUS_SUCCESS)
+                break;
+        }
+
+        cmd_ret = -1;
+        if (!batch.commit())
+            break;
+        for (i = EXPORT_CEK; i <= EXPORT_ARK; i++) {
+            uint8_t cert_buf[sizeof(amd_cert)];
+            size_t cert_size = sev::read_file(m_output_folder + member_files[i],
+                                              cert_buf, sizeof(cert_buf));
+            if (cert_size == 0)
+                break;
+            if (!digest_sha(cert_buf, cert_size, current.digest[i],
+                            SHA256_DIGEST_LENGTH, SHA_TYPE_256))
+                break;
+            if (!have_last || memcmp(current.digest[i], last.digest[i], SHA256_DIGEST_LENGTH) != 0)
+                changed = true;
+        }
+        if (i != EXPORT_MEMBER_COUNT)
+            break;
+
+        if (!changed) {
+            cmd_ret = STATUS_NO_CHANGE;
+            break;
+        }
+
+        // Rebuild the zip from scratch, so it never holds stale members
+        std::remove(zip_full.c_str());
         cmd_ret = m_sev_device->zip_certs(m_output_folder, zip_name, cert_names);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        if (sev::write_file(digests_full, &current, sizeof(current)) != sizeof(current))
+            cmd_ret = -1;
     } while (0);
+
+    // Free memory
+    delete pdh;
+    delete cert_chain;
+
     return (int)cmd_ret;
 }
 
@@ -493,54 +697,32 @@ int Command::calculate_measurement(measurement_t *user_data, hmac_sha_256 *final
 {
     int cmd_ret = ERROR_UNSUPPORTED;
 
-    uint32_t measurement_length = sizeof(final_meas);
-
-    // Create and initialize the context
-    HMAC_CTX *ctx;
-    if (!(ctx = HMAC_CTX_new()))
-        return ERROR_BAD_MEASUREMENT;
-
     // Need platform_status to determine API version
     uint8_t status_data[sizeof(sev_platform_status_cmd_buf)];
     sev_platform_status_cmd_buf *status_data_buf = (sev_platform_status_cmd_buf *)&status_data;
 
     do {
-        // Need platform_status to determine API version
         cmd_ret = m_sev_device->platform_status(status_data);
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
-        if (HMAC_Init_ex(ctx, user_data->tik, sizeof(user_data->tik), EVP_sha256(), NULL) != 1)
-            break;
-        if (status_data_buf->api_minor >= 17) {
-            if (HMAC_Update(ctx, &user_data->meas_ctx, sizeof(user_data->meas_ctx)) != 1)
-                break;
-            if (HMAC_Update(ctx, &user_data->api_major, sizeof(user_data->api_major)) != 1)
-                break;
-            if (HMAC_Update(ctx, &user_data->api_minor, sizeof(user_data->api_minor)) != 1)
-                break;
-            if (HMAC_Update(ctx, &user_data->build_id, sizeof(user_data->build_id)) != 1)
-                break;
-        }
-        if (HMAC_Update(ctx, (uint8_t *)&user_data->policy, sizeof(user_data->policy)) != 1)
-            break;
-        if (HMAC_Update(ctx, (uint8_t *)&user_data->digest, sizeof(user_data->digest)) != 1)
-            break;
         // Use the same random MNonce as the FW in our validation calculations
-        if (HMAC_Update(ctx, (uint8_t *)&user_data->mnonce, sizeof(user_data->mnonce)) != 1)
-            break;
-        if (HMAC_Final(ctx, (uint8_t *)final_meas, &measurement_length) != 1)  // size = 32
+        if (!calc_launch_measurement(final_meas, user_data->tik, user_data->meas_ctx,
+                                     user_data->api_major, user_data->api_minor,
+                                     user_data->build_id, user_data->policy,
+                                     user_data->digest, user_data->mnonce,
+                                     status_data_buf->api_minor >= 17)) {
+            cmd_ret = ERROR_BAD_MEASUREMENT;
             break;
-
-        cmd_ret = STATUS_SUCCESS;
+        }
     } while (0);
 
-    HMAC_CTX_free(ctx);
     return cmd_ret;
 }
 
 int Command::calc_measurement(measurement_t *user_data)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "calc_measurement");
     int cmd_ret = -1;
     hmac_sha_256 final_meas;
 
@@ -553,7 +735,20 @@ int Command::calc_measurement(measurement_t *user_data)
         }
         std::string meas_str = meas_buf;
 
-        if (m_verbose_flag) {          // Print ID arrays
+        if (m_out) {
+            m_out->begin_map("calc_measurement");
+            m_out->add_uint("context", user_data->meas_ctx);
+            m_out->add_uint("api_major", user_data->api_major);
+            m_out->add_uint("api_minor", user_data->api_minor);
+            m_out->add_uint("build_id", user_data->build_id);
+            m_out->add_uint("policy", user_data->policy);
+            m_out->add_bytes("digest", user_data->digest, sizeof(user_data->digest));
+            m_out->add_bytes("mnonce", user_data->mnonce, sizeof(user_data->mnonce));
+            m_out->add_bytes("tik", user_data->tik, sizeof(user_data->tik));
+            m_out->add_bytes("measurement", final_meas, sizeof(final_meas));
+            m_out->end_map();
+        }
+        else if (m_verbose_flag) {     // Print ID arrays
             // Print input args for user
             printf("Input Arguments:\n");
             printf("   context: %02x\n", user_data->meas_ctx);
@@ -580,11 +775,146 @@ int Command::calc_measurement(measurement_t *user_data)
             std::string meas_path = m_output_folder+CALC_MEASUREMENT_FILENAME;
             sev::write_file(meas_path, (void *)meas_str.c_str(), meas_str.size());
         }
+
+        // For package_secret, if this is the launch generate_launch_blob
+        // started in this folder
+        sev::Secure<sev::session_keys> keys;
+        if (sev::SessionStore::global().get(m_output_folder, keys.get()) &&
+            memcmp(keys->tk.tik, user_data->tik, sizeof(keys->tk.tik)) == 0)
+            sev::SessionStore::global().set_measurement(m_output_folder, final_meas);
     }
 
     return (int)cmd_ret;
 }
 
+/**
+ * The launch digest for calc_measurement, from the OVMF image and, for
+ * measured direct boot, the kernel, initrd and cmdline. What was hashed is
+ * cached in the output folder, so asking again about the same (unchanged)
+ * files doesn't read them again
+ */
+int Command::calc_launch_digest(std::string ovmf_file, std::string kernel_file,
+                                std::string initrd_file, std::string cmdline,
+                                uint32_t min_vcpus, uint32_t max_vcpus,
+                                uint32_t vcpu_sig, bool snp)
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "calc_launch_digest");
+    int cmd_ret = -1;
+    sev::launch_digest_input input = {ovmf_file, kernel_file, initrd_file, cmdline};
+    sev::launch_vcpus vcpus = {min_vcpus, max_vcpus, vcpu_sig, snp ? sev::SNP_SEV_FEATURES : 0};
+    sev::snp_launch_stats snp_stats;
+    sev::launch_digest_stats *stats = &snp_stats.files;
+    sev::LaunchDigestCache cache;
+    std::string cache_full = m_output_folder + LAUNCH_DIGEST_CACHE_FILENAME;
+    sev::LaunchPageManifest manifest;
+    std::string manifest_full = m_output_folder + LAUNCH_DIGEST_PAGES_FILENAME;
+    bool es = max_vcpus != 0;       // SEV-ES or SNP, with a digest per vCPU count
+    uint32_t count = es && min_vcpus <= max_vcpus ? max_vcpus - min_vcpus + 1 : 1;
+    size_t digest_size = snp ? sev::SNP_DIGEST_SIZE : SHA256_DIGEST_LENGTH;
+    uint8_t *digests = NULL;
+
+    if (count > sev::LAUNCH_MAX_VCPUS || (snp && !es)) {
+        fprintf(stderr, "Error: the vCPU count has to be 1 to %u\n", sev::LAUNCH_MAX_VCPUS);
+        return ERROR_INVALID_PARAM;
+    }
+    digests = new uint8_t[count*digest_size];
+
+    cache.load(cache_full);
+    if (snp) {
+        manifest.load(manifest_full);
+        cmd_ret = sev::calc_snp_launch_digests(&input, &cache, &vcpus, 0,
+                                               (uint8_t (*)[sev::SNP_DIGEST_SIZE])digests,
+                                               &snp_stats, &manifest);
+    }
+    else if (es)
+        cmd_ret = sev::calc_sev_es_launch_digests(&input, &cache, &vcpus,
+                                                  (uint8_t (*)[SHA256_DIGEST_LENGTH])digests, stats);
+    else
+        cmd_ret = sev::calc_sev_launch_digest(&input, &cache, digests, stats);
+
+    if (cmd_ret == STATUS_SUCCESS) {
+        // One digest, or one line per vCPU count
+        std::string digest_str = "";
+        for (uint32_t n = 0; n < count; n++) {
+            char digest_buf[sev::SNP_DIGEST_SIZE*2+1] = {0};  // 2 chars per byte +1 for null term
+            for (size_t i = 0; i < digest_size; i++) {
+                sprintf(digest_buf+strlen(digest_buf), "%02x", digests[n*digest_size + i]);
+            }
+            if (count > 1) {
+                if (n > 0)
+                    digest_str += "\n";
+                digest_str += std::to_string(min_vcpus + n) + " ";
+            }
+            digest_str += digest_buf;
+        }
+
+        if (m_out) {
+            m_out->begin_map("calc_launch_digest");
+            m_out->add_string("ovmf", ovmf_file.c_str());
+            if (!kernel_file.empty()) {
+                m_out->add_string("kernel", kernel_file.c_str());
+                m_out->add_string("initrd", initrd_file.c_str());
+                m_out->add_string("cmdline", cmdline.c_str());
+            }
+            if (es)
+                m_out->add_uint("vcpu_sig", vcpu_sig);
+            if (count > 1) {
+                m_out->begin_array("digests");
+                for (uint32_t n = 0; n < count; n++) {
+                    m_out->begin_map();
+                    m_out->add_uint("vcpus", min_vcpus + n);
+                    m_out->add_bytes("digest", digests + n*digest_size, digest_size);
+                    m_out->end_map();
+                }
+                m_out->end_array();
+            }
+            else {
+                if (es)
+                    m_out->add_uint("vcpus", min_vcpus);
+                m_out->add_bytes("digest", digests, digest_size);
+            }
+            m_out->add_uint("bytes_hashed", stats->bytes_hashed);
+            m_out->add_uint("cache_hits", stats->cache_hits);
+            if (snp) {
+                m_out->add_uint("pages", snp_stats.pages);
+                m_out->add_uint("pages_hashed", snp_stats.pages_hashed);
+                m_out->add_uint("pages_per_sec", (uint64_t)snp_stats.pages_per_sec);
+            }
+            m_out->end_map();
+        }
+        else if (m_verbose_flag) {
+            printf("OVMF: %s\n", ovmf_file.c_str());
+            if (!kernel_file.empty()) {
+                printf("Kernel: %s\n", kernel_file.c_str());
+                printf("Initrd: %s\n", initrd_file.c_str());
+                printf("Cmdline: %s\n", cmdline.c_str());
+            }
+            if (es)
+                printf("%s, %u to %u vCPU(s) of signature %08x\n", snp ? "SEV-SNP" : "SEV-ES",
+                       min_vcpus, max_vcpus, vcpu_sig);
+            printf("Hashed %llu bytes, %u file(s) from the cache\n",
+                   (unsigned long long)stats->bytes_hashed, stats->cache_hits);
+            if (snp)
+                printf("%llu pages, %llu hashed on %u thread(s) (%llu unchanged), %.0f pages/s\n",
+                       (unsigned long long)snp_stats.pages,
+                       (unsigned long long)snp_stats.pages_hashed, snp_stats.threads,
+                       (unsigned long long)snp_stats.pages_reused, snp_stats.pages_per_sec);
+            printf("\n%s\n", digest_str.c_str());
+        }
+        if (m_output_folder != "") {
+            std::string digest_path = m_output_folder+LAUNCH_DIGEST_FILENAME;
+            sev::write_file(digest_path, (void *)digest_str.c_str(), digest_str.size());
+        }
+
+        // Not being able to save the cache only makes the next one slower
+        cache.save(cache_full);
+        manifest.save(manifest_full);
+    }
+
+    delete[] digests;
+    return cmd_ret;
+}
+
 int Command::import_all_certs(sev_cert *pdh, sev_cert *pek, sev_cert *oca,
                               sev_cert *cek, amd_cert *ask, amd_cert *ark)
 {
@@ -642,6 +972,7 @@ int Command::import_all_certs(sev_cert *pdh, sev_cert *pek, sev_cert *oca,
 
 int Command::validate_cert_chain(void)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "validate_cert_chain");
     int cmd_ret = -1;
     sev_cert pdh;
     sev_cert pek;
@@ -651,6 +982,7 @@ int Command::validate_cert_chain(void)
     amd_cert ark;
 
     sev_cert ask_pubkey;
+    const char *failed_cert = "";   // The cert that didn't validate, if any
 
     do {
         cmd_ret = import_all_certs(&pdh, &pek, &oca, &cek, &ask, &ark);
@@ -664,11 +996,13 @@ int Command::validate_cert_chain(void)
         AMDCert tmp_amd;
 
         // Validate the ARK
+        failed_cert = "ark";
         cmd_ret = tmp_amd.amd_cert_validate_ark(&ark);
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
         // Validate the ASK
+        failed_cert = "ask";
         cmd_ret = tmp_amd.amd_cert_validate_ask(&ask, &ark);
         if (cmd_ret != STATUS_SUCCESS)
             break;
@@ -682,26 +1016,39 @@ int Command::validate_cert_chain(void)
             break;
 
         // Validate the CEK
+        failed_cert = "cek";
         cmd_ret = tmp_sev_cek.verify_sev_cert(&ask_pubkey);
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
         // Validate the PEK with the CEK and OCA
+        failed_cert = "pek";
         cmd_ret = tmp_sev_pek.verify_sev_cert(&cek, &oca);
         if (cmd_ret != STATUS_SUCCESS)
             break;
 
         // Validate the PDH
+        failed_cert = "pdh";
         cmd_ret = tmp_sev_pdh.verify_sev_cert(&pek);
         if (cmd_ret != STATUS_SUCCESS)
             break;
+        failed_cert = "";
     } while (0);
 
+    if (m_out) {
+        m_out->begin_map("validate_cert_chain");
+        m_out->add_bool("valid", cmd_ret == STATUS_SUCCESS);
+        if (cmd_ret != STATUS_SUCCESS && *failed_cert)
+            m_out->add_string("failed_cert", failed_cert);
+        m_out->end_map();
+    }
+
     return (int)cmd_ret;
 }
 
 int Command::generate_launch_blob(uint32_t policy)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "generate_launch_blob");
     int cmd_ret = ERROR_UNSUPPORTED;
     sev_session_buf session_data_buf;
     std::string buf_file = m_output_folder + LAUNCH_BLOB_FILENAME;
@@ -722,31 +1069,33 @@ int Command::generate_launch_blob(uint32_t policy)
 
         // Generate a new GODH Public/Private keypair
         if (!generate_ecdh_key_pair(&godh_key_pair)) {
-            printf("Error generating new GODH ECDH keypair\n");
+            fprintf(stderr, "Error generating new GODH ECDH keypair\n");
             break;
         }
 
         // This cert is really just a way to send over the godh public key,
         // so the api major/minor don't matter here
         if (!cert_obj.create_godh_cert(&godh_key_pair, 0, 0)) {
-            printf("Error creating GODH certificate\n");
+            fprintf(stderr, "Error creating GODH certificate\n");
             break;
         }
         memcpy(&godh_pubkey_cert, cert_obj.data(), sizeof(sev_cert)); // TODO, shouldn't need this?
 
-        // Write the cert to file
-        std::string godh_cert_file = m_output_folder + GUEST_OWNER_DH_FILENAME;
-        if (sev::write_file(godh_cert_file, &godh_pubkey_cert, sizeof(sev_cert)) != sizeof(sev_cert))
-            break;
-
-        // Write the unencrypted TK (TIK and TEK) to a tmp file so it can be
-        // read in during package_secret
-        std::string tmp_tk_file = m_output_folder + GUEST_TK_FILENAME;
-        sev::write_file(tmp_tk_file, &m_tk, sizeof(m_tk));
-
-        cmd_ret = build_session_buffer(&session_data_buf, policy, godh_key_pair, &pdh);
+        cmd_ret = build_session_buffer(&session_data_buf, &m_tk, policy, godh_key_pair, &pdh);
         if (cmd_ret == STATUS_SUCCESS) {
-            if (m_verbose_flag) {
+            if (m_out) {
+                m_out->begin_map("generate_launch_blob");
+                m_out->add_uint("policy", policy);
+                m_out->add_bytes("nonce", session_data_buf.nonce, sizeof(session_data_buf.nonce));
+                m_out->add_bytes("wrap_tek", session_data_buf.wrap_tk.tek, sizeof(session_data_buf.wrap_tk.tek));
+                m_out->add_bytes("wrap_tik", session_data_buf.wrap_tk.tik, sizeof(session_data_buf.wrap_tk.tik));
+                m_out->add_bytes("wrap_iv", session_data_buf.wrap_iv, sizeof(session_data_buf.wrap_iv));
+                m_out->add_bytes("wrap_mac", session_data_buf.wrap_mac, sizeof(session_data_buf.wrap_mac));
+                m_out->add_bytes("policy_mac", session_data_buf.policy_mac, sizeof(session_data_buf.policy_mac));
+                serialize_sev_cert(m_out, "godh_cert", &godh_pubkey_cert);
+                m_out->end_map();
+            }
+            else if (m_verbose_flag) {
                 printf("Guest Policy (input): %08x\n", policy);
                 printf("nonce:\n");
                 for (size_t i = 0; i < sizeof(session_data_buf.nonce); i++) {
@@ -774,467 +1123,714 @@ int Command::generate_launch_blob(uint32_t policy)
                 }
                 printf("\n");
             }
-            sev::write_file(buf_file, (void *)&session_data_buf, sizeof(sev_session_buf));
+
+            // The unencrypted TK (TIK and TEK) that build_session_buffer
+            // made stays in memory for package_secret. It only goes to disk
+            // if a later sevtool process has to pick it up
+            sev::SessionStore &store = sev::SessionStore::global();
+            bool persist = store.persist_files();
+            if (!store.put(m_output_folder, &m_tk, &session_data_buf) && !persist) {
+                fprintf(stderr, "Error: too many launches in progress\n");
+                cmd_ret = ERROR_RESOURCE_LIMIT;
+                break;
+            }
+
+            // The GODH cert and the blob, for LAUNCH_START
+            sev::FileWriteBatch batch;
+            batch.add(m_output_folder + GUEST_OWNER_DH_FILENAME, &godh_pubkey_cert, sizeof(sev_cert));
+            if (persist)
+                batch.add(m_output_folder + GUEST_TK_FILENAME, &m_tk, sizeof(m_tk));
+            batch.add(buf_file, &session_data_buf, sizeof(sev_session_buf));
+            if (!batch.commit())
+                cmd_ret = -1;
         }
     } while (0);
 
     return (int)cmd_ret;
 }
 
-int Command::package_secret(void)
+/**
+ * The TK and measurement for the secret header. From earlier in this process
+ * if there were any, otherwise from generate_launch_blob's and
+ * calc_measurement's files. The measurement is skipped if it isn't needed
+ */
+int Command::load_launch_keys(bool measurement)
 {
     int cmd_ret = ERROR_UNSUPPORTED;
     sev_session_buf session_data_buf;
+    std::string launch_blob_file = m_output_folder + LAUNCH_BLOB_FILENAME;
+    std::string measurement_file = m_output_folder + CALC_MEASUREMENT_FILENAME;
+    sev::Secure<sev::session_keys> keys;
+    bool stored = sev::SessionStore::global().get(m_output_folder, keys.get());
+
+    do {
+        if (stored) {
+            memcpy(&m_tk, &keys->tk, sizeof(m_tk));
+        }
+        else {
+            // Read in the blob to import the TEK
+            if (sev::read_file(launch_blob_file, &session_data_buf, sizeof(sev_session_buf)) != sizeof(sev_session_buf))
+                break;
+
+            // Read in the unencrypted TK (TIK and TEK) created in build_session_buffer
+            std::string tmp_tk_file = m_output_folder + GUEST_TK_FILENAME;
+            if (sev::read_file(tmp_tk_file, &m_tk, sizeof(m_tk)) != sizeof(m_tk)) {
+                fprintf(stderr, "Error reading in %s\n", tmp_tk_file.c_str());
+                break;
+            }
+        }
+
+        // Read in the measurement, to be used as part of the launch secret header hmac
+        if (measurement && stored && keys->has_measurement) {
+            memcpy(m_measurement, keys->measurement, sizeof(m_measurement));
+        }
+        else if (measurement &&
+                 sev::read_file(measurement_file, &m_measurement, sizeof(m_measurement)) != sizeof(m_measurement)) {
+            fprintf(stderr, "Error reading in %s\n", measurement_file.c_str());
+            break;
+        }
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+int Command::package_secret(void)
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "package_secret");
+    int cmd_ret = ERROR_UNSUPPORTED;
     sev_hdr_buf packaged_secret_header;
     std::string secret_file = m_output_folder + SECRET_FILENAME;
-    std::string launch_blob_file = m_output_folder + LAUNCH_BLOB_FILENAME;
     std::string packaged_secret_file = m_output_folder + PACKAGED_SECRET_FILENAME;
     std::string packaged_secret_header_file = m_output_folder + PACKAGED_SECRET_HEADER_FILENAME;
 
     uint32_t flags = 0;
     iv_128 iv;
-    sev::gen_random_bytes(&iv, sizeof(iv));     // Pick a random IV
+    uint8_t status_data[sizeof(sev_platform_status_cmd_buf)];
+    sev_platform_status_cmd_buf *status = (sev_platform_status_cmd_buf *)&status_data;
 
     do {
-        // Get the size of the secret, so we can allocate that much memory
-        size_t secret_size = sev::get_file_size(secret_file);
-        if (secret_size < 8) {
-            printf("Error: SEV requires a secret greater than 8 bytes\n");
-            break;
-        }
-        uint8_t secret_mem[secret_size];
-        uint8_t encrypted_mem[secret_size];
-
-        // Read in the secret
-        // printf("Attempting to read in Secrets file\n");
-        if (sev::read_file(secret_file, secret_mem, secret_size) != secret_size)
+        // Pick a random IV
+        if (!sev::gen_random_bytes(&iv, sizeof(iv)))
             break;
 
-        // Read in the blob to import the TEK
-        // printf("Attempting to read in LaunchBlob file to import TEK\n");
-        if (sev::read_file(launch_blob_file, &session_data_buf, sizeof(sev_session_buf)) != sizeof(sev_session_buf))
+        // Read in the secret. One open, and mmap'd if it's big
+        sev::FileView secret;
+        if (!secret.open(secret_file))
             break;
-
-        // Read in the unencrypted TK (TIK and TEK) created in build_session_buffer
-        std::string tmp_tk_file = m_output_folder + GUEST_TK_FILENAME;
-        if (sev::read_file(tmp_tk_file, &m_tk, sizeof(m_tk) != sizeof(m_tk))) {
-            printf("Error reading in %s\n", tmp_tk_file.c_str());
+        size_t secret_size = secret.size();
+        if (secret_size < 8) {
+            fprintf(stderr, "Error: SEV requires a secret greater than 8 bytes\n");
             break;
         }
+        uint8_t *encrypted_mem = new uint8_t[secret_size];
 
-        // Encrypt the secret with the TEK
-        encrypt_with_tek(encrypted_mem, secret_mem, secret_size, iv);
+        do {
+            if (load_launch_keys() != STATUS_SUCCESS)
+                break;
 
-        if (m_verbose_flag) {
-            printf("Random IV\n");
-            for (size_t i = 0; i < sizeof(iv); i++) {
-                printf("%02x ", iv[i]);
-            }
-            printf("\n");
-        }
+            // From API 0.17 on, the header MAC covers the measurement
+            if (m_sev_device->platform_status(status_data) != STATUS_SUCCESS)
+                break;
 
-        // Read in the measurement, to be used as part of the launch secret header hmac
-        std::string measurement_file = m_output_folder + CALC_MEASUREMENT_FILENAME;
-        if (sev::read_file(measurement_file, &m_measurement, sizeof(m_measurement)) != sizeof(m_measurement)) {
-            printf("Error reading in %s\n", measurement_file.c_str());
-            break;
-        }
+            if (m_verbose_flag && !m_out) {
+                printf("Random IV\n");
+                for (size_t i = 0; i < sizeof(iv); i++) {
+                    printf("%02x ", iv[i]);
+                }
+                printf("\n");
+            }
 
-        // Write the encrypted secret to a file
-        sev::write_file(packaged_secret_file, encrypted_mem, secret_size);
+            // Encrypt the secret with the TEK and set up the Launch_Secret
+            // packet header
+            sev::secret_piece piece = {secret.data(), secret_size};
+            if (sev::package_secret_pieces(&m_tk, m_measurement, status->api_minor, iv, flags,
+                                           &piece, 1, encrypted_mem, secret_size,
+                                           &packaged_secret_header) != STATUS_SUCCESS)
+                break;
 
-        // Set up the Launch_Secret packet header
-        if (!create_launch_secret_header(&packaged_secret_header, &iv, encrypted_mem,
-                                        sizeof(encrypted_mem), flags)) {
-            break;
-        }
+            // Write the encrypted secret and the header
+            sev::FileWriteBatch batch;
+            batch.add(packaged_secret_file, encrypted_mem, secret_size);
+            batch.add(packaged_secret_header_file, &packaged_secret_header, sizeof(packaged_secret_header));
+            if (!batch.commit())
+                break;
 
-        // Write the header to a file
-        sev::write_file(packaged_secret_header_file, &packaged_secret_header, sizeof(packaged_secret_header));
+            cmd_ret = STATUS_SUCCESS;
+        } while (0);
 
-        cmd_ret = STATUS_SUCCESS;
+        delete[] encrypted_mem;
     } while (0);
 
     return (int)cmd_ret;
 }
 
-// --------------------------------------------------------------- //
-// ---------------- generate_launch_blob functions --------------- //
-// --------------------------------------------------------------- //
-/*
- * NIST Compliant KDF
- */
-bool Command::kdf(uint8_t *key_out,       size_t key_out_length,
-                  const uint8_t *key_in,  size_t key_in_length,
-                  const uint8_t *label,   size_t label_length,
-                  const uint8_t *context, size_t context_length)
+int Command::package_secret_table(std::string secrets)
 {
-    if (!key_out || !key_in || !label || (key_out_length == 0) ||
-       (key_in_length == 0) || (label_length == 0))
-        return false;
-
-    bool cmd_ret = false;
-    uint8_t null_byte = '\0';
-    unsigned int out_len = 0;
-    uint8_t prf_out[NIST_KDF_H_BYTES];      // Buffer to collect PRF output
-
-    // length in bits of derived key
-    uint32_t l = (uint32_t)(key_out_length * BITS_PER_BYTE);
-
-    // number of iterations to produce enough derived key bits
-    uint32_t n = ((l - 1) / NIST_KDF_H) + 1;
-
-    size_t bytes_left = key_out_length;
-    uint32_t offset = 0;
-
-    // Create and initialize the context
-    HMAC_CTX *ctx;
-    if (!(ctx = HMAC_CTX_new()))
-        return cmd_ret;
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "package_secret_table");
+    int cmd_ret = ERROR_INVALID_PARAM;
+    std::string packaged_secret_file = m_output_folder + PACKAGED_SECRET_FILENAME;
+    std::string packaged_secret_header_file = m_output_folder + PACKAGED_SECRET_HEADER_FILENAME;
+    sev::FileView files[sev::SECRET_TABLE_MAX_ENTRIES];
+    sev::SecretTable table;
+    sev_hdr_buf header;
+    uint8_t status_data[sizeof(sev_platform_status_cmd_buf)];
+    sev_platform_status_cmd_buf *status = (sev_platform_status_cmd_buf *)&status_data;
+    uint8_t *packaged = NULL;
+    iv_128 iv;
 
-    for (unsigned int i = 1; i <= n; i++)
-    {
-        if (HMAC_CTX_reset(ctx) != 1)
+    do {
+        // Pick a random IV
+        if (!sev::gen_random_bytes(&iv, sizeof(iv))) {
+            cmd_ret = ERROR_UNSUPPORTED;
             break;
+        }
 
-        // calculate a chunk of random data from the PRF
-        if (HMAC_Init_ex(ctx, key_in, (int)key_in_length, EVP_sha256(), NULL) != 1)
-            break;
-        if (HMAC_Update(ctx, (uint8_t*)&i, sizeof(i)) != 1)
-            break;
-        if (HMAC_Update(ctx, (unsigned char*)label, label_length) != 1)
+        // guid=file[,guid=file...]. Each file is mapped and encrypted from
+        // where it is
+        size_t start = 0;
+        bool failed = false;
+        while (start <= secrets.size() && !failed) {
+            size_t end = secrets.find(',', start);
+            if (end == std::string::npos)
+                end = secrets.size();
+            std::string entry = secrets.substr(start, end - start);
+            size_t eq = entry.find('=');
+            std::string guid_str = entry.substr(0, eq);
+            uint8_t guid[16];
+            sev::FileView *file = &files[table.count()];
+
+            failed = true;
+            if (eq == std::string::npos) {
+                fprintf(stderr, "Error: \"%s\" isn't guid=file\n", entry.c_str());
+            }
+            else if (guid_str != "disk" && !sev::str_to_guid(guid_str, guid)) {
+                fprintf(stderr, "Error: \"%s\" isn't a GUID\n", guid_str.c_str());
+            }
+            else if (table.count() >= sev::SECRET_TABLE_MAX_ENTRIES) {
+                fprintf(stderr, "Error: a secret table can have up to %zu secrets\n",
+                                sev::SECRET_TABLE_MAX_ENTRIES);
+            }
+            else if (!file->open(entry.substr(eq + 1))) {
+                fprintf(stderr, "Error: could not read %s\n", entry.substr(eq + 1).c_str());
+            }
+            else if (!table.add(guid_str == "disk" ? sev::SECRET_DISK_PASSPHRASE_GUID : guid,
+                                file->data(), file->size())) {
+                fprintf(stderr, "Error: %s is in the secret table twice\n", guid_str.c_str());
+            }
+            else {
+                failed = false;
+            }
+            start = end + 1;
+        }
+        if (failed)
             break;
-        if (HMAC_Update(ctx, &null_byte, sizeof(null_byte)) != 1)
+
+        if (load_launch_keys() != STATUS_SUCCESS) {
+            cmd_ret = ERROR_UNSUPPORTED;
             break;
-        if ((context) && (context_length != 0)) {
-            if (HMAC_Update(ctx, (unsigned char*)context, context_length) != 1)
-                break;
         }
-        if (HMAC_Update(ctx, (uint8_t*)&l, sizeof(l)) != 1)
+        // From API 0.17 on, the header MAC covers the measurement
+        cmd_ret = m_sev_device->platform_status(status_data);
+        if (cmd_ret != STATUS_SUCCESS)
             break;
-        if (HMAC_Final(ctx, prf_out, &out_len) != 1)
+
+        packaged = new uint8_t[table.size()];
+        cmd_ret = table.package(&m_tk, m_measurement, status->api_minor, iv, packaged,
+                                table.size(), &header);
+        if (cmd_ret != STATUS_SUCCESS)
             break;
 
-        // Write out the key bytes
-        if (bytes_left <= NIST_KDF_H_BYTES) {
-            memcpy(key_out + offset, prf_out, bytes_left);
+        if (m_out) {
+            m_out->begin_map("package_secret_table");
+            m_out->add_uint("secrets", table.count());
+            m_out->add_uint("size", table.size());
+            m_out->add_bytes("iv", iv, sizeof(iv));
+            m_out->end_map();
         }
-        else {
-            memcpy(key_out + offset, prf_out, NIST_KDF_H_BYTES);
-            offset     += NIST_KDF_H_BYTES;
-            bytes_left -= NIST_KDF_H_BYTES;
+        else if (m_verbose_flag) {
+            printf("%zu secret(s), %zu byte packet\n", table.count(), table.size());
+            if (table.size() > sev::SECRET_TABLE_PAGE_SIZE)
+                printf("Bigger than the %zu byte secret area in a default OVMF build\n",
+                       sev::SECRET_TABLE_PAGE_SIZE);
         }
 
-        if (i == n)          // If successfully finished all iterations
-            cmd_ret = true;
-    }
+        sev::FileWriteBatch batch;
+        batch.add(packaged_secret_file, packaged, table.size());
+        batch.add(packaged_secret_header_file, &header, sizeof(header));
+        if (!batch.commit())
+            cmd_ret = ERROR_UNSUPPORTED;
+    } while (0);
 
-    HMAC_CTX_free(ctx);
+    delete[] packaged;
     return cmd_ret;
 }
 
-/*
- * Note that this function NEWs/allocates memory for a
- * uint8_t array using OPENSSL_malloc that must be freed
- * in the calling function using OPENSSL_FREE()
+/**
+ * Key material that can't be kept in locked memory isn't read in at all
  */
-uint8_t* Command::calculate_shared_secret(EVP_PKEY *priv_key, EVP_PKEY *peer_key,
-                                          size_t& shared_key_len_out)
+static bool locked_buffer(sev::SecureBuffer *buf, int *cmd_ret)
 {
-    if (!priv_key || !peer_key)
-        return NULL;
+    if (buf->data() && buf->locked())
+        return true;
+    fprintf(stderr, "Error: could not lock %zu bytes of memory (see ulimit -l)\n", buf->size());
+    *cmd_ret = ERROR_RESOURCE_LIMIT;
+    return false;
+}
 
-    bool success = false;
-    EVP_PKEY_CTX *ctx = NULL;
-    uint8_t *shared_key = NULL;
+/**
+ * package_secret's secret for every launch in session_file, which is any
+ * number of TK + measurement pairs back to back (see sev::secret_session).
+ * The secret is read once, into locked memory, and the sessions are
+ * packaged on every core at once
+ */
+int Command::package_secret_fanout(std::string session_file, uint32_t threads)
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "package_secret_fanout");
+    int cmd_ret = ERROR_INVALID_LENGTH;
+    std::string secret_file = m_output_folder + SECRET_FILENAME;
+    std::string packaged_secrets_file = m_output_folder + PACKAGED_SECRETS_FILENAME;
+    std::string packaged_headers_file = m_output_folder + PACKAGED_SECRET_HEADERS_FILENAME;
+    uint8_t status_data[sizeof(sev_platform_status_cmd_buf)];
+    sev_platform_status_cmd_buf *status = (sev_platform_status_cmd_buf *)&status_data;
+    sev::SecureBuffer *secret = NULL;
+    sev::SecureBuffer *sessions = NULL;
+    size_t count = 0;
+    uint8_t *packaged = NULL;
+    sev_hdr_buf *headers = NULL;
+    sev::secret_fanout_stats stats;
 
     do {
-        // Create the context using your private key
-        if (!(ctx = EVP_PKEY_CTX_new(priv_key, NULL)))
-            break;
+        // The TKs go straight from the file into locked memory of their
+        // own, as there can be any number of them
+        {
+            sev::FileView view;
+            if (!view.open(session_file)) {
+                fprintf(stderr, "Error: could not read %s\n", session_file.c_str());
+                cmd_ret = ERROR_INVALID_PARAM;
+                break;
+            }
+            if (view.size() == 0 || view.size() % sizeof(sev::secret_session) != 0) {
+                fprintf(stderr, "Error: %s isn't a whole number of %zu byte sessions\n",
+                                session_file.c_str(), sizeof(sev::secret_session));
+                break;
+            }
+            count = view.size() / sizeof(sev::secret_session);
+            sessions = new sev::SecureBuffer(view.size());
+            if (!locked_buffer(sessions, &cmd_ret))
+                break;
+            memcpy(sessions->data(), view.data(), view.size());
+        }
 
-        // Calculate the intermediate secret
-        if (EVP_PKEY_derive_init(ctx) <= 0)
-            break;
-        if (EVP_PKEY_derive_set_peer(ctx, peer_key) <= 0)
-            break;
+        // And so does the secret, once for all of them
+        {
+            sev::FileView view;
+            if (!view.open(secret_file)) {
+                fprintf(stderr, "Error: could not read %s\n", secret_file.c_str());
+                cmd_ret = ERROR_INVALID_PARAM;
+                break;
+            }
+            if (view.size() < 8) {
+                fprintf(stderr, "Error: SEV requires a secret greater than 8 bytes\n");
+                break;
+            }
+            secret = new sev::SecureBuffer(view.size());
+            if (!locked_buffer(secret, &cmd_ret))
+                break;
+            memcpy(secret->data(), view.data(), view.size());
+        }
 
-        // Determine buffer length
-        if (EVP_PKEY_derive(ctx, NULL, &shared_key_len_out) <= 0)
+        // From API 0.17 on, the header MAC covers the measurement
+        cmd_ret = m_sev_device->platform_status(status_data);
+        if (cmd_ret != STATUS_SUCCESS)
             break;
 
-        // Need to free shared_key using OPENSSL_FREE() in the calling function
-        shared_key = (unsigned char*)OPENSSL_malloc(shared_key_len_out);
-        if (!shared_key)
-            break;      // malloc failure
-
-        // Compute the shared secret with the ECDH key material.
-        if (EVP_PKEY_derive(ctx, shared_key, &shared_key_len_out) <= 0)
+        size_t secret_size = secret->size();
+        packaged = new uint8_t[count*secret_size];
+        headers = new sev_hdr_buf[count];
+        cmd_ret = sev::package_secret_fanout(secret->data(), secret_size,
+                                             (const sev::secret_session *)sessions->data(), count,
+                                             status->api_minor, threads, packaged,
+                                             headers, &stats);
+        if (cmd_ret != STATUS_SUCCESS)
             break;
 
-        success = true;
-    } while (0);
+        if (m_out) {
+            m_out->begin_map("package_secret_fanout");
+            m_out->add_uint("sessions", stats.sessions);
+            m_out->add_uint("size", secret->size());
+            m_out->add_uint("threads", stats.threads);
+            m_out->add_uint("sessions_per_sec", (uint64_t)stats.sessions_per_sec);
+            m_out->end_map();
+        }
+        else if (m_verbose_flag) {
+            printf("%llu session(s) packaged on %u thread(s), %.0f sessions/s, %.1f MB/s\n",
+                   (unsigned long long)stats.packaged, stats.threads, stats.sessions_per_sec,
+                   stats.bytes_per_sec / 1e6);
+        }
 
-    EVP_PKEY_CTX_free(ctx);
+        sev::FileWriteBatch batch;
+        batch.add(packaged_secrets_file, packaged, count*secret->size());
+        batch.add(packaged_headers_file, headers, count*sizeof(sev_hdr_buf));
+        if (!batch.commit())
+            cmd_ret = ERROR_UNSUPPORTED;
+    } while (0);
 
-    return success ? shared_key : NULL;
+    delete[] headers;
+    delete[] packaged;
+    delete secret;
+    delete sessions;
+    return cmd_ret;
 }
 
-/*
- * Generate a master_secret value from our (test suite) Private DH key,
- *   the Platform's public DH key, and a nonce
- * This function calls two functions (above) which allocate memory
- *   for keys, and this function must free that memory
+/**
+ * The guest memory in image_file as a stream of SEND_UPDATE_DATA packets,
+ * under generate_launch_blob's TEK/TIK. See migration.h for the format
  */
-bool Command::derive_master_secret(aes_128_key master_secret,
-                                   EVP_PKEY *godh_priv_key,
-                                   const sev_cert *pdh_public,
-                                   const uint8_t nonce[sizeof(nonce_128)])
+int Command::package_migration(std::string image_file, uint64_t gpa, uint32_t threads)
 {
-    if (!godh_priv_key || !pdh_public)
-        return false;
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "package_migration");
+    int cmd_ret = ERROR_INVALID_PARAM;
+    std::string stream_file = m_output_folder + MIGRATION_STREAM_FILENAME;
+    sev::FileView image;
+    sev::FileMapWriter stream;
+    size_t stream_size = 0;
+    sev::migration_stats stats;
+    sev::migration_stats window_stats;
 
-    sev_cert dummy;
-    memset(&dummy, 0, sizeof(sev_cert));    // To remove compile warnings
-    SEVCert temp_obj(dummy);                // TODO. Hack b/c just want to call function later
-    bool ret = false;
-    EVP_PKEY *plat_owner_pub_key = NULL;    // Platform owner public key
-    size_t shared_key_len = 0;
+    memset(&stats, 0, sizeof(stats));
 
     do {
-        // New up the Platform Owner's public EVP_PKEY
-        if (!(plat_owner_pub_key = EVP_PKEY_new()))
+        if (!image.open(image_file) || image.size() == 0) {
+            fprintf(stderr, "Error: could not read %s\n", image_file.c_str());
             break;
-
-        // Get the friend's Public EVP_PKEY from the certificate
-        // This function allocates memory and attaches an EC_Key
-        //  to your EVP_PKEY so, to prevent mem leaks, make sure
-        //  the EVP_PKEY is freed at the end of this function
-        if (temp_obj.compile_public_key_from_certificate(pdh_public, plat_owner_pub_key) != STATUS_SUCCESS)
+        }
+        if (load_launch_keys(false) != STATUS_SUCCESS) {
+            cmd_ret = ERROR_UNSUPPORTED;
             break;
+        }
 
-        // Calculate the shared secret
-        // This function is allocating memory for this uint8_t[],
-        //  must free it at the end of this function
-        uint8_t *shared_key = calculate_shared_secret(godh_priv_key, plat_owner_pub_key, shared_key_len);
-        if (!shared_key)
+        stream_size = sev::migration_stream_size(image.size());
+        if (!stream.open(stream_file, stream_size)) {
+            cmd_ret = ERROR_UNSUPPORTED;
             break;
+        }
 
-        // Derive the master secret from the intermediate secret
-        if (!kdf((unsigned char*)master_secret, sizeof(aes_128_key), shared_key,
-            shared_key_len, (uint8_t*)SEV_MASTER_SECRET_LABEL,
-            sizeof(SEV_MASTER_SECRET_LABEL)-1, nonce, sizeof(nonce_128))) // sizeof(nonce), bad?
+        // Packaged straight into the file, a window at a time, so neither
+        // the stream nor a copy of it has to fit in memory
+        const size_t window = sev::MIGRATION_WINDOW*sev::MIGRATION_PAGE_SIZE;
+        uint64_t start = sev::Metrics::now_ns();
+        for (size_t offset = 0; offset < image.size(); offset += window) {
+            size_t size = std::min(window, image.size() - offset);
+            size_t out_size = sev::migration_stream_size(size);
+            uint8_t *out = stream.map(offset/sev::MIGRATION_PAGE_SIZE*sev::MIGRATION_PACKET_STRIDE,
+                                      out_size);
+            if (!out) {
+                cmd_ret = ERROR_UNSUPPORTED;
+                break;
+            }
+            cmd_ret = sev::migration_pack(&m_tk, image.data() + offset, size, gpa + offset,
+                                          threads, out, out_size, &window_stats);
+            if (cmd_ret != STATUS_SUCCESS)
+                break;
+            stats.pages += window_stats.pages;
+            stats.bytes += window_stats.bytes;
+            stats.threads = std::max(stats.threads, window_stats.threads);
+        }
+        if (cmd_ret != STATUS_SUCCESS)
             break;
-
-        // Free memory allocated in calculate_shared_secret
-        OPENSSL_free(shared_key);    // Local variable
-
-        ret = true;
+        if (!stream.commit()) {
+            cmd_ret = ERROR_UNSUPPORTED;
+            break;
+        }
+        uint64_t elapsed = sev::Metrics::now_ns() - start;
+        stats.gib_per_sec = elapsed ? (double)stats.bytes * 1e9 / (double)elapsed / (1024.0*1024*1024) : 0;
+
+        if (m_out) {
+            m_out->begin_map("package_migration");
+            m_out->add_uint("pages", stats.pages);
+            m_out->add_uint("bytes", stats.bytes);
+            m_out->add_uint("stream_bytes", stream_size);
+            m_out->add_uint("threads", stats.threads);
+            m_out->add_uint("mib_per_sec", (uint64_t)(stats.gib_per_sec * 1024));
+            m_out->end_map();
+        }
+        else if (m_verbose_flag) {
+            printf("%llu page(s) packaged on %u thread(s), %zu byte stream, %.2f GiB/s\n",
+                   (unsigned long long)stats.pages, stats.threads, stream_size, stats.gib_per_sec);
+        }
     } while (0);
 
-    // Free memory
-    EVP_PKEY_free(plat_owner_pub_key);
-
-    return ret;
-}
-
-bool Command::derive_kek(aes_128_key kek, const aes_128_key master_secret)
-{
-    bool ret = kdf((unsigned char*)kek, sizeof(aes_128_key), master_secret, sizeof(aes_128_key),
-                   (uint8_t*)SEV_KEK_LABEL, sizeof(SEV_KEK_LABEL)-1, NULL, 0);
-    return ret;
-}
-
-bool Command::derive_kik(hmac_key_128 kik, const aes_128_key master_secret)
-{
-    bool ret = kdf((unsigned char*)kik, sizeof(aes_128_key), master_secret, sizeof(aes_128_key),
-                   (uint8_t*)SEV_KIK_LABEL, sizeof(SEV_KIK_LABEL)-1, NULL, 0);
-    return ret;
-}
-
-bool Command::gen_hmac(hmac_sha_256 *out, hmac_key_128 key, uint8_t *msg, size_t msg_len)
-{
-    if (!out || !msg)
-        return false;
-
-    unsigned int out_len = 0;
-    HMAC(EVP_sha256(), key, sizeof(hmac_key_128), msg,    // Returns NULL or value of out
-         msg_len, (uint8_t*)out, &out_len);
-
-    if ((out != NULL) && (out_len == sizeof(hmac_sha_256)))
-        return true;
-    else
-        return false;
+    return cmd_ret;
 }
 
-/*
- * AES128 Encrypt a buffer
+/**
+ * Checks a package_migration stream the way a receiver would, and if
+ * image_file isn't "", that it decrypts to that image
  */
-bool Command::encrypt(uint8_t *out, const uint8_t *in, size_t length,
-                      const aes_128_key Key, const iv_128 IV)
+int Command::verify_migration(std::string stream_file, std::string image_file, uint32_t threads)
 {
-    if (!out || !in)
-        return false;
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "verify_migration");
+    int cmd_ret = ERROR_INVALID_PARAM;
+    sev::FileView stream;
+    sev::FileView image;
+    sev::migration_stats stats;
 
-    EVP_CIPHER_CTX *ctx;
-    int len = 0;
-    bool cmd_ret = false;
+    memset(&stats, 0, sizeof(stats));
 
     do {
-        // Create and initialize the context
-        if (!(ctx = EVP_CIPHER_CTX_new()))
+        if (!stream.open(stream_file)) {
+            fprintf(stderr, "Error: could not read %s\n", stream_file.c_str());
             break;
-
-        // Initialize the encryption operation. IMPORTANT - ensure you
-        // use a key and IV size appropriate for your cipher
-        if (EVP_EncryptInit_ex(ctx, EVP_aes_128_ctr(), NULL, Key, IV) != 1)
+        }
+        if (image_file != "" && !image.open(image_file)) {
+            fprintf(stderr, "Error: could not read %s\n", image_file.c_str());
             break;
-
-        // Provide the message to be encrypted, and obtain the encrypted output
-        if (EVP_EncryptUpdate(ctx, out, &len, in, (int)length) != 1)
+        }
+        if (load_launch_keys(false) != STATUS_SUCCESS) {
+            cmd_ret = ERROR_UNSUPPORTED;
             break;
+        }
 
-        // Finalize the encryption. Further out bytes may be written at
-        // this stage
-        if (EVP_EncryptFinal_ex(ctx, out + len, &len) != 1)
+        cmd_ret = sev::migration_verify(&m_tk, stream.data(), stream.size(),
+                                        image_file != "" ? image.data() : NULL, image.size(),
+                                        threads, &stats);
+        if (cmd_ret == ERROR_INVALID_LENGTH) {
+            fprintf(stderr, "Error: %s isn't a whole number of packets\n", stream_file.c_str());
             break;
+        }
 
-        cmd_ret = true;
+        if (m_out) {
+            m_out->begin_map("verify_migration");
+            m_out->add_uint("pages", stats.pages);
+            m_out->add_uint("failed", stats.failed);
+            if (stats.failed)
+                m_out->add_uint("first_failed", stats.first_failed);
+            m_out->add_uint("threads", stats.threads);
+            m_out->add_uint("mib_per_sec", (uint64_t)(stats.gib_per_sec * 1024));
+            m_out->end_map();
+        }
+        else if (m_verbose_flag) {
+            printf("%llu of %llu page(s) verified on %u thread(s), %.2f GiB/s\n",
+                   (unsigned long long)(stats.pages - stats.failed),
+                   (unsigned long long)stats.pages, stats.threads, stats.gib_per_sec);
+        }
+        if (stats.failed)
+            fprintf(stderr, "Error: %llu page(s) failed, the first is page %llu\n",
+                            (unsigned long long)stats.failed, (unsigned long long)stats.first_failed);
     } while (0);
 
-    // Clean up
-    EVP_CIPHER_CTX_free(ctx);
-
     return cmd_ret;
 }
 
-int Command::build_session_buffer(sev_session_buf *buf, uint32_t guest_policy,
-                                  EVP_PKEY *godh_priv_key, sev_cert *pdh_pub)
+#ifdef __linux__
+static sev::AttestServer *attest_server_running = NULL;
+
+static void attest_server_signal(int)
 {
-    int cmd_ret = -1;
+    if (attest_server_running)
+        attest_server_running->stop();
+}
 
-    aes_128_key master_secret;
-    nonce_128 nonce;
-    aes_128_key kek;
-    hmac_key_128 kik;
-    iv_128 iv;
-    tek_tik wrap_tk;
-    hmac_sha_256 wrap_mac;
-    hmac_sha_256 policy_mac;
+/**
+ * validate_cert_chain, generate_launch_blob, calc_measurement and
+ * package_secret for any number of guests at once, until SIGINT/SIGTERM.
+ * See attestserver.h for the protocol
+ */
+int Command::attest_server(std::string listen, uint32_t policy,
+                           std::string digest_hex, std::string secret_file)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    sev::attest_server_config config;
+    uint8_t *secret = NULL;
+    uint8_t (*digests)[32] = NULL;
+    const size_t digest_chars = sizeof(digests[0])*2;
+    uint8_t ask_ark[sizeof(amd_cert)*2];
+    size_t ask_ark_length = 0;
+    amd_cert ask;
+    AMDCert tmp_amd;
 
-    do {
-        // Generate a random nonce
-        sev::gen_random_bytes(nonce, sizeof(nonce_128));
+    sev::attest_server_defaults(&config);
+    config.listen = listen;
+    config.policy = policy;
 
-        // Derive Master Secret
-        if (!derive_master_secret(master_secret, godh_priv_key, pdh_pub, nonce))
+    do {
+        // Any number of approved launch digests, separated by commas
+        size_t count = (digest_hex.size() + 1) / (digest_chars + 1);
+        if (count == 0 || count > sev::ATTEST_MAX_DIGESTS ||
+            digest_hex.size() != count*(digest_chars + 1) - 1) {
+            fprintf(stderr, "Error: the launch digests have to be 1 to %zu comma separated %zu hex byte digests\n",
+                            sev::ATTEST_MAX_DIGESTS, sizeof(digests[0]));
+            cmd_ret = ERROR_INVALID_PARAM;
             break;
+        }
+        digests = new uint8_t[count][32];
+        size_t i = 0;
+        for (; i < count; i++) {
+            size_t offset = i*(digest_chars + 1);
+            if ((i > 0 && digest_hex[offset - 1] != ',') ||
+                !sev::str_to_array(digest_hex.substr(offset, digest_chars), digests[i],
+                                   sizeof(digests[i])))
+                break;
+        }
+        if (i != count) {
+            fprintf(stderr, "Error: launch digest %zu isn't comma separated\n", i + 1);
+            cmd_ret = ERROR_INVALID_PARAM;
+            break;
+        }
+        config.digests = digests;
+        config.digest_count = count;
 
-        // Derive the KEK and KIK
-        if (!derive_kek(kek, master_secret))
+        config.secret_size = sev::get_file_size(secret_file);
+        if (config.secret_size < 8 || config.secret_size > sev::ATTEST_MAX_SECRET_SIZE) {
+            fprintf(stderr, "Error: SEV requires a secret of 8 to %zu bytes\n", sev::ATTEST_MAX_SECRET_SIZE);
+            cmd_ret = ERROR_INVALID_LENGTH;
             break;
-        if (!derive_kik(kik, master_secret))
+        }
+        secret = (uint8_t *)sev::secure_alloc(config.secret_size);
+        if (sev::read_file(secret_file, secret, config.secret_size) != config.secret_size)
             break;
+        config.secret = secret;
 
-        // Generate a random TEK and TIK. Combine in to TK. Wrap.
-        // Preserve TK for use in LAUNCH_MEASURE and LAUNCH_SECRET
-        sev::gen_random_bytes(m_tk.tek, sizeof(m_tk.tek));
-        sev::gen_random_bytes(m_tk.tik, sizeof(m_tk.tik));
-
-        // Create an IV and wrap the TK with KEK and IV
-        sev::gen_random_bytes(iv, sizeof(iv_128));
-        if (!encrypt((uint8_t *)&wrap_tk, (uint8_t *)&m_tk, sizeof(m_tk), kek, iv))
+        // The ASK/ARK the hosts send are only accepted if they're these
+        cmd_ret = m_sev_device->kds_get_ask_ark(ask_ark, sizeof(ask_ark), &ask_ark_length);
+        if (cmd_ret != STATUS_SUCCESS)
             break;
-
-        // Generate the HMAC for the wrap_tk
-        if (!gen_hmac(&wrap_mac, kik, (uint8_t *)&wrap_tk, sizeof(wrap_tk)))
+        cmd_ret = tmp_amd.amd_cert_init(&ask, ask_ark);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+        cmd_ret = ERROR_INVALID_CERTIFICATE;
+        config.ask = ask_ark;
+        config.ask_size = tmp_amd.amd_cert_get_size(&ask);
+        if (config.ask_size >= ask_ark_length)
             break;
+        config.ark = ask_ark + config.ask_size;
+        config.ark_size = ask_ark_length - config.ask_size;
+        cmd_ret = ERROR_UNSUPPORTED;
 
-        // Generate the HMAC for the Policy bits
-        if (!gen_hmac(&policy_mac, m_tk.tik, (uint8_t *)&guest_policy, sizeof(guest_policy)))
+        sev::AttestServer server(&config);
+        if (!server.open())
             break;
 
-        // Copy everything to the session data buffer
-        memcpy(&buf->nonce, &nonce, sizeof(buf->nonce));
-        memcpy(&buf->wrap_tk, &wrap_tk, sizeof(buf->wrap_tk));
-        memcpy(&buf->wrap_iv, &iv, sizeof(buf->wrap_iv));
-        memcpy(&buf->wrap_mac, &wrap_mac, sizeof(buf->wrap_mac));
-        memcpy(&buf->policy_mac, &policy_mac, sizeof(buf->policy_mac));
+        attest_server_running = &server;
+        signal(SIGINT, attest_server_signal);
+        signal(SIGTERM, attest_server_signal);
+        // Stdout is only for the document under --format
+        fprintf(m_out ? stderr : stdout, "Attestation server listening on %s\n", listen.c_str());
+        fflush(m_out ? stderr : stdout);
 
+        server.run();
+
+        signal(SIGINT, SIG_DFL);
+        signal(SIGTERM, SIG_DFL);
+        attest_server_running = NULL;
         cmd_ret = STATUS_SUCCESS;
     } while (0);
 
-    return cmd_ret;
-}
+    sev::secure_free(secret, config.secret_size);
+    delete[] digests;
 
-// --------------------------------------------------------------- //
-// ------------------- package_secret functions ------------------ //
-// --------------------------------------------------------------- //
-/*
- * Used in Launch_Secret to encrypt the transfer data with the TEK
- */
-int Command::encrypt_with_tek(uint8_t *encrypted_mem, const uint8_t *secret_mem,
-                              size_t secret_mem_size, const iv_128 iv)
-{
-    return encrypt(encrypted_mem, secret_mem, secret_mem_size, m_tk.tek, iv); // AES-128-CTR
+    return cmd_ret;
 }
 
-bool Command::create_launch_secret_header(sev_hdr_buf *out_header, iv_128 *iv,
-                                          uint8_t *buf, size_t buffer_len,
-                                          uint32_t hdr_flags)
+int Command::verify_snp_reports(std::string report_file, uint32_t threads)
 {
-    bool ret = false;
-
-    // Note: API <= 0.16 and older does LaunchSecret differently than Naples API >= 0.17
-    const uint8_t meas_ctx = 0x01;
-    sev_hdr_buf header;
-    uint32_t measurement_length = sizeof(header.mac);
-    const uint32_t buf_len = (uint32_t)buffer_len;
-
-    memcpy(header.iv, iv, sizeof(iv_128));
-    header.flags = hdr_flags;
-
-    // Create and initialize the context
-    HMAC_CTX *ctx;
-    if (!(ctx = HMAC_CTX_new()))
-        return ret;
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "verify_snp_reports");
+    int cmd_ret = ERROR_INVALID_LENGTH;
+    sev::FileView reports;
+    size_t count = 0;
+    int *results = NULL;
+    uint8_t ask_ark[sizeof(amd_cert)*2];
+    size_t ask_ark_length = 0;
+    amd_cert ask;
+    amd_cert ark;
+    AMDCert tmp_amd;
+    sev::SNPReportVerifier verifier(m_sev_device->backend());
+    sev::snp_verify_stats stats;
 
-    // Need platform_status to determine API version
-    uint8_t status_data[sizeof(sev_platform_status_cmd_buf)];
-    sev_platform_status_cmd_buf *status_data_buf = (sev_platform_status_cmd_buf *)&status_data;
-    int cmd_ret = -1;
+    memset(&stats, 0, sizeof(stats));
 
     do {
-        cmd_ret = m_sev_device->platform_status(status_data);
-        if (cmd_ret != STATUS_SUCCESS)
-            break;
-
-        if (HMAC_Init_ex(ctx, m_tk.tik, sizeof(m_tk.tik), EVP_sha256(), NULL) != 1)
+        // Any number of reports, back to back, checked where they are
+        if (!reports.open(report_file)) {
+            fprintf(stderr, "Error: could not read %s\n", report_file.c_str());
+            cmd_ret = ERROR_INVALID_PARAM;
             break;
-        if (HMAC_Update(ctx, &meas_ctx, sizeof(meas_ctx)) != 1)
+        }
+        if (reports.size() == 0 || reports.size() % sizeof(snp_attestation_report) != 0) {
+            fprintf(stderr, "Error: %s isn't a whole number of %zu byte reports\n",
+                            report_file.c_str(), sizeof(snp_attestation_report));
             break;
-        if (HMAC_Update(ctx, (uint8_t*)&header.flags, sizeof(header.flags)) != 1)
+        }
+        count = reports.size() / sizeof(snp_attestation_report);
+
+        // The ARK and ASK are the same for every report, so they're only
+        // fetched and validated once
+        cmd_ret = m_sev_device->kds_get_ask_ark(ask_ark, sizeof(ask_ark), &ask_ark_length);
+        if (cmd_ret != STATUS_SUCCESS)
             break;
-        if (HMAC_Update(ctx, (uint8_t*)&header.iv, sizeof(header.iv)) != 1)
+        cmd_ret = tmp_amd.amd_cert_init(&ask, ask_ark);
+        if (cmd_ret != STATUS_SUCCESS)
             break;
-        if (HMAC_Update(ctx, (uint8_t*)&buf_len, sizeof(buf_len)) != 1) // Guest Length
+        size_t ask_size = tmp_amd.amd_cert_get_size(&ask);
+        cmd_ret = ERROR_INVALID_CERTIFICATE;
+        if (ask_size >= ask_ark_length)
             break;
-        if (HMAC_Update(ctx, (uint8_t*)&buf_len, sizeof(buf_len)) != 1) // Trans Length
+        cmd_ret = tmp_amd.amd_cert_init(&ark, ask_ark + ask_size);
+        if (cmd_ret != STATUS_SUCCESS)
             break;
-        if (HMAC_Update(ctx, buf, buf_len) != 1)                        // Data
+        cmd_ret = verifier.set_amd_chain(&ask, &ark);
+        if (cmd_ret != STATUS_SUCCESS) {
+            fprintf(stderr, "Error: the ASK/ARK didn't validate\n");
             break;
-        if (status_data_buf->api_minor >= 17) {
-            if (HMAC_Update(ctx, m_measurement, sizeof(m_measurement)) != 1) // Measure
-                break;
         }
-        if (HMAC_Final(ctx, (uint8_t*)&header.mac, &measurement_length) != 1)
-            break;
 
-        memcpy(out_header, &header, sizeof(sev_hdr_buf));
-        ret = true;
-    } while (0);
+        results = new int[count];
+        cmd_ret = verifier.verify_batch((const snp_attestation_report *)reports.data(), count,
+                                        results, threads, &stats);
 
-    HMAC_CTX_free(ctx);
+        std::string results_str = "";
+        char line[32];
+        for (size_t i = 0; i < count; i++) {
+            snprintf(line, sizeof(line), "%zu %s 0x%02x\n", i,
+                     results[i] == STATUS_SUCCESS ? "ok" : "fail", (unsigned)results[i]);
+            results_str += line;
+        }
 
-    return ret;
+        if (m_out) {
+            m_out->begin_map("verify_snp_reports");
+            m_out->add_string("file", report_file.c_str());
+            m_out->add_uint("reports", stats.reports);
+            m_out->add_uint("verified", stats.verified);
+            m_out->add_uint("failed", stats.failed);
+            m_out->begin_array("failures");
+            for (size_t i = 0; i < count; i++) {
+                if (results[i] == STATUS_SUCCESS)
+                    continue;
+                m_out->begin_map();
+                m_out->add_uint("index", i);
+                m_out->add_int("error", results[i]);
+                m_out->end_map();
+            }
+            m_out->end_array();
+            m_out->add_uint("vcek_fetches", stats.vcek_fetches);
+            m_out->add_uint("reports_per_sec", (uint64_t)stats.reports_per_sec);
+            m_out->end_map();
+        }
+        else if (m_verbose_flag) {
+            printf("%s", results_str.c_str());
+            printf("%llu of %llu report(s) verified on %u thread(s), %llu VCEK fetch(es), %.0f reports/s\n",
+                   (unsigned long long)stats.verified, (unsigned long long)stats.reports,
+                   stats.threads, (unsigned long long)stats.vcek_fetches, stats.reports_per_sec);
+        }
+        if (m_output_folder != "") {
+            std::string results_path = m_output_folder+SNP_VERIFY_FILENAME;
+            sev::write_file(results_path, (void *)results_str.c_str(), results_str.size());
+        }
+    } while (0);
+
+    delete[] results;
+    return cmd_ret;
 }
+#endif
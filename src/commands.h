@@ -23,6 +23,11 @@
 #include <openssl/sha.h>    // for SHA256_DIGEST_LENGTH
 #include <string>
 
+namespace sev {
+    class FileWriteBatch;   // utilities.h
+    class Serializer;       // serializer.h
+}
+
 const std::string PDH_FILENAME          = "pdh.cert";      // PDH signed by PEK
 const std::string PDH_READABLE_FILENAME = "pdh_readable.txt";
 const std::string PEK_FILENAME          = "pek.cert";      // PEK signed by CEK
@@ -37,6 +42,7 @@ const std::string ARK_FILENAME          = "ark.cert";      // ARK self-signed
 const std::string ARK_READABLE_FILENAME = "ark_readable.cert";
 
 const std::string CERTS_ZIP_FILENAME              = "certs_export";             // export_cert_chain
+const std::string CERTS_EXPORT_DIGESTS_FILENAME   = "certs_export.digests";     // export_cert_chain
 const std::string ASK_ARK_FILENAME                = "ask_ark.cert";             // get_ask_ark
 const std::string PEK_CSR_HEX_FILENAME            = "pek_csr.cert";             // pek_csr
 const std::string PEK_CSR_READABLE_FILENAME       = "pek_csr_readable.txt";     // pek_csr
@@ -45,12 +51,19 @@ const std::string CERT_CHAIN_READABLE_FILENAME    = "cert_chain_readable.txt";
 const std::string GET_ID_S0_FILENAME              = "getid_s0_out.txt";         // get_id
 const std::string GET_ID_S1_FILENAME              = "getid_s1_out.txt";         // get_id
 const std::string CALC_MEASUREMENT_FILENAME       = "calc_measurement_out.txt"; // calc_measurement
+const std::string LAUNCH_DIGEST_FILENAME          = "launch_digest_out.txt";    // calc_launch_digest
+const std::string LAUNCH_DIGEST_CACHE_FILENAME    = "launch_digest.cache";      // calc_launch_digest
+const std::string LAUNCH_DIGEST_PAGES_FILENAME    = "launch_digest.pages";      // calc_launch_digest --snp
 const std::string LAUNCH_BLOB_FILENAME            = "launch_blob.bin";          // generate_launch_blob
 const std::string GUEST_OWNER_DH_FILENAME         = "godh.cert";                // generate_launch_blob
 const std::string GUEST_TK_FILENAME               = "tmp_tk.bin";               // generate_launch_blob
 const std::string SECRET_FILENAME                 = "secret.txt";               // package_secret
 const std::string PACKAGED_SECRET_FILENAME        = "packaged_secret.bin";      // package_secret
 const std::string PACKAGED_SECRET_HEADER_FILENAME = "packaged_secret_header.bin"; // package_secret
+const std::string PACKAGED_SECRETS_FILENAME       = "packaged_secrets.bin";     // package_secret_fanout
+const std::string PACKAGED_SECRET_HEADERS_FILENAME = "packaged_secret_headers.bin"; // package_secret_fanout
+const std::string MIGRATION_STREAM_FILENAME       = "migration_stream.bin";     // package_migration
+const std::string SNP_VERIFY_FILENAME             = "snp_verify_out.txt";       // verify_snp_reports
 
 constexpr uint32_t BITS_PER_BYTE    = 8;
 constexpr uint32_t NIST_KDF_H_BYTES = 32;
@@ -63,6 +76,26 @@ constexpr uint8_t SEV_KIK_LABEL[]           = "sev-kik";
 
 constexpr auto LAUNCH_MEASURE_CTX           = 0x4;
 
+// export_cert_chain: the exported certs and zip already match the platform,
+// so nothing was written
+constexpr int STATUS_NO_CHANGE              = 0x1000;
+
+// The certs export_cert_chain writes, in the order they go in the zip
+enum cert_export_member {
+    EXPORT_PDH = 0,
+    EXPORT_PEK,
+    EXPORT_OCA,
+    EXPORT_CEK,
+    EXPORT_ASK,
+    EXPORT_ARK,
+    EXPORT_MEMBER_COUNT,
+};
+
+// SHA256 of each cert, as of the last export_cert_chain
+struct cert_export_digests {
+    uint8_t digest[EXPORT_MEMBER_COUNT][SHA256_DIGEST_LENGTH];
+};
+
 struct measurement_t {
     uint8_t  meas_ctx;  // LAUNCH_MEASURE_CTX
     uint8_t  api_major;
@@ -77,40 +110,25 @@ struct measurement_t {
 class Command {
 private:
     SEVDevice *m_sev_device;
-    tek_tik m_tk;                   // Unencrypted TIK/TEK. wrap_tk is this enc with KEK
+    tek_tik &m_tk;                  // Unencrypted TIK/TEK, in the secure arena. wrap_tk is this enc with KEK
     hmac_sha_256 m_measurement;     // Measurement. Used in LaunchSecret header HMAC
     std::string m_output_folder = "";
     int m_verbose_flag = 0;
+    sev::Serializer *m_out = NULL;  // --format json/cbor. Replaces the printf output
 
     int calculate_measurement(measurement_t *user_data, hmac_sha_256 *final_meas);
-    int generate_all_certs(void);
+    int write_ask_ark_certs(sev::FileWriteBatch *batch);
     int import_all_certs(sev_cert *pdh, sev_cert *pek, sev_cert *oca,
                          sev_cert *cek, amd_cert *ask, amd_cert *ark);
-    bool kdf(uint8_t *key_out, size_t key_out_length, const uint8_t *key_in,
-             size_t key_in_length, const uint8_t *label, size_t label_length,
-             const uint8_t *context, size_t context_length);
-    uint8_t* calculate_shared_secret(EVP_PKEY *priv_key, EVP_PKEY *peer_key,
-                                     size_t& shared_key_len_out);
-    bool derive_master_secret(aes_128_key master_secret,
-                              EVP_PKEY *godh_priv_key,
-                              const sev_cert *pdh_public,
-                              const uint8_t nonce[sizeof(nonce_128)]);
-    bool derive_kek(aes_128_key kek, const aes_128_key master_secret);
-    bool derive_kik(hmac_key_128 kik, const aes_128_key master_secret);
-    bool gen_hmac(hmac_sha_256 *out, hmac_key_128 key, uint8_t *msg, size_t msg_len);
-    bool encrypt(uint8_t *out, const uint8_t *in, size_t length,
-                 const aes_128_key Key, const uint8_t IV[128/8]);
-    int build_session_buffer(sev_session_buf *buf, uint32_t guest_policy,
-                             EVP_PKEY *godh_priv_key, sev_cert *pdh_pub);
-    int encrypt_with_tek(uint8_t *encrypted_mem, const uint8_t *secret_mem,
-                         size_t secret_mem_size, const iv_128 iv);
-    bool create_launch_secret_header(sev_hdr_buf *out_header, iv_128 *iv,
-                                     uint8_t *buf, size_t buffer_len,
-                                     uint32_t hdr_flags);
+    int load_launch_keys(bool measurement = true);
+
+    Command(const Command&) = delete;
+    Command& operator=(const Command&) = delete;
 
 public:
     Command();
-    Command(std::string output_folder, int verbose_flag);
+    Command(std::string output_folder, int verbose_flag,
+            sev::Serializer *out = NULL);
     ~Command();
 
     int factory_reset(void);
@@ -130,11 +148,25 @@ public:
     int set_externally_owned(std::string oca_priv_key_file);
     int generate_cek_ask(void);
     int get_ask_ark(void);
-    int export_cert_chain(void);
+    int generate_all_certs(void);      // export_cert_chain without the zip
+    int export_cert_chain(void);       // STATUS_NO_CHANGE if nothing changed
     int calc_measurement(measurement_t *user_data);
+    int calc_launch_digest(std::string ovmf_file, std::string kernel_file,
+                           std::string initrd_file, std::string cmdline,
+                           uint32_t min_vcpus = 0, uint32_t max_vcpus = 0,
+                           uint32_t vcpu_sig = 0, bool snp = false);
     int validate_cert_chain(void);
     int generate_launch_blob(uint32_t policy);
     int package_secret(void);
+    int package_secret_table(std::string secrets);
+    int package_secret_fanout(std::string session_file, uint32_t threads = 0);
+    int package_migration(std::string image_file, uint64_t gpa = 0, uint32_t threads = 0);
+    int verify_migration(std::string stream_file, std::string image_file, uint32_t threads = 0);
+#ifdef __linux__
+    int attest_server(std::string listen, uint32_t policy,
+                      std::string digest_hex, std::string secret_file);
+    int verify_snp_reports(std::string report_file, uint32_t threads = 0);
+#endif
 };
 
 #endif /* COMMANDS_H */
@@ -15,6 +15,7 @@
  **************************************************************************/
 
 #include "crypto.h"
+#include "securemem.h"
 #include "sevcert.h"
 
 #include <fstream>
@@ -36,7 +37,7 @@ bool kdf(uint8_t *key_out,       size_t key_out_length,
     bool ret_val = false;
     uint8_t null_byte = '\0';
     unsigned int out_len = 0;
-    uint8_t prf_out[NIST_KDF_H_BYTES];      // Buffer to collect PRF output
+    sev::Secure<uint8_t[NIST_KDF_H_BYTES]> prf_out;    // Buffer to collect PRF output
 
     // Length in bits of derived key
     uint32_t l = (uint32_t)(key_out_length * BITS_PER_BYTE);
@@ -72,15 +73,15 @@ bool kdf(uint8_t *key_out,       size_t key_out_length,
         }
         if (HMAC_Update(ctx, (uint8_t*)&l, sizeof(l)) != 1)
             break;
-        if (HMAC_Final(ctx, prf_out, &out_len) != 1)
+        if (HMAC_Final(ctx, *prf_out, &out_len) != 1)
             break;
 
         // Write out the key bytes
         if (BytesLeft <= NIST_KDF_H_BYTES) {
-            memcpy(key_out + offset, prf_out, BytesLeft);
+            memcpy(key_out + offset, *prf_out, BytesLeft);
         }
         else {
-            memcpy(key_out + offset, prf_out, NIST_KDF_H_BYTES);
+            memcpy(key_out + offset, *prf_out, NIST_KDF_H_BYTES);
             offset    += NIST_KDF_H_BYTES;
             BytesLeft -= NIST_KDF_H_BYTES;
         }
@@ -94,9 +95,9 @@ bool kdf(uint8_t *key_out,       size_t key_out_length,
 }
 
 /**
- * Note that this function NEWs/allocates memory for a
- * uint8_t array using OPENSSL_malloc that must be freed
- * in the calling function using OPENSSL_FREE()
+ * Note that this function allocates the uint8_t array from the
+ * secure arena, and it must be freed in the calling function using
+ * sev::secure_free(shared_key, shared_key_len_out)
  */
 uint8_t* calculate_shared_secret(EVP_PKEY *priv_key, EVP_PKEY *peer_key,
                                  size_t& shared_key_len_out)
@@ -123,10 +124,8 @@ uint8_t* calculate_shared_secret(EVP_PKEY *priv_key, EVP_PKEY *peer_key,
         if (EVP_PKEY_derive(ctx, NULL, &shared_key_len_out) <= 0)
             break;
 
-        // Need to free shared_key using OPENSSL_FREE() in the calling function
-        shared_key = (unsigned char*)OPENSSL_malloc(shared_key_len_out);
-        if (!shared_key)
-            break;      // malloc failure
+        // Need to free shared_key using sev::secure_free() in the calling function
+        shared_key = (uint8_t *)sev::secure_alloc(shared_key_len_out);
 
         // Compute the shared secret with the ECDH key material.
         if (EVP_PKEY_derive(ctx, shared_key, &shared_key_len_out) <= 0)
@@ -136,8 +135,12 @@ uint8_t* calculate_shared_secret(EVP_PKEY *priv_key, EVP_PKEY *peer_key,
     } while (0);
 
     EVP_PKEY_CTX_free(ctx);
+    if (!success && shared_key) {
+        sev::secure_free(shared_key, shared_key_len_out);
+        shared_key = NULL;
+    }
 
-    return success ? shared_key : NULL;
+    return shared_key;
 }
 
 /**
@@ -185,15 +188,12 @@ bool derive_master_secret(aes_128_key master_secret,
             break;
 
         // Derive the master secret from the intermediate secret
-        if (!kdf((unsigned char*)master_secret, sizeof(aes_128_key), shared_key,
-            shared_key_len, (uint8_t*)SEV_MASTER_SECRET_LABEL,
-            sizeof(SEV_MASTER_SECRET_LABEL)-1, nonce, sizeof(nonce_128))) // sizeof(nonce), bad?
-            break;
-
-        // Free memory allocated in calculate_shared_secret
-        OPENSSL_free(shared_key);    // Local variable
+        ret = kdf((unsigned char*)master_secret, sizeof(aes_128_key), shared_key,
+                  shared_key_len, (uint8_t*)SEV_MASTER_SECRET_LABEL,
+                  sizeof(SEV_MASTER_SECRET_LABEL)-1, nonce, sizeof(nonce_128)); // sizeof(nonce), bad?
 
-        ret = true;
+        // Wipe and free the memory allocated in calculate_shared_secret
+        sev::secure_free(shared_key, shared_key_len);
     } while (0);
 
     EVP_PKEY_free(plat_owner_pub_key);
@@ -268,6 +268,117 @@ bool encrypt(uint8_t *out, const uint8_t *in, size_t length,
     return ret_val;
 }
 
+/*
+ * The LAUNCH_START session buffer. A random TEK and TIK go to tk, and are
+ * wrapped into buf with the KEK/KIK from godh_priv_key and pdh_pub
+ */
+int build_session_buffer(sev_session_buf *buf, tek_tik *tk, uint32_t guest_policy,
+                         EVP_PKEY *godh_priv_key, const sev_cert *pdh_pub)
+{
+    int cmd_ret = -1;
+    sev::Secure<aes_128_key> master_secret;
+    nonce_128 nonce;
+    sev::Secure<aes_128_key> kek;
+    sev::Secure<hmac_key_128> kik;
+    iv_128 iv;
+    tek_tik wrap_tk;
+    hmac_sha_256 wrap_mac;
+    hmac_sha_256 policy_mac;
+
+    if (!buf || !tk || !godh_priv_key || !pdh_pub)
+        return ERROR_INVALID_PARAM;
+
+    do {
+        // Generate a random nonce
+        if (!sev::gen_random_bytes(nonce, sizeof(nonce_128)))
+            break;
+
+        // Derive Master Secret
+        if (!derive_master_secret(*master_secret, godh_priv_key, pdh_pub, nonce))
+            break;
+
+        // Derive the KEK and KIK
+        if (!derive_kek(*kek, *master_secret))
+            break;
+        if (!derive_kik(*kik, *master_secret))
+            break;
+
+        // Generate a random TEK and TIK. Combine in to TK. Wrap.
+        // The caller keeps TK for LAUNCH_MEASURE and LAUNCH_SECRET
+        if (!sev::gen_random_bytes(tk, sizeof(tek_tik)))
+            break;
+
+        // Create an IV and wrap the TK with KEK and IV
+        if (!sev::gen_random_bytes(iv, sizeof(iv_128)))
+            break;
+        if (!encrypt((uint8_t *)&wrap_tk, (uint8_t *)tk, sizeof(tek_tik), *kek, iv))
+            break;
+
+        // Generate the HMAC for the wrap_tk
+        if (!gen_hmac(&wrap_mac, *kik, (uint8_t *)&wrap_tk, sizeof(wrap_tk)))
+            break;
+
+        // Generate the HMAC for the Policy bits
+        if (!gen_hmac(&policy_mac, tk->tik, (uint8_t *)&guest_policy, sizeof(guest_policy)))
+            break;
+
+        // Copy everything to the session data buffer
+        memcpy(&buf->nonce, &nonce, sizeof(buf->nonce));
+        memcpy(&buf->wrap_tk, &wrap_tk, sizeof(buf->wrap_tk));
+        memcpy(&buf->wrap_iv, &iv, sizeof(buf->wrap_iv));
+        memcpy(&buf->wrap_mac, &wrap_mac, sizeof(buf->wrap_mac));
+        memcpy(&buf->policy_mac, &policy_mac, sizeof(buf->policy_mac));
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+bool calc_launch_measurement(hmac_sha_256 *out, const aes_128_key tik, uint8_t meas_ctx,
+                             uint8_t api_major, uint8_t api_minor, uint8_t build_id,
+                             uint32_t policy, const uint8_t digest[32],
+                             const nonce_128 mnonce, bool versioned)
+{
+    bool ret = false;
+    unsigned int measurement_length = sizeof(hmac_sha_256);
+    HMAC_CTX *ctx;
+
+    if (!out || !tik || !digest || !mnonce)
+        return ret;
+    if (!(ctx = HMAC_CTX_new()))
+        return ret;
+
+    do {
+        if (HMAC_Init_ex(ctx, tik, sizeof(aes_128_key), EVP_sha256(), NULL) != 1)
+            break;
+        if (versioned) {
+            if (HMAC_Update(ctx, &meas_ctx, sizeof(meas_ctx)) != 1)
+                break;
+            if (HMAC_Update(ctx, &api_major, sizeof(api_major)) != 1)
+                break;
+            if (HMAC_Update(ctx, &api_minor, sizeof(api_minor)) != 1)
+                break;
+            if (HMAC_Update(ctx, &build_id, sizeof(build_id)) != 1)
+                break;
+        }
+        if (HMAC_Update(ctx, (const uint8_t *)&policy, sizeof(policy)) != 1)
+            break;
+        if (HMAC_Update(ctx, digest, 32) != 1)
+            break;
+        // The same MNonce the FW used
+        if (HMAC_Update(ctx, mnonce, sizeof(nonce_128)) != 1)
+            break;
+        if (HMAC_Final(ctx, (uint8_t *)out, &measurement_length) != 1)
+            break;
+
+        ret = true;
+    } while (0);
+
+    HMAC_CTX_free(ctx);
+    return ret;
+}
+
 /**
  * Description:   Generates a new P-384 key pair
  * Typical Usage: Used to create a new Guest Owner DH
@@ -375,7 +486,7 @@ static bool rsa_sign(sev_sig *sig, EVP_PKEY **priv_evp_key,
     uint32_t sig_len = sizeof(sev_sig);
 
     do {
-        printf("Error: RSA signing untested!");
+        fprintf(stderr, "Error: RSA signing untested!");
         // This code probably does not work!
 
         // Allocates a new RSA private key which is freed at the bottom of this function
@@ -406,7 +517,7 @@ bool rsa_verify(/*sev_sig *sig, EVP_PKEY **pub_evp_key,
     bool is_valid = false;
 
     do {
-        printf("Error: RSA verification untested!");
+        fprintf(stderr, "Error: RSA verification untested!");
         // This code probably does not work!
 
         is_valid = true;
@@ -552,11 +663,11 @@ static bool sign_verify_message(sev_sig *sig, EVP_PKEY **evp_key_pair, const uin
                 break;
         }
         else if ((algo == SEV_SIG_ALGO_ECDH_SHA256) || (algo == SEV_SIG_ALGO_ECDH_SHA384)) {
-            printf("Error: ECDH signing unsupported");
+            fprintf(stderr, "Error: ECDH signing unsupported");
             break;                       // Error unsupported
         }
         else {
-            printf("Error: invalid signing algo. Can't sign");
+            fprintf(stderr, "Error: invalid signing algo. Can't sign");
             break;                          // Invalid params
         }
 
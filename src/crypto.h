@@ -97,6 +97,18 @@ bool gen_hmac(hmac_sha_256 *out, hmac_key_128 key, uint8_t *msg, size_t msg_len)
 bool encrypt(uint8_t *out, const uint8_t *in, size_t length,
              const aes_128_key key, const uint8_t iv[128/8]);
 
+// The LAUNCH_START session buffer, with a new random TK that goes to tk
+int build_session_buffer(sev_session_buf *buf, tek_tik *tk, uint32_t guest_policy,
+                         EVP_PKEY *godh_priv_key, const sev_cert *pdh_pub);
+
+// The LAUNCH_MEASURE measurement:
+//   HMAC(TIK, [meas_ctx | api_major | api_minor | build_id |] policy | digest | mnonce)
+// The bracketed part is only there if versioned, which is from API 0.17 on
+bool calc_launch_measurement(hmac_sha_256 *out, const aes_128_key tik, uint8_t meas_ctx,
+                             uint8_t api_major, uint8_t api_minor, uint8_t build_id,
+                             uint32_t policy, const uint8_t digest[32],
+                             const nonce_128 mnonce, bool versioned);
+
 bool generate_ecdh_key_pair(EVP_PKEY **evp_key_pair);
 
 bool digest_sha(const void *msg, size_t msg_len, uint8_t *digest,
@@ -0,0 +1,208 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "csprng.h"
+#include <atomic>
+#include <cerrno>
+#include <climits>              // for INT_MAX
+#include <cstring>
+#include <mutex>
+#include <openssl/crypto.h>     // for OPENSSL_cleanse
+#include <openssl/evp.h>
+#include <openssl/rand.h>
+#ifdef __linux__
+#include <pthread.h>            // for pthread_atfork
+#include <sys/random.h>         // for getrandom
+#endif
+
+namespace {
+struct csprng_state {
+    EVP_CIPHER_CTX *ctx;
+    uint8_t block[sev::CSPRNG_BLOCK_SIZE];
+    size_t available;           // Unserved bytes, at the end of block
+    uint64_t since_seed;
+    uint64_t fork_count;        // When it was seeded
+    bool seeded;
+    sev::csprng_stats stats;
+
+    csprng_state(void) : ctx(NULL), available(0), since_seed(0), fork_count(0), seeded(false)
+    {
+        memset(&stats, 0, sizeof(stats));
+    }
+    ~csprng_state()
+    {
+        EVP_CIPHER_CTX_free(ctx);
+        OPENSSL_cleanse(block, sizeof(block));
+    }
+};
+
+thread_local csprng_state tls_state;
+
+// Bumped in the child of every fork, so each thread's state knows it's
+// been copied without a getpid() per call
+std::atomic<uint64_t> fork_count(0);
+std::once_flag atfork_once;
+}
+
+static void csprng_forked(void)
+{
+    fork_count++;
+}
+
+static bool os_random(uint8_t *bytes, size_t size)
+{
+#ifdef __linux__
+    while (size > 0) {
+        ssize_t got = getrandom(bytes, size, 0);
+        if (got < 0) {
+            if (errno == EINTR)
+                continue;
+            return RAND_bytes(bytes, (int)size) == 1;   // No getrandom syscall
+        }
+        bytes += got;
+        size -= (size_t)got;
+    }
+    return true;
+#else
+    return RAND_bytes(bytes, (int)size) == 1;
+#endif
+}
+
+// size bytes of keystream into out. The cipher runs over zeros in place
+static bool keystream(csprng_state *state, uint8_t *out, size_t size)
+{
+    while (size > 0) {
+        size_t chunk = size < (size_t)INT_MAX / 2 ? size : (size_t)INT_MAX / 2;
+        int len = 0;
+        memset(out, 0, chunk);
+        if (EVP_EncryptUpdate(state->ctx, out, &len, out, (int)chunk) != 1 || (size_t)len != chunk)
+            return false;
+        out += chunk;
+        size -= chunk;
+    }
+    return true;
+}
+
+static bool rekey(csprng_state *state, const uint8_t *key)
+{
+    return EVP_EncryptInit_ex(state->ctx, EVP_aes_256_ctr(), NULL, key, key + 32) == 1;
+}
+
+// The key for the next keystream, from this one, which it then replaces
+static bool next_key(csprng_state *state)
+{
+    uint8_t key[sev::CSPRNG_KEY_SIZE];
+    bool ok = keystream(state, key, sizeof(key)) && rekey(state, key);
+    OPENSSL_cleanse(key, sizeof(key));
+    return ok;
+}
+
+static bool reseed(csprng_state *state)
+{
+    uint8_t seed[sev::CSPRNG_KEY_SIZE];
+    bool ok = false;
+
+    do {
+        if (!state->ctx && !(state->ctx = EVP_CIPHER_CTX_new()))
+            break;
+        uint64_t forks = fork_count;
+        if (!os_random(seed, sizeof(seed)) || !rekey(state, seed))
+            break;
+
+        // Whatever's left came from the old key
+        OPENSSL_cleanse(state->block, sizeof(state->block));
+        state->available = 0;
+        state->since_seed = 0;
+        state->fork_count = forks;
+        state->seeded = true;
+        state->stats.reseeds++;
+        ok = true;
+    } while (0);
+
+    OPENSSL_cleanse(seed, sizeof(seed));
+    return ok;
+}
+
+// A new block, the first bytes of which become the next key
+static bool refill(csprng_state *state)
+{
+    if (!keystream(state, state->block, sizeof(state->block)) ||
+        !rekey(state, state->block))
+        return false;
+    OPENSSL_cleanse(state->block, sev::CSPRNG_KEY_SIZE);
+    state->available = sizeof(state->block) - sev::CSPRNG_KEY_SIZE;
+    state->stats.refills++;
+    return true;
+}
+
+bool sev::random_bytes(void *bytes, size_t num_bytes)
+{
+    csprng_state *state = &tls_state;
+    uint8_t *out = (uint8_t *)bytes;
+    size_t left = num_bytes;
+    bool ok = false;
+
+#ifdef __linux__
+    std::call_once(atfork_once, []() { pthread_atfork(NULL, NULL, csprng_forked); });
+#endif
+
+    do {
+        if (!state->seeded || state->fork_count != fork_count ||
+            state->since_seed >= CSPRNG_RESEED_BYTES) {
+            if (!reseed(state))
+                break;
+        }
+
+        // A batch goes straight to the caller, then the key moves on
+        if (left >= CSPRNG_BLOCK_SIZE) {
+            if (!keystream(state, out, left) || !next_key(state))
+                break;
+            left = 0;
+        }
+
+        bool failed = false;
+        while (left > 0) {
+            if (state->available == 0 && !refill(state)) {
+                failed = true;
+                break;
+            }
+            uint8_t *from = state->block + sizeof(state->block) - state->available;
+            size_t size = left < state->available ? left : state->available;
+            memcpy(out + (num_bytes - left), from, size);
+            OPENSSL_cleanse(from, size);
+            state->available -= size;
+            left -= size;
+        }
+        if (failed)
+            break;
+
+        state->since_seed += num_bytes;
+        state->stats.bytes += num_bytes;
+        ok = true;
+    } while (0);
+
+    if (!ok) {
+        // Don't leave a half-filled buffer looking random
+        OPENSSL_cleanse(bytes, num_bytes);
+        state->seeded = false;
+    }
+    return ok;
+}
+
+void sev::csprng_get_stats(csprng_stats *stats)
+{
+    *stats = tls_state.stats;
+}
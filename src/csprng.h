@@ -0,0 +1,57 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef CSPRNG_H
+#define CSPRNG_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sev
+{
+    constexpr size_t   CSPRNG_BLOCK_SIZE   = 4096;          // Generated at a time, then served from
+    constexpr size_t   CSPRNG_KEY_SIZE     = 32 + 16;       // AES-256-CTR key and counter
+    constexpr uint64_t CSPRNG_RESEED_BYTES = 16*1024*1024;  // From the OS, after this many
+
+    struct csprng_stats {
+        uint64_t bytes;             // Served
+        uint64_t refills;           // Of the block
+        uint64_t reseeds;           // From the OS, including the first seed
+    };
+
+    /**
+     * Random bytes from a per-thread generator: AES-256-CTR keystream, a
+     * block at a time, seeded from getrandom() (RAND_bytes off Linux). Small
+     * requests (IVs, nonces, keys) are a copy out of the block, not a
+     * syscall. Requests of a block or more are generated straight into
+     * bytes, so a batch (every IV of a fan-out, say) should be one call.
+     *
+     * The key is replaced with the first bytes of each new keystream, and
+     * bytes are wiped from the block as they're served, so nothing that was
+     * handed out can be worked out from the state afterwards. It's reseeded
+     * from the OS every CSPRNG_RESEED_BYTES, and in a forked child before
+     * its first use, so parent and child never share output.
+     *
+     * False only if the OS wouldn't give a seed, in which case bytes is
+     * zeroed and mustn't be used.
+     */
+    bool random_bytes(void *bytes, size_t num_bytes);
+
+    // This thread's, since it started
+    void csprng_get_stats(csprng_stats *stats);
+}
+
+#endif /* CSPRNG_H */
@@ -0,0 +1,1073 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "launchdigest.h"
+#include "metrics.h"            // for Metrics::now_ns
+#include "sevapi.h"             // for SEV_ERROR_CODE
+#include <algorithm>            // for std::min
+#include <atomic>
+#include <climits>              // for PATH_MAX
+#include <cstring>
+#include <openssl/crypto.h>     // for CRYPTO_memcmp
+#include <stdlib.h>             // for realpath
+#include <sys/mman.h>           // for madvise
+#include <thread>
+
+const uint8_t sev::OVMF_TABLE_FOOTER_GUID[16] = {
+    0xde, 0x82, 0xb5, 0x96, 0xb2, 0x1f, 0xf7, 0x45, 0xba, 0xea, 0xa3, 0x66, 0xc5, 0x5a, 0x08, 0x2d};
+const uint8_t sev::SEV_HASH_TABLE_RV_GUID[16] = {
+    0x1f, 0x37, 0x55, 0x72, 0x3b, 0x3a, 0x04, 0x4b, 0x92, 0x7b, 0x1d, 0xa6, 0xef, 0xa8, 0xd4, 0x54};
+const uint8_t sev::SEV_HASH_TABLE_GUID[16] = {
+    0x06, 0xd6, 0x38, 0x94, 0x22, 0x4f, 0xc9, 0x4c, 0xb4, 0x79, 0xa7, 0x93, 0xd4, 0x11, 0xfd, 0x21};
+const uint8_t sev::SEV_KERNEL_ENTRY_GUID[16] = {
+    0x37, 0x94, 0xe7, 0x4d, 0xd2, 0xab, 0x7f, 0x42, 0xb8, 0x35, 0xd5, 0xb1, 0x72, 0xd2, 0x04, 0x5b};
+const uint8_t sev::SEV_INITRD_ENTRY_GUID[16] = {
+    0x31, 0xf7, 0xba, 0x44, 0x2f, 0x3a, 0xd7, 0x4b, 0x9a, 0xf1, 0x41, 0xe2, 0x91, 0x69, 0x78, 0x1d};
+const uint8_t sev::SEV_CMDLINE_ENTRY_GUID[16] = {
+    0xd8, 0x2d, 0xd0, 0x97, 0x20, 0xbd, 0x94, 0x4c, 0xaa, 0x78, 0xe7, 0x71, 0x4d, 0x36, 0xab, 0x2a};
+const uint8_t sev::SEV_ES_RESET_BLOCK_GUID[16] = {
+    0xde, 0x71, 0xf7, 0x00, 0x7e, 0x1a, 0xcb, 0x4f, 0x89, 0x0e, 0x68, 0xc7, 0x7e, 0x2f, 0xb4, 0x4e};
+const uint8_t sev::SEV_METADATA_GUID[16] = {
+    0x66, 0x65, 0x88, 0xdc, 0x4a, 0x98, 0x98, 0x47, 0xa7, 0x5e, 0x55, 0x85, 0xa7, 0xbf, 0x67, 0xcc};
+
+static_assert(sizeof(sev::sev_hash_table) % 16 == 0, "hashes table isn't padded");
+static_assert(sizeof(sev::snp_page_info) == 0x70, "PAGE_INFO isn't 0x70 bytes");
+
+// The footer table ends this far before the end of the image, and each
+// entry ends with its length and GUID
+static constexpr size_t OVMF_FOOTER_OFFSET = 32;
+static constexpr size_t OVMF_ENTRY_HEADER  = sizeof(uint16_t) + 16;
+
+static constexpr size_t LAUNCH_MAX_JOBS    = 3;     // The OVMF image, kernel and initrd
+
+struct launch_cache_entry {
+    char     path[sev::LAUNCH_CACHE_PATH_SIZE];    // Empty if the entry is free
+    sev::file_identity id;
+    uint8_t  sha256[SHA256_DIGEST_LENGTH];          // Of the contents
+    SHA256_CTX state;                               // Before SHA256_Final
+    uint64_t last_used;
+};
+
+struct sev::launch_cache_file {
+    uint32_t magic;
+    uint32_t version;
+    uint32_t state_size;                            // sizeof(SHA256_CTX), as a check
+    uint32_t reserved;
+    uint64_t clock;
+    launch_cache_entry entries[LAUNCH_CACHE_ENTRIES];
+};
+
+bool sev::ovmf_table_find(const uint8_t *image, size_t size, const uint8_t *guid,
+                          const uint8_t **data, size_t *length)
+{
+    uint16_t entry_size;
+
+    if (!image || size < OVMF_FOOTER_OFFSET + OVMF_ENTRY_HEADER)
+        return false;
+
+    // The footer is an entry whose data is all the other entries
+    size_t footer = size - OVMF_FOOTER_OFFSET - OVMF_ENTRY_HEADER;
+    if (memcmp(image + footer + sizeof(uint16_t), OVMF_TABLE_FOOTER_GUID, 16) != 0)
+        return false;
+    memcpy(&entry_size, image + footer, sizeof(entry_size));
+    if (entry_size < OVMF_ENTRY_HEADER || entry_size - OVMF_ENTRY_HEADER > footer)
+        return false;
+
+    // Walked from the end back
+    size_t start = footer - (entry_size - OVMF_ENTRY_HEADER);
+    size_t end = footer;
+    while (end - start >= OVMF_ENTRY_HEADER) {
+        const uint8_t *header = image + end - OVMF_ENTRY_HEADER;
+        memcpy(&entry_size, header, sizeof(entry_size));
+        if (entry_size < OVMF_ENTRY_HEADER || entry_size > end - start)
+            return false;
+        if (memcmp(header + sizeof(uint16_t), guid, 16) == 0) {
+            *data = image + end - entry_size;
+            *length = entry_size - OVMF_ENTRY_HEADER;
+            return true;
+        }
+        end -= entry_size;
+    }
+    return false;
+}
+
+sev::LaunchDigestCache::LaunchDigestCache()
+                      : m_file(new launch_cache_file),
+                        m_clock(0),
+                        m_dirty(false)
+{
+    clear();
+}
+
+sev::LaunchDigestCache::~LaunchDigestCache()
+{
+    delete m_file;
+}
+
+void sev::LaunchDigestCache::clear(void)
+{
+    memset(m_file, 0, sizeof(*m_file));
+    m_file->magic = LAUNCH_CACHE_MAGIC;
+    m_file->version = LAUNCH_CACHE_VERSION;
+    m_file->state_size = sizeof(SHA256_CTX);
+    m_clock = 0;
+}
+
+void sev::LaunchDigestCache::load(const std::string file_name)
+{
+    FileView view;
+
+    clear();
+    if (get_file_size(file_name) != sizeof(*m_file) || !view.open(file_name))
+        return;
+    memcpy(m_file, view.data(), sizeof(*m_file));
+    if (m_file->magic != LAUNCH_CACHE_MAGIC || m_file->version != LAUNCH_CACHE_VERSION ||
+        m_file->state_size != sizeof(SHA256_CTX)) {
+        clear();
+        return;
+    }
+    m_clock = m_file->clock;
+    for (size_t i = 0; i < LAUNCH_CACHE_ENTRIES; i++)
+        m_file->entries[i].path[LAUNCH_CACHE_PATH_SIZE - 1] = '\0';
+}
+
+bool sev::LaunchDigestCache::save(const std::string file_name)
+{
+    FileWriteBatch batch;
+
+    if (!m_dirty)
+        return true;
+    m_file->clock = m_clock;
+    if (!batch.add(file_name, m_file, sizeof(*m_file)) || !batch.commit())
+        return false;
+    m_dirty = false;
+    return true;
+}
+
+struct sev::launch_manifest_header {
+    uint32_t magic;
+    uint32_t version;
+    uint64_t image_size;                            // A whole number of pages
+    uint8_t  checksum[SHA256_DIGEST_LENGTH];        // Of the rest of the header and the hashes
+    // Then the SHA-384 of each page, then the image
+};
+
+// Where each part of a manifest is, and how big the whole is
+static size_t manifest_hashes_size(const sev::launch_manifest_header *header)
+{
+    return (size_t)(header->image_size / PAGE_SIZE_4K) * sev::SNP_DIGEST_SIZE;
+}
+
+static size_t manifest_size(const sev::launch_manifest_header *header)
+{
+    return sizeof(*header) + manifest_hashes_size(header) + (size_t)header->image_size;
+}
+
+static bool manifest_checksum(const sev::launch_manifest_header *header, uint8_t *checksum)
+{
+    SHA256_CTX ctx;
+    return SHA256_Init(&ctx) == 1 &&
+           SHA256_Update(&ctx, header, offsetof(sev::launch_manifest_header, checksum)) == 1 &&
+           SHA256_Update(&ctx, header + 1, manifest_hashes_size(header)) == 1 &&
+           SHA256_Final(checksum, &ctx) == 1;
+}
+
+sev::LaunchPageManifest::LaunchPageManifest()
+                       : m_data(NULL),
+                         m_header(NULL),
+                         m_dirty(false)
+{
+}
+
+sev::LaunchPageManifest::~LaunchPageManifest()
+{
+    clear();
+}
+
+void sev::LaunchPageManifest::clear(void)
+{
+    m_view.close();
+    delete[] m_data;
+    m_data = NULL;
+    m_header = NULL;
+    m_dirty = false;
+}
+
+void sev::LaunchPageManifest::load(const std::string file_name)
+{
+    launch_manifest_header header;
+    uint8_t checksum[SHA256_DIGEST_LENGTH];
+
+    clear();
+    if (!m_view.open(file_name) || m_view.size() < sizeof(header))
+        return;
+    memcpy(&header, m_view.data(), sizeof(header));
+    if (header.magic != LAUNCH_MANIFEST_MAGIC || header.version != LAUNCH_MANIFEST_VERSION ||
+        header.image_size == 0 || header.image_size % PAGE_SIZE_4K != 0 ||
+        header.image_size > m_view.size() || manifest_size(&header) != m_view.size()) {
+        m_view.close();
+        return;
+    }
+
+    // The hashes are what's trusted. A damaged image copy only means
+    // pages that don't match it get hashed again
+    const launch_manifest_header *mapped = (const launch_manifest_header *)m_view.data();
+    if (!manifest_checksum(mapped, checksum) ||
+        CRYPTO_memcmp(checksum, header.checksum, sizeof(checksum)) != 0) {
+        m_view.close();
+        return;
+    }
+    m_header = mapped;
+}
+
+bool sev::LaunchPageManifest::save(const std::string file_name)
+{
+    FileWriteBatch batch;
+
+    if (!m_dirty)
+        return true;
+    if (!batch.add(file_name, m_data, manifest_size(m_header)) || !batch.commit())
+        return false;
+    m_dirty = false;
+    return true;
+}
+
+const uint8_t *sev::LaunchPageManifest::image(void) const
+{
+    if (!m_header)
+        return NULL;
+    return (const uint8_t *)(m_header + 1) + manifest_hashes_size(m_header);
+}
+
+size_t sev::LaunchPageManifest::size(void) const
+{
+    return m_header ? (size_t)m_header->image_size : 0;
+}
+
+const uint8_t (*sev::LaunchPageManifest::hashes(void) const)[sev::SNP_DIGEST_SIZE]
+{
+    if (!m_header)
+        return NULL;
+    return (const uint8_t (*)[SNP_DIGEST_SIZE])(m_header + 1);
+}
+
+void sev::LaunchPageManifest::update(const uint8_t *image, size_t size,
+                                     const uint8_t (*hashes)[SNP_DIGEST_SIZE])
+{
+    launch_manifest_header header;
+
+    memset(&header, 0, sizeof(header));
+    header.magic = LAUNCH_MANIFEST_MAGIC;
+    header.version = LAUNCH_MANIFEST_VERSION;
+    header.image_size = size;
+    uint8_t *data = new uint8_t[manifest_size(&header)];
+    memcpy(data, &header, sizeof(header));
+    memcpy(data + sizeof(header), hashes, manifest_hashes_size(&header));
+    memcpy(data + sizeof(header) + manifest_hashes_size(&header), image, size);
+    launch_manifest_header *full = (launch_manifest_header *)data;
+    manifest_checksum(full, full->checksum);
+
+    // The image may be the one that was loaded, so it's only let go of now
+    clear();
+    m_data = data;
+    m_header = full;
+    m_dirty = true;
+}
+
+// False if it doesn't fit in an entry
+static bool cache_path(const std::string path, char *full)
+{
+    char *real = realpath(path.c_str(), NULL);
+    bool ret = real && strlen(real) < sev::LAUNCH_CACHE_PATH_SIZE;
+
+    if (ret)
+        strcpy(full, real);
+    free(real);
+    return ret;
+}
+
+bool sev::LaunchDigestCache::find(const std::string path, const file_identity *id,
+                                  SHA256_CTX *state)
+{
+    char full[PATH_MAX];
+    SHA256_CTX check;
+    uint8_t sha256[SHA256_DIGEST_LENGTH];
+
+    if (!cache_path(path, full))
+        return false;
+
+    for (size_t i = 0; i < LAUNCH_CACHE_ENTRIES; i++) {
+        launch_cache_entry *entry = &m_file->entries[i];
+        if (strcmp(entry->path, full) != 0 || memcmp(&entry->id, id, sizeof(*id)) != 0)
+            continue;
+
+        // Only trust a state that finishes to the hash stored with it
+        memcpy(&check, &entry->state, sizeof(check));
+        if (SHA256_Final(sha256, &check) != 1 ||
+            memcmp(sha256, entry->sha256, sizeof(sha256)) != 0)
+            return false;
+
+        entry->last_used = ++m_clock;
+        memcpy(state, &entry->state, sizeof(*state));
+        return true;
+    }
+    return false;
+}
+
+void sev::LaunchDigestCache::put(const std::string path, const file_identity *id,
+                                 const SHA256_CTX *state)
+{
+    char full[PATH_MAX];
+    SHA256_CTX check;
+    launch_cache_entry *entry = &m_file->entries[0];
+
+    if (!cache_path(path, full))
+        return;
+
+    // The same file, else a free entry, else the least recently used
+    for (size_t i = 0; i < LAUNCH_CACHE_ENTRIES; i++) {
+        launch_cache_entry *candidate = &m_file->entries[i];
+        if (strcmp(candidate->path, full) == 0) {
+            entry = candidate;
+            break;
+        }
+        if (candidate->last_used < entry->last_used)
+            entry = candidate;
+    }
+
+    memset(entry, 0, sizeof(*entry));
+    strcpy(entry->path, full);
+    entry->id = *id;
+    memcpy(&entry->state, state, sizeof(entry->state));
+    memcpy(&check, state, sizeof(check));
+    SHA256_Final(entry->sha256, &check);
+    entry->last_used = ++m_clock;
+    m_dirty = true;
+}
+
+namespace {
+    // One file for calc_sev_launch_digest, from the cache or hashed
+    struct file_hash_job {
+        std::string path;
+        sev::file_identity id;
+        SHA256_CTX state;
+        bool cached;
+        bool ok;
+        uint64_t bytes;
+    };
+}
+
+/**
+ * Adds the whole file to job->state, LAUNCH_HASH_CHUNK at a time. Mapped
+ * files have the next chunk read ahead while the current one is hashed
+ */
+static void hash_file(file_hash_job *job)
+{
+    sev::FileView view;
+
+    job->ok = false;
+    if (SHA256_Init(&job->state) != 1 || !view.open(job->path))
+        return;
+
+    const uint8_t *data = view.data();
+    size_t size = view.size();
+    if (view.mapped())
+        madvise((void *)data, size, MADV_SEQUENTIAL);
+    for (size_t offset = 0; offset < size; offset += sev::LAUNCH_HASH_CHUNK) {
+        size_t length = std::min(sev::LAUNCH_HASH_CHUNK, size - offset);
+        if (view.mapped() && offset + length < size)
+            madvise((void *)(data + offset + length),
+                    std::min(sev::LAUNCH_HASH_CHUNK, size - offset - length), MADV_WILLNEED);
+        if (SHA256_Update(&job->state, data + offset, length) != 1)
+            return;
+    }
+
+    job->id = view.identity();
+    job->bytes = size;
+    job->ok = true;
+}
+
+static bool finish_copy(const SHA256_CTX *state, uint8_t *digest)
+{
+    SHA256_CTX ctx;
+    memcpy(&ctx, state, sizeof(ctx));
+    return SHA256_Final(digest, &ctx) == 1;
+}
+
+static void hash_table_entry(sev::sev_hash_table_entry *entry, const uint8_t *guid)
+{
+    memcpy(entry->guid, guid, sizeof(entry->guid));
+    entry->length = (uint16_t)sizeof(*entry);
+}
+
+/**
+ * Hashes the files of the jobs that aren't in the cache, jobs[0] on this
+ * thread and the others on their own, then puts the new ones in the cache
+ */
+static bool run_hash_jobs(file_hash_job *jobs, size_t num_jobs, sev::LaunchDigestCache *cache,
+                          sev::launch_digest_stats *stats)
+{
+    std::thread workers[LAUNCH_MAX_JOBS];
+    bool ret = true;
+
+    for (size_t i = 0; i < num_jobs; i++) {
+        file_hash_job *job = &jobs[i];
+        job->cached = cache && sev::get_file_identity(job->path, &job->id) &&
+                      cache->find(job->path, &job->id, &job->state);
+        job->ok = job->cached;
+        job->bytes = 0;
+        if (!job->cached && i != 0)
+            workers[i] = std::thread(hash_file, job);
+    }
+    if (!jobs[0].cached)
+        hash_file(&jobs[0]);
+    for (size_t i = 0; i < num_jobs; i++) {
+        if (workers[i].joinable())
+            workers[i].join();
+    }
+
+    for (size_t i = 0; i < num_jobs; i++) {
+        file_hash_job *job = &jobs[i];
+        if (!job->ok) {
+            fprintf(stderr, "Error: could not hash %s\n", job->path.c_str());
+            ret = false;
+            continue;
+        }
+        stats->bytes_hashed += job->bytes;
+        if (job->cached)
+            stats->cache_hits++;
+        else
+            stats->cache_misses++;
+        if (cache && !job->cached)
+            cache->put(job->path, &job->id, &job->state);
+    }
+    return ret;
+}
+
+/**
+ * The hashes table for measured direct boot, from the hashed kernel and
+ * initrd (NULL for none)
+ */
+static bool build_hash_table(const sev::launch_digest_input *in, const file_hash_job *kernel,
+                             const file_hash_job *initrd, sev::sev_hash_table *table)
+{
+    memset(table, 0, sizeof(*table));
+    memcpy(table->guid, sev::SEV_HASH_TABLE_GUID, sizeof(table->guid));
+    table->length = (uint16_t)offsetof(sev::sev_hash_table, padding);
+    hash_table_entry(&table->cmdline, sev::SEV_CMDLINE_ENTRY_GUID);
+    hash_table_entry(&table->initrd, sev::SEV_INITRD_ENTRY_GUID);
+    hash_table_entry(&table->kernel, sev::SEV_KERNEL_ENTRY_GUID);
+
+    // QEMU passes the cmdline with its NUL, and an empty initrd if there isn't one
+    if (!SHA256((const uint8_t *)in->cmdline.c_str(), in->cmdline.size() + 1,
+                table->cmdline.hash))
+        return false;
+    if (initrd ? !finish_copy(&initrd->state, table->initrd.hash)
+               : !SHA256((const uint8_t *)"", 0, table->initrd.hash))
+        return false;
+    return finish_copy(&kernel->state, table->kernel.hash);
+}
+
+/**
+ * What every SEV and SEV-ES launch digest starts with: the OVMF image, then
+ * the hashes table for measured direct boot. launch is the SHA-256 state
+ * after them, and ovmf the image, for anything else that has to be looked
+ * up in it
+ */
+static int launch_prefix(const sev::launch_digest_input *in, sev::LaunchDigestCache *cache,
+                         SHA256_CTX *launch, sev::FileView *ovmf,
+                         sev::launch_digest_stats *stats)
+{
+    enum { JOB_OVMF, JOB_KERNEL, JOB_INITRD, NUM_JOBS };
+    file_hash_job jobs[NUM_JOBS];
+    size_t num_jobs = 1;
+    int cmd_ret = ERROR_INVALID_PARAM;
+
+    memset(stats, 0, sizeof(*stats));
+    jobs[JOB_OVMF].path = in->ovmf;
+    if (!in->kernel.empty()) {
+        jobs[JOB_KERNEL].path = in->kernel;
+        num_jobs = in->initrd.empty() ? 2 : 3;
+        jobs[JOB_INITRD].path = in->initrd;
+    }
+    else if (!in->initrd.empty() || !in->cmdline.empty()) {
+        fprintf(stderr, "Error: an initrd or cmdline needs a kernel\n");
+        return cmd_ret;
+    }
+
+    do {
+        // Everything not in the cache is hashed at once, the OVMF image on this thread
+        if (!run_hash_jobs(jobs, num_jobs, cache, stats))
+            break;
+
+        // Mapped, so only the parts that are looked at are read
+        if (!ovmf->open(in->ovmf))
+            break;
+        memcpy(launch, &jobs[JOB_OVMF].state, sizeof(*launch));
+
+        if (num_jobs > 1) {
+            // The firmware has to have been built to check the hashes
+            const uint8_t *rv_data = NULL;
+            size_t rv_length = 0;
+            if (!sev::ovmf_table_find(ovmf->data(), ovmf->size(), sev::SEV_HASH_TABLE_RV_GUID,
+                                      &rv_data, &rv_length)) {
+                fprintf(stderr, "Error: %s doesn't support measured direct boot\n", in->ovmf.c_str());
+                cmd_ret = ERROR_UNSUPPORTED;
+                break;
+            }
+
+            sev::sev_hash_table table;
+            if (!build_hash_table(in, &jobs[JOB_KERNEL],
+                                  num_jobs == 3 ? &jobs[JOB_INITRD] : NULL, &table))
+                break;
+            if (SHA256_Update(launch, &table, sizeof(table)) != 1)
+                break;
+        }
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+int sev::calc_sev_launch_digest(const launch_digest_input *in, LaunchDigestCache *cache,
+                                uint8_t *digest, launch_digest_stats *stats)
+{
+    SHA256_CTX launch;
+    FileView ovmf;
+
+    int cmd_ret = launch_prefix(in, cache, &launch, &ovmf, stats);
+    if (cmd_ret == STATUS_SUCCESS && SHA256_Final(digest, &launch) != 1)
+        cmd_ret = ERROR_INVALID_PARAM;
+    return cmd_ret;
+}
+
+static const struct {
+    const char *name;
+    uint32_t family;
+    uint32_t model;
+    uint32_t stepping;
+} vcpu_types[] = {
+    {"EPYC",         23,  1, 2},
+    {"EPYC-v1",      23,  1, 2},
+    {"EPYC-v2",      23,  1, 2},
+    {"EPYC-IBPB",    23,  1, 2},
+    {"EPYC-v3",      23,  1, 2},
+    {"EPYC-v4",      23,  1, 2},
+    {"EPYC-Rome",    23, 49, 0},
+    {"EPYC-Rome-v1", 23, 49, 0},
+    {"EPYC-Rome-v2", 23, 49, 0},
+    {"EPYC-Rome-v3", 23, 49, 0},
+    {"EPYC-Milan",   25,  1, 1},
+    {"EPYC-Milan-v1", 25, 1, 1},
+    {"EPYC-Milan-v2", 25, 1, 1},
+    {"EPYC-Genoa",   25, 17, 0},
+    {"EPYC-Genoa-v1", 25, 17, 0},
+};
+
+bool sev::vcpu_signature(const std::string type, uint32_t *signature)
+{
+    for (size_t i = 0; i < sizeof(vcpu_types)/sizeof(vcpu_types[0]); i++) {
+        if (type != vcpu_types[i].name)
+            continue;
+        // Families past 0xF are 0xF plus the extended family
+        uint32_t family = vcpu_types[i].family;
+        uint32_t family_low = family > 0xF ? 0xF : family;
+        uint32_t family_high = family > 0xF ? family - 0xF : 0;
+        *signature = (family_high << 20) | (((vcpu_types[i].model >> 4) & 0xF) << 16) |
+                     (family_low << 8) | ((vcpu_types[i].model & 0xF) << 4) |
+                     (vcpu_types[i].stepping & 0xF);
+        return true;
+    }
+
+    // Or the value itself, in hex
+    char *end = NULL;
+    unsigned long value = strtoul(type.c_str(), &end, 16);
+    if (type.empty() || *end != '\0' || value > UINT32_MAX)
+        return false;
+    *signature = (uint32_t)value;
+    return true;
+}
+
+namespace {
+    typedef struct __attribute__ ((__packed__)) vmcb_seg_t
+    {
+        uint16_t selector;
+        uint16_t attrib;
+        uint32_t limit;
+        uint64_t base;
+    } vmcb_seg;
+
+    // The SEV-ES save area (AMD APM vol 2, table B-4), with only the
+    // fields that aren't 0 when a vCPU is reset
+    typedef struct __attribute__ ((__packed__)) sev_es_vmsa_t
+    {
+        vmcb_seg es, cs, ss, ds, fs, gs, gdtr, ldtr, idtr, tr;
+        uint8_t  reserved_1[0xD0 - 0xA0];
+        uint64_t efer;
+        uint8_t  reserved_2[0x148 - 0xD8];
+        uint64_t cr4;
+        uint64_t cr3;
+        uint64_t cr0;
+        uint64_t dr7;
+        uint64_t dr6;
+        uint64_t rflags;
+        uint64_t rip;
+        uint8_t  reserved_3[0x268 - 0x180];
+        uint64_t g_pat;
+        uint8_t  reserved_4[0x310 - 0x270];
+        uint64_t rdx;
+        uint8_t  reserved_5[0x3B0 - 0x318];
+        uint64_t sev_features;
+        uint8_t  reserved_6[0x3E8 - 0x3B8];
+        uint64_t xcr0;
+        uint8_t  reserved_7[0x408 - 0x3F0];
+        uint32_t mxcsr;
+        uint16_t x87_ftw;
+        uint16_t x87_fsw;
+        uint16_t x87_fcw;
+        uint8_t  reserved_8[PAGE_SIZE_4K - 0x412];
+    } sev_es_vmsa;
+
+    static_assert(sizeof(sev_es_vmsa) == PAGE_SIZE_4K, "VMSA isn't a page");
+    static_assert(offsetof(sev_es_vmsa, rip) == 0x178, "VMSA rip moved");
+    static_assert(offsetof(sev_es_vmsa, rdx) == 0x310, "VMSA rdx moved");
+    static_assert(offsetof(sev_es_vmsa, sev_features) == 0x3B0, "VMSA sev_features moved");
+    static_assert(offsetof(sev_es_vmsa, x87_fcw) == 0x410, "VMSA x87_fcw moved");
+}
+
+static void set_seg(vmcb_seg *seg, uint16_t selector, uint16_t attrib, uint64_t base)
+{
+    seg->selector = selector;
+    seg->attrib = attrib;
+    seg->limit = 0xFFFF;
+    seg->base = base;
+}
+
+/**
+ * A vCPU's VMSA as KVM sets it up at reset under QEMU, starting at eip in
+ * real mode. rdx holds the CPUID signature, like on real hardware
+ */
+static void build_vmsa(sev_es_vmsa *vmsa, uint32_t eip, const sev::launch_vcpus *vcpus)
+{
+    memset(vmsa, 0, sizeof(*vmsa));
+    set_seg(&vmsa->es, 0, 0x93, 0);
+    set_seg(&vmsa->cs, 0xF000, 0x9B, eip & 0xFFFF0000);
+    set_seg(&vmsa->ss, 0, 0x93, 0);
+    set_seg(&vmsa->ds, 0, 0x93, 0);
+    set_seg(&vmsa->fs, 0, 0x93, 0);
+    set_seg(&vmsa->gs, 0, 0x93, 0);
+    set_seg(&vmsa->gdtr, 0, 0, 0);
+    set_seg(&vmsa->ldtr, 0, 0x82, 0);
+    set_seg(&vmsa->idtr, 0, 0, 0);
+    set_seg(&vmsa->tr, 0, 0x8B, 0);
+    vmsa->efer = 0x1000;                // SVME, which KVM sets
+    vmsa->cr4 = 0x40;                   // MCE, which KVM sets
+    vmsa->cr0 = 0x10;
+    vmsa->dr7 = 0x400;
+    vmsa->dr6 = 0xFFFF0FF0;
+    vmsa->rflags = 0x2;
+    vmsa->rip = eip & 0xFFFF;
+    vmsa->g_pat = 0x0007040600070406ULL;
+    vmsa->rdx = vcpus->signature;
+    vmsa->sev_features = vcpus->sev_features;
+    vmsa->xcr0 = 0x1;
+    vmsa->mxcsr = 0x1F80;
+    vmsa->x87_fcw = 0x37F;
+}
+
+int sev::calc_sev_es_launch_digests(const launch_digest_input *in, LaunchDigestCache *cache,
+                                    const launch_vcpus *vcpus, uint8_t (*digests)[32],
+                                    launch_digest_stats *stats)
+{
+    SHA256_CTX launch;
+    SHA256_CTX copy;
+    FileView ovmf;
+    const uint8_t *reset_block = NULL;
+    size_t reset_length = 0;
+    uint32_t ap_eip = 0;
+    sev_es_vmsa *vmsa = new sev_es_vmsa[2];     // BSP, APs
+    int cmd_ret = ERROR_INVALID_PARAM;
+
+    do {
+        if (vcpus->min_count == 0 || vcpus->min_count > vcpus->max_count ||
+            vcpus->max_count > LAUNCH_MAX_VCPUS) {
+            fprintf(stderr, "Error: the vCPU count has to be 1 to %u\n", LAUNCH_MAX_VCPUS);
+            memset(stats, 0, sizeof(*stats));
+            break;
+        }
+
+        cmd_ret = launch_prefix(in, cache, &launch, &ovmf, stats);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        // The APs start wherever OVMF's SEV-ES reset block says
+        if (!ovmf_table_find(ovmf.data(), ovmf.size(), SEV_ES_RESET_BLOCK_GUID,
+                             &reset_block, &reset_length) || reset_length < sizeof(ap_eip)) {
+            fprintf(stderr, "Error: %s doesn't support SEV-ES\n", in->ovmf.c_str());
+            cmd_ret = ERROR_UNSUPPORTED;
+            break;
+        }
+        memcpy(&ap_eip, reset_block, sizeof(ap_eip));
+        build_vmsa(&vmsa[0], SEV_BSP_RESET_EIP, vcpus);
+        build_vmsa(&vmsa[1], ap_eip, vcpus);
+
+        // One VMSA per vCPU, BSP first. Every count in the range is a
+        // prefix of the largest, so they all come out of one pass
+        cmd_ret = ERROR_INVALID_PARAM;
+        bool failed = false;
+        for (uint32_t count = 1; count <= vcpus->max_count && !failed; count++) {
+            failed = SHA256_Update(&launch, &vmsa[count == 1 ? 0 : 1], sizeof(sev_es_vmsa)) != 1;
+            if (!failed && count >= vcpus->min_count) {
+                memcpy(&copy, &launch, sizeof(copy));
+                failed = SHA256_Final(digests[count - vcpus->min_count], &copy) != 1;
+            }
+        }
+        if (failed)
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    delete[] vmsa;
+    return cmd_ret;
+}
+
+/**
+ * The AP reset address from the SEV-ES reset block, which SNP firmware has
+ * as well
+ */
+static bool ap_reset_eip(const uint8_t *ovmf, size_t ovmf_size, uint32_t *eip)
+{
+    const uint8_t *reset_block = NULL;
+    size_t reset_length = 0;
+
+    if (!sev::ovmf_table_find(ovmf, ovmf_size, sev::SEV_ES_RESET_BLOCK_GUID,
+                              &reset_block, &reset_length) || reset_length < sizeof(*eip))
+        return false;
+    memcpy(eip, reset_block, sizeof(*eip));
+    return true;
+}
+
+struct snp_page_hasher {
+    const uint8_t *image;
+    size_t pages;
+    uint8_t (*hashes)[sev::SNP_DIGEST_SIZE];
+    const uint8_t *prev_image;          // The manifest's, or NULL
+    size_t prev_pages;
+    const uint8_t (*prev_hashes)[sev::SNP_DIGEST_SIZE];
+    std::atomic<size_t> next;           // First page of the next batch
+    std::atomic<uint64_t> reused;
+    std::atomic<bool> failed;
+};
+
+/**
+ * Takes SNP_HASH_BATCH pages at a time until there are none left. A page
+ * that's the same as in the previous image gets its hash from there
+ */
+static void hash_pages(snp_page_hasher *hasher)
+{
+    while (true) {
+        size_t first = hasher->next.fetch_add(sev::SNP_HASH_BATCH);
+        if (first >= hasher->pages)
+            return;
+        size_t last = std::min(first + sev::SNP_HASH_BATCH, hasher->pages);
+        uint64_t reused = 0;
+        for (size_t page = first; page < last; page++) {
+            const uint8_t *data = hasher->image + page*PAGE_SIZE_4K;
+            if (page < hasher->prev_pages &&
+                memcmp(data, hasher->prev_image + page*PAGE_SIZE_4K, PAGE_SIZE_4K) == 0) {
+                memcpy(hasher->hashes[page], hasher->prev_hashes[page], sev::SNP_DIGEST_SIZE);
+                reused++;
+            }
+            else if (!SHA384(data, PAGE_SIZE_4K, hasher->hashes[page])) {
+                hasher->failed = true;
+            }
+        }
+        hasher->reused += reused;
+    }
+}
+
+/**
+ * One link of the SNP launch digest chain: ld = SHA-384(PAGE_INFO), with
+ * the PAGE_INFO's digest_cur being the ld before. contents is NULL for the
+ * page types that aren't measured
+ */
+static bool snp_update(uint8_t *ld, const uint8_t *contents, uint8_t page_type, uint64_t gpa)
+{
+    sev::snp_page_info info;
+
+    memset(&info, 0, sizeof(info));
+    memcpy(info.digest_cur, ld, sizeof(info.digest_cur));
+    if (contents)
+        memcpy(info.contents, contents, sizeof(info.contents));
+    info.length = (uint16_t)sizeof(info);
+    info.page_type = page_type;
+    info.gpa = gpa;
+    return SHA384((const uint8_t *)&info, sizeof(info), ld) != NULL;
+}
+
+int sev::snp_launch_digests(const uint8_t *ovmf, size_t ovmf_size, const sev_hash_table *table,
+                            const launch_vcpus *vcpus, uint32_t threads,
+                            uint8_t (*digests)[SNP_DIGEST_SIZE], snp_launch_stats *stats,
+                            LaunchPageManifest *manifest)
+{
+    uint64_t start = Metrics::now_ns();
+    size_t pages = ovmf_size / PAGE_SIZE_4K;
+    uint64_t ovmf_gpa = (1ULL << 32) - ovmf_size;      // Up to 4GB
+    const uint8_t *meta_ref = NULL;
+    size_t meta_ref_length = 0;
+    uint32_t meta_offset = 0;
+    sev_metadata_header header;
+    const uint8_t *descs = NULL;
+    uint32_t ap_eip = 0;
+    uint64_t table_gpa = 0;
+    uint8_t ld[SNP_DIGEST_SIZE];
+    uint8_t contents[SNP_DIGEST_SIZE];
+    uint8_t (*hashes)[SNP_DIGEST_SIZE] = NULL;
+    uint8_t *page = NULL;
+    int cmd_ret = ERROR_INVALID_PARAM;
+
+    stats->pages = 0;
+    stats->pages_hashed = 0;
+    stats->pages_reused = 0;
+    stats->threads = 0;
+    stats->pages_per_sec = 0;
+
+    do {
+        if (vcpus->min_count == 0 || vcpus->min_count > vcpus->max_count ||
+            vcpus->max_count > LAUNCH_MAX_VCPUS) {
+            fprintf(stderr, "Error: the vCPU count has to be 1 to %u\n", LAUNCH_MAX_VCPUS);
+            break;
+        }
+        if (ovmf_size == 0 || ovmf_size % PAGE_SIZE_4K != 0 || ovmf_size > (1ULL << 32)) {
+            fprintf(stderr, "Error: the OVMF image isn't a whole number of pages\n");
+            break;
+        }
+
+        // Everything the chain needs from the image, before any hashing
+        cmd_ret = ERROR_UNSUPPORTED;
+        if (!ovmf_table_find(ovmf, ovmf_size, SEV_METADATA_GUID, &meta_ref, &meta_ref_length) ||
+            meta_ref_length < sizeof(meta_offset)) {
+            fprintf(stderr, "Error: the OVMF image doesn't support SEV-SNP\n");
+            break;
+        }
+        if (!ap_reset_eip(ovmf, ovmf_size, &ap_eip)) {
+            fprintf(stderr, "Error: the OVMF image doesn't support SEV-ES\n");
+            break;
+        }
+        if (table) {
+            const uint8_t *rv_data = NULL;
+            size_t rv_length = 0;
+            uint32_t rv_gpa = 0;
+            if (!ovmf_table_find(ovmf, ovmf_size, SEV_HASH_TABLE_RV_GUID, &rv_data, &rv_length) ||
+                rv_length < sizeof(rv_gpa)) {
+                fprintf(stderr, "Error: the OVMF image doesn't support measured direct boot\n");
+                break;
+            }
+            memcpy(&rv_gpa, rv_data, sizeof(rv_gpa));
+            table_gpa = rv_gpa;
+            if ((table_gpa & (PAGE_SIZE_4K - 1)) + sizeof(*table) > PAGE_SIZE_4K) {
+                fprintf(stderr, "Error: the hashes table would cross a page\n");
+                break;
+            }
+        }
+
+        // The metadata is found by its offset from the end of the image
+        cmd_ret = ERROR_INVALID_PARAM;
+        memcpy(&meta_offset, meta_ref, sizeof(meta_offset));
+        if (meta_offset < sizeof(header) || meta_offset > ovmf_size)
+            break;
+        memcpy(&header, ovmf + ovmf_size - meta_offset, sizeof(header));
+        descs = ovmf + ovmf_size - meta_offset + sizeof(header);
+        // The header and its descriptors have to fit in what's left of the image
+        if (header.signature != SEV_METADATA_SIGNATURE || header.version != SEV_METADATA_VERSION ||
+            header.length < sizeof(header) || header.length > meta_offset ||
+            header.num_desc > (header.length - sizeof(header)) / sizeof(sev_metadata_desc)) {
+            fprintf(stderr, "Error: the OVMF image's SEV metadata is bad\n");
+            break;
+        }
+
+        // Every page of the image that isn't in the manifest, hashed on every thread
+        if (threads == 0)
+            threads = std::thread::hardware_concurrency();
+        threads = std::max(1u, std::min(threads, SNP_MAX_THREADS));
+        threads = (uint32_t)std::min((size_t)threads, (pages + SNP_HASH_BATCH - 1) / SNP_HASH_BATCH);
+        hashes = new uint8_t[pages][SNP_DIGEST_SIZE];
+        snp_page_hasher hasher;
+        hasher.image = ovmf;
+        hasher.pages = pages;
+        hasher.hashes = hashes;
+        hasher.prev_image = manifest ? manifest->image() : NULL;
+        hasher.prev_pages = hasher.prev_image ? manifest->size() / PAGE_SIZE_4K : 0;
+        hasher.prev_hashes = hasher.prev_image ? manifest->hashes() : NULL;
+        hasher.next = 0;
+        hasher.reused = 0;
+        hasher.failed = false;
+        std::thread workers[SNP_MAX_THREADS];
+        for (uint32_t i = 1; i < threads; i++)
+            workers[i] = std::thread(hash_pages, &hasher);
+        hash_pages(&hasher);
+        for (uint32_t i = 1; i < threads; i++)
+            workers[i].join();
+        if (hasher.failed)
+            break;
+        stats->threads = threads;
+        stats->pages_reused = hasher.reused;
+        stats->pages_hashed = pages - stats->pages_reused;
+
+        // Then the chain, which can only be run in order
+        bool failed = false;
+        memset(ld, 0, sizeof(ld));
+        for (size_t i = 0; i < pages && !failed; i++)
+            failed = !snp_update(ld, hashes[i], SNP_PAGE_TYPE_NORMAL, ovmf_gpa + i*PAGE_SIZE_4K);
+        stats->pages = pages;
+
+        for (uint32_t d = 0; d < header.num_desc && !failed; d++) {
+            sev_metadata_desc desc;
+            memcpy(&desc, descs + d*sizeof(desc), sizeof(desc));
+            if (desc.base % PAGE_SIZE_4K != 0 || desc.size % PAGE_SIZE_4K != 0) {
+                fprintf(stderr, "Error: SEV metadata section %u isn't page aligned\n", d);
+                failed = true;
+                break;
+            }
+            switch (desc.type) {
+                case SEV_SECTION_SNP_SEC_MEM:
+                case SEV_SECTION_SVSM_CAA:
+                    for (uint64_t gpa = desc.base; gpa < (uint64_t)desc.base + desc.size && !failed;
+                         gpa += PAGE_SIZE_4K, stats->pages++)
+                        failed = !snp_update(ld, NULL, SNP_PAGE_TYPE_ZERO, gpa);
+                    break;
+                case SEV_SECTION_SNP_SECRETS:
+                    failed = !snp_update(ld, NULL, SNP_PAGE_TYPE_SECRETS, desc.base);
+                    stats->pages++;
+                    break;
+                case SEV_SECTION_CPUID:
+                    failed = !snp_update(ld, NULL, SNP_PAGE_TYPE_CPUID, desc.base);
+                    stats->pages++;
+                    break;
+                case SEV_SECTION_SNP_KERNEL_HASHES:
+                    if (table) {
+                        // A page of its own, with the table where OVMF looks for it
+                        if (desc.size != PAGE_SIZE_4K) {
+                            failed = true;
+                            break;
+                        }
+                        if (!page)
+                            page = new uint8_t[PAGE_SIZE_4K];
+                        memset(page, 0, PAGE_SIZE_4K);
+                        memcpy(page + (table_gpa & (PAGE_SIZE_4K - 1)), table, sizeof(*table));
+                        failed = !SHA384(page, PAGE_SIZE_4K, contents) ||
+                                 !snp_update(ld, contents, SNP_PAGE_TYPE_NORMAL, desc.base);
+                        stats->pages++;
+                        stats->pages_hashed++;
+                        table = NULL;
+                    }
+                    else {
+                        for (uint64_t gpa = desc.base; gpa < (uint64_t)desc.base + desc.size && !failed;
+                             gpa += PAGE_SIZE_4K, stats->pages++)
+                            failed = !snp_update(ld, NULL, SNP_PAGE_TYPE_ZERO, gpa);
+                    }
+                    break;
+                default:
+                    fprintf(stderr, "Error: unknown SEV metadata section type %u\n", desc.type);
+                    failed = true;
+                    break;
+            }
+        }
+        if (failed)
+            break;
+        if (table) {
+            fprintf(stderr, "Error: the OVMF image has no SEV metadata section for the hashes table\n");
+            cmd_ret = ERROR_UNSUPPORTED;
+            break;
+        }
+
+        // One VMSA per vCPU, BSP first, each count following on from the one before
+        sev_es_vmsa *vmsa = new sev_es_vmsa;
+        uint8_t vmsa_hash[2][SNP_DIGEST_SIZE];      // BSP, APs
+        build_vmsa(vmsa, SEV_BSP_RESET_EIP, vcpus);
+        failed = !SHA384((const uint8_t *)vmsa, sizeof(*vmsa), vmsa_hash[0]);
+        build_vmsa(vmsa, ap_eip, vcpus);
+        failed |= !SHA384((const uint8_t *)vmsa, sizeof(*vmsa), vmsa_hash[1]);
+        delete vmsa;
+        for (uint32_t count = 1; count <= vcpus->max_count && !failed; count++) {
+            failed = !snp_update(ld, vmsa_hash[count == 1 ? 0 : 1], SNP_PAGE_TYPE_VMSA, SNP_VMSA_GPA);
+            stats->pages++;
+            if (count >= vcpus->min_count)
+                memcpy(digests[count - vcpus->min_count], ld, SNP_DIGEST_SIZE);
+        }
+        stats->pages_hashed += 2;
+        if (failed)
+            break;
+
+        if (manifest)
+            manifest->update(ovmf, ovmf_size, hashes);
+
+        uint64_t elapsed = Metrics::now_ns() - start;
+        stats->pages_per_sec = elapsed ? (double)stats->pages * 1e9 / (double)elapsed : 0;
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    delete[] page;
+    delete[] hashes;
+    return cmd_ret;
+}
+
+int sev::calc_snp_launch_digests(const launch_digest_input *in, LaunchDigestCache *cache,
+                                 const launch_vcpus *vcpus, uint32_t threads,
+                                 uint8_t (*digests)[SNP_DIGEST_SIZE], snp_launch_stats *stats,
+                                 LaunchPageManifest *manifest)
+{
+    enum { JOB_KERNEL, JOB_INITRD, NUM_JOBS };
+    file_hash_job jobs[NUM_JOBS];
+    size_t num_jobs = 0;
+    sev_hash_table table;
+    FileView ovmf;
+    int cmd_ret = ERROR_INVALID_PARAM;
+
+    memset(stats, 0, sizeof(*stats));
+    if (!in->kernel.empty()) {
+        jobs[JOB_KERNEL].path = in->kernel;
+        jobs[JOB_INITRD].path = in->initrd;
+        num_jobs = in->initrd.empty() ? 1 : 2;
+    }
+    else if (!in->initrd.empty() || !in->cmdline.empty()) {
+        fprintf(stderr, "Error: an initrd or cmdline needs a kernel\n");
+        return cmd_ret;
+    }
+
+    do {
+        if (num_jobs > 0) {
+            if (!run_hash_jobs(jobs, num_jobs, cache, &stats->files))
+                break;
+            if (!build_hash_table(in, &jobs[JOB_KERNEL],
+                                  num_jobs == 2 ? &jobs[JOB_INITRD] : NULL, &table))
+                break;
+        }
+
+        // Every page is hashed or compared, so have the kernel read it in ahead of the threads
+        if (!ovmf.open(in->ovmf))
+            break;
+        if (ovmf.mapped())
+            madvise((void *)ovmf.data(), ovmf.size(), MADV_WILLNEED);
+
+        cmd_ret = snp_launch_digests(ovmf.data(), ovmf.size(), num_jobs > 0 ? &table : NULL,
+                                     vcpus, threads, digests, stats, manifest);
+    } while (0);
+
+    return cmd_ret;
+}
@@ -0,0 +1,311 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+/**
+ * The launch digest calc_measurement needs, worked out from the images the
+ * guest is launched with instead of by hand.
+ *
+ * For SEV, the digest is the SHA-256 of everything the VMM passes to
+ * LAUNCH_UPDATE_DATA, in order: the OVMF image, then, for measured direct
+ * boot (QEMU's -kernel with kernel-hashes=on), the table of the kernel,
+ * initrd and cmdline hashes that OVMF checks them against. SEV-ES adds the
+ * LAUNCH_UPDATE_VMSA page of each vCPU after that.
+ *
+ * SEV-SNP measures page by page instead: each SNP_LAUNCH_UPDATE page adds
+ * a PAGE_INFO, whose contents field is the SHA-384 of the page, to a
+ * SHA-384 chain. What's in the pages that aren't the OVMF image (zeroed,
+ * secrets, CPUID, the hashes table) is described by the OVMF image's SEV
+ * metadata.
+ */
+
+#ifndef LAUNCHDIGEST_H
+#define LAUNCHDIGEST_H
+
+#include "utilities.h"          // for file_identity
+#include <cstddef>
+#include <cstdint>
+#include <openssl/sha.h>
+#include <string>
+
+namespace sev
+{
+    constexpr size_t   LAUNCH_HASH_CHUNK      = 2*1024*1024;   // Hashed per step, with the next read ahead
+    constexpr size_t   LAUNCH_CACHE_ENTRIES   = 32;
+    constexpr size_t   LAUNCH_CACHE_PATH_SIZE = 256;
+    constexpr uint32_t LAUNCH_CACHE_MAGIC     = 0x4443444C;    // "LDCD"
+    constexpr uint32_t LAUNCH_CACHE_VERSION   = 1;
+    constexpr uint32_t LAUNCH_MAX_VCPUS       = 512;
+    constexpr uint32_t SEV_BSP_RESET_EIP      = 0xFFFFFFF0;
+    constexpr size_t   SNP_DIGEST_SIZE        = 48;            // SHA-384
+    constexpr size_t   SNP_HASH_BATCH         = 64;            // Pages a thread takes at a time
+    constexpr uint32_t SNP_MAX_THREADS        = 64;
+    constexpr uint64_t SNP_VMSA_GPA           = 0xFFFFFFFFF000ULL;
+    constexpr uint64_t SNP_SEV_FEATURES       = 0x1;           // SNPActive, all QEMU sets
+    constexpr uint32_t SEV_METADATA_SIGNATURE = 0x56455341;    // "ASEV"
+    constexpr uint32_t SEV_METADATA_VERSION   = 1;
+    constexpr uint32_t LAUNCH_MANIFEST_MAGIC   = 0x4D50444C;   // "LDPM"
+    constexpr uint32_t LAUNCH_MANIFEST_VERSION = 1;
+
+    // GUIDs in the OVMF footer table and the hashes table, in their in-memory
+    // (little endian) byte order
+    extern const uint8_t OVMF_TABLE_FOOTER_GUID[16];
+    extern const uint8_t SEV_HASH_TABLE_RV_GUID[16];    // Where OVMF expects the hashes table
+    extern const uint8_t SEV_HASH_TABLE_GUID[16];
+    extern const uint8_t SEV_KERNEL_ENTRY_GUID[16];
+    extern const uint8_t SEV_INITRD_ENTRY_GUID[16];
+    extern const uint8_t SEV_CMDLINE_ENTRY_GUID[16];
+    extern const uint8_t SEV_ES_RESET_BLOCK_GUID[16];   // Where the APs start
+    extern const uint8_t SEV_METADATA_GUID[16];         // Where the SEV metadata is
+
+    // SNP_LAUNCH_UPDATE page types
+    enum SNP_PAGE_TYPE {
+        SNP_PAGE_TYPE_NORMAL     = 0x1,
+        SNP_PAGE_TYPE_VMSA       = 0x2,
+        SNP_PAGE_TYPE_ZERO       = 0x3,
+        SNP_PAGE_TYPE_UNMEASURED = 0x4,
+        SNP_PAGE_TYPE_SECRETS    = 0x5,
+        SNP_PAGE_TYPE_CPUID      = 0x6,
+    };
+
+    // What OVMF's SEV metadata says a range of guest memory is for
+    enum SEV_SECTION_TYPE {
+        SEV_SECTION_SNP_SEC_MEM       = 0x1,    // Zeroed
+        SEV_SECTION_SNP_SECRETS       = 0x2,
+        SEV_SECTION_CPUID             = 0x3,
+        SEV_SECTION_SVSM_CAA          = 0x4,    // Zeroed
+        SEV_SECTION_SNP_KERNEL_HASHES = 0x10,   // The hashes table, or zeroed without one
+    };
+
+    // What the SNP launch digest is a chain of (SNP ABI, PAGE_INFO)
+    typedef struct __attribute__ ((__packed__)) snp_page_info_t
+    {
+        uint8_t  digest_cur[SNP_DIGEST_SIZE];   // The launch digest so far
+        uint8_t  contents[SNP_DIGEST_SIZE];     // SHA-384 of the page. 0 if it isn't measured
+        uint16_t length;                        // Of this struct
+        uint8_t  page_type;                     // SNP_PAGE_TYPE
+        uint8_t  imi_page;
+        uint8_t  vmpl3_perms;
+        uint8_t  vmpl2_perms;
+        uint8_t  vmpl1_perms;
+        uint8_t  reserved;
+        uint64_t gpa;
+    } snp_page_info;
+
+    typedef struct __attribute__ ((__packed__)) sev_metadata_header_t
+    {
+        uint32_t signature;                     // SEV_METADATA_SIGNATURE
+        uint32_t length;                        // With the descriptors
+        uint32_t version;
+        uint32_t num_desc;
+    } sev_metadata_header;
+
+    typedef struct __attribute__ ((__packed__)) sev_metadata_desc_t
+    {
+        uint32_t base;                          // GPA
+        uint32_t size;
+        uint32_t type;                          // SEV_SECTION_TYPE
+    } sev_metadata_desc;
+
+    typedef struct __attribute__ ((__packed__)) sev_hash_table_entry_t
+    {
+        uint8_t  guid[16];
+        uint16_t length;                // Of the entry
+        uint8_t  hash[32];              // SHA-256
+    } sev_hash_table_entry;
+
+    // As QEMU measures it: padded to a multiple of 16 bytes
+    typedef struct __attribute__ ((__packed__)) sev_hash_table_t
+    {
+        uint8_t  guid[16];
+        uint16_t length;                // Without the padding
+        sev_hash_table_entry cmdline;   // Including the terminating NUL
+        sev_hash_table_entry initrd;    // Of nothing, if there's no initrd
+        sev_hash_table_entry kernel;
+        uint8_t  padding[8];
+    } sev_hash_table;
+
+    /**
+     * Finds an entry of the GUIDed table at the end of an OVMF image. data
+     * points into image. False if there's no table, or no entry for guid
+     */
+    bool ovmf_table_find(const uint8_t *image, size_t size, const uint8_t *guid,
+                         const uint8_t **data, size_t *length);
+
+    struct launch_digest_input {
+        std::string ovmf;
+        std::string kernel;             // Empty without measured direct boot
+        std::string initrd;             // Only with a kernel. Empty for none
+        std::string cmdline;            // Only with a kernel
+    };
+
+    struct launch_vcpus {
+        uint32_t min_count;             // A digest for each count from min_count
+        uint32_t max_count;             // to max_count
+        uint32_t signature;             // CPUID 1 EAX. See vcpu_signature
+        uint64_t sev_features;          // 0 for SEV-ES, SNP_SEV_FEATURES for SNP
+    };
+
+    struct launch_digest_stats {
+        uint64_t bytes_hashed;          // Of the files. 0 if they all came from the cache
+        uint32_t cache_hits;
+        uint32_t cache_misses;
+    };
+
+    struct snp_launch_stats {
+        launch_digest_stats files;      // The kernel and initrd
+        uint64_t pages;                 // PAGE_INFOs in the chain
+        uint64_t pages_hashed;          // Whose contents were hashed
+        uint64_t pages_reused;          // Same as in the manifest, so not hashed
+        uint32_t threads;               // That hashed them
+        double   pages_per_sec;         // PAGE_INFOs, over the whole calculation
+    };
+
+    struct launch_cache_file;
+
+    /**
+     * The SHA-256 state after the whole contents of each file hashed
+     * before, by (path, device, inode, size, mtime). The content hash is
+     * stored with it, and an entry whose state doesn't finish to that hash
+     * is ignored. Since the state is kept rather than just the hash, a
+     * cached OVMF image can still have the hashes table (or anything else
+     * measured after it) added on.
+     *
+     * Kept in one small file, loaded and saved whole. The least recently
+     * used entry is replaced when it's full. Not thread safe. Paths are
+     * made absolute first, and longer ones than fit aren't cached.
+     */
+    class LaunchDigestCache {
+    private:
+        launch_cache_file *m_file;
+        uint64_t m_clock;               // For least recently used
+        bool m_dirty;
+
+        LaunchDigestCache(const LaunchDigestCache&) = delete;
+        LaunchDigestCache& operator=(const LaunchDigestCache&) = delete;
+
+    public:
+        LaunchDigestCache();
+        ~LaunchDigestCache();
+
+        // A missing or unreadable cache file just leaves the cache empty
+        void load(const std::string file_name);
+        // Only writes if anything was put()
+        bool save(const std::string file_name);
+
+        bool find(const std::string path, const file_identity *id, SHA256_CTX *state);
+        void put(const std::string path, const file_identity *id, const SHA256_CTX *state);
+        void clear(void);
+    };
+
+    struct launch_manifest_header;
+
+    /**
+     * The SHA-384 of every page of the last OVMF image an SNP launch digest
+     * was worked out for, along with a copy of the image. A new image is
+     * compared with the copy page by page, and only the pages that differ
+     * are hashed again, so a rebuild with a small patch (or another variant
+     * of the same firmware) costs a memcmp of the image plus the changed
+     * pages, rather than hashing all of it.
+     *
+     * Kept in one file: a header with a SHA-256 of itself and the hashes,
+     * which is checked on load, then the hashes, then the image. Loading it
+     * maps the file. Not thread safe.
+     */
+    class LaunchPageManifest {
+    private:
+        FileView m_view;                // What was loaded
+        uint8_t *m_data;                // What update() made, to save
+        const launch_manifest_header *m_header;     // Into one of them, or NULL
+        bool m_dirty;
+
+        LaunchPageManifest(const LaunchPageManifest&) = delete;
+        LaunchPageManifest& operator=(const LaunchPageManifest&) = delete;
+
+    public:
+        LaunchPageManifest();
+        ~LaunchPageManifest();
+
+        // A missing or bad manifest file just leaves it empty
+        void load(const std::string file_name);
+        // Only writes if it was update()d
+        bool save(const std::string file_name);
+        void clear(void);
+
+        // The previous image, and the SHA-384 of each of its pages. NULL if none
+        const uint8_t *image(void) const;
+        size_t size(void) const;
+        const uint8_t (*hashes(void) const)[SNP_DIGEST_SIZE];
+
+        // Replaces it with a new image and its page hashes. Both are copied
+        void update(const uint8_t *image, size_t size,
+                    const uint8_t (*hashes)[SNP_DIGEST_SIZE]);
+    };
+
+    /**
+     * The SEV (not SEV-ES or SNP) launch digest. The kernel and initrd are
+     * hashed on their own threads while the OVMF image is. cache may be
+     * NULL. Returns a SEV_ERROR_CODE: ERROR_INVALID_PARAM if a file can't be
+     * read, ERROR_UNSUPPORTED for a kernel with an OVMF that has nowhere to
+     * put the hashes table
+     */
+    int calc_sev_launch_digest(const launch_digest_input *in, LaunchDigestCache *cache,
+                               uint8_t *digest, launch_digest_stats *stats);
+
+    /**
+     * The CPUID signature of a QEMU vCPU model (-cpu EPYC-v4 etc.), or a hex
+     * signature. False if it's neither
+     */
+    bool vcpu_signature(const std::string type, uint32_t *signature);
+
+    /**
+     * SEV-ES launch digests, for every vCPU count in vcpus at once: digests
+     * gets max_count - min_count + 1 of them. The firmware and hashes table
+     * are hashed (or come from the cache) once, then each count only adds
+     * one more VMSA page to the one before. ERROR_UNSUPPORTED if the OVMF
+     * image doesn't have the SEV-ES reset block
+     */
+    int calc_sev_es_launch_digests(const launch_digest_input *in, LaunchDigestCache *cache,
+                                   const launch_vcpus *vcpus, uint8_t (*digests)[32],
+                                   launch_digest_stats *stats);
+
+    /**
+     * SEV-SNP launch digests of an OVMF image in memory, for every vCPU
+     * count in vcpus, like calc_sev_es_launch_digests. The image's pages are
+     * hashed on threads threads (0 for one per core), then the PAGE_INFO
+     * chain is run through them, the SEV metadata sections and the VMSAs on
+     * this one. table is the hashes table for measured direct boot, or NULL.
+     * With a manifest, pages that are the same as in its image aren't
+     * hashed, and it's updated to this image afterwards. ERROR_UNSUPPORTED
+     * if the image has no SEV metadata or SEV-ES reset block, or nowhere
+     * for a table
+     */
+    int snp_launch_digests(const uint8_t *ovmf, size_t ovmf_size, const sev_hash_table *table,
+                           const launch_vcpus *vcpus, uint32_t threads,
+                           uint8_t (*digests)[SNP_DIGEST_SIZE], snp_launch_stats *stats,
+                           LaunchPageManifest *manifest = NULL);
+
+    /**
+     * The same, from the files: the OVMF image is mapped rather than read,
+     * and the kernel and initrd hashed on their own threads first, through
+     * cache (which may be NULL) like the SEV digest's
+     */
+    int calc_snp_launch_digests(const launch_digest_input *in, LaunchDigestCache *cache,
+                                const launch_vcpus *vcpus, uint32_t threads,
+                                uint8_t (*digests)[SNP_DIGEST_SIZE], snp_launch_stats *stats,
+                                LaunchPageManifest *manifest = NULL);
+}
+
+#endif /* LAUNCHDIGEST_H */
@@ -0,0 +1,347 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "libsevtool.h"
+#include "amdcert.h"
+#include "crypto.h"
+#include "measurematch.h"
+#include "metrics.h"
+#include "secretpack.h"
+#include "securemem.h"
+#include "sevcert.h"
+#include "sevcore.h"
+#include <atomic>
+#include <mutex>
+#include <stdexcept>            // for std::runtime_error
+
+static_assert(SEVTOOL_SEV_CERT_SIZE == sizeof(sev_cert), "sev_cert size changed");
+static_assert(SEVTOOL_AMD_CERT_MAX_SIZE == sizeof(amd_cert), "amd_cert size changed");
+static_assert(SEVTOOL_SESSION_SIZE == sizeof(sev_session_buf), "sev_session_buf size changed");
+static_assert(SEVTOOL_TK_SIZE == sizeof(tek_tik), "tek_tik size changed");
+static_assert(SEVTOOL_HMAC_SIZE == sizeof(hmac_sha_256), "hmac_sha_256 size changed");
+static_assert(SEVTOOL_NONCE_SIZE == sizeof(nonce_128), "nonce_128 size changed");
+static_assert(SEVTOOL_HDR_SIZE == sizeof(sev_hdr_buf), "sev_hdr_buf size changed");
+static_assert((int)SEVTOOL_BACKEND_SIM == (int)SEV_BACKEND_SIM, "backend ids changed");
+
+constexpr size_t SEVTOOL_MIN_SECRET_SIZE = 8;
+
+static std::mutex init_mutex;
+static std::atomic<SEVDevice *> sev_device(NULL);
+static int sev_backend = SEVTOOL_BACKEND_DEFAULT;
+
+int sevtool_init(int backend)
+{
+    std::lock_guard<std::mutex> lock(init_mutex);
+
+    if (sev_device.load()) {
+        if (backend == SEVTOOL_BACKEND_DEFAULT || backend == sev_backend)
+            return STATUS_SUCCESS;
+        return ERROR_INVALID_PARAM;
+    }
+
+    if (backend != SEVTOOL_BACKEND_DEFAULT && backend != SEVTOOL_BACKEND_IOCTL &&
+        backend != SEVTOOL_BACKEND_SIM)
+        return ERROR_INVALID_PARAM;
+
+    SEVDevice::set_backend_type((SEV_BACKEND_TYPE)backend);
+    try {
+        sev_device = &SEVDevice::get_sev_device();
+    }
+    catch (const std::runtime_error &) {
+        return -1;
+    }
+    sev_backend = SEVDevice::get_backend_type();
+
+    return STATUS_SUCCESS;
+}
+
+static SEVDevice *get_device(void)
+{
+    if (!sev_device.load() && sevtool_init(SEVTOOL_BACKEND_DEFAULT) != STATUS_SUCCESS)
+        return NULL;
+    return sev_device.load();
+}
+
+int sevtool_platform_status(struct sevtool_platform_status *status)
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "platform_status");
+    uint8_t data[sizeof(sev_platform_status_cmd_buf)];
+    sev_platform_status_cmd_buf *data_buf = (sev_platform_status_cmd_buf *)&data;
+    SEVDevice *device = get_device();
+    int cmd_ret = -1;
+
+    if (!status)
+        return ERROR_INVALID_PARAM;
+    if (!device)
+        return cmd_ret;
+
+    cmd_ret = device->platform_status(data);
+    if (cmd_ret == STATUS_SUCCESS) {
+        status->api_major   = data_buf->api_major;
+        status->api_minor   = data_buf->api_minor;
+        status->state       = data_buf->current_platform_state;
+        status->owner       = data_buf->owner;
+        status->config      = data_buf->config;
+        status->build_id    = data_buf->build_id;
+        status->guest_count = data_buf->guest_count;
+    }
+
+    return cmd_ret;
+}
+
+int sevtool_export_cert_chain(struct sevtool_cert_chain *chain)
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "export_cert_chain");
+    uint8_t data[sizeof(sev_pdh_cert_export_cmd_buf)];
+    sev_cert_chain_buf cert_chain;          // PEK, OCA, CEK (unsigned)
+    uint8_t ask_ark_buf[sizeof(amd_cert)*2] = {0};
+    size_t ask_ark_length = 0;
+    amd_cert ask;
+    amd_cert ark;
+    AMDCert tmp_amd;
+    SEVDevice *device = get_device();
+    int cmd_ret = -1;
+
+    if (!chain)
+        return ERROR_INVALID_PARAM;
+    if (!device)
+        return cmd_ret;
+
+    do {
+        cmd_ret = device->pdh_cert_export(data, chain->pdh, &cert_chain);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        // The CEK in the cert chain is unsigned, so use the one from the KDS
+        cmd_ret = device->kds_get_cek((sev_cert *)chain->cek);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        cmd_ret = device->kds_get_ask_ark(ask_ark_buf, sizeof(ask_ark_buf), &ask_ark_length);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        // Split the ask_ark into its two variable size certs
+        cmd_ret = tmp_amd.amd_cert_init(&ask, ask_ark_buf);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+        size_t ask_size = tmp_amd.amd_cert_get_size(&ask);
+        cmd_ret = tmp_amd.amd_cert_init(&ark, ask_ark_buf + ask_size);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+        size_t ark_size = tmp_amd.amd_cert_get_size(&ark);
+        if (ask_size + ark_size > ask_ark_length) {
+            cmd_ret = ERROR_INVALID_LENGTH;
+            break;
+        }
+
+        memcpy(chain->pek, &cert_chain.pek_cert, sizeof(sev_cert));
+        memcpy(chain->oca, &cert_chain.oca_cert, sizeof(sev_cert));
+        memcpy(chain->ask, ask_ark_buf, ask_size);
+        memcpy(chain->ark, ask_ark_buf + ask_size, ark_size);
+        chain->ask_size = ask_size;
+        chain->ark_size = ark_size;
+    } while (0);
+
+    return cmd_ret;
+}
+
+int sevtool_validate_cert_chain(const struct sevtool_cert_chain *chain)
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "validate_cert_chain");
+    int cmd_ret = ERROR_INVALID_CERTIFICATE;
+    sev_cert pdh;
+    sev_cert pek;
+    sev_cert oca;
+    sev_cert cek;
+    amd_cert ask;
+    amd_cert ark;
+    sev_cert ask_pubkey;
+
+    if (!chain)
+        return ERROR_INVALID_PARAM;
+    if (chain->ask_size > sizeof(amd_cert) || chain->ark_size > sizeof(amd_cert))
+        return ERROR_INVALID_LENGTH;
+
+    memcpy(&pdh, chain->pdh, sizeof(sev_cert));
+    memcpy(&pek, chain->pek, sizeof(sev_cert));
+    memcpy(&oca, chain->oca, sizeof(sev_cert));
+    memcpy(&cek, chain->cek, sizeof(sev_cert));
+
+    do {
+        AMDCert tmp_amd;
+        uint8_t amd_buf[sizeof(amd_cert)] = {0};    // Zero padded, like reading the file
+
+        memcpy(amd_buf, chain->ark, chain->ark_size);
+        cmd_ret = tmp_amd.amd_cert_init(&ark, amd_buf);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        memset(amd_buf, 0, sizeof(amd_buf));
+        memcpy(amd_buf, chain->ask, chain->ask_size);
+        cmd_ret = tmp_amd.amd_cert_init(&ask, amd_buf);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        SEVCert tmp_sev_cek(cek);   // Pass in child cert in constructor
+        SEVCert tmp_sev_pek(pek);
+        SEVCert tmp_sev_pdh(pdh);
+
+        cmd_ret = tmp_amd.amd_cert_validate_ark(&ark);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        cmd_ret = tmp_amd.amd_cert_validate_ask(&ask, &ark);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        // verify_sev_cert needs the ASK's public key as an sev_cert
+        cmd_ret = tmp_amd.amd_cert_export_pub_key(&ask, &ask_pubkey);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        cmd_ret = tmp_sev_cek.verify_sev_cert(&ask_pubkey);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        cmd_ret = tmp_sev_pek.verify_sev_cert(&cek, &oca);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        cmd_ret = tmp_sev_pdh.verify_sev_cert(&pek);
+    } while (0);
+
+    return cmd_ret;
+}
+
+int sevtool_generate_launch_blob(const uint8_t *pdh, size_t pdh_size,
+                                 uint32_t policy,
+                                 struct sevtool_launch_blob *blob)
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "generate_launch_blob");
+    int cmd_ret = ERROR_UNSUPPORTED;
+    sev_session_buf session_data_buf;
+    sev_cert pdh_cert;
+    sev_cert godh_pubkey_cert;
+    EVP_PKEY *godh_key_pair = NULL;      // Guest Owner Diffie-Hellman
+    sev::Secure<tek_tik> tk;
+
+    if (!pdh || !blob)
+        return ERROR_INVALID_PARAM;
+    if (pdh_size != sizeof(sev_cert))
+        return ERROR_INVALID_LENGTH;
+
+    memcpy(&pdh_cert, pdh, sizeof(sev_cert));
+    memset(&session_data_buf, 0, sizeof(sev_session_buf));
+    memset(&godh_pubkey_cert, 0, sizeof(sev_cert));
+
+    do {
+        SEVCert cert_obj(godh_pubkey_cert);
+
+        if (!generate_ecdh_key_pair(&godh_key_pair))
+            break;
+
+        // The GODH cert is only a way to send over the public key, so the
+        // api major/minor don't matter here
+        if (!cert_obj.create_godh_cert(&godh_key_pair, 0, 0))
+            break;
+
+        cmd_ret = build_session_buffer(&session_data_buf, tk.get(), policy,
+                                       godh_key_pair, &pdh_cert);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        memcpy(blob->session, &session_data_buf, sizeof(sev_session_buf));
+        memcpy(blob->godh_cert, cert_obj.data(), sizeof(sev_cert));
+        memcpy(blob->tk, tk.get(), sizeof(tek_tik));
+    } while (0);
+
+    EVP_PKEY_free(godh_key_pair);
+
+    return cmd_ret;
+}
+
+int sevtool_calc_measurement(const struct sevtool_measurement *meas,
+                             uint8_t measurement[SEVTOOL_HMAC_SIZE])
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "calc_measurement");
+    hmac_sha_256 final_meas;
+
+    if (!meas || !measurement)
+        return ERROR_INVALID_PARAM;
+
+    if (!calc_launch_measurement(&final_meas, meas->tik, meas->meas_ctx, meas->api_major,
+                                 meas->api_minor, meas->build_id, meas->policy,
+                                 meas->digest, meas->mnonce, meas->api_minor >= 17))
+        return ERROR_BAD_MEASUREMENT;
+
+    memcpy(measurement, final_meas, sizeof(final_meas));
+    return STATUS_SUCCESS;
+}
+
+int sevtool_match_measurement(const struct sevtool_measurement *meas,
+                              const uint8_t (*digests)[32], size_t count,
+                              const uint8_t measurement[SEVTOOL_HMAC_SIZE],
+                              size_t *index)
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "match_measurement");
+
+    if (!meas || !digests || !measurement || !index)
+        return ERROR_INVALID_PARAM;
+
+    sev::MeasurementMatcher matcher(meas->tik, sizeof(meas->tik), meas->meas_ctx,
+                                    meas->api_major, meas->api_minor, meas->build_id,
+                                    meas->policy);
+    int matched = matcher.match(digests, count, meas->mnonce, measurement);
+    if (matched < 0)
+        return ERROR_BAD_MEASUREMENT;
+
+    *index = (size_t)matched;
+    return STATUS_SUCCESS;
+}
+
+int sevtool_package_secret(const uint8_t tk[SEVTOOL_TK_SIZE],
+                           const uint8_t measurement[SEVTOOL_HMAC_SIZE],
+                           uint8_t api_minor,
+                           const uint8_t *secret, size_t secret_size,
+                           uint8_t *packaged, size_t packaged_size,
+                           uint8_t header[SEVTOOL_HDR_SIZE])
+{
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "package_secret");
+    int cmd_ret = ERROR_UNSUPPORTED;
+    sev::Secure<tek_tik> keys;
+    iv_128 iv;
+    sev_hdr_buf packaged_secret_header;
+    sev::secret_piece piece = {secret, secret_size};
+
+    if (!tk || !measurement || !secret || !packaged || !header)
+        return ERROR_INVALID_PARAM;
+    if (secret_size < SEVTOOL_MIN_SECRET_SIZE || packaged_size != secret_size)
+        return ERROR_INVALID_LENGTH;
+
+    // Pick a random IV
+    if (!sev::gen_random_bytes(iv, sizeof(iv)))
+        return ERROR_UNSUPPORTED;
+    memcpy(keys.get(), tk, sizeof(tek_tik));
+
+    cmd_ret = sev::package_secret_pieces(keys.get(), measurement, api_minor, iv, 0,
+                                         &piece, 1, packaged, packaged_size,
+                                         &packaged_secret_header);
+    if (cmd_ret == STATUS_SUCCESS)
+        memcpy(header, &packaged_secret_header, sizeof(sev_hdr_buf));
+
+    return cmd_ret;
+}
@@ -0,0 +1,161 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+/**
+ * libsevtool: the guest owner side of sevtool as a library.
+ *
+ * Everything is buffer in/buffer out. Nothing here reads or writes files,
+ * prints, or keeps state between calls, so every function can be called
+ * from any number of threads at once. The only shared state is the SEV
+ * device itself, which is opened on first use (see sevtool_init).
+ *
+ * The buffers use the same binary layouts as the files sevtool writes, so
+ * e.g. sevtool_cert_chain.pdh holds the same bytes as pdh.cert and
+ * sevtool_launch_blob.session the same bytes as launch_blob.bin.
+ *
+ * Unless noted, functions return 0 on success, -1 if the SEV device can't
+ * be opened, or one of the SEV_ERROR_CODEs from sevapi.h.
+ */
+
+#ifndef LIBSEVTOOL_H
+#define LIBSEVTOOL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SEVTOOL_SEV_CERT_SIZE       2084    /* sev_cert */
+#define SEVTOOL_AMD_CERT_MAX_SIZE   1600    /* amd_cert with a 4096 bit key */
+#define SEVTOOL_SESSION_SIZE        128     /* sev_session_buf */
+#define SEVTOOL_TK_SIZE             32      /* tek_tik, the unwrapped TEK and TIK */
+#define SEVTOOL_HMAC_SIZE           32      /* hmac_sha_256 */
+#define SEVTOOL_NONCE_SIZE          16      /* nonce_128 */
+#define SEVTOOL_HDR_SIZE            52      /* sev_hdr_buf */
+
+/* Same values as SEV_BACKEND_TYPE */
+enum sevtool_backend {
+    SEVTOOL_BACKEND_DEFAULT = 0,    /* SEVTOOL_BACKEND env var, else /dev/sev */
+    SEVTOOL_BACKEND_IOCTL   = 1,
+    SEVTOOL_BACKEND_SIM     = 2,
+};
+
+struct sevtool_platform_status {
+    uint8_t  api_major;
+    uint8_t  api_minor;
+    uint8_t  state;             /* SEV_PLATFORM_STATE */
+    uint8_t  owner;
+    uint16_t config;
+    uint8_t  build_id;
+    uint32_t guest_count;
+};
+
+struct sevtool_cert_chain {
+    uint8_t pdh[SEVTOOL_SEV_CERT_SIZE];
+    uint8_t pek[SEVTOOL_SEV_CERT_SIZE];
+    uint8_t oca[SEVTOOL_SEV_CERT_SIZE];
+    uint8_t cek[SEVTOOL_SEV_CERT_SIZE];     /* Signed by the ASK, from the KDS */
+    uint8_t ask[SEVTOOL_AMD_CERT_MAX_SIZE];
+    uint8_t ark[SEVTOOL_AMD_CERT_MAX_SIZE];
+    size_t  ask_size;                       /* AMD certs are variable size */
+    size_t  ark_size;
+};
+
+struct sevtool_launch_blob {
+    uint8_t session[SEVTOOL_SESSION_SIZE];      /* For LAUNCH_START */
+    uint8_t godh_cert[SEVTOOL_SEV_CERT_SIZE];   /* For LAUNCH_START */
+    uint8_t tk[SEVTOOL_TK_SIZE];                /* Keep secret. Needed for the measurement and secret */
+};
+
+/* Same layout as measurement_t */
+struct sevtool_measurement {
+    uint8_t  meas_ctx;          /* 0x04 */
+    uint8_t  api_major;
+    uint8_t  api_minor;
+    uint8_t  build_id;
+    uint32_t policy;
+    uint8_t  digest[32];
+    uint8_t  mnonce[SEVTOOL_NONCE_SIZE];
+    uint8_t  tik[16];
+};
+
+/**
+ * Picks the device backend and opens it. Optional: the first call to
+ * anything that needs the device does sevtool_init(SEVTOOL_BACKEND_DEFAULT).
+ * Once the device is open, asking for a different backend returns
+ * ERROR_INVALID_PARAM.
+ */
+int sevtool_init(int backend);
+
+int sevtool_platform_status(struct sevtool_platform_status *status);
+
+/**
+ * PDH_CERT_EXPORT plus the CEK/ASK/ARK from the KDS. The simulator supplies
+ * those itself; on real hardware they are downloaded like export_cert_chain
+ * does, through a private temp folder that is removed again.
+ */
+int sevtool_export_cert_chain(struct sevtool_cert_chain *chain);
+
+/* ARK -> ASK -> CEK -> PEK (with the OCA) -> PDH. Doesn't need the device */
+int sevtool_validate_cert_chain(const struct sevtool_cert_chain *chain);
+
+/**
+ * Makes a new GODH key pair and TEK/TIK, and wraps them for the PDH.
+ * Doesn't need the device.
+ */
+int sevtool_generate_launch_blob(const uint8_t *pdh, size_t pdh_size,
+                                 uint32_t policy,
+                                 struct sevtool_launch_blob *blob);
+
+/**
+ * The expected LAUNCH_MEASURE HMAC. Which fields are covered depends on the
+ * API version in meas, which should be the one the firmware reported.
+ * Doesn't need the device.
+ */
+int sevtool_calc_measurement(const struct sevtool_measurement *meas,
+                             uint8_t measurement[SEVTOOL_HMAC_SIZE]);
+
+/**
+ * Checks a reported LAUNCH_MEASURE measurement against count approved launch
+ * digests (meas->digest isn't used). On a match, returns 0 and sets *index
+ * to which digest it was, otherwise ERROR_BAD_MEASUREMENT. The HMAC is only
+ * set up once for all of them, and every one is compared in constant time.
+ * Doesn't need the device.
+ */
+int sevtool_match_measurement(const struct sevtool_measurement *meas,
+                              const uint8_t (*digests)[32], size_t count,
+                              const uint8_t measurement[SEVTOOL_HMAC_SIZE],
+                              size_t *index);
+
+/**
+ * Encrypts secret with the TEK for LAUNCH_SECRET. packaged must be
+ * secret_size bytes. api_minor is the firmware's: from 0.17 on the header
+ * MAC also covers the launch measurement. Doesn't need the device.
+ */
+int sevtool_package_secret(const uint8_t tk[SEVTOOL_TK_SIZE],
+                           const uint8_t measurement[SEVTOOL_HMAC_SIZE],
+                           uint8_t api_minor,
+                           const uint8_t *secret, size_t secret_size,
+                           uint8_t *packaged, size_t packaged_size,
+                           uint8_t header[SEVTOOL_HDR_SIZE]);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* LIBSEVTOOL_H */
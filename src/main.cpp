@@ -15,6 +15,10 @@
  **************************************************************************/
 
 #include "commands.h"  // has measurement_t
+#include "launchdigest.h" // for --vcpu_type
+#include "metrics.h"   // for --trace and --metrics
+#include "serializer.h" // for --format
+#include "sessionstore.h" // for --tk_store
 #include "tests.h"     // for test_all
 #include "utilities.h" // for str_to_array
 #include <getopt.h>    // for getopt_long
@@ -24,6 +28,17 @@
 const char help_array[] =  "The following commands are supported:\n" \
                     " sevtool -[global opts] --[command] [command opts]\n" \
                     "(Please see the readme file for more detailed information)\n" \
+                    "Global options:\n" \
+                    "  ofolder [folder]\n" \
+                    "  sim  (use the built-in SEV firmware simulator instead of /dev/sev)\n" \
+                    "  trace [file]  (write a Chrome trace-event JSON file of the run)\n" \
+                    "  metrics [file]  (write latency histograms in Prometheus text format)\n" \
+                    "  format [json|cbor]  (print the results as JSON or CBOR instead of text)\n" \
+                    "  tk_store [file|memory]  (also write tmp_tk.bin for later runs (default), or keep the TEK/TIK in memory only)\n" \
+                    "  vcpus [n|min-max]  (calc_launch_digest for SEV-ES, with this many vCPUs)\n" \
+                    "  vcpu_type [QEMU cpu model|hex signature]  (of the SEV-ES vCPUs, e.g. EPYC-v4)\n" \
+                    "  snp  (calc_launch_digest for SEV-SNP, with --vcpus and --vcpu_type)\n" \
+                    "  threads [n]  (for package_secret_fanout, package/verify_migration and verify_snp_reports, 0 for one per core)\n" \
                     "Platform Owner commands:\n" \
                     "  factory_reset\n" \
                     "  platform_status\n" \
@@ -53,6 +68,10 @@ const char help_array[] =  "The following commands are supported:\n" \
                     "          uint32_t digest\n" \
                     "          uint8_t  m_nonce[128/8]\n" \
                     "          uint8_t  gctx_tik[128/8]\n" \
+                    "  calc_launch_digest\n" \
+                    "      Input params:\n" \
+                    "          OVMF image file\n" \
+                    "          [kernel file, initrd file (or \"\") and cmdline]\n" \
                     "  validate_cert_chain\n" \
                     "  generate_launch_blob\n" \
                     "      Input params:\n" \
@@ -60,6 +79,28 @@ const char help_array[] =  "The following commands are supported:\n" \
                     "  package_secret\n" \
                     "      Input params:\n" \
                     "          launch_blob.txt file\n" \
+                    "  package_secret_table\n" \
+                    "      Input params:\n" \
+                    "          guid=file[,guid=file...]  (guid \"disk\" for the disk passphrase)\n" \
+                    "  package_secret_fanout\n" \
+                    "      Input params:\n" \
+                    "          file of TK + measurement pairs, back to back\n" \
+                    "  package_migration\n" \
+                    "      Input params:\n" \
+                    "          guest memory image file\n" \
+                    "  verify_migration\n" \
+                    "      Input params:\n" \
+                    "          migration stream file\n" \
+                    "          [guest memory image file to compare with]\n" \
+                    "  attest_server\n" \
+                    "      Input params:\n" \
+                    "          port, host:port or Unix socket path to listen on\n" \
+                    "          uint32_t policy\n" \
+                    "          uint8_t  digest[256/8][,digest...]\n" \
+                    "          secret file\n" \
+                    "  verify_snp_reports\n" \
+                    "      Input params:\n" \
+                    "          file of SEV-SNP attestation reports, back to back\n" \
                     ;
 
 /* Flag set by '--verbose' */
@@ -88,9 +129,16 @@ static struct option long_options[] =
     {"export_cert_chain",    no_argument,       0, 'p'},
     /* Guest Owner commands */
     {"calc_measurement",     required_argument, 0, 't'},
+    {"calc_launch_digest",   required_argument, 0, 'D'},
     {"validate_cert_chain",  no_argument,       0, 'u'},
     {"generate_launch_blob", required_argument, 0, 'v'},
     {"package_secret",       no_argument,       0, 'w'},
+    {"package_secret_table", required_argument, 0, 'W'},
+    {"package_secret_fanout", required_argument, 0, 'P'},
+    {"package_migration",    required_argument, 0, 'y'},
+    {"verify_migration",     required_argument, 0, 'Y'},
+    {"attest_server",        required_argument, 0, 'A'},
+    {"verify_snp_reports",   required_argument, 0, 'x'},
 
     /* Run tests */
     {"test_all",             no_argument,       0, 'T'},
@@ -98,6 +146,15 @@ static struct option long_options[] =
     {"help",                 no_argument,       0, 'H'},
     {"sys_info",             no_argument,       0, 'I'},
     {"ofolder",              required_argument, 0, 'O'},
+    {"sim",                  no_argument,       0, 'S'},
+    {"trace",                required_argument, 0, 'R'},
+    {"metrics",              required_argument, 0, 'M'},
+    {"format",               required_argument, 0, 'F'},
+    {"tk_store",             required_argument, 0, 'K'},
+    {"vcpus",                required_argument, 0, 'V'},
+    {"vcpu_type",            required_argument, 0, 'C'},
+    {"snp",                  no_argument,       0, 'N'},
+    {"threads",              required_argument, 0, 'G'},
     {0, 0, 0, 0}
 };
 
@@ -109,6 +166,26 @@ int main(int argc, char **argv)
 
     int cmd_ret = 0xFFFF;
 
+    // --format: every command adds its results to one document, which is
+    // printed instead of the usual text once all the commands have run
+    static uint8_t out_buf[sev::SERIALIZER_DEFAULT_SIZE];
+    sev::Serializer *out = NULL;
+
+    // --vcpus and --vcpu_type: calc_launch_digest for SEV-ES instead of SEV
+    uint32_t min_vcpus = 0;
+    uint32_t max_vcpus = 0;
+    uint32_t vcpu_sig = 0;
+    bool vcpu_type_set = false;
+    bool snp = false;
+
+    // --threads: for the commands that spread work across threads. 0 is one
+    // per core
+    uint32_t threads = 0;
+
+    // Each sevtool run is a new process, so by default the TK goes to
+    // tmp_tk.bin for a later package_secret to read
+    sev::SessionStore::global().set_persist_files(true);
+
     while ((c = getopt_long (argc, argv, "hio:", long_options, &option_index)) != -1)
     {
         switch (c) {
@@ -120,7 +197,7 @@ int main(int argc, char **argv)
             }
             case 'i':           // sys_info
             case 'I': {
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.sys_info();  // Display system info
                 break;
             }
@@ -133,101 +210,169 @@ int main(int argc, char **argv)
                 std::string cmd = "if test -d " + output_folder + " ; then echo \"exist\"; else echo \"no\"; fi";
                 std::string output = "";
                 if (!sev::execute_system_command(cmd, &output)) {
-                    printf("Error. Output directory %s existance check failed.\n", output_folder.c_str());
+                    fprintf(stderr, "Error. Output directory %s existance check failed.\n", output_folder.c_str());
                     return false;
                 }
 
                 if (strncmp(output.c_str(), "exists", 2) != 0) {
-                    printf("Error. Output directory %s does not exist. " \
-                           "Please manually create it and try again\n", output_folder.c_str());
+                    fprintf(stderr, "Error. Output directory %s does not exist. " \
+                                    "Please manually create it and try again\n", output_folder.c_str());
                     return false;
                 }
 
                 break;
             }
+            case 'S': {         // sim
+                SEVDevice::set_backend_type(SEV_BACKEND_SIM);
+                break;
+            }
+            case 'R': {         // trace
+                sev::Metrics::enable_trace(optarg);
+                break;
+            }
+            case 'M': {         // metrics
+                sev::Metrics::enable_metrics(optarg);
+                break;
+            }
+            case 'F': {         // format
+                sev::OUTPUT_FORMAT format = sev::OUTPUT_FORMAT_TEXT;
+                if (!sev::Serializer::parse_format(optarg, &format)) {
+                    fprintf(stderr, "Error: --format must be json or cbor\n");
+                    return false;
+                }
+                out = new sev::Serializer(out_buf, sizeof(out_buf), format);
+                out->begin_map();
+                break;
+            }
+            case 'K': {         // tk_store
+                std::string store = optarg;
+                if (store != "file" && store != "memory") {
+                    fprintf(stderr, "Error: --tk_store must be file or memory\n");
+                    return false;
+                }
+                sev::SessionStore::global().set_persist_files(store == "file");
+                break;
+            }
+            case 'V': {         // vcpus
+                char *end = NULL;
+                unsigned long min_count = strtoul(optarg, &end, 10);
+                unsigned long max_count = min_count;
+                if (*end == '-')
+                    max_count = strtoul(end + 1, &end, 10);
+                if (end == optarg || *end != '\0' || min_count == 0 || min_count > max_count ||
+                    max_count > sev::LAUNCH_MAX_VCPUS) {
+                    fprintf(stderr, "Error: --vcpus must be n or min-max, from 1 to %u\n", sev::LAUNCH_MAX_VCPUS);
+                    return false;
+                }
+                min_vcpus = (uint32_t)min_count;
+                max_vcpus = (uint32_t)max_count;
+                break;
+            }
+            case 'C': {         // vcpu_type
+                if (!sev::vcpu_signature(optarg, &vcpu_sig)) {
+                    fprintf(stderr, "Error: --vcpu_type must be a QEMU EPYC cpu model or a hex signature\n");
+                    return false;
+                }
+                vcpu_type_set = true;
+                break;
+            }
+            case 'N': {         // snp
+                snp = true;
+                break;
+            }
+            case 'G': {         // threads
+                char *end = NULL;
+                unsigned long count = strtoul(optarg, &end, 10);
+                if (end == optarg || *end != '\0' || count > UINT32_MAX) {
+                    fprintf(stderr, "Error: --threads must be a number of threads, or 0 for one per core\n");
+                    return false;
+                }
+                threads = (uint32_t)count;
+                break;
+            }
             case 'a': {         // PLATFORM_RESET
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.factory_reset();
                 break;
             }
             case 'b': {         // PLATFORM_STATUS
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.platform_status();
                 break;
             }
             case 'c': {         // PEK_GEN
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.pek_gen();
                 break;
             }
             case 'd': {         // PEK_CSR
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.pek_csr();
                 break;
             }
             case 'e': {         // PDH_GEN
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.pdh_gen();
                 break;
             }
             case 'f': {         // PDH_CERT_EXPORT
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.pdh_cert_export();
                 break;
             }
             case 'g': {         // PEK_CERT_IMPORT
                 optind--;   // Can't use option_index because it doesn't account for '-' flags
                 if (argc - optind != 1) {
-                    printf("Error: Expecting exactly 1 arg for pek_cert_import\n");
+                    fprintf(stderr, "Error: Expecting exactly 1 arg for pek_cert_import\n");
                     return false;
                 }
 
                 std::string oca_priv_key_file = argv[optind++];
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.pek_cert_import(oca_priv_key_file);
                 break;
             }
             case 'j': {         // GET_ID
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.get_id();
                 break;
             }
             case 'k': {         // SET_SELF_OWNED
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.set_self_owned();
                 break;
             }
             case 'l': {         // SET_EXTERNALLY_OWNED
                 optind--;   // Can't use option_index because it doesn't account for '-' flags
                 if (argc - optind != 1) {
-                    printf("Error: Expecting exactly 1 arg for set_externally_owned\n");
+                    fprintf(stderr, "Error: Expecting exactly 1 arg for set_externally_owned\n");
                     return false;
                 }
 
                 std::string oca_priv_key_file = argv[optind++];
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.set_externally_owned(oca_priv_key_file);
                 break;
             }
             case 'm': {         // GENERATE_CEK_ASK
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.generate_cek_ask();
                 break;
             }
             case 'n': {         // GET_ASK_ARK
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.get_ask_ark();
                 break;
             }
             case 'p': {         // EXPORT_CERT_CHAIN
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.export_cert_chain();
                 break;
             }
             case 't': {         // CALC_MEASUREMENT
                 optind--;   // Can't use option_index because it doesn't account for '-' flags
                 if (argc - optind != 8) {
-                    printf("Error: Expecting exactly 8 args for calc_measurement\n");
+                    fprintf(stderr, "Error: Expecting exactly 8 args for calc_measurement\n");
                     return false;
                 }
 
@@ -240,32 +385,142 @@ int main(int argc, char **argv)
                 sev::str_to_array(std::string(argv[optind++]), (uint8_t *)&user_data.digest, sizeof(user_data.digest));
                 sev::str_to_array(std::string(argv[optind++]), (uint8_t *)&user_data.mnonce, sizeof(user_data.mnonce));
                 sev::str_to_array(std::string(argv[optind++]), (uint8_t *)&user_data.tik,    sizeof(user_data.tik));
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.calc_measurement(&user_data);
                 break;
             }
+            case 'D': {         // CALC_LAUNCH_DIGEST
+                optind--;   // Can't use option_index because it doesn't account for '-' flags
+                if (argc - optind != 1 && argc - optind != 4) {
+                    fprintf(stderr, "Error: Expecting 1 (OVMF) or 4 (OVMF, kernel, initrd, cmdline) args for calc_launch_digest\n");
+                    return false;
+                }
+
+                std::string ovmf_file = argv[optind++];
+                std::string kernel_file = "";
+                std::string initrd_file = "";
+                std::string cmdline = "";
+                if (optind < argc) {
+                    kernel_file = argv[optind++];
+                    initrd_file = argv[optind++];
+                    cmdline = argv[optind++];
+                }
+                // The VMSAs have the vCPU signature in them, so there's no default
+                if (max_vcpus != 0 && !vcpu_type_set) {
+                    fprintf(stderr, "Error: --vcpus needs --vcpu_type\n");
+                    return false;
+                }
+                if (snp && max_vcpus == 0) {
+                    fprintf(stderr, "Error: --snp needs --vcpus and --vcpu_type\n");
+                    return false;
+                }
+                Command cmd(output_folder, verbose_flag, out);
+                cmd_ret = cmd.calc_launch_digest(ovmf_file, kernel_file, initrd_file, cmdline,
+                                                 min_vcpus, max_vcpus, vcpu_sig, snp);
+                break;
+            }
             case 'u': {         // VALIDATE_CERT_CHAIN
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.validate_cert_chain();
                 break;
             }
             case 'v': {         // GENERATE_LAUNCH_BLOB
                 optind--;   // Can't use option_index because it doesn't account for '-' flags
                 if (argc - optind != 1) {
-                    printf("Error: Expecting exactly 1 arg for generate_launch_blob\n");
+                    fprintf(stderr, "Error: Expecting exactly 1 arg for generate_launch_blob\n");
                     return false;
                 }
 
                 uint32_t guest_policy = (uint8_t)strtol(argv[optind++], NULL, 16);
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.generate_launch_blob(guest_policy);
                 break;
             }
             case 'w': {         // PACKAGE_SECRET
-                Command cmd(output_folder, verbose_flag);
+                Command cmd(output_folder, verbose_flag, out);
                 cmd_ret = cmd.package_secret();
                 break;
             }
+            case 'W': {         // PACKAGE_SECRET_TABLE
+                optind--;   // Can't use option_index because it doesn't account for '-' flags
+                if (argc - optind != 1) {
+                    fprintf(stderr, "Error: Expecting exactly 1 arg for package_secret_table\n");
+                    return false;
+                }
+
+                std::string secrets = argv[optind++];
+                Command cmd(output_folder, verbose_flag, out);
+                cmd_ret = cmd.package_secret_table(secrets);
+                break;
+            }
+            case 'P': {         // PACKAGE_SECRET_FANOUT
+                optind--;   // Can't use option_index because it doesn't account for '-' flags
+                if (argc - optind != 1) {
+                    fprintf(stderr, "Error: Expecting exactly 1 arg for package_secret_fanout\n");
+                    return false;
+                }
+
+                std::string session_file = argv[optind++];
+                Command cmd(output_folder, verbose_flag, out);
+                cmd_ret = cmd.package_secret_fanout(session_file, threads);
+                break;
+            }
+            case 'y': {         // PACKAGE_MIGRATION
+                optind--;   // Can't use option_index because it doesn't account for '-' flags
+                if (argc - optind != 1) {
+                    fprintf(stderr, "Error: Expecting exactly 1 arg for package_migration\n");
+                    return false;
+                }
+
+                std::string image_file = argv[optind++];
+                Command cmd(output_folder, verbose_flag, out);
+                cmd_ret = cmd.package_migration(image_file, 0, threads);
+                break;
+            }
+            case 'Y': {         // VERIFY_MIGRATION
+                optind--;   // Can't use option_index because it doesn't account for '-' flags
+                if (argc - optind != 1 && argc - optind != 2) {
+                    fprintf(stderr, "Error: Expecting 1 (stream) or 2 (stream, image) args for verify_migration\n");
+                    return false;
+                }
+
+                std::string stream_file = argv[optind++];
+                std::string image_file = "";
+                if (optind < argc)
+                    image_file = argv[optind++];
+                Command cmd(output_folder, verbose_flag, out);
+                cmd_ret = cmd.verify_migration(stream_file, image_file, threads);
+                break;
+            }
+#ifdef __linux__
+            case 'A': {         // ATTEST_SERVER
+                optind--;   // Can't use option_index because it doesn't account for '-' flags
+                if (argc - optind != 4) {
+                    fprintf(stderr, "Error: Expecting exactly 4 args for attest_server\n");
+                    return false;
+                }
+
+                std::string listen = argv[optind++];
+                uint32_t guest_policy = (uint32_t)strtoul(argv[optind++], NULL, 16);
+                std::string digest = argv[optind++];
+                std::string secret_file = argv[optind++];
+                Command cmd(output_folder, verbose_flag, out);
+                cmd_ret = cmd.attest_server(listen, guest_policy, digest, secret_file);
+                break;
+            }
+            case 'x': {         // VERIFY_SNP_REPORTS
+                optind--;   // Can't use option_index because it doesn't account for '-' flags
+                if (argc - optind != 1) {
+                    fprintf(stderr, "Error: Expecting exactly 1 arg for verify_snp_reports\n");
+                    return false;
+                }
+
+                std::string report_file = argv[optind++];
+                Command cmd(output_folder, verbose_flag, out);
+                cmd_ret = cmd.verify_snp_reports(report_file, threads);
+                break;
+            }
+#endif
             case 'T': {         // Run Tests
                 Tests test(output_folder, verbose_flag);
                 cmd_ret = (test.test_all() == 0); // 0 = fail, 1 = pass
@@ -283,9 +538,25 @@ int main(int argc, char **argv)
         }
     }
 
-    if (cmd_ret == 0) {
+    if (out) {
+        out->add_int("status", cmd_ret);
+        out->end_map();
+        if (!out->ok()) {
+            fprintf(stderr, "Error: the results don't fit in %zu bytes\n", sizeof(out_buf));
+        }
+        else {
+            fwrite(out->data(), 1, out->size(), stdout);
+            if (out->format() == sev::OUTPUT_FORMAT_JSON)
+                printf("\n");
+        }
+        delete out;
+    }
+    else if (cmd_ret == 0) {
         printf("\nCommand Successful\n");
     }
+    else if (cmd_ret == STATUS_NO_CHANGE) {
+        printf("\nCommand Successful, nothing changed since the last export\n");
+    }
     else if (cmd_ret == 0xFFFF) {
         printf("\nCommand not supported/recognized. Possibly bad formatting\n");
     }
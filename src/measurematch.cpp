@@ -0,0 +1,130 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "measurematch.h"
+#include <cstring>
+#include <openssl/crypto.h>     // for CRYPTO_memcmp, OPENSSL_cleanse
+
+static constexpr uint8_t HMAC_IPAD = 0x36;
+static constexpr uint8_t HMAC_OPAD = 0x5c;
+
+sev::MeasurementMatcher::MeasurementMatcher(const uint8_t *tik, size_t tik_size,
+                                            uint8_t meas_ctx, uint8_t api_major,
+                                            uint8_t api_minor, uint8_t build_id,
+                                            uint32_t policy)
+                       : m_ok(false)
+{
+    uint8_t pad[SHA256_CBLOCK];
+    const uint8_t fields[4] = {meas_ctx, api_major, api_minor, build_id};
+
+    do {
+        if (!tik || tik_size == 0)
+            break;
+
+        // Keys longer than a block are hashed first, as in HMAC_Init
+        memset(pad, 0, sizeof(pad));
+        if (tik_size > sizeof(pad))
+            SHA256(tik, tik_size, pad);
+        else
+            memcpy(pad, tik, tik_size);
+
+        for (size_t i = 0; i < sizeof(pad); i++)
+            pad[i] ^= HMAC_IPAD;
+        if (SHA256_Init(&m_inner) != 1 || SHA256_Update(&m_inner, pad, sizeof(pad)) != 1)
+            break;
+        for (size_t i = 0; i < sizeof(pad); i++)
+            pad[i] ^= HMAC_IPAD ^ HMAC_OPAD;
+        if (SHA256_Init(&m_outer) != 1 || SHA256_Update(&m_outer, pad, sizeof(pad)) != 1)
+            break;
+
+        if (api_minor >= 17 && SHA256_Update(&m_inner, fields, sizeof(fields)) != 1)
+            break;
+        if (SHA256_Update(&m_inner, &policy, sizeof(policy)) != 1)
+            break;
+
+        m_ok = true;
+    } while (0);
+
+    OPENSSL_cleanse(pad, sizeof(pad));
+}
+
+sev::MeasurementMatcher::~MeasurementMatcher()
+{
+    OPENSSL_cleanse(&m_inner, sizeof(m_inner));
+    OPENSSL_cleanse(&m_outer, sizeof(m_outer));
+}
+
+bool sev::MeasurementMatcher::measure(const uint8_t *digest, const uint8_t *mnonce,
+                                      uint8_t *measurement) const
+{
+    SHA256_CTX ctx;
+    uint8_t inner[SHA256_DIGEST_LENGTH];
+    bool ret = false;
+
+    do {
+        if (!m_ok)
+            break;
+
+        memcpy(&ctx, &m_inner, sizeof(ctx));
+        if (SHA256_Update(&ctx, digest, MEASURE_DIGEST_SIZE) != 1)
+            break;
+        if (SHA256_Update(&ctx, mnonce, MEASURE_NONCE_SIZE) != 1)
+            break;
+        if (SHA256_Final(inner, &ctx) != 1)
+            break;
+
+        memcpy(&ctx, &m_outer, sizeof(ctx));
+        if (SHA256_Update(&ctx, inner, sizeof(inner)) != 1)
+            break;
+        if (SHA256_Final(measurement, &ctx) != 1)
+            break;
+
+        ret = true;
+    } while (0);
+
+    OPENSSL_cleanse(&ctx, sizeof(ctx));
+    OPENSSL_cleanse(inner, sizeof(inner));
+    return ret;
+}
+
+int sev::MeasurementMatcher::match(const uint8_t (*digests)[MEASURE_DIGEST_SIZE],
+                                   size_t count, const uint8_t *mnonce,
+                                   const uint8_t *measurement) const
+{
+    uint8_t candidate[SHA256_DIGEST_LENGTH];
+    uint32_t found = 0;         // All ones once a candidate matched
+    uint32_t index = 0;
+    bool failed = false;
+
+    if (!m_ok || !digests || !mnonce || !measurement || count > INT32_MAX)
+        return -1;
+
+    for (size_t i = 0; i < count; i++) {
+        failed |= !measure(digests[i], mnonce, candidate);
+
+        // Only the first match is kept, without a branch on which one it was
+        uint32_t equal = 0u - (uint32_t)(CRYPTO_memcmp(candidate, measurement,
+                                                       sizeof(candidate)) == 0);
+        uint32_t first = equal & ~found;
+        index = (index & ~first) | ((uint32_t)i & first);
+        found |= equal;
+    }
+    OPENSSL_cleanse(candidate, sizeof(candidate));
+
+    if (failed || !found)
+        return -1;
+    return (int)index;
+}
@@ -0,0 +1,75 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef MEASUREMATCH_H
+#define MEASUREMATCH_H
+
+#include <cstddef>
+#include <cstdint>
+#include <openssl/sha.h>
+
+namespace sev
+{
+    constexpr size_t MEASURE_DIGEST_SIZE = 32;
+    constexpr size_t MEASURE_NONCE_SIZE  = 16;
+
+    /**
+     * Checks a LAUNCH_MEASURE measurement against a list of approved launch
+     * digests. The measurement is
+     *   HMAC-SHA256(TIK, meas_ctx || api_major || api_minor || build_id ||
+     *                    policy || digest || mnonce)
+     * and everything up to the digest is the same for every candidate, so
+     * the HMAC's inner SHA-256 state is hashed that far (and the outer one
+     * through the key block) once, here. Each candidate then starts from a
+     * copy of those states instead of a new HMAC: three SHA-256 blocks
+     * instead of five, and no key setup or EVP calls.
+     *
+     * meas_ctx..build_id are only in the HMAC from API 0.17 on, the same as
+     * calc_launch_measurement. The states are as secret as the TIK,
+     * and are wiped by the destructor.
+     */
+    class MeasurementMatcher {
+    private:
+        SHA256_CTX m_inner;     // After (TIK ^ ipad) and the fields up to policy
+        SHA256_CTX m_outer;     // After (TIK ^ opad)
+        bool m_ok;
+
+        MeasurementMatcher(const MeasurementMatcher&) = delete;
+        MeasurementMatcher& operator=(const MeasurementMatcher&) = delete;
+
+    public:
+        MeasurementMatcher(const uint8_t *tik, size_t tik_size, uint8_t meas_ctx,
+                           uint8_t api_major, uint8_t api_minor, uint8_t build_id,
+                           uint32_t policy);
+        ~MeasurementMatcher();
+
+        bool ok(void) const { return m_ok; }
+
+        // The measurement for one digest
+        bool measure(const uint8_t *digest, const uint8_t *mnonce, uint8_t *measurement) const;
+
+        /**
+         * Index of the digest whose measurement is measurement, or -1 if
+         * none is. Every candidate is measured and compared in constant
+         * time, whether or not an earlier one matched, so the time taken
+         * doesn't say which one did
+         */
+        int match(const uint8_t (*digests)[MEASURE_DIGEST_SIZE], size_t count,
+                  const uint8_t *mnonce, const uint8_t *measurement) const;
+    };
+}
+
+#endif /* MEASUREMATCH_H */
@@ -0,0 +1,417 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "metrics.h"
+#include <chrono>
+#include <cmath>        // for ceil
+#include <cstdio>       // for fopen, std::rename
+#include <cstdlib>      // for atexit
+#include <mutex>
+#ifdef __linux__
+#include <unistd.h>     // for getpid
+#endif
+
+struct trace_event {
+    const sev::LatencyHistogram *hist;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    uint32_t tid;
+};
+
+static const char *metric_categories[][2] = {
+    {sev::METRIC_CAT_IOCTL,   "Time spent in SEV firmware commands"},
+    {sev::METRIC_CAT_COMMAND, "Time spent in each sevtool command"},
+    {sev::METRIC_CAT_KDS,     "Time spent downloading certs from the AMD servers"},
+    {sev::METRIC_CAT_VERIFY,  "Time spent validating certificate signatures"},
+};
+
+// Prometheus histogram bucket bounds, 10us to 60s
+static const uint64_t prometheus_bounds_ns[] = {
+    10000ULL, 25000ULL, 50000ULL, 100000ULL, 250000ULL, 500000ULL,
+    1000000ULL, 2500000ULL, 5000000ULL, 10000000ULL, 25000000ULL, 50000000ULL,
+    100000000ULL, 250000000ULL, 500000000ULL, 1000000000ULL, 2500000000ULL,
+    5000000000ULL, 10000000000ULL, 30000000000ULL, 60000000000ULL,
+};
+
+static const double reported_percentiles[] = {50.0, 90.0, 99.0, 99.9};
+
+static const uint64_t process_start_ns = sev::Metrics::now_ns();
+
+static std::mutex metrics_mutex;
+static sev::LatencyHistogram *histograms[sev::METRIC_MAX_HISTOGRAMS];
+static size_t histogram_count = 0;
+
+static std::atomic<bool> trace_on(false);
+static trace_event *trace_events = NULL;    // Ring of TRACE_MAX_EVENTS
+static uint64_t trace_event_total = 0;      // Events ever added to the ring
+static std::string trace_file = "";
+static std::string metrics_file = "";
+static bool flush_registered = false;
+
+static std::atomic<uint32_t> next_thread_id(1);
+static thread_local uint32_t thread_id = 0;
+
+sev::LatencyHistogram::LatencyHistogram(const std::string category,
+                                        const std::string name)
+    : m_category(category), m_name(name)
+{
+    reset();
+}
+
+uint32_t sev::LatencyHistogram::slot_index(uint64_t value_ns)
+{
+    if (value_ns < HIST_SUB_BUCKETS)
+        return (uint32_t)value_ns;
+
+    uint32_t msb = 63 - (uint32_t)__builtin_clzll(value_ns);
+    uint32_t shift = msb - HIST_SUB_BUCKET_BITS;
+    uint32_t sub = (uint32_t)(value_ns >> shift) & (HIST_SUB_BUCKETS - 1);
+    return (shift + 1) * HIST_SUB_BUCKETS + sub;
+}
+
+uint64_t sev::LatencyHistogram::slot_lowest(uint32_t index)
+{
+    if (index < HIST_SUB_BUCKETS)
+        return index;
+
+    uint32_t shift = index / HIST_SUB_BUCKETS - 1;
+    uint64_t sub = index % HIST_SUB_BUCKETS;
+    return (HIST_SUB_BUCKETS + sub) << shift;
+}
+
+uint64_t sev::LatencyHistogram::slot_highest(uint32_t index)
+{
+    if (index < HIST_SUB_BUCKETS)
+        return index;
+
+    uint32_t shift = index / HIST_SUB_BUCKETS - 1;
+    return slot_lowest(index) + ((1ULL << shift) - 1);
+}
+
+void sev::LatencyHistogram::record(uint64_t value_ns)
+{
+    m_counts[slot_index(value_ns)].fetch_add(1, std::memory_order_relaxed);
+    m_total.fetch_add(1, std::memory_order_relaxed);
+    m_sum_ns.fetch_add(value_ns, std::memory_order_relaxed);
+
+    uint64_t max = m_max_ns.load(std::memory_order_relaxed);
+    while (value_ns > max &&
+           !m_max_ns.compare_exchange_weak(max, value_ns, std::memory_order_relaxed)) {
+    }
+}
+
+void sev::LatencyHistogram::reset(void)
+{
+    for (uint32_t i = 0; i < HIST_SLOTS; i++)
+        m_counts[i].store(0, std::memory_order_relaxed);
+    m_total.store(0, std::memory_order_relaxed);
+    m_sum_ns.store(0, std::memory_order_relaxed);
+    m_max_ns.store(0, std::memory_order_relaxed);
+}
+
+/**
+ * Counts everything recorded in the slot value_ns falls in, so the answer
+ * can be high by up to 1/HIST_SUB_BUCKETS of value_ns
+ */
+uint64_t sev::LatencyHistogram::count_at_or_below(uint64_t value_ns) const
+{
+    uint32_t last = slot_index(value_ns);
+    uint64_t count = 0;
+
+    for (uint32_t i = 0; i <= last; i++)
+        count += m_counts[i].load(std::memory_order_relaxed);
+
+    return count;
+}
+
+/**
+ * Returns the highest value (in ns) that's in the same slot as the value
+ * at the given percentile (0-100), capped to the largest value recorded
+ */
+uint64_t sev::LatencyHistogram::value_at_percentile(double percentile) const
+{
+    uint64_t total = 0;
+    for (uint32_t i = 0; i < HIST_SLOTS; i++)
+        total += m_counts[i].load(std::memory_order_relaxed);
+    if (total == 0)
+        return 0;
+
+    uint64_t target = (uint64_t)ceil((percentile / 100.0) * (double)total);
+    if (target == 0)
+        target = 1;
+
+    uint64_t max = max_ns();
+    uint64_t count = 0;
+    for (uint32_t i = 0; i < HIST_SLOTS; i++) {
+        count += m_counts[i].load(std::memory_order_relaxed);
+        if (count >= target)
+            return (slot_highest(i) < max) ? slot_highest(i) : max;
+    }
+    return max;
+}
+
+uint64_t sev::Metrics::now_ns(void)
+{
+    return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/**
+ * Returns the histogram for category/name, creating it if this is the
+ * first time it's been asked for. Returns NULL once METRIC_MAX_HISTOGRAMS
+ * have been created; record() ignores those.
+ */
+sev::LatencyHistogram *sev::Metrics::histogram(const char *category,
+                                               const std::string name)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+
+    for (size_t i = 0; i < histogram_count; i++) {
+        if (histograms[i]->name() == name && histograms[i]->category() == category)
+            return histograms[i];
+    }
+
+    if (histogram_count == METRIC_MAX_HISTOGRAMS)
+        return NULL;
+
+    LatencyHistogram *hist = new LatencyHistogram(category, name);
+    histograms[histogram_count++] = hist;
+    return hist;
+}
+
+void sev::Metrics::record(LatencyHistogram *hist, uint64_t start_ns,
+                          uint64_t duration_ns)
+{
+    if (!hist)
+        return;
+
+    hist->record(duration_ns);
+
+    if (!trace_on.load(std::memory_order_relaxed))
+        return;
+
+    if (thread_id == 0)
+        thread_id = next_thread_id.fetch_add(1);
+
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    trace_event *event = &trace_events[trace_event_total % TRACE_MAX_EVENTS];
+    event->hist = hist;
+    event->start_ns = start_ns;
+    event->duration_ns = duration_ns;
+    event->tid = thread_id;
+    trace_event_total++;
+}
+
+static void flush_at_exit(void)
+{
+    sev::Metrics::flush();
+}
+
+static void register_flush(void)
+{
+    if (!flush_registered) {
+        atexit(flush_at_exit);
+        flush_registered = true;
+    }
+}
+
+void sev::Metrics::enable_trace(const std::string file_name)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+
+    if (!trace_events)
+        trace_events = new trace_event[TRACE_MAX_EVENTS];
+    trace_file = file_name;
+    register_flush();
+    trace_on.store(true);
+}
+
+void sev::Metrics::enable_metrics(const std::string file_name)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+
+    metrics_file = file_name;
+    register_flush();
+}
+
+bool sev::Metrics::trace_enabled(void)
+{
+    return trace_on.load(std::memory_order_relaxed);
+}
+
+/**
+ * Description: Renders every histogram in the Prometheus text exposition
+ *              format. Each category becomes one histogram family
+ *              (sevtool_<category>_duration_seconds) with one series per
+ *              op, plus a gauge family with the HDR percentiles
+ */
+std::string sev::Metrics::prometheus_text(void)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    std::string out = "";
+    char line[256];
+
+    for (size_t c = 0; c < sizeof(metric_categories)/sizeof(metric_categories[0]); c++) {
+        const char *category = metric_categories[c][0];
+        std::string family = std::string("sevtool_") + category + "_duration_seconds";
+        bool header_done = false;
+
+        for (size_t i = 0; i < histogram_count; i++) {
+            const LatencyHistogram *hist = histograms[i];
+            if (hist->category() != category)
+                continue;
+
+            if (!header_done) {
+                out += "# HELP " + family + " " + metric_categories[c][1] + "\n";
+                out += "# TYPE " + family + " histogram\n";
+                header_done = true;
+            }
+
+            const char *op = hist->name().c_str();
+            for (size_t b = 0; b < sizeof(prometheus_bounds_ns)/sizeof(prometheus_bounds_ns[0]); b++) {
+                snprintf(line, sizeof(line), "%s_bucket{op=\"%s\",le=\"%g\"} %llu\n",
+                         family.c_str(), op, (double)prometheus_bounds_ns[b] / 1e9,
+                         (unsigned long long)hist->count_at_or_below(prometheus_bounds_ns[b]));
+                out += line;
+            }
+            // Use the buckets for the count too, so +Inf always matches it
+            unsigned long long count = (unsigned long long)hist->count_at_or_below(UINT64_MAX);
+            snprintf(line, sizeof(line), "%s_bucket{op=\"%s\",le=\"+Inf\"} %llu\n",
+                     family.c_str(), op, count);
+            out += line;
+            snprintf(line, sizeof(line), "%s_sum{op=\"%s\"} %.9f\n",
+                     family.c_str(), op, (double)hist->sum_ns() / 1e9);
+            out += line;
+            snprintf(line, sizeof(line), "%s_count{op=\"%s\"} %llu\n",
+                     family.c_str(), op, count);
+            out += line;
+        }
+
+        if (!header_done)
+            continue;
+
+        std::string quantiles = std::string("sevtool_") + category + "_duration_percentile_seconds";
+        out += "# HELP " + quantiles + " HDR histogram percentiles of " +
+               family + "\n";
+        out += "# TYPE " + quantiles + " gauge\n";
+        for (size_t i = 0; i < histogram_count; i++) {
+            const LatencyHistogram *hist = histograms[i];
+            if (hist->category() != category)
+                continue;
+            for (size_t p = 0; p < sizeof(reported_percentiles)/sizeof(reported_percentiles[0]); p++) {
+                snprintf(line, sizeof(line), "%s{op=\"%s\",percentile=\"%g\"} %.9f\n",
+                         quantiles.c_str(), hist->name().c_str(), reported_percentiles[p],
+                         (double)hist->value_at_percentile(reported_percentiles[p]) / 1e9);
+                out += line;
+            }
+        }
+    }
+
+    return out;
+}
+
+/**
+ * Description: Renders the captured events in the Chrome trace-event
+ *              format (chrome://tracing, Perfetto). Every event is a
+ *              complete ("X") event with its start and duration in us,
+ *              relative to when the process started
+ */
+std::string sev::Metrics::trace_json(void)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+    std::string out = "{\"traceEvents\":[\n";
+    char line[512];
+#ifdef __linux__
+    int pid = (int)getpid();
+#else
+    int pid = 1;
+#endif
+
+    snprintf(line, sizeof(line), "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":%d,"
+             "\"tid\":0,\"args\":{\"name\":\"sevtool\"}}", pid);
+    out += line;
+
+    uint64_t first = (trace_event_total > TRACE_MAX_EVENTS) ?
+                     trace_event_total - TRACE_MAX_EVENTS : 0;
+    for (uint64_t i = first; i < trace_event_total; i++) {
+        const trace_event *event = &trace_events[i % TRACE_MAX_EVENTS];
+        snprintf(line, sizeof(line), ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\","
+                 "\"pid\":%d,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f}",
+                 event->hist->name().c_str(), event->hist->category().c_str(),
+                 pid, event->tid,
+                 (double)(event->start_ns - process_start_ns) / 1000.0,
+                 (double)event->duration_ns / 1000.0);
+        out += line;
+    }
+    out += "\n],\"displayTimeUnit\":\"ms\"}\n";
+
+    return out;
+}
+
+// Write to a temp file and rename it, so readers never see half a file
+static bool replace_file(const std::string file_name, const std::string &contents)
+{
+    std::string tmp_name = file_name + ".tmp";
+    FILE *file = fopen(tmp_name.c_str(), "wb");
+    if (!file) {
+        fprintf(stderr, "Error: unable to open %s\n", tmp_name.c_str());
+        return false;
+    }
+
+    bool ok = (fwrite(contents.data(), 1, contents.size(), file) == contents.size());
+    ok = (fclose(file) == 0) && ok;
+    if (ok)
+        ok = (std::rename(tmp_name.c_str(), file_name.c_str()) == 0);
+    if (!ok) {
+        fprintf(stderr, "Error: unable to write %s\n", file_name.c_str());
+        remove(tmp_name.c_str());
+    }
+    return ok;
+}
+
+/**
+ * Description: Writes the --trace and --metrics files (whichever are on)
+ *              with everything recorded so far. Runs at exit, and can be
+ *              called at any time by long running users
+ */
+bool sev::Metrics::flush(void)
+{
+    bool ret = true;
+    std::string trace_name, metrics_name;
+
+    {
+        std::lock_guard<std::mutex> lock(metrics_mutex);
+        trace_name = trace_file;
+        metrics_name = metrics_file;
+    }
+
+    if (!trace_name.empty())
+        ret = replace_file(trace_name, trace_json()) && ret;
+    if (!metrics_name.empty())
+        ret = replace_file(metrics_name, prometheus_text()) && ret;
+
+    return ret;
+}
+
+// Clear all recorded values and trace events. The histograms stay registered
+void sev::Metrics::reset(void)
+{
+    std::lock_guard<std::mutex> lock(metrics_mutex);
+
+    for (size_t i = 0; i < histogram_count; i++)
+        histograms[i]->reset();
+    trace_event_total = 0;
+}
@@ -0,0 +1,140 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace sev
+{
+    // Metric categories. Each one is a separate Prometheus metric family
+    constexpr char METRIC_CAT_IOCTL[]   = "ioctl";      // SEVDevice::sev_ioctl, per firmware command
+    constexpr char METRIC_CAT_COMMAND[] = "command";    // Command public functions
+    constexpr char METRIC_CAT_KDS[]     = "kds";        // Cert downloads from the AMD servers
+    constexpr char METRIC_CAT_VERIFY[]  = "verify";     // SEVCert/AMDCert signature checks
+
+    constexpr size_t METRIC_MAX_HISTOGRAMS = 96;
+    constexpr size_t TRACE_MAX_EVENTS      = 65536;     // Oldest events get dropped after this
+
+    /**
+     * Latency histogram with the HdrHistogram bucket layout. Values (in ns)
+     * are put in power-of-two ranges that are each split into
+     * HIST_SUB_BUCKETS linear buckets, so every value is kept to within
+     * 1/HIST_SUB_BUCKETS (6.25%) of what was recorded, from 1ns up to the
+     * full 64-bit range, in under 8KB. record() is lock free and can be
+     * called from any thread.
+     */
+    class LatencyHistogram {
+    public:
+        static constexpr uint32_t HIST_SUB_BUCKET_BITS = 4;
+        static constexpr uint32_t HIST_SUB_BUCKETS     = 1 << HIST_SUB_BUCKET_BITS;
+        static constexpr uint32_t HIST_SLOTS = (64 - HIST_SUB_BUCKET_BITS + 1) * HIST_SUB_BUCKETS;
+
+    private:
+        std::string m_category;
+        std::string m_name;
+        std::atomic<uint64_t> m_counts[HIST_SLOTS];
+        std::atomic<uint64_t> m_total;
+        std::atomic<uint64_t> m_sum_ns;
+        std::atomic<uint64_t> m_max_ns;
+
+        static uint32_t slot_index(uint64_t value_ns);
+        static uint64_t slot_lowest(uint32_t index);
+        static uint64_t slot_highest(uint32_t index);
+
+        LatencyHistogram(const LatencyHistogram&) = delete;
+        LatencyHistogram& operator=(const LatencyHistogram&) = delete;
+
+    public:
+        LatencyHistogram(const std::string category, const std::string name);
+
+        const std::string &category(void) const { return m_category; }
+        const std::string &name(void) const { return m_name; }
+
+        void record(uint64_t value_ns);
+        void reset(void);
+        uint64_t count(void) const { return m_total.load(std::memory_order_relaxed); }
+        uint64_t sum_ns(void) const { return m_sum_ns.load(std::memory_order_relaxed); }
+        uint64_t max_ns(void) const { return m_max_ns.load(std::memory_order_relaxed); }
+        uint64_t count_at_or_below(uint64_t value_ns) const;
+        uint64_t value_at_percentile(double percentile) const;
+    };
+
+    /**
+     * Process wide registry of the latency histograms, plus the optional
+     * Chrome trace-event recorder (--trace) and Prometheus text dump
+     * (--metrics). Histograms are created on first use and live until the
+     * process exits, so callers can keep the pointers.
+     *
+     * One-shot runs get both files written when the process exits. Long
+     * running users (a daemon) call flush() whenever they want the files
+     * brought up to date; the trace keeps only the last TRACE_MAX_EVENTS
+     * events, so its memory use stays bounded.
+     */
+    class Metrics {
+    public:
+        static uint64_t now_ns(void);
+
+        static LatencyHistogram *histogram(const char *category, const std::string name);
+        static void record(LatencyHistogram *hist, uint64_t start_ns, uint64_t duration_ns);
+
+        static void enable_trace(const std::string file_name);
+        static void enable_metrics(const std::string file_name);
+        static bool trace_enabled(void);
+
+        static std::string prometheus_text(void);
+        static std::string trace_json(void);
+        static bool flush(void);
+        static void reset(void);
+    };
+
+    /**
+     * Times the enclosing scope and records it in a histogram (and the
+     * trace, if one is being captured) when it goes out of scope
+     */
+    class TraceScope {
+    private:
+        LatencyHistogram *m_hist;
+        uint64_t m_start_ns;
+
+    public:
+        explicit TraceScope(LatencyHistogram *hist)
+            : m_hist(hist), m_start_ns(Metrics::now_ns()) {}
+        ~TraceScope(void)
+        {
+            Metrics::record(m_hist, m_start_ns, Metrics::now_ns() - m_start_ns);
+        }
+    };
+
+    #define SEV_METRIC_CONCAT2(a, b) a##b
+    #define SEV_METRIC_CONCAT(a, b)  SEV_METRIC_CONCAT2(a, b)
+
+    /**
+     * Ex) SEV_TRACE_SCOPE(sev::METRIC_CAT_COMMAND, "pek_gen");
+     * The histogram is only looked up the first time the line runs
+     */
+    #define SEV_TRACE_SCOPE(category, name)                                       \
+        static sev::LatencyHistogram *SEV_METRIC_CONCAT(sev_trace_hist_, __LINE__) = \
+            sev::Metrics::histogram(category, name);                              \
+        sev::TraceScope SEV_METRIC_CONCAT(sev_trace_scope_, __LINE__)(            \
+            SEV_METRIC_CONCAT(sev_trace_hist_, __LINE__))
+}
+
+#endif /* METRICS_H */
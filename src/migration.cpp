@@ -0,0 +1,287 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "migration.h"
+#include "csprng.h"
+#include "metrics.h"
+#include <algorithm>            // for std::min
+#include <atomic>
+#include <cstring>
+#include <openssl/crypto.h>     // for CRYPTO_memcmp
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+#include <thread>
+
+namespace {
+struct migration_job {
+    const tek_tik *tk;
+    const uint8_t *image;       // To pack from, or compare with. May be NULL to verify
+    size_t image_size;
+    uint8_t *out;               // Packing
+    const uint8_t *stream;      // Verifying
+    size_t pages;
+    size_t last_length;         // Of the last page
+    uint64_t gpa;               // Of the first page
+    std::atomic<size_t> next;   // First page of the next batch
+    std::atomic<uint64_t> failed;
+    std::atomic<uint64_t> first_failed;
+};
+
+// A worker's cipher and MAC, keyed once and only given a new IV per page
+struct page_crypto {
+    EVP_CIPHER_CTX *cipher;
+    HMAC_CTX *hmac;
+};
+}
+
+static bool page_crypto_init(page_crypto *c, const tek_tik *tk)
+{
+    c->cipher = EVP_CIPHER_CTX_new();
+    c->hmac = HMAC_CTX_new();
+    return c->cipher && c->hmac &&
+           EVP_EncryptInit_ex(c->cipher, EVP_aes_128_ctr(), NULL, tk->tek, NULL) == 1 &&
+           HMAC_Init_ex(c->hmac, tk->tik, sizeof(tk->tik), EVP_sha256(), NULL) == 1;
+}
+
+static void page_crypto_free(page_crypto *c)
+{
+    EVP_CIPHER_CTX_free(c->cipher);
+    HMAC_CTX_free(c->hmac);
+}
+
+// HMAC(TIK, FLAGS | IV | TRANS_DATA)
+static bool page_mac(page_crypto *c, const sev_hdr_buf *hdr, const uint8_t *trans,
+                     size_t length, hmac_sha_256 mac)
+{
+    unsigned int mac_length = sizeof(hmac_sha_256);
+    return HMAC_Init_ex(c->hmac, NULL, 0, NULL, NULL) == 1 &&
+           HMAC_Update(c->hmac, (const uint8_t *)&hdr->flags, sizeof(hdr->flags)) == 1 &&
+           HMAC_Update(c->hmac, hdr->iv, sizeof(hdr->iv)) == 1 &&
+           HMAC_Update(c->hmac, trans, length) == 1 &&
+           HMAC_Final(c->hmac, mac, &mac_length) == 1;
+}
+
+// CTR, so this decrypts too
+static bool page_crypt(page_crypto *c, const iv_128 iv, const uint8_t *in, uint8_t *out,
+                       size_t length)
+{
+    int len = 0;
+    return EVP_EncryptInit_ex(c->cipher, NULL, NULL, NULL, iv) == 1 &&
+           EVP_EncryptUpdate(c->cipher, out, &len, in, (int)length) == 1 &&
+           (size_t)len == length;
+}
+
+static void page_failed(migration_job *job, size_t page)
+{
+    job->failed++;
+    uint64_t first = job->first_failed;
+    while (page < first && !job->first_failed.compare_exchange_weak(first, page)) {}
+}
+
+static void pack_pages(migration_job *job)
+{
+    page_crypto c;
+    iv_128 ivs[sev::MIGRATION_BATCH];
+    bool ready = page_crypto_init(&c, job->tk);
+
+    while (true) {
+        size_t first = job->next.fetch_add(sev::MIGRATION_BATCH);
+        if (first >= job->pages)
+            break;
+        size_t last = std::min(first + sev::MIGRATION_BATCH, job->pages);
+        // One draw from this thread's CSPRNG for the whole batch
+        bool ok = ready && sev::random_bytes(ivs, (last - first)*sizeof(iv_128));
+
+        for (size_t i = first; i < last; i++) {
+            sev::migration_packet *packet =
+                (sev::migration_packet *)(job->out + i*sev::MIGRATION_PACKET_STRIDE);
+            uint8_t *trans = (uint8_t *)(packet + 1);
+            size_t length = i + 1 == job->pages ? job->last_length : sev::MIGRATION_PAGE_SIZE;
+
+            memset(packet, 0, sizeof(*packet));
+            packet->gpa = job->gpa + i*sev::MIGRATION_PAGE_SIZE;
+            packet->length = (uint32_t)length;
+            memcpy(packet->hdr.iv, ivs[i - first], sizeof(iv_128));
+            if (!ok ||
+                !page_crypt(&c, packet->hdr.iv, job->image + i*sev::MIGRATION_PAGE_SIZE, trans, length) ||
+                !page_mac(&c, &packet->hdr, trans, length, packet->hdr.mac))
+                page_failed(job, i);
+        }
+    }
+
+    OPENSSL_cleanse(ivs, sizeof(ivs));
+    page_crypto_free(&c);
+}
+
+static void verify_pages(migration_job *job)
+{
+    page_crypto c;
+    uint8_t page[sev::MIGRATION_PAGE_SIZE];
+    hmac_sha_256 mac;
+    bool ready = page_crypto_init(&c, job->tk);
+
+    while (true) {
+        size_t first = job->next.fetch_add(sev::MIGRATION_BATCH);
+        if (first >= job->pages)
+            break;
+        size_t last = std::min(first + sev::MIGRATION_BATCH, job->pages);
+
+        for (size_t i = first; i < last; i++) {
+            const sev::migration_packet *packet =
+                (const sev::migration_packet *)(job->stream + i*sev::MIGRATION_PACKET_STRIDE);
+            const uint8_t *trans = (const uint8_t *)(packet + 1);
+            size_t length = i + 1 == job->pages ? job->last_length : sev::MIGRATION_PAGE_SIZE;
+            size_t offset = i*sev::MIGRATION_PAGE_SIZE;
+
+            // The stream is only read, so the packet's fields are copied
+            // out before they're trusted
+            uint64_t gpa;
+            uint32_t packet_length;
+            sev_hdr_buf hdr;
+            memcpy(&gpa, &packet->gpa, sizeof(gpa));
+            memcpy(&packet_length, &packet->length, sizeof(packet_length));
+            memcpy(&hdr, &packet->hdr, sizeof(hdr));
+
+            bool ok = ready && packet_length == length && hdr.flags == 0 &&
+                      gpa == job->gpa + offset &&
+                      page_mac(&c, &hdr, trans, length, mac) &&
+                      CRYPTO_memcmp(mac, hdr.mac, sizeof(mac)) == 0 &&
+                      page_crypt(&c, hdr.iv, trans, page, length);
+            if (ok && job->image)
+                ok = offset + length <= job->image_size &&
+                     memcmp(page, job->image + offset, length) == 0;
+            if (!ok)
+                page_failed(job, i);
+        }
+    }
+
+    OPENSSL_cleanse(page, sizeof(page));
+    page_crypto_free(&c);
+}
+
+static uint32_t run_workers(void (*fn)(migration_job *), migration_job *job, uint32_t threads)
+{
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    threads = std::max(1u, std::min(threads, sev::MIGRATION_MAX_THREADS));
+    threads = (uint32_t)std::max((size_t)1, std::min((size_t)threads,
+                                 (job->pages + sev::MIGRATION_BATCH - 1) / sev::MIGRATION_BATCH));
+
+    std::thread workers[sev::MIGRATION_MAX_THREADS];
+    for (uint32_t i = 1; i < threads; i++)
+        workers[i] = std::thread(fn, job);
+    fn(job);
+    for (uint32_t i = 1; i < threads; i++)
+        workers[i].join();
+    return threads;
+}
+
+static void job_init(migration_job *job, const tek_tik *tk, size_t pages, size_t last_length,
+                     uint64_t gpa)
+{
+    job->tk = tk;
+    job->image = NULL;
+    job->image_size = 0;
+    job->out = NULL;
+    job->stream = NULL;
+    job->pages = pages;
+    job->last_length = last_length;
+    job->gpa = gpa;
+    job->next = 0;
+    job->failed = 0;
+    job->first_failed = UINT64_MAX;
+}
+
+static void job_stats(migration_job *job, uint32_t threads, uint64_t bytes, uint64_t start,
+                      sev::migration_stats *stats)
+{
+    uint64_t elapsed = sev::Metrics::now_ns() - start;
+    memset(stats, 0, sizeof(*stats));
+    stats->pages = job->pages;
+    stats->bytes = bytes;
+    stats->failed = job->failed;
+    stats->first_failed = stats->failed ? job->first_failed.load() : 0;
+    stats->threads = threads;
+    stats->gib_per_sec = elapsed ? (double)bytes * 1e9 / (double)elapsed / (1024.0*1024*1024) : 0;
+}
+
+size_t sev::migration_stream_size(size_t size)
+{
+    size_t pages = (size + MIGRATION_PAGE_SIZE - 1) / MIGRATION_PAGE_SIZE;
+    return pages*sizeof(migration_packet) + size;
+}
+
+int sev::migration_pack(const tek_tik *tk, const uint8_t *image, size_t size, uint64_t gpa,
+                        uint32_t threads, uint8_t *out, size_t out_size, migration_stats *stats)
+{
+    if (!tk || !image || !out || !stats || size == 0)
+        return ERROR_INVALID_PARAM;
+    if (out_size != migration_stream_size(size))
+        return ERROR_INVALID_LENGTH;
+
+    uint64_t start = Metrics::now_ns();
+    size_t pages = (size + MIGRATION_PAGE_SIZE - 1) / MIGRATION_PAGE_SIZE;
+    migration_job job;
+    job_init(&job, tk, pages, size - (pages - 1)*MIGRATION_PAGE_SIZE, gpa);
+    job.image = image;
+    job.image_size = size;
+    job.out = out;
+
+    threads = run_workers(pack_pages, &job, threads);
+    job_stats(&job, threads, size, start, stats);
+
+    return stats->failed == 0 ? STATUS_SUCCESS : ERROR_UNSUPPORTED;
+}
+
+int sev::migration_verify(const tek_tik *tk, const uint8_t *stream, size_t stream_size,
+                          const uint8_t *image, size_t image_size, uint32_t threads,
+                          migration_stats *stats)
+{
+    if (!tk || !stream || !stats)
+        return ERROR_INVALID_PARAM;
+
+    // Whole packets, and only the last one short
+    size_t pages = stream_size / MIGRATION_PACKET_STRIDE;
+    size_t rest = stream_size % MIGRATION_PACKET_STRIDE;
+    size_t last_length = MIGRATION_PAGE_SIZE;
+    if (rest != 0) {
+        if (rest <= sizeof(migration_packet))
+            return ERROR_INVALID_LENGTH;
+        pages++;
+        last_length = rest - sizeof(migration_packet);
+    }
+    if (pages == 0)
+        return ERROR_INVALID_LENGTH;
+
+    uint64_t start = Metrics::now_ns();
+    uint64_t gpa;
+    memcpy(&gpa, stream, sizeof(gpa));      // The rest have to follow on from it
+    migration_job job;
+    job_init(&job, tk, pages, last_length, gpa);
+    job.stream = stream;
+    job.image = image;
+    job.image_size = image ? image_size : 0;
+
+    threads = run_workers(verify_pages, &job, threads);
+    job_stats(&job, threads, (pages - 1)*MIGRATION_PAGE_SIZE + last_length, start, stats);
+
+    // A stream of the wrong image that's otherwise good still fails
+    if (image && image_size != stats->bytes && stats->failed == 0) {
+        stats->failed = 1;
+        stats->first_failed = pages - 1;
+    }
+    return stats->failed == 0 ? STATUS_SUCCESS : ERROR_BAD_MEASUREMENT;
+}
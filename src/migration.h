@@ -0,0 +1,83 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef MIGRATION_H
+#define MIGRATION_H
+
+#include "sevapi.h"         // for tek_tik, sev_hdr_buf
+#include <cstddef>
+#include <cstdint>
+
+namespace sev
+{
+    constexpr size_t   MIGRATION_PAGE_SIZE   = 4096;
+    constexpr size_t   MIGRATION_BATCH       = 64;      // Pages a worker takes at a time
+    constexpr uint32_t MIGRATION_MAX_THREADS = 64;
+    constexpr size_t   MIGRATION_WINDOW      = 16384;   // Pages package_migration maps at a time
+
+    /**
+     * In front of each page's transport data in a migration stream: where
+     * the page goes, and the SEND_UPDATE_DATA header the receiver passes to
+     * RECEIVE_UPDATE_DATA with it. The guest and transport lengths are the
+     * same, there's no compression
+     */
+    typedef struct __attribute__ ((__packed__)) migration_packet_t
+    {
+        uint64_t    gpa;
+        uint32_t    length;         // Of the transport data after this
+        sev_hdr_buf hdr;
+    } migration_packet;
+
+    // Packet i is at i*MIGRATION_PACKET_STRIDE. Only the last can be short
+    constexpr size_t MIGRATION_PACKET_STRIDE = sizeof(migration_packet) + MIGRATION_PAGE_SIZE;
+
+    struct migration_stats {
+        uint64_t pages;
+        uint64_t bytes;             // Of guest memory
+        uint64_t failed;            // Pages that didn't verify (or encrypt)
+        uint64_t first_failed;      // Index of the first one, if any
+        uint32_t threads;
+        double   gib_per_sec;       // Of guest memory
+    };
+
+    // The size of the stream for size bytes of guest memory
+    size_t migration_stream_size(size_t size);
+
+    /**
+     * The guest memory image as SEND_UPDATE_DATA would send it, one packet
+     * per page, on up to threads threads (0 for one per core). Each page is
+     * AES-128-CTR encrypted under the TEK with its own random IV, and its
+     * header MAC is HMAC-SHA256(TIK, FLAGS | IV | TRANS_DATA). The image is
+     * only read, so it can be a mapped file. Page i goes to gpa + i*4096.
+     * out has to be migration_stream_size(size) bytes
+     */
+    int migration_pack(const tek_tik *tk, const uint8_t *image, size_t size, uint64_t gpa,
+                       uint32_t threads, uint8_t *out, size_t out_size, migration_stats *stats);
+
+    /**
+     * Checks every packet of a stream the way a receiver would: the MAC
+     * (in constant time), that the pages are contiguous, and that it
+     * decrypts. If image isn't NULL, each decrypted page is also compared
+     * with the page at the same offset in it. STATUS_SUCCESS if every page
+     * was good, otherwise ERROR_BAD_MEASUREMENT and stats says which was
+     * first. ERROR_INVALID_LENGTH if the stream isn't whole packets
+     */
+    int migration_verify(const tek_tik *tk, const uint8_t *stream, size_t stream_size,
+                         const uint8_t *image, size_t image_size, uint32_t threads,
+                         migration_stats *stats);
+}
+
+#endif /* MIGRATION_H */
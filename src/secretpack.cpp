@@ -0,0 +1,322 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "secretpack.h"
+#include "metrics.h"
+#include "utilities.h"          // for gen_random_bytes
+#include <algorithm>            // for std::min
+#include <atomic>
+#include <climits>              // for INT_MAX
+#include <cstring>
+#include <thread>
+#include <openssl/evp.h>
+#include <openssl/hmac.h>
+
+// 1e74f542-71dd-4d66-963e-ef4287ff173b
+const uint8_t sev::SECRET_TABLE_HEADER_GUID[16] = {
+    0x42, 0xf5, 0x74, 0x1e, 0xdd, 0x71, 0x66, 0x4d, 0x96, 0x3e, 0xef, 0x42, 0x87, 0xff, 0x17, 0x3b};
+// 736869e5-84f0-4973-92ec-06879ce3da0b
+const uint8_t sev::SECRET_DISK_PASSPHRASE_GUID[16] = {
+    0xe5, 0x69, 0x68, 0x73, 0xf0, 0x84, 0x73, 0x49, 0x92, 0xec, 0x06, 0x87, 0x9c, 0xe3, 0xda, 0x0b};
+
+static const uint8_t zero_block[sev::SECRET_TABLE_ALIGN] = {0};
+
+bool sev::str_to_guid(const std::string str, uint8_t guid[16])
+{
+    // Where each byte's two digits are, in the in-memory order: the first
+    // three fields are little endian, the last two are bytes
+    static const uint8_t offsets[16] = {6, 4, 2, 0, 11, 9, 16, 14,
+                                        19, 21, 24, 26, 28, 30, 32, 34};
+
+    if (str.size() != 36 || str[8] != '-' || str[13] != '-' || str[18] != '-' || str[23] != '-')
+        return false;
+
+    for (size_t i = 0; i < 16; i++) {
+        uint8_t byte = 0;
+        for (size_t j = 0; j < 2; j++) {
+            char c = str[offsets[i] + j];
+            byte = (uint8_t)(byte << 4);
+            if (c >= '0' && c <= '9')
+                byte |= (uint8_t)(c - '0');
+            else if (c >= 'a' && c <= 'f')
+                byte |= (uint8_t)(c - 'a' + 10);
+            else if (c >= 'A' && c <= 'F')
+                byte |= (uint8_t)(c - 'A' + 10);
+            else
+                return false;
+        }
+        guid[i] = byte;
+    }
+    return true;
+}
+
+// HMAC(TIK, 0x01 | FLAGS | IV | GUEST_LENGTH | TRANS_LENGTH, then the data
+// goes in with HMAC_Update and the measurement in finish_secret_mac
+static bool start_secret_mac(HMAC_CTX *hmac, const hmac_key_128 tik, uint32_t flags,
+                             const iv_128 iv, uint32_t length)
+{
+    const uint8_t meas_ctx = 0x01;
+
+    return HMAC_Init_ex(hmac, tik, sizeof(hmac_key_128), EVP_sha256(), NULL) == 1 &&
+           HMAC_Update(hmac, &meas_ctx, sizeof(meas_ctx)) == 1 &&
+           HMAC_Update(hmac, (const uint8_t *)&flags, sizeof(flags)) == 1 &&
+           HMAC_Update(hmac, iv, sizeof(iv_128)) == 1 &&
+           HMAC_Update(hmac, (const uint8_t *)&length, sizeof(length)) == 1 &&  // Guest Length
+           HMAC_Update(hmac, (const uint8_t *)&length, sizeof(length)) == 1;    // Trans Length
+}
+
+// Only from API 0.17 on is the launch measurement MAC'd too
+static bool finish_secret_mac(HMAC_CTX *hmac, const hmac_sha_256 measurement,
+                              uint8_t api_minor, hmac_sha_256 mac)
+{
+    unsigned int mac_length = sizeof(hmac_sha_256);
+
+    if (api_minor >= 17 && HMAC_Update(hmac, measurement, sizeof(hmac_sha_256)) != 1)
+        return false;
+    return HMAC_Final(hmac, mac, &mac_length) == 1;
+}
+
+int sev::package_secret_pieces(const tek_tik *tk, const hmac_sha_256 measurement,
+                               uint8_t api_minor, const iv_128 iv, uint32_t flags,
+                               const secret_piece *pieces, size_t count,
+                               uint8_t *out, size_t out_size, sev_hdr_buf *header)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    EVP_CIPHER_CTX *cipher = NULL;
+    HMAC_CTX *hmac = NULL;
+    size_t total = 0;
+
+    if (!tk || !measurement || !out || !header || (!pieces && count != 0))
+        return ERROR_INVALID_PARAM;
+    for (size_t i = 0; i < count; i++)
+        total += pieces[i].size;
+    if (total != out_size || total > UINT32_MAX)
+        return ERROR_INVALID_LENGTH;
+    const uint32_t length = (uint32_t)total;
+
+    memset(header, 0, sizeof(sev_hdr_buf));
+    header->flags = flags;
+    memcpy(header->iv, iv, sizeof(iv_128));
+
+    do {
+        if (!(cipher = EVP_CIPHER_CTX_new()) || !(hmac = HMAC_CTX_new()))
+            break;
+        if (EVP_EncryptInit_ex(cipher, EVP_aes_128_ctr(), NULL, tk->tek, iv) != 1)
+            break;
+
+        // Everything before the data is known up front
+        if (!start_secret_mac(hmac, tk->tik, header->flags, header->iv, length))
+            break;
+
+        // CTR carries on from one piece to the next, so the pieces come out
+        // the same as if they'd been one buffer
+        bool failed = false;
+        size_t offset = 0;
+        for (size_t i = 0; i < count && !failed; i++) {
+            size_t done = 0;
+            while (done < pieces[i].size && !failed) {
+                size_t chunk = std::min(pieces[i].size - done, SECRET_PACK_CHUNK);
+                const uint8_t *in = pieces[i].data ? pieces[i].data + done : zero_block;
+                if (!pieces[i].data)
+                    chunk = std::min(chunk, sizeof(zero_block));
+                int len = 0;
+                failed = EVP_EncryptUpdate(cipher, out + offset, &len, in, (int)chunk) != 1 ||
+                         (size_t)len != chunk ||
+                         HMAC_Update(hmac, out + offset, chunk) != 1;
+                offset += chunk;
+                done += chunk;
+            }
+        }
+        if (failed)
+            break;
+
+        if (!finish_secret_mac(hmac, measurement, api_minor, header->mac))
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    EVP_CIPHER_CTX_free(cipher);
+    HMAC_CTX_free(hmac);
+    return cmd_ret;
+}
+
+bool sev::launch_secret_mac(const hmac_key_128 tik, const hmac_sha_256 measurement,
+                            uint8_t api_minor, const sev_hdr_buf *header,
+                            const uint8_t *packaged, size_t size, hmac_sha_256 mac)
+{
+    bool ret = false;
+    HMAC_CTX *hmac;
+
+    if (!tik || !measurement || !header || !packaged || !mac || size > UINT32_MAX)
+        return ret;
+    if (!(hmac = HMAC_CTX_new()))
+        return ret;
+
+    ret = start_secret_mac(hmac, tik, header->flags, header->iv, (uint32_t)size) &&
+          HMAC_Update(hmac, packaged, size) == 1 &&
+          finish_secret_mac(hmac, measurement, api_minor, mac);
+
+    HMAC_CTX_free(hmac);
+    return ret;
+}
+
+namespace {
+struct secret_fanout_job {
+    const uint8_t *secret;
+    size_t size;
+    const sev::secret_session *sessions;
+    size_t count;
+    uint8_t api_minor;
+    const iv_128 *ivs;
+    uint8_t *out;
+    sev_hdr_buf *headers;
+    std::atomic<size_t> next;           // First session of the next batch
+    std::atomic<uint64_t> packaged;
+};
+}
+
+static void package_sessions(secret_fanout_job *job)
+{
+    sev::secret_piece piece = {job->secret, job->size};
+
+    while (true) {
+        size_t first = job->next.fetch_add(sev::SECRET_FANOUT_BATCH);
+        if (first >= job->count)
+            return;
+        size_t last = std::min(first + sev::SECRET_FANOUT_BATCH, job->count);
+        uint64_t packaged = 0;
+        for (size_t i = first; i < last; i++) {
+            if (sev::package_secret_pieces(&job->sessions[i].tk, job->sessions[i].measurement,
+                                           job->api_minor, job->ivs[i], 0, &piece, 1,
+                                           job->out + i*job->size, job->size,
+                                           &job->headers[i]) == STATUS_SUCCESS)
+                packaged++;
+        }
+        job->packaged += packaged;
+    }
+}
+
+int sev::package_secret_fanout(const uint8_t *secret, size_t size,
+                               const secret_session *sessions, size_t count,
+                               uint8_t api_minor, uint32_t threads, uint8_t *out,
+                               sev_hdr_buf *headers, secret_fanout_stats *stats)
+{
+    if (!secret || !sessions || !out || !headers || !stats || count == 0)
+        return ERROR_INVALID_PARAM;
+    if (size == 0 || size > UINT32_MAX || count > SIZE_MAX / size)
+        return ERROR_INVALID_LENGTH;
+
+    uint64_t start = Metrics::now_ns();
+
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    threads = std::max(1u, std::min(threads, SECRET_FANOUT_MAX_THREADS));
+    threads = (uint32_t)std::max((size_t)1, std::min((size_t)threads,
+                                 (count + SECRET_FANOUT_BATCH - 1) / SECRET_FANOUT_BATCH));
+
+    // One draw for every IV, instead of one per session on the workers
+    iv_128 *ivs = new iv_128[count];
+    if (!gen_random_bytes(ivs, count*sizeof(iv_128))) {
+        delete[] ivs;
+        return ERROR_UNSUPPORTED;
+    }
+
+    secret_fanout_job job;
+    job.secret = secret;
+    job.size = size;
+    job.sessions = sessions;
+    job.count = count;
+    job.api_minor = api_minor;
+    job.ivs = ivs;
+    job.out = out;
+    job.headers = headers;
+    job.next = 0;
+    job.packaged = 0;
+    std::thread workers[SECRET_FANOUT_MAX_THREADS];
+    for (uint32_t i = 1; i < threads; i++)
+        workers[i] = std::thread(package_sessions, &job);
+    package_sessions(&job);
+    for (uint32_t i = 1; i < threads; i++)
+        workers[i].join();
+    delete[] ivs;
+
+    uint64_t elapsed = Metrics::now_ns() - start;
+    memset(stats, 0, sizeof(*stats));
+    stats->sessions = count;
+    stats->packaged = job.packaged;
+    stats->threads = threads;
+    stats->sessions_per_sec = elapsed ? (double)count * 1e9 / (double)elapsed : 0;
+    stats->bytes_per_sec = stats->sessions_per_sec * (double)size;
+
+    return stats->packaged == count ? STATUS_SUCCESS : ERROR_UNSUPPORTED;
+}
+
+sev::SecretTable::SecretTable(void)
+               : m_count(0),
+                 m_length(sizeof(secret_table_header))
+{
+    memcpy(m_header.guid, SECRET_TABLE_HEADER_GUID, sizeof(m_header.guid));
+    m_header.length = 0;
+    memset(m_entries, 0, sizeof(m_entries));
+}
+
+bool sev::SecretTable::add(const uint8_t guid[16], const uint8_t *data, size_t size)
+{
+    if (!guid || (!data && size != 0) || m_count >= SECRET_TABLE_MAX_ENTRIES)
+        return false;
+    if (size > INT_MAX - m_length - sizeof(secret_table_header) - SECRET_TABLE_ALIGN)
+        return false;
+    for (size_t i = 0; i < m_count; i++) {
+        if (memcmp(m_entries[i].guid, guid, sizeof(m_entries[i].guid)) == 0)
+            return false;
+    }
+
+    secret_table_header *entry = &m_entries[m_count];
+    memcpy(entry->guid, guid, sizeof(entry->guid));
+    entry->length = (uint32_t)(sizeof(secret_table_header) + size);
+    m_pieces[1 + 2*m_count].data = (const uint8_t *)entry;
+    m_pieces[1 + 2*m_count].size = sizeof(secret_table_header);
+    m_pieces[2 + 2*m_count].data = data;
+    m_pieces[2 + 2*m_count].size = size;
+    m_count++;
+    m_length += entry->length;
+    return true;
+}
+
+size_t sev::SecretTable::size(void) const
+{
+    return (m_length + SECRET_TABLE_ALIGN - 1) / SECRET_TABLE_ALIGN * SECRET_TABLE_ALIGN;
+}
+
+int sev::SecretTable::package(const tek_tik *tk, const hmac_sha_256 measurement, uint8_t api_minor,
+                              const iv_128 iv, uint8_t *out, size_t out_size, sev_hdr_buf *header)
+{
+    if (m_count == 0)
+        return ERROR_INVALID_PARAM;
+    if (out_size != size())
+        return ERROR_INVALID_LENGTH;
+
+    // The header and padding are only known once everything's been added
+    m_header.length = (uint32_t)m_length;
+    m_pieces[0].data = (const uint8_t *)&m_header;
+    m_pieces[0].size = sizeof(m_header);
+    m_pieces[1 + 2*m_count].data = NULL;
+    m_pieces[1 + 2*m_count].size = size() - m_length;
+
+    return package_secret_pieces(tk, measurement, api_minor, iv, 0, m_pieces, 2*m_count + 2,
+                                 out, out_size, header);
+}
@@ -0,0 +1,144 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef SECRETPACK_H
+#define SECRETPACK_H
+
+#include "sevapi.h"         // for tek_tik, sev_hdr_buf, iv_128
+#include <cstddef>
+#include <cstdint>
+#include <string>
+
+namespace sev
+{
+    constexpr size_t SECRET_TABLE_MAX_ENTRIES = 32;
+    constexpr size_t SECRET_TABLE_ALIGN       = 16;         // The packet is padded to this
+    constexpr size_t SECRET_TABLE_PAGE_SIZE   = 4096;       // OVMF's secret area, unless built bigger
+    constexpr size_t SECRET_PACK_CHUNK        = 16*1024;    // Encrypted then MAC'd while it's in cache
+    constexpr size_t SECRET_FANOUT_BATCH        = 16;       // Sessions a worker takes at a time
+    constexpr uint32_t SECRET_FANOUT_MAX_THREADS = 64;
+
+    // In their in-memory (little endian) byte order
+    extern const uint8_t SECRET_TABLE_HEADER_GUID[16];
+    extern const uint8_t SECRET_DISK_PASSPHRASE_GUID[16];   // What cryptsetup's efi_secret hook reads
+
+    // The secret table header, and the one in front of each entry. Each
+    // length counts its own header
+    typedef struct __attribute__ ((__packed__)) secret_table_header_t
+    {
+        uint8_t  guid[16];
+        uint32_t length;
+    } secret_table_header;
+
+    // One launch to package a secret for: tmp_tk.bin followed by the
+    // measurement, the same as generate_launch_blob and calc_measurement
+    // write them
+    typedef struct __attribute__ ((__packed__)) secret_session_t
+    {
+        tek_tik      tk;
+        hmac_sha_256 measurement;
+    } secret_session;
+
+    struct secret_fanout_stats {
+        uint64_t sessions;
+        uint64_t packaged;
+        uint32_t threads;
+        double   sessions_per_sec;
+        double   bytes_per_sec;         // Of secret encrypted
+    };
+
+    // One piece of the plaintext. data == NULL for size zero bytes
+    struct secret_piece {
+        const uint8_t *data;
+        size_t size;
+    };
+
+    /**
+     * A GUID in its usual text form (8-4-4-4-12 hex digits) to the byte
+     * order OVMF has it in memory
+     */
+    bool str_to_guid(const std::string str, uint8_t guid[16]);
+
+    /**
+     * Encrypts the pieces, one after another, as one LAUNCH_SECRET packet
+     * into out (the total of their sizes), and makes its header. Each chunk
+     * is MAC'd straight after it's encrypted, so the plaintext is read once,
+     * the ciphertext is read back from cache, and nothing is copied. The
+     * MAC is launch_secret_mac's
+     */
+    int package_secret_pieces(const tek_tik *tk, const hmac_sha_256 measurement,
+                              uint8_t api_minor, const iv_128 iv, uint32_t flags,
+                              const secret_piece *pieces, size_t count,
+                              uint8_t *out, size_t out_size, sev_hdr_buf *header);
+
+    /**
+     * The LAUNCH_SECRET header MAC of an already packaged secret:
+     *   HMAC(TIK, 0x01 | FLAGS | IV | GUEST_LENGTH | TRANS_LENGTH | DATA [| MEASURE])
+     * with MEASURE, the launch measurement, only from API 0.17 on. For
+     * checking a packet; package_secret_pieces makes it as it encrypts
+     */
+    bool launch_secret_mac(const hmac_key_128 tik, const hmac_sha_256 measurement,
+                           uint8_t api_minor, const sev_hdr_buf *header,
+                           const uint8_t *packaged, size_t size, hmac_sha_256 mac);
+
+    /**
+     * The same secret packaged for count launches at once, on up to threads
+     * threads (0 for one per core). Session i's packet is size bytes at
+     * out + i*size, and its header is headers[i]. Every session gets its own
+     * random IV; they're all drawn up front, in one CSPRNG call. The secret is only
+     * read, so it can be in locked memory, and nothing is copied per
+     * session
+     */
+    int package_secret_fanout(const uint8_t *secret, size_t size,
+                              const secret_session *sessions, size_t count,
+                              uint8_t api_minor, uint32_t threads, uint8_t *out,
+                              sev_hdr_buf *headers, secret_fanout_stats *stats);
+
+    /**
+     * Several secrets in the table format OVMF and the efi_secret driver
+     * read out of the guest's secret area:
+     *   header GUID | total length | (entry GUID | entry length | data)...
+     * padded with zeros to SECRET_TABLE_ALIGN. add() only keeps a pointer
+     * to the data, which has to stay valid until package(), and package()
+     * encrypts the table's headers and the data in place, in one pass,
+     * into one packet.
+     * Ex) SecretTable table; table.add(SECRET_DISK_PASSPHRASE_GUID, key, key_len);
+     *     table.add(ssh_guid, ssh_key, ssh_key_len);
+     *     table.package(&tk, measurement, api_minor, iv, out, table.size(), &header);
+     */
+    class SecretTable {
+    private:
+        secret_table_header m_header;
+        secret_table_header m_entries[SECRET_TABLE_MAX_ENTRIES];
+        secret_piece m_pieces[2*SECRET_TABLE_MAX_ENTRIES + 2];  // + header and padding
+        size_t m_count;
+        size_t m_length;                // Without the padding
+
+    public:
+        SecretTable(void);
+
+        // False if the table is full, the GUID is already in it, or it'd
+        // be too big
+        bool add(const uint8_t guid[16], const uint8_t *data, size_t size);
+        size_t count(void) const { return m_count; }
+        size_t size(void) const;        // Of the packet, with the padding
+
+        int package(const tek_tik *tk, const hmac_sha_256 measurement, uint8_t api_minor,
+                    const iv_128 iv, uint8_t *out, size_t out_size, sev_hdr_buf *header);
+    };
+}
+
+#endif /* SECRETPACK_H */
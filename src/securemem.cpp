@@ -0,0 +1,248 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "securemem.h"
+#include <atomic>
+#include <cstring>
+#include <new>                  // for std::nothrow
+#include <openssl/crypto.h>     // for OPENSSL_cleanse
+#ifdef __linux__
+#include <sys/mman.h>
+#include <unistd.h>             // for sysconf
+#endif
+
+static std::atomic<uint64_t> secure_fallback_count(0);
+
+sev::SecureArena::SecureArena(const uint32_t *counts)
+                : m_base(NULL),
+                  m_size(0),
+                  m_mapped(false),
+                  m_locked(false)
+{
+    if (!counts)
+        counts = SECURE_ARENA_DEF_COUNTS;
+
+    for (size_t i = 0; i < SECURE_ARENA_CLASSES; i++)
+        m_size += SECURE_ARENA_BLOCK_SIZES[i] * counts[i];
+
+#ifdef __linux__
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    m_size = (m_size + page - 1) / page * page;
+    void *mem = mmap(NULL, m_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED) {
+        m_base = (uint8_t *)mem;
+        m_mapped = true;
+        m_locked = (mlock(m_base, m_size) == 0);
+        madvise(m_base, m_size, MADV_DONTDUMP);
+    }
+#endif
+    if (!m_base) {
+        m_base = new (std::nothrow) uint8_t[m_size];
+        if (m_base)
+            memset(m_base, 0, m_size);
+    }
+
+    uint8_t *pos = m_base;
+    for (size_t i = 0; i < SECURE_ARENA_CLASSES; i++) {
+        slab *s = &m_slabs[i];
+        s->block_size = SECURE_ARENA_BLOCK_SIZES[i];
+        s->count = m_base ? counts[i] : 0;
+        s->base = pos;
+        s->free_list = new uint32_t[s->count ? s->count : 1];
+        s->in_use = new bool[s->count ? s->count : 1];
+        s->free_top = s->count;
+        s->peak = 0;
+        s->allocs = 0;
+        s->failures = 0;
+        // Lowest addresses are handed out first
+        for (uint32_t b = 0; b < s->count; b++) {
+            s->free_list[b] = s->count - 1 - b;
+            s->in_use[b] = false;
+        }
+        if (pos)
+            pos += s->block_size * s->count;
+    }
+}
+
+sev::SecureArena::~SecureArena()
+{
+    for (size_t i = 0; i < SECURE_ARENA_CLASSES; i++) {
+        delete[] m_slabs[i].free_list;
+        delete[] m_slabs[i].in_use;
+    }
+    if (!m_base)
+        return;
+
+    OPENSSL_cleanse(m_base, m_size);
+#ifdef __linux__
+    if (m_mapped) {
+        if (m_locked)
+            munlock(m_base, m_size);
+        munmap(m_base, m_size);
+        return;
+    }
+#endif
+    delete[] m_base;
+}
+
+sev::SecureArena &sev::SecureArena::global(void)
+{
+    static SecureArena arena;
+    return arena;
+}
+
+void *sev::SecureArena::alloc(size_t size)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    slab *first = NULL;
+
+    // The smallest class that fits, or a bigger one if that's used up
+    for (size_t i = 0; i < SECURE_ARENA_CLASSES; i++) {
+        slab *s = &m_slabs[i];
+        if (s->block_size < size)
+            continue;
+        if (!first)
+            first = s;
+        if (s->free_top == 0)
+            continue;
+
+        uint32_t index = s->free_list[--s->free_top];
+        s->in_use[index] = true;
+        s->allocs++;
+        if (s->count - s->free_top > s->peak)
+            s->peak = s->count - s->free_top;
+        return s->base + (size_t)index * s->block_size;   // Zeroed by free()
+    }
+
+    if (first)
+        first->failures++;
+    return NULL;
+}
+
+bool sev::SecureArena::free(void *ptr)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint8_t *p = (uint8_t *)ptr;
+
+    for (size_t i = 0; i < SECURE_ARENA_CLASSES; i++) {
+        slab *s = &m_slabs[i];
+        if (!p || p < s->base || p >= s->base + s->block_size * s->count)
+            continue;
+
+        size_t offset = (size_t)(p - s->base);
+        uint32_t index = (uint32_t)(offset / s->block_size);
+        if (offset % s->block_size != 0 || !s->in_use[index])
+            return false;
+
+        OPENSSL_cleanse(p, s->block_size);
+        s->in_use[index] = false;
+        s->free_list[s->free_top++] = index;
+        return true;
+    }
+    return false;
+}
+
+bool sev::SecureArena::owns(const void *ptr) const
+{
+    const uint8_t *p = (const uint8_t *)ptr;
+    return m_base && p >= m_base && p < m_base + m_size;
+}
+
+void sev::SecureArena::stats(size_t class_index, secure_arena_stats *out)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    memset(out, 0, sizeof(*out));
+    if (class_index >= SECURE_ARENA_CLASSES)
+        return;
+
+    const slab *s = &m_slabs[class_index];
+    out->block_size = s->block_size;
+    out->capacity = s->count;
+    out->in_use = s->count - s->free_top;
+    out->peak = s->peak;
+    out->allocs = s->allocs;
+    out->failures = s->failures;
+}
+
+sev::SecureBuffer::SecureBuffer(size_t size)
+                 : m_data(NULL),
+                   m_size(size),
+                   m_mapped_size(0),
+                   m_locked(false)
+{
+#ifdef __linux__
+    size_t page = (size_t)sysconf(_SC_PAGESIZE);
+    size_t mapped_size = (size ? size + page - 1 : page) / page * page;
+    void *mem = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (mem != MAP_FAILED) {
+        m_data = (uint8_t *)mem;
+        m_mapped_size = mapped_size;
+        m_locked = (mlock(m_data, m_mapped_size) == 0);
+        madvise(m_data, m_mapped_size, MADV_DONTDUMP);
+        return;
+    }
+#endif
+    m_data = new (std::nothrow) uint8_t[size ? size : 1];
+    if (m_data)
+        memset(m_data, 0, size);
+}
+
+sev::SecureBuffer::~SecureBuffer()
+{
+    if (!m_data)
+        return;
+
+    OPENSSL_cleanse(m_data, m_size);
+#ifdef __linux__
+    if (m_mapped_size) {
+        if (m_locked)
+            munlock(m_data, m_mapped_size);
+        munmap(m_data, m_mapped_size);
+        return;
+    }
+#endif
+    delete[] m_data;
+}
+
+void *sev::secure_alloc(size_t size)
+{
+    void *ptr = SecureArena::global().alloc(size);
+    if (ptr)
+        return ptr;
+
+    secure_fallback_count++;
+    uint8_t *heap = new uint8_t[size ? size : 1];
+    memset(heap, 0, size);
+    return heap;
+}
+
+void sev::secure_free(void *ptr, size_t size)
+{
+    if (!ptr)
+        return;
+    if (SecureArena::global().owns(ptr)) {
+        SecureArena::global().free(ptr);
+        return;
+    }
+    OPENSSL_cleanse(ptr, size);
+    delete[] (uint8_t *)ptr;
+}
+
+uint64_t sev::secure_fallbacks(void)
+{
+    return secure_fallback_count.load();
+}
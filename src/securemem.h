@@ -0,0 +1,148 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef SECUREMEM_H
+#define SECUREMEM_H
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+
+namespace sev
+{
+    // 16/32/48/64 for keys and secrets, then payloads (LAUNCH_SECRET data)
+    constexpr size_t SECURE_ARENA_CLASSES = 6;
+    constexpr size_t SECURE_ARENA_BLOCK_SIZES[SECURE_ARENA_CLASSES] = {16, 32, 48, 64, 1024, 16*1024};
+    constexpr uint32_t SECURE_ARENA_DEF_COUNTS[SECURE_ARENA_CLASSES]  = {256, 256, 64, 128, 16, 4};
+
+    struct secure_arena_stats {
+        size_t   block_size;
+        uint32_t capacity;
+        uint32_t in_use;
+        uint32_t peak;
+        uint64_t allocs;
+        uint64_t failures;          // Nothing free in this class or any bigger one
+    };
+
+    /**
+     * A fixed amount of page-locked memory (mlock, and left out of core
+     * dumps) for key material, split into slabs of equal size blocks.
+     * Allocating pops a free list and freeing wipes the block and pushes it
+     * back, so both are O(1) and nothing is ever handed to the heap.
+     *
+     * If the memory can't be locked (RLIMIT_MEMLOCK), the arena still works
+     * and locked() says so. On Windows it is ordinary memory.
+     */
+    class SecureArena {
+    private:
+        struct slab {
+            size_t block_size;
+            uint32_t count;
+            uint8_t *base;
+            uint32_t *free_list;    // Stack of free block indexes
+            uint32_t free_top;
+            bool *in_use;           // Catches double and foreign frees
+            uint32_t peak;
+            uint64_t allocs;
+            uint64_t failures;
+        };
+
+        std::mutex m_mutex;
+        slab m_slabs[SECURE_ARENA_CLASSES];
+        uint8_t *m_base;
+        size_t m_size;
+        bool m_mapped;
+        bool m_locked;
+
+        SecureArena(const SecureArena&) = delete;
+        SecureArena& operator=(const SecureArena&) = delete;
+
+    public:
+        // counts: blocks per class, NULL for SECURE_ARENA_DEF_COUNTS
+        explicit SecureArena(const uint32_t *counts = NULL);
+        ~SecureArena();
+
+        // Zero filled. NULL if size is too big or everything that fits is
+        // in use
+        void *alloc(size_t size);
+        // Wipes the whole block. False (and nothing done) if ptr isn't an
+        // allocated block of this arena
+        bool free(void *ptr);
+        bool owns(const void *ptr) const;
+
+        bool locked(void) const { return m_locked; }
+        void stats(size_t class_index, secure_arena_stats *out);
+
+        static SecureArena &global(void);
+    };
+
+    /**
+     * One page-locked buffer, sized to fit, for key material that's too big
+     * for an arena (a sessions file, a big secret). Zero filled, and wiped
+     * when it goes out of scope. As with the arena, locked() says whether
+     * the lock took, and on Windows it is ordinary memory.
+     */
+    class SecureBuffer {
+    private:
+        uint8_t *m_data;
+        size_t m_size;
+        size_t m_mapped_size;           // Whole pages, 0 if from the heap
+        bool m_locked;
+
+        SecureBuffer(const SecureBuffer&) = delete;
+        SecureBuffer& operator=(const SecureBuffer&) = delete;
+
+    public:
+        explicit SecureBuffer(size_t size);
+        ~SecureBuffer();
+
+        // NULL if size bytes couldn't be had
+        uint8_t *data(void) { return m_data; }
+        size_t size(void) const { return m_size; }
+        bool locked(void) const { return m_locked; }
+    };
+
+    /**
+     * From the global arena, or if it's full, the heap (counted in
+     * secure_fallbacks()). secure_free() wipes size bytes either way
+     */
+    void *secure_alloc(size_t size);
+    void secure_free(void *ptr, size_t size);
+    uint64_t secure_fallbacks(void);
+
+    /**
+     * One T of key material, for the life of the scope
+     * Ex) sev::Secure<aes_128_key> kek; derive_kek(*kek, *master_secret);
+     */
+    template <typename T>
+    class Secure {
+    private:
+        T *m_ptr;
+
+        Secure(const Secure&) = delete;
+        Secure& operator=(const Secure&) = delete;
+
+    public:
+        Secure(void) : m_ptr((T *)secure_alloc(sizeof(T))) {}
+        ~Secure() { secure_free(m_ptr, sizeof(T)); }
+
+        T *get(void) { return m_ptr; }
+        T &operator*(void) { return *m_ptr; }
+        T *operator->(void) { return m_ptr; }
+    };
+}
+
+#endif /* SECUREMEM_H */
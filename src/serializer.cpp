@@ -0,0 +1,275 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "serializer.h"
+#include <cstring>
+
+// CBOR major types (RFC 8949 section 3.1)
+static constexpr uint8_t CBOR_UINT        = 0;
+static constexpr uint8_t CBOR_NEGATIVE    = 1;
+static constexpr uint8_t CBOR_BYTES       = 2;
+static constexpr uint8_t CBOR_TEXT        = 3;
+static constexpr uint8_t CBOR_FALSE       = 0xF4;
+static constexpr uint8_t CBOR_TRUE        = 0xF5;
+static constexpr uint8_t CBOR_ARRAY_START = 0x9F;  // Indefinite length
+static constexpr uint8_t CBOR_MAP_START   = 0xBF;  // Indefinite length
+static constexpr uint8_t CBOR_BREAK       = 0xFF;
+
+static const char hex_digits[] = "0123456789abcdef";
+
+sev::Serializer::Serializer(void *buf, size_t capacity, OUTPUT_FORMAT format)
+                : m_buf((uint8_t *)buf),
+                  m_capacity(capacity),
+                  m_format(format)
+{
+    reset();
+}
+
+bool sev::Serializer::parse_format(const char *name, OUTPUT_FORMAT *format)
+{
+    if (strcmp(name, "json") == 0)
+        *format = OUTPUT_FORMAT_JSON;
+    else if (strcmp(name, "cbor") == 0)
+        *format = OUTPUT_FORMAT_CBOR;
+    else
+        return false;
+    return true;
+}
+
+void sev::Serializer::reset(void)
+{
+    m_size = 0;
+    m_overflow = false;
+    m_depth = 0;
+    m_first[0] = true;
+    m_in_map[0] = false;
+}
+
+void sev::Serializer::put(const void *data, size_t length)
+{
+    if (m_overflow || length == 0)
+        return;
+    if (length > m_capacity - m_size) {
+        m_overflow = true;
+        return;
+    }
+    memcpy(m_buf + m_size, data, length);
+    m_size += length;
+}
+
+/**
+ * The initial byte of a data item: the major type in the top 3 bits, and the
+ * value (or length) either in the low 5 bits or in the 1/2/4/8 bytes after
+ */
+void sev::Serializer::put_cbor_head(uint8_t major_type, uint64_t value)
+{
+    uint8_t head[9];
+    size_t length = 1;
+    uint8_t type = (uint8_t)(major_type << 5);
+
+    if (value < 24) {
+        head[0] = (uint8_t)(type | value);
+    }
+    else {
+        size_t bytes = (value <= 0xFF) ? 1 : (value <= 0xFFFF) ? 2 :
+                       (value <= 0xFFFFFFFFULL) ? 4 : 8;
+        head[0] = (uint8_t)(type | ((bytes == 1) ? 24 : (bytes == 2) ? 25 :
+                                    (bytes == 4) ? 26 : 27));
+        for (size_t i = 0; i < bytes; i++)      // Big endian
+            head[1 + i] = (uint8_t)(value >> (8 * (bytes - 1 - i)));
+        length += bytes;
+    }
+    put(head, length);
+}
+
+void sev::Serializer::put_json_string(const char *str)
+{
+    put_byte('"');
+    const char *run = str;      // Start of the characters that don't need escaping
+    for (const char *c = str; *c; c++) {
+        uint8_t ch = (uint8_t)*c;
+        if (ch >= 0x20 && ch != '"' && ch != '\\')
+            continue;
+        put(run, (size_t)(c - run));
+        run = c + 1;
+        if (ch == '"' || ch == '\\') {
+            char escaped[2] = {'\\', (char)ch};
+            put(escaped, sizeof(escaped));
+        }
+        else {
+            char escaped[6] = {'\\', 'u', '0', '0', hex_digits[ch >> 4], hex_digits[ch & 0xF]};
+            put(escaped, sizeof(escaped));
+        }
+    }
+    put(run, strlen(run));
+    put_byte('"');
+}
+
+void sev::Serializer::put_decimal(uint64_t value)
+{
+    char digits[20];
+    size_t pos = sizeof(digits);
+    do {
+        digits[--pos] = (char)('0' + value % 10);
+        value /= 10;
+    } while (value);
+    put(digits + pos, sizeof(digits) - pos);
+}
+
+// The separator and the key (if in a map) that go before every value
+void sev::Serializer::begin_value(const char *key)
+{
+    bool first = m_first[m_depth];
+    m_first[m_depth] = false;
+
+    if (m_format == OUTPUT_FORMAT_JSON) {
+        if (!first)
+            put_byte(',');
+        if (m_in_map[m_depth]) {
+            put_json_string(key ? key : "");
+            put_byte(':');
+        }
+    }
+    else if (m_in_map[m_depth]) {
+        size_t length = key ? strlen(key) : 0;
+        put_cbor_head(CBOR_TEXT, length);
+        put(key, length);
+    }
+}
+
+void sev::Serializer::begin_container(const char *key, char json_open, uint8_t cbor_open)
+{
+    begin_value(key);
+    if (m_depth == SERIALIZER_MAX_DEPTH) {
+        m_overflow = true;
+        return;
+    }
+    if (m_format == OUTPUT_FORMAT_JSON)
+        put_byte((uint8_t)json_open);
+    else
+        put_byte(cbor_open);
+    m_depth++;
+    m_first[m_depth] = true;
+    m_in_map[m_depth] = (cbor_open == CBOR_MAP_START);
+}
+
+void sev::Serializer::end_container(char json_close)
+{
+    if (m_depth == 0) {
+        m_overflow = true;
+        return;
+    }
+    m_depth--;
+    if (m_format == OUTPUT_FORMAT_JSON)
+        put_byte((uint8_t)json_close);
+    else
+        put_byte(CBOR_BREAK);
+}
+
+void sev::Serializer::begin_map(const char *key)
+{
+    begin_container(key, '{', CBOR_MAP_START);
+}
+
+void sev::Serializer::end_map(void)
+{
+    end_container('}');
+}
+
+void sev::Serializer::begin_array(const char *key)
+{
+    begin_container(key, '[', CBOR_ARRAY_START);
+}
+
+void sev::Serializer::end_array(void)
+{
+    end_container(']');
+}
+
+void sev::Serializer::add_uint(const char *key, uint64_t value)
+{
+    begin_value(key);
+    if (m_format == OUTPUT_FORMAT_JSON)
+        put_decimal(value);
+    else
+        put_cbor_head(CBOR_UINT, value);
+}
+
+void sev::Serializer::add_int(const char *key, int64_t value)
+{
+    if (value >= 0) {
+        add_uint(key, (uint64_t)value);
+        return;
+    }
+
+    // -1 - value can't overflow, unlike -value
+    uint64_t magnitude_less_one = (uint64_t)(-1 - value);
+    begin_value(key);
+    if (m_format == OUTPUT_FORMAT_JSON) {
+        put_byte('-');
+        put_decimal(magnitude_less_one + 1);
+    }
+    else {
+        put_cbor_head(CBOR_NEGATIVE, magnitude_less_one);
+    }
+}
+
+void sev::Serializer::add_bool(const char *key, bool value)
+{
+    begin_value(key);
+    if (m_format == OUTPUT_FORMAT_JSON)
+        put(value ? "true" : "false", value ? 4 : 5);
+    else
+        put_byte(value ? CBOR_TRUE : CBOR_FALSE);
+}
+
+void sev::Serializer::add_string(const char *key, const char *value)
+{
+    begin_value(key);
+    if (m_format == OUTPUT_FORMAT_JSON) {
+        put_json_string(value);
+    }
+    else {
+        size_t length = strlen(value);
+        put_cbor_head(CBOR_TEXT, length);
+        put(value, length);
+    }
+}
+
+void sev::Serializer::add_bytes(const char *key, const void *data, size_t length)
+{
+    begin_value(key);
+    if (m_format != OUTPUT_FORMAT_JSON) {
+        put_cbor_head(CBOR_BYTES, length);
+        put(data, length);
+        return;
+    }
+
+    // Hex straight into the buffer
+    put_byte('"');
+    if (!m_overflow && length > (m_capacity - m_size) / 2)
+        m_overflow = true;
+    if (!m_overflow) {
+        const uint8_t *bytes = (const uint8_t *)data;
+        uint8_t *out = m_buf + m_size;
+        for (size_t i = 0; i < length; i++) {
+            out[2*i]     = (uint8_t)hex_digits[bytes[i] >> 4];
+            out[2*i + 1] = (uint8_t)hex_digits[bytes[i] & 0xF];
+        }
+        m_size += 2*length;
+    }
+    put_byte('"');
+}
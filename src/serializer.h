@@ -0,0 +1,94 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef SERIALIZER_H
+#define SERIALIZER_H
+
+#include <cstddef>
+#include <cstdint>
+
+namespace sev
+{
+    enum OUTPUT_FORMAT {
+        OUTPUT_FORMAT_TEXT = 0,     // The usual printf output
+        OUTPUT_FORMAT_JSON = 1,
+        OUTPUT_FORMAT_CBOR = 2,     // RFC 8949
+    };
+
+    constexpr size_t SERIALIZER_MAX_DEPTH    = 16;
+    constexpr size_t SERIALIZER_DEFAULT_SIZE = 64*1024;    // Enough for pdh_cert_export
+
+    /**
+     * Streams a JSON or CBOR document into a caller supplied buffer, one
+     * field at a time. Nothing is allocated and no strings are built: keys
+     * and values are written straight into the buffer.
+     *
+     * Keys are ignored inside arrays and required inside maps. In JSON, byte
+     * strings come out as lowercase hex, the same as the *_out.txt files. In
+     * CBOR, maps and arrays are indefinite length so their size doesn't have
+     * to be known up front.
+     *
+     * If the buffer fills up, the rest of the document is dropped and ok()
+     * returns false.
+     */
+    class Serializer {
+    private:
+        uint8_t *m_buf;
+        size_t m_capacity;
+        size_t m_size;
+        bool m_overflow;
+        OUTPUT_FORMAT m_format;
+        size_t m_depth;
+        bool m_first[SERIALIZER_MAX_DEPTH + 1];     // No value yet at this depth
+        bool m_in_map[SERIALIZER_MAX_DEPTH + 1];    // Else in an array (or at the top)
+
+        void put(const void *data, size_t length);
+        void put_byte(uint8_t byte) { put(&byte, 1); }
+        void put_cbor_head(uint8_t major_type, uint64_t value);
+        void put_json_string(const char *str);
+        void put_decimal(uint64_t value);
+        void begin_value(const char *key);
+        void begin_container(const char *key, char json_open, uint8_t cbor_open);
+        void end_container(char json_close);
+
+        Serializer(const Serializer&) = delete;
+        Serializer& operator=(const Serializer&) = delete;
+
+    public:
+        Serializer(void *buf, size_t capacity, OUTPUT_FORMAT format);
+
+        // "json" or "cbor". Returns false for anything else
+        static bool parse_format(const char *name, OUTPUT_FORMAT *format);
+
+        void begin_map(const char *key = NULL);
+        void end_map(void);
+        void begin_array(const char *key = NULL);
+        void end_array(void);
+        void add_uint(const char *key, uint64_t value);
+        void add_int(const char *key, int64_t value);
+        void add_bool(const char *key, bool value);
+        void add_string(const char *key, const char *value);
+        void add_bytes(const char *key, const void *data, size_t length);
+
+        void reset(void);
+        OUTPUT_FORMAT format(void) const { return m_format; }
+        const uint8_t *data(void) const { return m_buf; }
+        size_t size(void) const { return m_size; }
+        bool ok(void) const { return !m_overflow && m_depth == 0; }
+    };
+}
+
+#endif /* SERIALIZER_H */
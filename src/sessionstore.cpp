@@ -0,0 +1,183 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "sessionstore.h"
+#include "metrics.h"            // for Metrics::now_ns
+#include "securemem.h"
+#include <cstring>
+
+struct sev::session_entry {
+    bool in_use;
+    std::string handle;
+    uint64_t expires_ns;
+    tek_tik *tk;                        // In the secure arena, while in use
+    sev_session_buf session;
+    hmac_sha_256 measurement;
+    bool has_measurement;
+};
+
+sev::SessionStore::SessionStore(uint32_t capacity, uint32_t ttl_ms)
+                 : m_entries(new session_entry[capacity ? capacity : 1]),
+                   m_capacity(capacity ? capacity : 1),
+                   m_ttl_ms(ttl_ms),
+                   m_persist_files(false)
+{
+    // Made first so it's destroyed after global(), which frees into it
+    SecureArena::global();
+
+    for (uint32_t i = 0; i < m_capacity; i++) {
+        m_entries[i].in_use = false;
+        m_entries[i].tk = NULL;
+    }
+}
+
+sev::SessionStore::~SessionStore()
+{
+    clear();
+    delete[] m_entries;
+}
+
+sev::SessionStore &sev::SessionStore::global(void)
+{
+    static SessionStore store;
+    return store;
+}
+
+void sev::SessionStore::wipe(session_entry *entry)
+{
+    sev::secure_free(entry->tk, sizeof(tek_tik));
+    entry->tk = NULL;
+    entry->handle.clear();
+    entry->in_use = false;
+}
+
+// Expired entries are wiped on the way past. Called with the mutex held
+sev::session_entry *sev::SessionStore::find(const std::string handle, uint64_t now)
+{
+    session_entry *found = NULL;
+
+    for (uint32_t i = 0; i < m_capacity; i++) {
+        session_entry *entry = &m_entries[i];
+        if (!entry->in_use)
+            continue;
+        if (entry->expires_ns <= now)
+            wipe(entry);
+        else if (!found && entry->handle == handle)
+            found = entry;
+    }
+    return found;
+}
+
+bool sev::SessionStore::put(const std::string handle, const tek_tik *tk,
+                            const sev_session_buf *session)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t now = sev::Metrics::now_ns();
+    session_entry *entry = find(handle, now);
+
+    if (!entry) {
+        for (uint32_t i = 0; i < m_capacity && !entry; i++) {
+            if (!m_entries[i].in_use)
+                entry = &m_entries[i];
+        }
+        if (!entry)
+            return false;
+    }
+
+    if (!entry->tk)
+        entry->tk = (tek_tik *)sev::secure_alloc(sizeof(tek_tik));
+    entry->in_use = true;
+    entry->handle = handle;
+    entry->expires_ns = now + (uint64_t)m_ttl_ms * 1000000ULL;
+    memcpy(entry->tk, tk, sizeof(tek_tik));
+    memcpy(&entry->session, session, sizeof(sev_session_buf));
+    memset(entry->measurement, 0, sizeof(entry->measurement));
+    entry->has_measurement = false;
+    return true;
+}
+
+bool sev::SessionStore::set_measurement(const std::string handle,
+                                        const hmac_sha_256 measurement)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    session_entry *entry = find(handle, sev::Metrics::now_ns());
+
+    if (!entry)
+        return false;
+    memcpy(entry->measurement, measurement, sizeof(hmac_sha_256));
+    entry->has_measurement = true;
+    return true;
+}
+
+bool sev::SessionStore::get(const std::string handle, session_keys *keys)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    session_entry *entry = find(handle, sev::Metrics::now_ns());
+
+    if (!entry)
+        return false;
+    memcpy(&keys->tk, entry->tk, sizeof(tek_tik));
+    memcpy(&keys->session, &entry->session, sizeof(sev_session_buf));
+    memcpy(keys->measurement, entry->measurement, sizeof(hmac_sha_256));
+    keys->has_measurement = entry->has_measurement;
+    return true;
+}
+
+void sev::SessionStore::remove(const std::string handle)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    session_entry *entry = find(handle, sev::Metrics::now_ns());
+
+    if (entry)
+        wipe(entry);
+}
+
+void sev::SessionStore::clear(void)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    for (uint32_t i = 0; i < m_capacity; i++) {
+        if (m_entries[i].in_use)
+            wipe(&m_entries[i]);
+    }
+}
+
+uint32_t sev::SessionStore::count(void)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint64_t now = sev::Metrics::now_ns();
+    uint32_t in_use = 0;
+
+    for (uint32_t i = 0; i < m_capacity; i++) {
+        if (m_entries[i].in_use && m_entries[i].expires_ns <= now)
+            wipe(&m_entries[i]);
+        else if (m_entries[i].in_use)
+            in_use++;
+    }
+    return in_use;
+}
+
+bool sev::SessionStore::persist_files(void)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    return m_persist_files;
+}
+
+void sev::SessionStore::set_persist_files(bool persist)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    m_persist_files = persist;
+}
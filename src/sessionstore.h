@@ -0,0 +1,93 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef SESSIONSTORE_H
+#define SESSIONSTORE_H
+
+#include "sevapi.h"
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string>
+
+namespace sev
+{
+    constexpr uint32_t SESSION_STORE_DEF_CAPACITY = 256;
+    constexpr uint32_t SESSION_STORE_DEF_TTL_MS   = 10*60*1000;    // Launch blob to LAUNCH_SECRET
+
+    // What package_secret needs from the earlier commands of a launch
+    struct session_keys {
+        tek_tik         tk;                 // Unencrypted
+        sev_session_buf session;
+        hmac_sha_256    measurement;
+        bool            has_measurement;
+    };
+
+    struct session_entry;
+
+    /**
+     * The TEK/TIK, session buffer and measurement of each launch in
+     * progress, kept in memory so generate_launch_blob, calc_measurement
+     * and package_secret don't have to pass key material through files.
+     * The handle is the command's output folder, the same thing that tied
+     * the files together.
+     *
+     * Entries are dropped ttl_ms after generate_launch_blob. The TEK/TIKs
+     * are kept in the secure arena, and wiped when dropped.
+     * Writing tmp_tk.bin for a later sevtool process to pick up is up to
+     * the caller, when persist_files() says so.
+     *
+     * Thread safe.
+     */
+    class SessionStore {
+    private:
+        std::mutex m_mutex;
+        session_entry *m_entries;
+        uint32_t m_capacity;
+        uint32_t m_ttl_ms;
+        bool m_persist_files;
+
+        session_entry *find(const std::string handle, uint64_t now);
+        void wipe(session_entry *entry);
+
+        SessionStore(const SessionStore&) = delete;
+        SessionStore& operator=(const SessionStore&) = delete;
+
+    public:
+        explicit SessionStore(uint32_t capacity = SESSION_STORE_DEF_CAPACITY,
+                              uint32_t ttl_ms = SESSION_STORE_DEF_TTL_MS);
+        ~SessionStore();
+
+        // The one the Commands use. Memory only unless set_persist_files()
+        static SessionStore &global(void);
+
+        // Replaces any earlier session for handle. False if the store is
+        // full of sessions that haven't expired
+        bool put(const std::string handle, const tek_tik *tk,
+                 const sev_session_buf *session);
+        // False if there's no session for handle
+        bool set_measurement(const std::string handle, const hmac_sha_256 measurement);
+        bool get(const std::string handle, session_keys *keys);
+        void remove(const std::string handle);
+        void clear(void);
+        uint32_t count(void);
+
+        bool persist_files(void);
+        void set_persist_files(bool persist);
+    };
+}
+
+#endif /* SESSIONSTORE_H */
@@ -26,6 +26,7 @@ typedef bool _Bool;
 #endif
 
 
+#include <stddef.h>         // for offsetof
 #include <stdint.h>
 
 // ------------------------------- //
@@ -939,4 +940,71 @@ typedef struct __attribute__ ((__packed__)) sev_dbg_encrypt_cmd_buf_t
     uint32_t    length;
 } sev_dbg_encrypt_cmd_buf;
 
+// SEV-SNP ABI Chapter 7.3: Attestation Report
+constexpr uint32_t SNP_REPORT_MIN_VERSION   = 2;
+constexpr uint32_t SNP_REPORT_SIG_ALGO      = 1;        // ECDSA P-384 with SHA-384
+constexpr uint32_t SNP_REPORT_SIGNED_SIZE   = 0x2A0;    // Everything before the signature
+constexpr uint32_t SNP_CHIP_ID_SIZE         = 64;
+
+/**
+ * TCB_VERSION. The security patch levels the VCEK is derived from.
+ */
+typedef union
+{
+    struct __attribute__ ((__packed__))
+    {
+        uint8_t boot_loader;
+        uint8_t tee;
+        uint8_t reserved[4];
+        uint8_t snp;
+        uint8_t microcode;
+    } f;
+    uint64_t raw;
+} snp_tcb_version;
+
+/**
+ * Signed by the VCEK for reported_tcb. Everything is little-endian, and the
+ * signature's r and s are laid out the same as in a sev_cert.
+ */
+typedef struct __attribute__ ((__packed__)) snp_attestation_report_t
+{
+    uint32_t        version;                // 0x00
+    uint32_t        guest_svn;              // 0x04
+    uint64_t        policy;                 // 0x08
+    uint8_t         family_id[16];          // 0x10
+    uint8_t         image_id[16];           // 0x20
+    uint32_t        vmpl;                   // 0x30
+    uint32_t        signature_algo;         // 0x34
+    snp_tcb_version current_tcb;            // 0x38
+    uint64_t        platform_info;          // 0x40
+    uint32_t        flags;                  // 0x48 - author_key_en, mask_chip_key...
+    uint32_t        reserved_0;             // 0x4C
+    uint8_t         report_data[64];        // 0x50
+    uint8_t         measurement[48];        // 0x90
+    uint8_t         host_data[32];          // 0xC0
+    uint8_t         id_key_digest[48];      // 0xE0
+    uint8_t         author_key_digest[48];  // 0x110
+    uint8_t         report_id[32];          // 0x140
+    uint8_t         report_id_ma[32];       // 0x160
+    snp_tcb_version reported_tcb;           // 0x180
+    uint8_t         reserved_1[0x18];       // 0x188
+    uint8_t         chip_id[SNP_CHIP_ID_SIZE];  // 0x1A0
+    snp_tcb_version committed_tcb;          // 0x1E0
+    uint8_t         current_build;          // 0x1E8
+    uint8_t         current_minor;
+    uint8_t         current_major;
+    uint8_t         reserved_2;
+    uint8_t         committed_build;        // 0x1EC
+    uint8_t         committed_minor;
+    uint8_t         committed_major;
+    uint8_t         reserved_3;
+    snp_tcb_version launch_tcb;             // 0x1F0
+    uint8_t         reserved_4[0xA8];       // 0x1F8
+    sev_sig         signature;              // 0x2A0
+} snp_attestation_report;
+
+static_assert(offsetof(snp_attestation_report, signature) == SNP_REPORT_SIGNED_SIZE,
+              "snp_attestation_report layout");
+static_assert(sizeof(snp_attestation_report) == 0x4A0, "snp_attestation_report size");
+
 #endif /* SEVAPI_H */
@@ -0,0 +1,93 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef SEVBACKEND_H
+#define SEVBACKEND_H
+
+#include "sevapi.h"
+#include <cstddef>
+#include <string>
+
+// Environment variables used to pick and configure the device backend
+constexpr char SEV_BACKEND_ENV[]         = "SEVTOOL_BACKEND";         // "ioctl" or "sim"
+constexpr char SEV_SIM_LATENCY_ENV[]     = "SEVTOOL_SIM_LATENCY_US";  // "500" or "pek_gen=20000,get_id=100"
+constexpr char SEV_SIM_DEVICE_ENV[]      = "SEVTOOL_SIM_DEVICE";      // "naples" or "rome"
+constexpr char SEV_SIM_SEED_ENV[]        = "SEVTOOL_SIM_SEED";        // hex string, chip unique secret
+
+constexpr char SEV_BACKEND_NAME_IOCTL[]  = "ioctl";
+constexpr char SEV_BACKEND_NAME_SIM[]    = "sim";
+
+enum SEV_BACKEND_TYPE {
+    SEV_BACKEND_DEFAULT = 0,    // Use SEV_BACKEND_ENV, else the kernel driver
+    SEV_BACKEND_IOCTL   = 1,    // /dev/sev through the ccp kernel driver
+    SEV_BACKEND_SIM     = 2,    // In-process PSP firmware simulator
+};
+
+/**
+ * Everything SEVDevice sends to the firmware goes through one of these.
+ * issue_cmd() has the same contract as ioctl(SEV_ISSUE_CMD): the command
+ * ids and data buffers are the ones from psp-sev.h, the return value is 0 on
+ * success and -1 on failure, and cmd_ret gets the firmware status code.
+ */
+class SEVBackend {
+public:
+    virtual ~SEVBackend(void) {}
+
+    virtual std::string name(void) = 0;
+    virtual bool open_device(void) = 0;
+    virtual int issue_cmd(int cmd, void *data, int *cmd_ret) = 0;
+
+    /*
+     * Stand-ins for the AMD KDS/developer site downloads. Backends that can't
+     * provide them return ERROR_UNSUPPORTED and the caller falls back to
+     * fetching the certs from the network.
+     */
+    virtual int kds_get_cek(const uint8_t *id, size_t id_length,
+                            sev_cert *cek)
+    {
+        (void)id; (void)id_length; (void)cek;
+        return ERROR_UNSUPPORTED;
+    }
+    virtual int kds_get_ask_ark(uint8_t *buf, size_t buf_length,
+                                size_t *ask_ark_length)
+    {
+        (void)buf; (void)buf_length; (void)ask_ark_length;
+        return ERROR_UNSUPPORTED;
+    }
+    // The VCEK for one chip at one TCB, as an ASK-signed sev_cert
+    virtual int kds_get_vcek(const uint8_t *chip_id, size_t id_length,
+                             uint64_t tcb, sev_cert *vcek)
+    {
+        (void)chip_id; (void)id_length; (void)tcb; (void)vcek;
+        return ERROR_UNSUPPORTED;
+    }
+};
+
+// Talks to the real firmware through the ccp kernel driver
+class SEVIoctlBackend : public SEVBackend {
+private:
+    int m_fd = -1;
+
+public:
+    SEVIoctlBackend(void) {}
+    ~SEVIoctlBackend(void);
+
+    std::string name(void) { return SEV_BACKEND_NAME_IOCTL; }
+    bool open_device(void);
+    int issue_cmd(int cmd, void *data, int *cmd_ret);
+};
+
+#endif /* SEVBACKEND_H */
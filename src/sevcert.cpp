@@ -14,8 +14,11 @@
  * limitations under the License.
  **************************************************************************/
 
+#include "certformat.h"
 #include "crypto.h"
+#include "metrics.h"
 #include "sevcert.h"
+#include "serializer.h"
 #include "utilities.h"
 #include <openssl/bn.h>
 #include <openssl/ec.h>
@@ -38,41 +41,43 @@
  */
 void print_sev_cert_readable(const sev_cert *cert, std::string &out_str)
 {
-    char out[sizeof(sev_cert)*3+500];   // 2 chars per byte + 1 spaces + ~500 extra chars for text
-
-    sprintf(out, "%-15s%08x\n", "Version:", cert->version);                         // uint32_t
-    sprintf(out+strlen(out), "%-15s%02x\n", "api_major:", cert->api_major);         // uint8_t
-    sprintf(out+strlen(out), "%-15s%02x\n", "api_minor:", cert->api_minor);         // uint8_t
-    sprintf(out+strlen(out), "%-15s%08x\n", "pub_key_usage:", cert->pub_key_usage); // uint32_t
-    sprintf(out+strlen(out), "%-15s%08x\n", "pub_key_algo:", cert->pub_key_algo);   // uint32_t
-    sprintf(out+strlen(out), "%-15s\n", "pub_key:");                                 // sev_pubkey
-    for (size_t i = 0; i < (size_t)(sizeof(sev_pubkey)); i++) {  //bytes to uint8
-        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->pub_key)[i] );
-    }
-    sprintf(out+strlen(out), "\n");
-    sprintf(out+strlen(out), "%-15s%08x\n", "sig_1_usage:", cert->sig_1_usage);     // uint32_t
-    sprintf(out+strlen(out), "%-15s%08x\n", "sig_1_algo:", cert->sig_1_algo);       // uint32_t
-    sprintf(out+strlen(out), "%-15s\n", "sig_1:");                                   // sev_sig
-    for (size_t i = 0; i < (size_t)(sizeof(sev_sig)); i++) {     //bytes to uint8
-        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->sig_1)[i] );
-    }
-    sprintf(out+strlen(out), "\n");
-    sprintf(out+strlen(out), "%-15s%08x\n", "sig_2_usage:", cert->sig_2_usage);     // uint32_t
-    sprintf(out+strlen(out), "%-15s%08x\n", "sig_2_algo:", cert->sig_2_algo);       // uint32_t
-    sprintf(out+strlen(out), "%-15s\n", "Sig2:");                                   // sev_sig
-    for (size_t i = 0; i < (size_t)(sizeof(sev_sig)); i++) {     //bytes to uint8
-        sprintf(out+strlen(out), "%02X ", ((uint8_t *)&cert->sig_2)[i] );
-    }
-    sprintf(out+strlen(out), "\n");
-
     if (out_str == "NULL") {
-        printf("%s\n", out);
+        sev::FormatBuffer out(stdout);
+        sev::format_sev_cert_readable(&out, cert);
+        printf("\n");
     }
     else {
-        out_str += out;
+        sev::FormatBuffer out(sev::sev_cert_readable_size() + 1);
+        if (sev::format_sev_cert_readable(&out, cert))
+            out_str.append(out.data(), out.size());
     }
 }
 
+/**
+ * Description: Adds the same fields as print_sev_cert_readable, as a map
+ * Parameters:  [out] is the document to add the cert to
+ *              [key] is the name of the map, or NULL inside an array
+ *              [cert] is the source cert
+ */
+void serialize_sev_cert(sev::Serializer *out, const char *key,
+                        const sev_cert *cert)
+{
+    out->begin_map(key);
+    out->add_uint("version", cert->version);
+    out->add_uint("api_major", cert->api_major);
+    out->add_uint("api_minor", cert->api_minor);
+    out->add_uint("pub_key_usage", cert->pub_key_usage);
+    out->add_uint("pub_key_algo", cert->pub_key_algo);
+    out->add_bytes("pub_key", &cert->pub_key, sizeof(sev_pubkey));
+    out->add_uint("sig_1_usage", cert->sig_1_usage);
+    out->add_uint("sig_1_algo", cert->sig_1_algo);
+    out->add_bytes("sig_1", &cert->sig_1, sizeof(sev_sig));
+    out->add_uint("sig_2_usage", cert->sig_2_usage);
+    out->add_uint("sig_2_algo", cert->sig_2_algo);
+    out->add_bytes("sig_2", &cert->sig_2, sizeof(sev_sig));
+    out->end_map();
+}
+
 /**
  * Description: Prints the contents of an sev_cert as hex bytes to the screen
  * Notes:       To print this to a file, just use write_file() directly
@@ -96,32 +101,34 @@ void print_sev_cert_hex(const sev_cert *cert)
  */
 void print_cert_chain_buf_readable(const sev_cert_chain_buf *p, std::string &out_str)
 {
-    char out_pek[50];    // Just big enough for string below
-    char out_oca[50];
-    char out_cek[50];
-
-    std::string out_str_local = "";
-
-    sprintf(out_pek, "PEK Memory: %ld bytes\n", sizeof(sev_cert));
-    out_str_local += out_pek;
-    print_sev_cert_readable(((sev_cert *)PEK_IN_CERT_CHAIN(p)), out_str_local);
-
-    sprintf(out_oca, "\nOCA Memory: %ld bytes\n", sizeof(sev_cert));
-    out_str_local += out_oca;
-    print_sev_cert_readable(((sev_cert *)OCA_IN_CERT_CHAIN(p)), out_str_local);
-
-    sprintf(out_cek, "\nCEK Memory: %ld bytes\n", sizeof(sev_cert));
-    out_str_local += out_cek;
-    print_sev_cert_readable(((sev_cert *)CEK_IN_CERT_CHAIN(p)), out_str_local);
-
     if (out_str == "NULL") {
-        printf("%s\n", out_str_local.c_str());
+        sev::FormatBuffer out(stdout);
+        sev::format_cert_chain_buf_readable(&out, p);
+        printf("\n");
     }
     else {
-        out_str = out_str_local;
+        sev::FormatBuffer out(sev::cert_chain_buf_readable_size() + 1);
+        if (sev::format_cert_chain_buf_readable(&out, p))
+            out_str.assign(out.data(), out.size());
     }
 }
 
+/**
+ * Description: Adds the PEK, OCA and CEK of the chain as a map of certs
+ * Parameters:  [out] is the document to add the chain to
+ *              [key] is the name of the map, or NULL inside an array
+ *              [p] is the source cert chain buf
+ */
+void serialize_cert_chain_buf(sev::Serializer *out, const char *key,
+                              const sev_cert_chain_buf *p)
+{
+    out->begin_map(key);
+    serialize_sev_cert(out, "pek", (const sev_cert *)PEK_IN_CERT_CHAIN(p));
+    serialize_sev_cert(out, "oca", (const sev_cert *)OCA_IN_CERT_CHAIN(p));
+    serialize_sev_cert(out, "cek", (const sev_cert *)CEK_IN_CERT_CHAIN(p));
+    out->end_map();
+}
+
 /**
  * Description: Prints out the cert chain (PDK, OCA, and CEK) to the screen as
  *              hex bytes
@@ -252,7 +259,7 @@ bool write_pub_key_pem(const std::string file_name, EVP_PKEY *evp_key_pair)
 
     // printf("Writing to file: %s\n", file_name.c_str());
     if (PEM_write_PUBKEY(pFile, evp_key_pair) != 1) {
-        printf("Error writing pubkey to file: %s\n", file_name.c_str());
+        fprintf(stderr, "Error writing pubkey to file: %s\n", file_name.c_str());
         fclose(pFile);
         return false;
     }
@@ -275,7 +282,7 @@ bool write_priv_key_pem(const std::string file_name, EVP_PKEY *evp_key_pair)
 
     // printf("Writing to file: %s\n", file_name.c_str());
     if (PEM_write_PrivateKey(pFile, evp_key_pair, NULL, NULL, 0, NULL, 0) != 1) {
-        printf("Error writing privkey to file: %s\n", file_name.c_str());
+        fprintf(stderr, "Error writing privkey to file: %s\n", file_name.c_str());
         fclose(pFile);
         return false;
     }
@@ -527,6 +534,7 @@ SEV_ERROR_CODE SEVCert::validate_signature(const sev_cert *child_cert,
                                            const sev_cert *parent_cert,
                                            EVP_PKEY *parent_signing_key)    // Probably PubKey
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_VERIFY, "sev_cert_signature");
     if (!child_cert || !parent_cert || !parent_signing_key)
         return ERROR_INVALID_CERTIFICATE;
 
@@ -581,7 +589,7 @@ SEV_ERROR_CODE SEVCert::validate_signature(const sev_cert *child_cert,
 
                 RSA *rsa_pub_key = EVP_PKEY_get1_RSA(parent_signing_key);   // Signer's (parent's) public key
                 if (!rsa_pub_key) {
-                    printf("Error parent signing key is bad\n");
+                    fprintf(stderr, "Error parent signing key is bad\n");
                     break;
                 }
 
@@ -643,7 +651,7 @@ SEV_ERROR_CODE SEVCert::validate_signature(const sev_cert *child_cert,
                 break;
             }
             else {       // Bad/unsupported signing key algorithm
-                printf("Unexpected algorithm! %x\n", parent_cert->pub_key_algo);
+                fprintf(stderr, "Unexpected algorithm! %x\n", parent_cert->pub_key_algo);
                 break;
             }
         }
@@ -812,8 +820,8 @@ SEV_ERROR_CODE SEVCert::decompile_public_key_into_certificate(sev_cert *cert, EV
         if ((cert->pub_key_algo == SEV_SIG_ALGO_RSA_SHA256) ||
             (cert->pub_key_algo == SEV_SIG_ALGO_RSA_SHA384)) {
             // TODO: THIS CODE IS UNTESTED!!!!!!!!!!!!!!!!!!!!!!!!!!!
-            printf("WARNING: You are using untested code in" \
-                   "decompile_public_key_into_certificate for RSA cert type!\n");
+            fprintf(stderr, "WARNING: You are using untested code in" \
+                            "decompile_public_key_into_certificate for RSA cert type!\n");
         }
         else if ((cert->pub_key_algo == SEV_SIG_ALGO_ECDSA_SHA256) ||
                  (cert->pub_key_algo == SEV_SIG_ALGO_ECDSA_SHA384) ||
@@ -879,6 +887,7 @@ SEV_ERROR_CODE SEVCert::decompile_public_key_into_certificate(sev_cert *cert, EV
  */
 SEV_ERROR_CODE SEVCert::verify_sev_cert(const sev_cert *parent_cert1, const sev_cert *parent_cert2)
 {
+    SEV_TRACE_SCOPE(sev::METRIC_CAT_VERIFY, "sev_cert");
     if (!parent_cert1)
         return ERROR_INVALID_CERTIFICATE;
 
@@ -21,6 +21,8 @@
 #include <string>
 #include <openssl/evp.h>
 
+namespace sev { class Serializer; }     // serializer.h
+
 // Public global functions
 static std::string sev_empty = "NULL";
 void print_sev_cert_readable(const sev_cert *cert,
@@ -29,6 +31,10 @@ void print_sev_cert_hex(const sev_cert *cert);
 void print_cert_chain_buf_readable(const sev_cert_chain_buf *p,
                                    std::string &out_str = sev_empty);
 void print_cert_chain_buf_hex(const sev_cert_chain_buf *p);
+void serialize_sev_cert(sev::Serializer *out, const char *key,
+                        const sev_cert *cert);
+void serialize_cert_chain_buf(sev::Serializer *out, const char *key,
+                              const sev_cert_chain_buf *p);
 void read_priv_key_pem_into_rsakey(const std::string file_name,
                                    RSA **rsa_priv_key);
 bool read_priv_key_pem_into_eckey(const std::string file_name,
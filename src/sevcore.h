@@ -17,13 +17,12 @@
 #ifndef SEVCORE_H
 #define SEVCORE_H
 
+#include "sevbackend.h"
 #include "sevcert.h"
 #include <cstddef>
 #include <cstring>
 #include <sys/stat.h>
 #include <fstream>
-#include <libvirt/libvirt.h>
-#include <libvirt/libvirt-qemu.h>
 #include <cstdio>
 #include <string>
 
@@ -51,10 +50,7 @@ enum __attribute__((mode(QI))) ePSP_DEVICE_TYPE {
 };
 
 constexpr char LINUX_SEV_FILE[]         = "/dev/sev";
-constexpr char QMP_SEV_CAPS_CMD[]       = "{\"execute\": \"query-sev-capabilities\"}";
 constexpr char KVM_AND_SEV_PARAM[]      = "/sys/module/kvm_amd/parameters/sev";
-constexpr char LIBVIRT_SEV_SUPPORTED[]  = "<sev supported='yes'>";
-constexpr char COMMAND_NOT_FOUND[]      = "CommandNotFound";
 
 // A system physical address that should always be invalid.
 // Used to test the SEV FW detects such invalid addresses and returns the
@@ -70,26 +66,6 @@ constexpr uint8_t  PLAT_STAT_CONFIGES_OFFSET = 8;
 constexpr uint32_t PLAT_STAT_OWNER_MASK      = (1U << PLAT_STAT_OWNER_OFFSET);
 constexpr uint32_t PLAT_STAT_ES_MASK         = (1U << PLAT_STAT_CONFIGES_OFFSET);
 
-const std::string SHELL_VM_XML_1 = "<domain type='kvm'>"
-                                   "<memory>256000</memory>"
-                                   "<features>"
-                                   "<acpi/>"
-                                   "</features>";
-
-const std::string SHELL_VM_XML_2 = "<memoryBacking>"
-                                   "<locked/>"
-                                   "</memoryBacking>"
-                                   "</domain>";
-
-const std::string SHELL_VM_NAME_BASE = "fceac9812431d";
-
-struct sev_dom_details
-{
-    std::string ovmf_bin_loc;
-    std::string c_bit_pos;
-    std::string reduced_phys_bits;
-};
-
 typedef union
 {
     struct
@@ -106,33 +82,22 @@ typedef union
 // Class to access the special SEV FW API test suite driver.
 class SEVDevice {
 private:
-    int mFd;
+    SEVBackend *m_backend;
     Deps dep_bits;
 
-    inline int get_fd(void) { return mFd; }
+    static SEV_BACKEND_TYPE m_backend_type;
+
     int sev_ioctl(int cmd, void *data, int *cmd_ret);
 
     bool validate_pek_csr(sev_cert *pek_csr);
     std::string display_build_info(void);
-    void get_family_model(uint32_t *family, uint32_t *model);
+    static void get_family_model(uint32_t *family, uint32_t *model);
 
     bool kvm_amd_sev_enabled(void);
-    bool valid_qemu(virDomainPtr dom);
-    bool valid_libvirt(virConnectPtr con);
-    bool valid_ovmf(virDomainPtr dom, bool sev_enabled, char *sev_temp_dir);
-    bool dom_state_up(virDomainPtr dom);
-    bool dom_state_down(virDomainPtr dom);
-    virDomainPtr start_new_domain(virConnectPtr con, std::string name,
-                                  bool sev_enable, struct sev_dom_details dom_details,
-                                  char *sev_temp_dir, char *ovmf_var_file);
-    void create_sev_temp_dir(char **sev_temp_file);
-    void create_sev_pipe_files(char *sev_temp_dir);
-    void create_ovmf_var_file(std::string ovmf_bin, char *sev_temp_dir, char **ovmf_var_file);
-    struct sev_dom_details find_sev_dom_details(virConnectPtr con);
-    std::string find_sev_ovmf_bin(char *capabilities);
-    std::string find_sev_c_bit_pos(char *capabilities);
-    std::string find_sev_reduced_phys_bits(char *capabilities);
+    void check_libvirt_dependencies(void);
     std::string format_software_support_text(void);
+    int kds_download(int (SEVDevice::*download)(const std::string, const std::string),
+                     uint8_t *buf, size_t buf_length, size_t *length);
 
     // Do NOT create ANY other constructors or destructors of any kind.
     SEVDevice(void)  = default;
@@ -147,6 +112,12 @@ public:
     // Singleton Constructor - Threadsafe in C++ 11 and greater.
     static SEVDevice& get_sev_device(void);
 
+    // Must be called before the first get_sev_device() to have any effect
+    static void set_backend_type(SEV_BACKEND_TYPE type);
+    static SEV_BACKEND_TYPE get_backend_type(void);
+    // For the KDS stand-ins that SEVDevice doesn't wrap
+    SEVBackend *backend(void) { return m_backend; }
+
     // Do NOT create ANY other constructors or destructors of any kind.
     ~SEVDevice(void);
 
@@ -167,7 +138,7 @@ public:
     int pek_cert_import(uint8_t *data, sev_cert *pek_csr,
                         const std::string oca_priv_key_file);
     int get_id(void *data, void *id_mem, uint32_t id_length = 0);
-    ePSP_DEVICE_TYPE get_device_type(void);
+    static ePSP_DEVICE_TYPE get_device_type(void);
 
     void check_dependencies(void);
 
@@ -180,6 +151,9 @@ public:
                          const std::string cert_file);
     int get_ask_ark(const std::string output_folder,
                     const std::string cert_file);
+    // Same as the two above, but into the caller's buffers
+    int kds_get_cek(sev_cert *cek);
+    int kds_get_ask_ark(uint8_t *buf, size_t buf_length, size_t *ask_ark_length);
     int zip_certs(const std::string output_folder,
                   const std::string zip_name,
                   const std::string files_to_zip);
@@ -16,45 +16,133 @@
 
 #ifdef __linux__
 #include "sevcore.h"
+#include "metrics.h"
+#include "sevlibvirt.h"
+#include "sevsim.h"
 #include "utilities.h"
 #include "psp-sev.h"
 #include <sys/ioctl.h>      // for ioctl()
 #include <sys/mman.h>       // for mmap() and friends
 #include <cstdio>           // for std::rename
+#include <cstdlib>          // for getenv
 #include <cerrno>           // for errorno
+#include <climits>          // for PATH_MAX
+#include <dlfcn.h>          // for dlopen()
 #include <fcntl.h>          // for O_RDWR
 #include <unistd.h>         // for close()
-#include <uuid/uuid.h>
+#include <mutex>
 #include <stdexcept>        // for std::runtime_error()
 
-char *SEV_PIPE_FILES[2];
+SEV_BACKEND_TYPE SEVDevice::m_backend_type = SEV_BACKEND_DEFAULT;
 
-SEVDevice::~SEVDevice()
+// Metric names of the firmware commands, indexed by psp-sev.h command id
+static const char *sev_cmd_names[SEV_MAX] = {
+    "factory_reset", "platform_status", "pek_gen", "pek_csr", "pdh_gen",
+    "pdh_cert_export", "pek_cert_import", "get_id", "get_id2",
+};
+
+static sev::LatencyHistogram *ioctl_histogram(int cmd)
+{
+    static struct ioctl_histograms {
+        sev::LatencyHistogram *hist[SEV_MAX];
+        ioctl_histograms()
+        {
+            for (int i = 0; i < SEV_MAX; i++)
+                hist[i] = sev::Metrics::histogram(sev::METRIC_CAT_IOCTL, sev_cmd_names[i]);
+        }
+    } histograms;
+
+    if (cmd < 0 || cmd >= SEV_MAX)
+        return NULL;
+    return histograms.hist[cmd];
+}
+
+SEVIoctlBackend::~SEVIoctlBackend()
 {
-    if (mFd >= 0) {
-        close(mFd);
+    if (m_fd >= 0) {
+        close(m_fd);
     }
-    mFd = -1;
+    m_fd = -1;
+}
+
+bool SEVIoctlBackend::open_device(void)
+{
+    m_fd = open(DEFAULT_SEV_DEVICE.c_str(), O_RDWR);
+    return m_fd >= 0;
+}
+
+int SEVIoctlBackend::issue_cmd(int cmd, void *data, int *cmd_ret)
+{
+    int ioctl_ret = -1;
+    sev_issue_cmd arg;
+
+    arg.cmd = (uint32_t)cmd;
+    arg.data = (uint64_t)data;
+
+    ioctl_ret = ioctl(m_fd, SEV_ISSUE_CMD, &arg);
+    *cmd_ret = arg.error;
+    // if (ioctl_ret != 0) {    // Sometimes you expect it to fail
+    //     printf("Error: cmd %#x ioctl_ret=%d (%#x)\n", cmd, ioctl_ret, arg.error);
+    // }
+
+    return ioctl_ret;
+}
+
+SEVDevice::~SEVDevice()
+{
+    delete m_backend;
+    m_backend = NULL;
 }
 
 SEVDevice& SEVDevice::get_sev_device(void)
 {
     static SEVDevice m_sev_device;
-    m_sev_device.mFd = open(DEFAULT_SEV_DEVICE.c_str(), O_RDWR);
-    m_sev_device.dep_bits = {{false, false, false, false, false}};
-    if (m_sev_device.mFd < 0) {
-        throw std::runtime_error("Can't open " + std::string(DEFAULT_SEV_DEVICE) + "!\n");
+    static std::mutex init_mutex;
+    std::lock_guard<std::mutex> lock(init_mutex);
+
+    if (!m_sev_device.m_backend) {
+        SEVBackend *backend = NULL;
+        if (get_backend_type() == SEV_BACKEND_SIM)
+            backend = new SEVSimBackend;
+        else
+            backend = new SEVIoctlBackend;
+
+        if (!backend->open_device()) {
+            std::string device = (get_backend_type() == SEV_BACKEND_SIM) ?
+                                 "the SEV firmware simulator" : DEFAULT_SEV_DEVICE;
+            delete backend;
+            throw std::runtime_error("Can't open " + device + "!\n");
+        }
+        m_sev_device.m_backend = backend;
+        m_sev_device.dep_bits = {{false, false, false, false, false}};
     }
     return m_sev_device;
 }
 
+void SEVDevice::set_backend_type(SEV_BACKEND_TYPE type)
+{
+    m_backend_type = type;
+}
+
+/**
+ * Unless set_backend_type() picked one, SEV_BACKEND_ENV can select the
+ * simulator. Everything else goes to /dev/sev.
+ */
+SEV_BACKEND_TYPE SEVDevice::get_backend_type(void)
+{
+    if (m_backend_type != SEV_BACKEND_DEFAULT)
+        return m_backend_type;
+
+    const char *backend = getenv(SEV_BACKEND_ENV);
+    if (backend && std::string(backend) == SEV_BACKEND_NAME_SIM)
+        return SEV_BACKEND_SIM;
+    return SEV_BACKEND_IOCTL;
+}
+
 int SEVDevice::sev_ioctl(int cmd, void *data, int *cmd_ret)
 {
     int ioctl_ret = -1;
-    sev_issue_cmd arg;
-
-    arg.cmd = (uint32_t)cmd;
-    arg.data = (uint64_t)data;
+    sev::TraceScope trace(ioctl_histogram(cmd));
 
     if (cmd == SEV_GET_ID) {
         /*
@@ -71,17 +159,13 @@ int SEVDevice::sev_ioctl(int cmd, void *data, int *cmd_ret)
 
         if (status_data.api_major == 0 && status_data.api_minor <= 17 &&
            status_data.build < 19) {
-            printf("Adding a 5 second delay to account for Naples GetID bug...\n");
-            ioctl_ret = ioctl(get_fd(), SEV_ISSUE_CMD, &arg);
+            fprintf(stderr, "Adding a 5 second delay to account for Naples GetID bug...\n");
+            ioctl_ret = m_backend->issue_cmd(cmd, data, cmd_ret);
             usleep(5000000);    // 5 seconds
         }
     }
 
-    ioctl_ret = ioctl(get_fd(), SEV_ISSUE_CMD, &arg);
-    *cmd_ret = arg.error;
-    // if (ioctl_ret != 0) {    // Sometimes you expect it to fail
-    //     printf("Error: cmd %#x ioctl_ret=%d (%#x)\n", cmd, ioctl_ret, arg.error);
-    // }
+    ioctl_ret = m_backend->issue_cmd(cmd, data, cmd_ret);
 
     return ioctl_ret;
 }
@@ -261,12 +345,12 @@ int SEVDevice::pek_cert_import(uint8_t *data, sev_cert *pek_csr,
         // Import the OCA pem file and turn it into an sev_cert
         SEVCert cert_obj(*(sev_cert *)oca_cert);
         if (!read_priv_key_pem_into_evpkey(oca_priv_key_file, &oca_priv_key)) {
-            printf("Error importing OCA Priv Key\n");
+            fprintf(stderr, "Error importing OCA Priv Key\n");
             cmd_ret = SEV_RET_INVALID_CERTIFICATE;
             break;
         }
         if (!cert_obj.create_oca_cert(&oca_priv_key, status_data.api_major, status_data.api_minor)) {
-            printf("Error creating OCA cert\n");
+            fprintf(stderr, "Error creating OCA cert\n");
             cmd_ret = SEV_RET_INVALID_CERTIFICATE;
             break;
         }
@@ -334,7 +418,6 @@ int SEVDevice::get_id(void *data, void *id_mem, uint32_t id_length)
 
 std::string SEVDevice::display_build_info(void)
 {
-    SEVDevice sev_device;
     uint8_t status_data[sizeof(sev_platform_status_cmd_buf)];
     sev_platform_status_cmd_buf *status_data_buf = (sev_platform_status_cmd_buf *)&status_data;
     int cmd_ret = -1;
@@ -343,7 +426,7 @@ std::string SEVDevice::display_build_info(void)
     std::string api_minor_ver = "API_Minor: xxx";
     std::string build_id_ver  = "BuildID: xxx";
 
-    cmd_ret = sev_device.platform_status(status_data);
+    cmd_ret = platform_status(status_data);
     if (cmd_ret != 0)
         return "";
 
@@ -378,6 +461,10 @@ ePSP_DEVICE_TYPE SEVDevice::get_device_type(void)
     uint32_t family = 0;
     uint32_t model = 0;
 
+    // The simulator isn't tied to the CPU it happens to be running on
+    if (get_backend_type() == SEV_BACKEND_SIM)
+        return SEVSimBackend::configured_device_type();
+
     get_family_model(&family, &model);
 
     if (family == NAPLES_FAMILY && (int)model >= (int)NAPLES_MODEL_LOW && model <= NAPLES_MODEL_HIGH) {
@@ -408,370 +495,74 @@ bool SEVDevice::kvm_amd_sev_enabled(void)
 }
 
 /**
- * Runs the virConnectGetDomainCapabilities command, and checks for the proper
- * SEV support which should be listed.
- */
-bool SEVDevice::valid_libvirt(virConnectPtr con)
-{
-    char *result = virConnectGetDomainCapabilities(con, NULL, "x86_64",
-                                                   NULL, "kvm", 0);
-
-    return std::strstr(result, LIBVIRT_SEV_SUPPORTED) ? true : false;
-}
-
-/**
- * Validates that qemu has the function query-sev-capabilities exists,
- * indicating that the correct SEV functionality has been backkported to the
- * running instance of QEMU.
- */
-bool SEVDevice::valid_qemu(virDomainPtr dom)
-{
-    char **result = (char **) malloc(sizeof *result);
-    bool ret_val = false;
-
-    // Check that qemu has the functions required for SEV.
-    virDomainQemuMonitorCommand(dom, QMP_SEV_CAPS_CMD, result,
-                                VIR_DOMAIN_QEMU_MONITOR_COMMAND_DEFAULT);
-
-    ret_val = std::strstr(*result, COMMAND_NOT_FOUND) ? false : true;
-
-    free(result);
-
-    return ret_val;
-}
-
-std::string SEVDevice::find_sev_ovmf_bin(char *capabilities)
-{
-    char *ovmf_bin_loc = (char *) malloc(strlen(capabilities));
-    strncpy(ovmf_bin_loc, capabilities, strlen(capabilities));
-
-    char *p_val_end = strstr(ovmf_bin_loc, "</value>");
-
-    if (p_val_end)
-    {
-        ovmf_bin_loc[p_val_end - ovmf_bin_loc] = '\0';
-        ovmf_bin_loc = strstr(ovmf_bin_loc, "<value>");
-        ovmf_bin_loc ? ovmf_bin_loc += sizeof("<value>") - 1 : "";
-    }
-
-    return ovmf_bin_loc;
-}
-
-std::string SEVDevice::find_sev_c_bit_pos(char * capabilities)
-{
-    char *c_bit_pos = (char *) malloc(strlen(capabilities));
-    strncpy(c_bit_pos, capabilities, strlen(capabilities));
-
-    char *p_c_bit_end = strstr(c_bit_pos, "</cbitpos>");
-
-    if (p_c_bit_end)
-    {
-        c_bit_pos[p_c_bit_end - c_bit_pos] = '\0';
-        c_bit_pos = strstr(c_bit_pos, "<cbitpos>");
-        c_bit_pos ? c_bit_pos += sizeof("<cbitpos>") - 1 : "";
-    }
-
-    return c_bit_pos;
-}
-
-std::string SEVDevice::find_sev_reduced_phys_bits(char * capabilities)
-{
-    char *reduced_phys_bits = (char *) malloc(strlen(capabilities));
-    strncpy(reduced_phys_bits, capabilities, strlen(capabilities));
-
-    char *p_reduced_phys_bit_end = strstr(reduced_phys_bits, "</reducedPhysBits>");
-
-    if (p_reduced_phys_bit_end)
-    {
-        reduced_phys_bits[p_reduced_phys_bit_end - reduced_phys_bits] = '\0';
-        reduced_phys_bits = strstr(reduced_phys_bits, "<reducedPhysBits>");
-        reduced_phys_bits ?
-            reduced_phys_bits += sizeof("<reducedPhysBits>") - 1 : "";
-    }
-
-    return reduced_phys_bits;
-}
-
-/**
- * Creates a local pipe to the shell vm for validating OVMF.
- */
-void SEVDevice::create_sev_pipe_files(char * sev_temp_dir)
-{
-    if (sev_temp_dir)
-    {
-        for (uint8_t i = 0; i < 2; i++)
-        {
-            // Allocate just enough size for the UUID being generated.
-            SEV_PIPE_FILES[i] = (char *) malloc(37 * sizeof(char));
-
-            // create a new UUID
-            uuid_t temp_uuid;
-            uuid_generate(temp_uuid);
-
-            // store the UUID in the character pointer array.
-            uuid_unparse_upper(temp_uuid, (char *) SEV_PIPE_FILES[i]);
-
-            std::string in_file_name(std::string(sev_temp_dir) + "/" + std::string(SEV_PIPE_FILES[i]) + ".in");
-            std::string out_file_name(std::string(sev_temp_dir) + "/" +  std::string(SEV_PIPE_FILES[i]) + ".out");
-
-            if (mkfifo(in_file_name.c_str(), 0777) < 0)
-            {
-                if (errno == EEXIST)
-                {
-                    fprintf(stderr, "CRITICAL: SEV pipe input file collision.\n");
-                }
-                else
-                {
-                    fprintf(stderr, "Error: Unknown error with mkfifo occured.\n");
-                }
-                fprintf(stderr, "errno: %d - %s", errno, strerror(errno));
-                exit(1);
-            }
-            else if (mkfifo(out_file_name.c_str(), 0777) < 0)
-            {
-                if (errno == EEXIST)
-                {
-                    fprintf(stderr, "CRITICAL: SEV pipe output file collision.\n");
-                }
-                else
-                {
-                    fprintf(stderr, "Error: Unknown error with mkfifo occured.\n");
-                }
-                fprintf(stderr, "errno: %d - %s", errno, strerror(errno));
-                exit(1);
-            }
-
-            if (chmod(in_file_name.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) < 0)
-            {
-                fprintf(stderr, "CRITICAL: Unable to modify the file "
-                        "permissions for the pipe files generated");
-                fprintf(stderr, "errno: %d - %s", errno, strerror(errno));
-                exit(1);
-            }
-
-            if (chmod(out_file_name.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) < 0)
-            {
-                fprintf(stderr, "CRITICAL: Unable to modify the file "
-                        "permissions for the pipe files generated");
-                fprintf(stderr, "errno: %d - %s", errno, strerror(errno));
-                exit(1);
-            }
-        }
-    }
-}
-
-/**
- *  Create the temp directory used for all SEV test files.
- */
-void SEVDevice::create_sev_temp_dir(char ** sev_temp_file)
-{
-    char sev_file_template[] = "/tmp/SEVXXXXXX";
-    *sev_temp_file = strdup(mkdtemp(sev_file_template));
-    if (chmod(*sev_temp_file, S_IRWXU | S_IRWXG | S_IRWXO) < 0)
-    {
-        fprintf(stderr, "CRITICAL: Unable to modify the sev temporary directory");
-        fprintf(stderr, "errno: %d - %s", errno, strerror(errno));
-        exit(1);
-    }
-}
-
-/**
- *  Creates an OVMF Variable file for validation of OVMF
+ * Looks for the sevtool-libvirt plugin in SEV_PLUGIN_DIR_ENV, next to the
+ * executable (.libs is where libtool leaves it in the build tree), and
+ * then where make install put it.
  */
-void SEVDevice::create_ovmf_var_file(std::string ovmf_bin, char * sev_temp_dir,
-                                     char ** ovmf_var_file)
+static void *open_libvirt_plugin(void)
 {
-    struct stat *ovmf_bin_details = new struct stat();
-    struct stat *ovmf_var_details = new struct stat();
-    uint64_t byte_count = 0;
-
-    if (stat(ovmf_bin.c_str(), ovmf_bin_details) == 0)
-    {
-        if (ovmf_bin_details->st_size < 0x200000)
-        {
-            byte_count = 0x200000 - ovmf_bin_details->st_size;
-        }
-        else
-        {
-            byte_count = 0x400000 - ovmf_bin_details->st_size;
-        }
-    }
-
-    std::string null_bytes(byte_count, '\0');
-    strcpy(*ovmf_var_file, sev_temp_dir);
-    strcat(*ovmf_var_file, "/OVMF-XXXXXX");
-
-    if (mkstemp(*ovmf_var_file) > 0)
-    {
-        std::ofstream fout(*ovmf_var_file);
-        fout << null_bytes;
-        fout.close();
+    std::string dirs[4];
+    size_t count = 0;
+    char exe[PATH_MAX];
+    void *handle = NULL;
+
+    const char *env = getenv(SEV_PLUGIN_DIR_ENV);
+    if (env && *env)
+        dirs[count++] = env;
+    ssize_t len = readlink("/proc/self/exe", exe, sizeof(exe) - 1);
+    if (len > 0) {
+        exe[len] = '\0';
+        std::string exe_dir = exe;
+        exe_dir = exe_dir.substr(0, exe_dir.find_last_of('/'));
+        dirs[count++] = exe_dir;
+        dirs[count++] = exe_dir + "/.libs";
     }
-    else
-    {
-        if (errno == EEXIST)
-        {
-            fprintf(stderr, "CRITICAL: OVMF variable file collision!\n");
-            fprintf(stderr, "errno: %d - %s", errno, strerror(errno));
-        }
-        else
-        {
-            fprintf(stderr, "CRITICAL: An unforseen error has occured: %d\n", errno);
-            fprintf(stderr, "errno: %d - %s", errno, strerror(errno));
-        }
-
-        exit(1);
-    }
-
-    delete ovmf_bin_details;
-    delete ovmf_var_details;
-}
-
-/**
- * Checks if the shell vm is currently running.
- */
-bool SEVDevice::dom_state_up(virDomainPtr dom)
-{
-    return !this->dom_state_down(dom);
-}
-
-/**
- * Checks if the shell vm is currently listed as down or non-existent.
- */
-bool SEVDevice::dom_state_down(virDomainPtr dom)
-{
-    virDomainInfo * dom_info = new virDomainInfo();
-    bool ret_val = false;
-
-    virDomainGetInfo(dom, dom_info);
+#ifdef SEVTOOL_PKGLIBDIR
+    dirs[count++] = SEVTOOL_PKGLIBDIR;
+#endif
 
-    switch (dom_info->state)
-    {
-        case VIR_DOMAIN_NOSTATE:
-        case VIR_DOMAIN_SHUTDOWN:
-        case VIR_DOMAIN_SHUTOFF:
-            ret_val = true;
-            break;
-        default:
-            break;
+    for (size_t i = 0; i < count && !handle; i++) {
+        std::string path = dirs[i] + "/" + SEV_LIBVIRT_PLUGIN;
+        if (access(path.c_str(), R_OK) != 0)
+            continue;
+        handle = dlopen(path.c_str(), RTLD_NOW | RTLD_LOCAL);
+        if (!handle)
+            fprintf(stderr, "Error: unable to load %s: %s\n", path.c_str(), dlerror());
     }
-
-    delete dom_info;
-    return ret_val;
-}
-
-virDomainPtr SEVDevice::start_new_domain(virConnectPtr con,
-                                         std::string name,
-                                         bool sev_enable,
-                                         struct sev_dom_details dom_details,
-                                         char * sev_temp_dir,
-                                         char * ovmf_var_file)
-{
-    // OVMF is running successfully without SEV enabled.
-    std::string shell_vm_name = "<name>" + name + "</name>";
-
-    std::string sev_pipe_path = "<source path='" + std::string(sev_temp_dir) + "/" +
-                                std::string(SEV_PIPE_FILES[sev_enable ? 1 : 0]) + "'/>";
-
-    std::string sev_pipe = "<devices>"
-                           "<serial type='pipe'>" +
-                           sev_pipe_path +
-                           "<target port='1'/>"
-                           "</serial>"
-                           "</devices>";
-
-    std::string code_bin_path = "<os><loader readonly='yes'"
-                                " type='pflash'>" +
-                                dom_details.ovmf_bin_loc +
-                                "</loader>";
-
-    std::string var_bin_path  = "<nvram>" +
-                                std::string(ovmf_var_file) +
-                                "</nvram>"
-                                "<type arch='x86_64'"
-                                " machine='q35'>hvm"
-                                "</type>"
-                                "</os>";
-
-    std::string SHELL_VM_SEV_ENABLE = "<launchSecurity type='sev'>"
-                                      "<policy>0x0001</policy>"
-                                      "<cbitpos>" +
-                                      dom_details.c_bit_pos +
-                                      "</cbitpos>"
-                                      "<reducedPhysBits>" +
-                                      dom_details.reduced_phys_bits +
-                                      "</reducedPhysBits>"
-                                      "</launchSecurity>";
-
-    std::string FINAL_XML = SHELL_VM_XML_1  +
-                            shell_vm_name   +
-                            sev_pipe        +
-                            code_bin_path   +
-                            var_bin_path    +
-                            (sev_enable ? SHELL_VM_SEV_ENABLE : "") +
-                            SHELL_VM_XML_2;
-
-    virDomainPtr dom = virDomainDefineXML(con, FINAL_XML.c_str());
-
-    virDomainCreate(dom);
-
-    return dom;
+    return handle;
 }
 
 /**
- * Validates that OVMF is working properly with SEV by investigating memory
- * pages which are known to be zero, but now contain encrypted valus.
+ * The QEMU, libvirt and OVMF part of check_dependencies. It's the only user
+ * of libvirt, so it runs in a plugin that is loaded here and nowhere else.
+ * The plugin is never unloaded, as libvirt can leave threads behind.
  */
-bool SEVDevice::valid_ovmf(virDomainPtr dom, bool sev_enabled, char * sev_temp_dir)
+void SEVDevice::check_libvirt_dependencies(void)
 {
-    bool ret_val = false;
-    uint8_t check = 0;
-
-    std::string file_name(sev_temp_dir);
-    file_name += "/";
-    file_name += SEV_PIPE_FILES[(sev_enabled ? 1 : 0)];
-    file_name += ".in";
-
-    std::ofstream pipe_in(file_name);
-
-    for (; check < 3; check++)
-    {
-        printf("Waiting for OVMF to come up...\n");
-        sleep(3);
-        if (this->dom_state_up(dom))
-        {
-            break;
-        }
+    sev_libvirt_deps deps;
+    memset(&deps, 0, sizeof(deps));
+
+    void *plugin = open_libvirt_plugin();
+    if (!plugin) {
+        printf("Unable to find %s, skipping the QEMU, Libvirt and OVMF checks\n",
+               SEV_LIBVIRT_PLUGIN);
+        return;
     }
 
-    // Attempt to shutdown the machine via OVMF. This is a valid check because
-    // instances of OVMF without proper code will fail to respond.
-    pipe_in << "\rreset -s s\r";
-    pipe_in.close();
-
-    // Wait long enough for the VM to be shutdown.
-    for (check = 0; check < 3; check++)
-    {
-        printf("Waiting for OVMF to shutdown...\n");
-        if (this->dom_state_down(dom))
-        {
-            ret_val = true;
-            break;
-        }
-        sleep(3);
+    sev_libvirt_check_fn check =
+        (sev_libvirt_check_fn)dlsym(plugin, SEV_LIBVIRT_PLUGIN_SYMBOL);
+    if (!check) {
+        fprintf(stderr, "Error: %s has no %s\n", SEV_LIBVIRT_PLUGIN, SEV_LIBVIRT_PLUGIN_SYMBOL);
+        return;
     }
-
-    if (!ret_val)
-    {
-        fprintf(stderr, "OVMF found running after OVMF reset given! Destroying transient VM!\n");
-        virDomainDestroy(dom);
+    if (check(&deps) != SEV_LIBVIRT_PLUGIN_VERSION) {
+        fprintf(stderr, "Error: %s doesn't match this sevtool\n", SEV_LIBVIRT_PLUGIN);
+        return;
     }
 
-    virDomainUndefineFlags(dom, VIR_DOMAIN_UNDEFINE_NVRAM);
-    virDomainFree(dom);
-
-    // Read the status of the domain.
-    return ret_val;
+    this->dep_bits.qemu = deps.qemu;
+    this->dep_bits.libvirt = deps.libvirt;
+    this->dep_bits.ovmf = deps.ovmf;
 }
 
 /**
@@ -804,84 +595,7 @@ void SEVDevice::check_dependencies(void)
 
             if (this->sev_ioctl(SEV_PLATFORM_STATUS, p_data, &cmd_ret) != -1)
             {
-                // Open a connection to the hypervisor using the default connection.
-                virConnectPtr con = virConnectOpen(NULL);
-
-                char *capabilities = virConnectGetDomainCapabilities(con,
-                                                                     NULL,
-                                                                     "x86_64",
-                                                                     NULL,
-                                                                     "kvm",
-                                                                     0);
-
-                struct sev_dom_details dom_details = {find_sev_ovmf_bin(capabilities),
-                                                      find_sev_c_bit_pos(capabilities),
-                                                      find_sev_reduced_phys_bits(capabilities)};
-
-                if (! dom_details.ovmf_bin_loc.empty())
-                {
-                    // Create the pipe files to interact with the shell VM.
-                    char *sev_temp_dir = (char *) malloc(sizeof("/tmp/SEVXXXXXX\0"));
-                    char *ovmf_var_file = (char *) malloc(sizeof(char) * 64);
-
-                    this->create_sev_temp_dir(&sev_temp_dir);
-                    this->create_sev_pipe_files(sev_temp_dir);
-                    this->create_ovmf_var_file(dom_details.ovmf_bin_loc, sev_temp_dir, &ovmf_var_file);
-
-                    // Create a shell VM with the XML specified
-                    // (destroyed upon completion of testing).
-                    virDomainPtr dom = this->start_new_domain(con,
-                                                              SHELL_VM_NAME_BASE + "1",
-                                                              false,
-                                                              dom_details,
-                                                              sev_temp_dir,
-                                                              ovmf_var_file);
-
-                    if (valid_qemu(dom))
-                    {
-                        this->dep_bits.qemu = !!1;
-
-                        // The libvirt check relies on QEMU to be successfully
-                        // configured.
-                        if (this->valid_libvirt(con))
-                        {
-                            this->dep_bits.libvirt = !!1;
-
-                            printf("Verifying OVMF works with SEV disabled...\n");
-
-                            if (this->valid_ovmf(dom, false, sev_temp_dir))
-                            {
-                                virDomainPtr sev_dom = start_new_domain(con,
-                                                                        SHELL_VM_NAME_BASE + "2",
-                                                                        true,
-                                                                        dom_details,
-                                                                        sev_temp_dir,
-                                                                        ovmf_var_file);
-
-                                printf("Verifying OVMF works with SEV enabled...\n");
-                                if (this->valid_ovmf(sev_dom, true, sev_temp_dir))
-                                {
-                                    this->dep_bits.ovmf = !!1;
-                                }
-                            }
-                        }
-                    }
-
-                    for (uint8_t i = 0; i < 2; i++)
-                    {
-                        remove(std::string(std::string(sev_temp_dir) + "/" + std::string(SEV_PIPE_FILES[i]) + ".in").c_str());
-                        remove(std::string(std::string(sev_temp_dir) + "/" + std::string(SEV_PIPE_FILES[i]) + ".out").c_str());
-                    }
-
-                    remove(ovmf_var_file);
-                    remove(sev_temp_dir);
-
-                    free(ovmf_var_file);
-                    free(sev_temp_dir);
-                }
-
-                // Cleanup
-                virConnectClose(con);
+                this->check_libvirt_dependencies();
             }
         }
     }
@@ -1132,6 +846,21 @@ int SEVDevice::generate_cek_ask(const std::string output_folder,
             break;
         }
 
+        // Everything from here on is the download
+        SEV_TRACE_SCOPE(sev::METRIC_CAT_KDS, "cek");
+
+        // Backends with their own KDS stand-in (the simulator) supply the CEK
+        sev_cert cek;
+        cmd_ret = m_backend->kds_get_cek(id_buf.socket1, sizeof(id_buf.socket1), &cek);
+        if (cmd_ret != ERROR_UNSUPPORTED) {
+            if (cmd_ret == SEV_RET_SUCCESS &&
+                sev::write_file(to_cert_w_path, &cek, sizeof(cek)) != sizeof(cek)) {
+                fprintf(stderr, "Error: writing cek cert file\n");
+                cmd_ret = SEV_RET_UNSUPPORTED;
+            }
+            break;
+        }
+
         // The AMD KDS server only accepts requests every 10 seconds
         std::string cert_w_path = output_folder + id0_buf;
         char tmp_buf[sizeof(id_buf.socket1)*2+1] = {0};  // 2 chars per byte +1 for null term
@@ -1141,7 +870,7 @@ int SEVDevice::generate_cek_ask(const std::string output_folder,
         int max_retries = (int)((10/sec_to_sleep)+2);
         while (!cert_found && retries <= max_retries) {
             if (!sev::execute_system_command(cmd, &output)) {
-                printf("Error: pipe not opened for system command\n");
+                fprintf(stderr, "Error: pipe not opened for system command\n");
                 cmd_ret = SEV_RET_UNSUPPORTED;
                 break;
             }
@@ -1152,18 +881,18 @@ int SEVDevice::generate_cek_ask(const std::string output_folder,
                 break;
             }
             sleep(sec_to_sleep);
-            printf("Trying again\n");
+            fprintf(stderr, "Trying again\n");
             retries++;
         }
         if (!cert_found) {
-            printf("Error: command to get cek_ask cert failed\n");
+            fprintf(stderr, "Error: command to get cek_ask cert failed\n");
             cmd_ret = SEV_RET_UNSUPPORTED;
             break;
         }
 
         // Copy the file from (get_id) name to something known (cert_file)
         if (std::rename(cert_w_path.c_str(), to_cert_w_path.c_str()) != 0) {
-            printf("Error: renaming cek cert file\n");
+            fprintf(stderr, "Error: renaming cek cert file\n");
             cmd_ret = SEV_RET_UNSUPPORTED;
             break;
         }
@@ -1203,14 +932,31 @@ int SEVDevice::get_ask_ark(const std::string output_folder,
             cert_w_path += ASK_ARK_ROME_FILE;
         }
         else {
-            printf("Error: Unable to determine Platform type. " \
-                        "Detected %i\n", (uint32_t)device_type);
+            fprintf(stderr, "Error: Unable to determine Platform type. " \
+                                 "Detected %i\n", (uint32_t)device_type);
+            break;
+        }
+
+        // Everything from here on is the download
+        SEV_TRACE_SCOPE(sev::METRIC_CAT_KDS, "ask_ark");
+
+        // Backends with their own KDS stand-in (the simulator) supply the certs
+        uint8_t ask_ark_buf[sizeof(amd_cert)*2];
+        size_t ask_ark_length = 0;
+        cmd_ret = m_backend->kds_get_ask_ark(ask_ark_buf, sizeof(ask_ark_buf), &ask_ark_length);
+        if (cmd_ret != ERROR_UNSUPPORTED) {
+            if (cmd_ret == SEV_RET_SUCCESS &&
+                sev::write_file(to_cert_w_path, ask_ark_buf, ask_ark_length) != ask_ark_length) {
+                fprintf(stderr, "Error: writing ask_ark cert file\n");
+                cmd_ret = SEV_RET_UNSUPPORTED;
+            }
             break;
         }
+        cmd_ret = SEV_RET_UNSUPPORTED;
 
         // Download the certificate from the AMD server
         if (!sev::execute_system_command(cmd, &output)) {
-            printf("Error: pipe not opened for system command\n");
+            fprintf(stderr, "Error: pipe not opened for system command\n");
             cmd_ret = SEV_RET_UNSUPPORTED;
             break;
         }
@@ -1218,14 +964,14 @@ int SEVDevice::get_ask_ark(const std::string output_folder,
         // Check if the file got downloaded
         char tmp_buf[100] = {0};  // Just try to read some amount of chars
         if (sev::read_file(cert_w_path, tmp_buf, sizeof(tmp_buf)) == 0) {
-            printf("Error: command to get ask_ark cert failed\n");
+            fprintf(stderr, "Error: command to get ask_ark cert failed\n");
             cmd_ret = SEV_RET_UNSUPPORTED;
             break;
         }
 
         // Rename the file (_PlatformType) to something known (cert_file)
         if (std::rename(cert_w_path.c_str(), to_cert_w_path.c_str()) != 0) {
-            printf("Error: renaming ask_ark cert file\n");
+            fprintf(stderr, "Error: renaming ask_ark cert file\n");
             cmd_ret = SEV_RET_UNSUPPORTED;
             break;
         }
@@ -1235,6 +981,81 @@ int SEVDevice::get_ask_ark(const std::string output_folder,
     return cmd_ret;
 }
 
+/**
+ * For backends without a KDS stand-in: runs one of the file based downloads
+ * above in a private temp folder, reads the cert back and removes the folder
+ */
+int SEVDevice::kds_download(int (SEVDevice::*download)(const std::string, const std::string),
+                            uint8_t *buf, size_t buf_length, size_t *length)
+{
+    int cmd_ret = SEV_RET_UNSUPPORTED;
+    const std::string cert_file = "kds.cert";
+    char folder_template[] = "/tmp/sevtool_kds.XXXXXX";
+
+    if (!mkdtemp(folder_template)) {
+        fprintf(stderr, "Error: unable to create a temp folder for the KDS download\n");
+        return cmd_ret;
+    }
+    std::string folder = std::string(folder_template) + "/";
+
+    do {
+        cmd_ret = (this->*download)(folder, cert_file);
+        if (cmd_ret != SEV_RET_SUCCESS)
+            break;
+
+        *length = sev::read_file(folder + cert_file, buf, buf_length);
+        if (*length == 0)
+            cmd_ret = SEV_RET_UNSUPPORTED;
+    } while (0);
+
+    std::remove((folder + cert_file).c_str());
+    rmdir(folder_template);
+
+    return cmd_ret;
+}
+
+int SEVDevice::kds_get_cek(sev_cert *cek)
+{
+    int cmd_ret = SEV_RET_UNSUPPORTED;
+    sev_user_data_get_id id_buf;
+
+    memset(&id_buf, 0, sizeof(sev_user_data_get_id));
+
+    do {
+        if (sev_ioctl(SEV_GET_ID, &id_buf, &cmd_ret) != 0)
+            break;
+
+        {
+            SEV_TRACE_SCOPE(sev::METRIC_CAT_KDS, "cek");
+            cmd_ret = m_backend->kds_get_cek(id_buf.socket1, sizeof(id_buf.socket1), cek);
+        }
+        if (cmd_ret != ERROR_UNSUPPORTED)
+            break;
+
+        size_t length = 0;
+        cmd_ret = kds_download(&SEVDevice::generate_cek_ask, (uint8_t *)cek,
+                               sizeof(sev_cert), &length);
+        if (cmd_ret == SEV_RET_SUCCESS && length != sizeof(sev_cert))
+            cmd_ret = SEV_RET_UNSUPPORTED;
+    } while (0);
+
+    return cmd_ret;
+}
+
+int SEVDevice::kds_get_ask_ark(uint8_t *buf, size_t buf_length, size_t *ask_ark_length)
+{
+    int cmd_ret = SEV_RET_UNSUPPORTED;
+
+    {
+        SEV_TRACE_SCOPE(sev::METRIC_CAT_KDS, "ask_ark");
+        cmd_ret = m_backend->kds_get_ask_ark(buf, buf_length, ask_ark_length);
+    }
+    if (cmd_ret == ERROR_UNSUPPORTED)
+        cmd_ret = kds_download(&SEVDevice::get_ask_ark, buf, buf_length, ask_ark_length);
+
+    return cmd_ret;
+}
+
 int SEVDevice::zip_certs(const std::string output_folder,
                          const std::string zip_name,
                          const std::string files_to_zip)
@@ -1248,7 +1069,7 @@ int SEVDevice::zip_certs(const std::string output_folder,
     sev::execute_system_command(cmd, &output);
 
     if (output.find(error) != std::string::npos) {
-        printf("Error when zipping up files!");
+        fprintf(stderr, "Error when zipping up files!");
         cmd_ret = -1;
     }
 
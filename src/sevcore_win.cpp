@@ -23,23 +23,17 @@
 #include <errno.h>          // for errorno
 #include <fcntl.h>          // for O_RDWR
 #include <unistd.h>         // for close()
-#include <stdexcept>        // for std::runtime_error()
 
 SEVDevice::~SEVDevice()
 {
-    if (mFd >= 0) {
-        close(mFd);
-    }
-    mFd = -1;
+    m_backend = NULL;
 }
 
+// There is no device backend for Windows yet, so m_backend stays NULL and
+// every command below returns an error
 SEVDevice& SEVDevice::get_sev_device(void)
 {
     static SEVDevice m_sev_device;
-    m_sev_device.mFd = open(DEFAULT_SEV_DEVICE, O_RDWR);
-    if (m_sev_device.mFd < 0) {
-        throw std::runtime_error("Can't open " + std::string(DEFAULT_SEV_DEVICE) + "!\n");
-    }
     return m_sev_device;
 }
 
@@ -0,0 +1,49 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+/**
+ * The interface between sevtool and the sevtool-libvirt plugin.
+ *
+ * The QEMU, libvirt and OVMF checks of sys_info need libvirt, which pulls a
+ * large tree of shared libraries into the process. They are built into a
+ * separate module that SEVDevice::check_dependencies dlopen()s, so no other
+ * command loads libvirt. Nothing in here may use libvirt types.
+ */
+
+#ifndef SEVLIBVIRT_H
+#define SEVLIBVIRT_H
+
+constexpr char SEV_LIBVIRT_PLUGIN[]        = "sevtool-libvirt.so";
+constexpr char SEV_LIBVIRT_PLUGIN_SYMBOL[] = "sevtool_libvirt_check";
+constexpr char SEV_PLUGIN_DIR_ENV[]        = "SEVTOOL_PLUGIN_DIR";  // Searched first
+
+// Bump if sev_libvirt_deps or the entry point change
+constexpr int SEV_LIBVIRT_PLUGIN_VERSION = 1;
+
+struct sev_libvirt_deps {
+    bool qemu;
+    bool libvirt;       // Only checked if qemu is
+    bool ovmf;          // Only checked if libvirt is
+};
+
+/**
+ * Starts throw away shell VMs through libvirt to check QEMU, libvirt and
+ * OVMF. Only call once the SEV kernel driver and KVM checks have passed.
+ * Returns SEV_LIBVIRT_PLUGIN_VERSION.
+ */
+typedef int (*sev_libvirt_check_fn)(sev_libvirt_deps *deps);
+
+#endif /* SEVLIBVIRT_H */
@@ -0,0 +1,998 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifdef __linux__
+#include "sevsim.h"
+#include "amdcert.h"        // for amd_root_key_id_*
+#include "crypto.h"
+#include "secretpack.h"     // for launch_secret_mac
+#include "sevcert.h"
+#include "utilities.h"
+#include "psp-sev.h"
+#include <cstdlib>          // for getenv, strtoul
+#include <cstring>
+#include <unistd.h>         // for usleep
+#include <openssl/bn.h>
+#include <openssl/crypto.h> // for CRYPTO_memcmp, OPENSSL_cleanse
+#include <openssl/ec.h>
+#include <openssl/rand.h>
+#include <openssl/rsa.h>
+
+constexpr char SIM_DEFAULT_SEED[]  = "sev-tool simulated chip";
+constexpr char SIM_CHIP_ID_LABEL[] = "sev-chip-id";
+
+static const struct {
+    const char *name;
+    int cmd;
+} sim_cmd_names[] = {
+    {"factory_reset",   SEV_FACTORY_RESET},
+    {"platform_status", SEV_PLATFORM_STATUS},
+    {"pek_gen",         SEV_PEK_GEN},
+    {"pek_csr",         SEV_PEK_CSR},
+    {"pdh_gen",         SEV_PDH_GEN},
+    {"pdh_cert_export", SEV_PDH_CERT_EXPORT},
+    {"pek_cert_import", SEV_PEK_CERT_IMPORT},
+    {"get_id",          SEV_GET_ID},
+};
+
+static bool generate_rsa_key_pair(EVP_PKEY **evp_key_pair, int bits)
+{
+    bool ret = false;
+    EVP_PKEY_CTX *ctx = NULL;
+
+    do {
+        if (!(ctx = EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, NULL)))
+            break;
+        if (EVP_PKEY_keygen_init(ctx) <= 0)
+            break;
+        if (EVP_PKEY_CTX_set_rsa_keygen_bits(ctx, bits) <= 0)
+            break;
+        if (EVP_PKEY_keygen(ctx, evp_key_pair) <= 0)
+            break;
+
+        ret = true;
+    } while (0);
+
+    EVP_PKEY_CTX_free(ctx);
+    return ret;
+}
+
+SEVSimBackend::SEVSimBackend(void)
+     : m_device_type(PSP_DEVICE_TYPE_ROME),
+       m_state(SEV_PLATFORM_INIT),
+       m_flags(0),
+       m_guest_count(0),
+       m_cek_key(NULL),
+       m_oca_key(NULL),
+       m_pek_key(NULL),
+       m_pdh_key(NULL),
+       m_csr_key(NULL),
+       m_ark_key(NULL),
+       m_ask_key(NULL),
+       m_amd_chain_valid(false)
+{
+    memset(m_latency_us, 0, sizeof(m_latency_us));
+    m_kds_latency_us = 0;
+    memset(m_chip_secret, 0, sizeof(m_chip_secret));
+    memset(m_chip_id, 0, sizeof(m_chip_id));
+}
+
+SEVSimBackend::~SEVSimBackend(void)
+{
+    EVP_PKEY_free(m_cek_key);
+    EVP_PKEY_free(m_oca_key);
+    EVP_PKEY_free(m_pek_key);
+    EVP_PKEY_free(m_pdh_key);
+    EVP_PKEY_free(m_csr_key);
+    EVP_PKEY_free(m_ark_key);
+    EVP_PKEY_free(m_ask_key);
+    OPENSSL_cleanse(m_chip_secret, sizeof(m_chip_secret));
+}
+
+ePSP_DEVICE_TYPE SEVSimBackend::configured_device_type(void)
+{
+    const char *device = getenv(SEV_SIM_DEVICE_ENV);
+
+    if (device && strcmp(device, "naples") == 0)
+        return PSP_DEVICE_TYPE_NAPLES;
+    return PSP_DEVICE_TYPE_ROME;
+}
+
+/**
+ * Brings up the simulated platform: reads the configuration from the
+ * environment, derives the chip secret, ID and CEK, and generates the
+ * initial OCA/PEK/PDH like the firmware does on first INIT.
+ */
+bool SEVSimBackend::open_device(void)
+{
+    bool ret = false;
+    const char *seed = getenv(SEV_SIM_SEED_ENV);
+    const char *latency = getenv(SEV_SIM_LATENCY_ENV);
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    do {
+        m_device_type = configured_device_type();
+        if (m_device_type == PSP_DEVICE_TYPE_ROME)
+            m_flags |= PLAT_STAT_ES_MASK;       // Rome supports SEV-ES
+
+        if (latency && !parse_latency_spec(latency)) {
+            fprintf(stderr, "Error: invalid %s value \"%s\"\n", SEV_SIM_LATENCY_ENV, latency);
+            break;
+        }
+
+        if (!seed || seed[0] == '\0')
+            seed = SIM_DEFAULT_SEED;
+        if (!digest_sha(seed, strlen(seed), m_chip_secret,
+                        sizeof(m_chip_secret), SHA_TYPE_256))
+            break;
+
+        if (!kdf(m_chip_id, sizeof(m_chip_id), m_chip_secret, sizeof(m_chip_secret),
+                 (const uint8_t *)SIM_CHIP_ID_LABEL, sizeof(SIM_CHIP_ID_LABEL)-1,
+                 NULL, 0))
+            break;
+
+        if (!derive_cek())
+            break;
+
+        if (!regen_oca_pek())
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+/**
+ * Accepts a single number of microseconds, which is applied to every
+ * command, and/or a comma separated list of command=microseconds pairs.
+ * "kds" sets the round trip time of the KDS stand-in.
+ * Ex) "500" or "pek_gen=20000,pdh_gen=8000" or "100,get_id=5000,kds=150000"
+ */
+bool SEVSimBackend::parse_latency_spec(const std::string spec)
+{
+    size_t start = 0;
+
+    while (start <= spec.size()) {
+        size_t end = spec.find(',', start);
+        if (end == std::string::npos)
+            end = spec.size();
+        std::string token = spec.substr(start, end - start);
+        start = end + 1;
+
+        if (token.empty())
+            continue;
+
+        size_t equals = token.find('=');
+        std::string value = (equals == std::string::npos) ? token : token.substr(equals + 1);
+        char *value_end = NULL;
+        unsigned long usec = strtoul(value.c_str(), &value_end, 10);
+        if (value.empty() || *value_end != '\0')
+            return false;
+
+        if (equals == std::string::npos) {
+            for (size_t i = 0; i < SIM_MAX_CMD; i++)
+                m_latency_us[i] = (uint32_t)usec;
+            continue;
+        }
+
+        std::string name = token.substr(0, equals);
+        if (name == SIM_KDS_LATENCY_NAME) {
+            m_kds_latency_us = (uint32_t)usec;
+            continue;
+        }
+        bool found = false;
+        for (size_t i = 0; i < sizeof(sim_cmd_names)/sizeof(sim_cmd_names[0]); i++) {
+            if (name == sim_cmd_names[i].name) {
+                m_latency_us[sim_cmd_names[i].cmd] = (uint32_t)usec;
+                found = true;
+            }
+        }
+        if (!found)
+            return false;
+    }
+
+    return true;
+}
+
+void SEVSimBackend::set_latency_us(int cmd, uint32_t usec)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    if (cmd >= 0 && cmd < (int)SIM_MAX_CMD)
+        m_latency_us[cmd] = usec;
+}
+
+void SEVSimBackend::inject_latency(int cmd)
+{
+    if (cmd >= 0 && cmd < (int)SIM_MAX_CMD && m_latency_us[cmd] != 0)
+        usleep(m_latency_us[cmd]);
+}
+
+uint8_t SEVSimBackend::api_minor(void)
+{
+    return (m_device_type == PSP_DEVICE_TYPE_NAPLES) ? SIM_API_MINOR_NAPLES
+                                                     : SIM_API_MINOR_ROME;
+}
+
+/**
+ * A P-384 key derived from the chip secret, so it doesn't change across runs
+ * or resets. Uses the extra-random-bits method (FIPS 186-4 B.4.1):
+ *   d = (c mod (n-1)) + 1
+ */
+bool SEVSimBackend::derive_ec_key(EVP_PKEY **key, const char *label,
+                                  const uint8_t *context, size_t context_length)
+{
+    bool ret = false;
+    uint8_t seed[SEV_ECC_CURVE_SIZE_BYTES + ECC_KEYGEN_EXTRA_BYTES];
+    EC_KEY *ec_key = NULL;
+    EC_POINT *pub_point = NULL;
+    BIGNUM *order = NULL;
+    BIGNUM *priv = NULL;
+    BN_CTX *bn_ctx = NULL;
+
+    do {
+        if (!kdf(seed, sizeof(seed), m_chip_secret, sizeof(m_chip_secret),
+                 (const uint8_t *)label, strlen(label), context, context_length))
+            break;
+
+        if (!(bn_ctx = BN_CTX_new()))
+            break;
+        if (!(ec_key = EC_KEY_new_by_curve_name(NID_secp384r1)))
+            break;
+        const EC_GROUP *group = EC_KEY_get0_group(ec_key);
+
+        order = BN_new();
+        if (!order || EC_GROUP_get_order(group, order, bn_ctx) != 1)
+            break;
+        if (BN_sub_word(order, 1) != 1)
+            break;
+        if (!(priv = BN_bin2bn(seed, sizeof(seed), NULL)))
+            break;
+        if (BN_mod(priv, priv, order, bn_ctx) != 1 || BN_add_word(priv, 1) != 1)
+            break;
+
+        if (!(pub_point = EC_POINT_new(group)))
+            break;
+        if (EC_POINT_mul(group, pub_point, priv, NULL, NULL, bn_ctx) != 1)
+            break;
+        if (EC_KEY_set_private_key(ec_key, priv) != 1 ||
+            EC_KEY_set_public_key(ec_key, pub_point) != 1)
+            break;
+
+        if (!(*key = EVP_PKEY_new()))
+            break;
+        if (EVP_PKEY_assign_EC_KEY(*key, ec_key) != 1) {
+            EVP_PKEY_free(*key);
+            *key = NULL;
+            break;
+        }
+        ec_key = NULL;          // Owned by key now
+
+        ret = true;
+    } while (0);
+
+    OPENSSL_cleanse(seed, sizeof(seed));
+    BN_clear_free(priv);
+    BN_free(order);
+    EC_POINT_free(pub_point);
+    EC_KEY_free(ec_key);
+    BN_CTX_free(bn_ctx);
+
+    return ret;
+}
+
+/**
+ * The CEK in the platform's cert chain is unsigned. The KDS copy gets signed
+ * by the ASK in create_amd_chain()
+ */
+bool SEVSimBackend::derive_cek(void)
+{
+    EVP_PKEY_free(m_cek_key);
+    m_cek_key = NULL;
+
+    if (!derive_ec_key(&m_cek_key, SEV_CEK_LABEL, NULL, 0))
+        return false;
+    return create_sev_cert(&m_cek, m_cek_key, SEV_USAGE_CEK, SEV_SIG_ALGO_ECDSA_SHA256);
+}
+
+/**
+ * Fills in the body of an unsigned sev_cert for the public part of key
+ */
+bool SEVSimBackend::create_sev_cert(sev_cert *cert, EVP_PKEY *key,
+                                    uint32_t usage, uint32_t algo)
+{
+    memset(cert, 0, sizeof(sev_cert));
+
+    cert->version = SEV_CERT_MAX_VERSION;
+    cert->api_major = SIM_API_MAJOR;
+    cert->api_minor = api_minor();
+    cert->pub_key_usage = usage;
+    cert->pub_key_algo = algo;
+    cert->sig_1_usage = SEV_USAGE_INVALID;
+    cert->sig_1_algo = SEV_SIG_ALGO_INVALID;
+    cert->sig_2_usage = SEV_USAGE_INVALID;
+    cert->sig_2_algo = SEV_SIG_ALGO_INVALID;
+
+    SEVCert tmp_cert(*cert);
+    return tmp_cert.decompile_public_key_into_certificate(cert, key) == STATUS_SUCCESS;
+}
+
+/**
+ * Signs [version:pub_key] of cert into its sig_1 or sig_2 (sig_index 1 or 2)
+ */
+bool SEVSimBackend::sign_sev_cert(sev_cert *cert, int sig_index, EVP_PKEY *signer,
+                                  uint32_t signer_usage, uint32_t signer_algo)
+{
+    uint32_t pub_key_offset = offsetof(sev_cert, sig_1_usage);  // 16 + sizeof(sev_pubkey)
+    sev_sig *sig = (sig_index == 1) ? &cert->sig_1 : &cert->sig_2;
+
+    memset(sig, 0, sizeof(sev_sig));
+    if (sig_index == 1) {
+        cert->sig_1_usage = signer_usage;
+        cert->sig_1_algo = signer_algo;
+    }
+    else {
+        cert->sig_2_usage = signer_usage;
+        cert->sig_2_algo = signer_algo;
+    }
+
+    if ((signer_algo == SEV_SIG_ALGO_RSA_SHA256) || (signer_algo == SEV_SIG_ALGO_RSA_SHA384)) {
+        return rsa_pss_sign(sig->rsa.s, sizeof(sig->rsa.s), signer,
+                            (uint8_t *)cert, pub_key_offset);
+    }
+    return sign_message(sig, &signer, (uint8_t *)cert, pub_key_offset,
+                        (SEV_SIG_ALGO)signer_algo);
+}
+
+/**
+ * RSA-PSS signature in the AMD format: salt length equal to the digest
+ * length, stored little-endian. SHA256 on Naples, SHA384 after.
+ */
+bool SEVSimBackend::rsa_pss_sign(uint8_t *sig, size_t sig_length, EVP_PKEY *rsa_key,
+                                 const uint8_t *msg, size_t msg_length)
+{
+    bool ret = false;
+    RSA *rsa = NULL;
+    const EVP_MD *md = (m_device_type == PSP_DEVICE_TYPE_NAPLES) ? EVP_sha256() : EVP_sha384();
+    uint8_t digest[EVP_MAX_MD_SIZE];
+    unsigned int digest_length = 0;
+    uint8_t encoded[AMD_CERT_KEY_BYTES_4K];
+
+    do {
+        if (!(rsa = EVP_PKEY_get1_RSA(rsa_key)))
+            break;
+        size_t rsa_length = (size_t)RSA_size(rsa);
+        if (rsa_length > sig_length || rsa_length > sizeof(encoded))
+            break;
+
+        if (EVP_Digest(msg, msg_length, digest, &digest_length, md, NULL) != 1)
+            break;
+        if (RSA_padding_add_PKCS1_PSS(rsa, encoded, digest, md, (int)digest_length) != 1)
+            break;
+        if (RSA_private_encrypt((int)rsa_length, encoded, sig, rsa, RSA_NO_PADDING) != (int)rsa_length)
+            break;
+        if (!sev::reverse_bytes(sig, rsa_length))
+            break;
+
+        ret = true;
+    } while (0);
+
+    RSA_free(rsa);
+    return ret;
+}
+
+/**
+ * Builds an AMD signing key cert for key. If parent is NULL the cert is
+ * self-signed, otherwise it is signed with parent_key.
+ */
+bool SEVSimBackend::create_amd_cert(amd_cert *cert, EVP_PKEY *key, const uint8_t *key_id,
+                                    AMD_SIG_USAGE usage, const amd_cert *parent,
+                                    EVP_PKEY *parent_key)
+{
+    bool ret = false;
+    RSA *rsa = NULL;
+    const BIGNUM *modulus = NULL;
+    const BIGNUM *pub_exp = NULL;
+    uint32_t fixed_offset = offsetof(amd_cert, pub_exp);    // 64 bytes
+    uint8_t msg[offsetof(amd_cert, sig)];
+
+    do {
+        if (!(rsa = EVP_PKEY_get1_RSA(key)))
+            break;
+
+        uint32_t bits = (uint32_t)RSA_bits(rsa);
+        memset(cert, 0, sizeof(amd_cert));
+        cert->version = AMD_CERT_VERSION;
+        memcpy(&cert->key_id_0, key_id, AMD_CERT_ID_SIZE_BYTES);
+        memcpy(&cert->certifying_id_0, parent ? (const uint8_t *)&parent->key_id_0 : key_id,
+               AMD_CERT_ID_SIZE_BYTES);
+        cert->key_usage = usage;
+        cert->pub_exp_size = bits;
+        cert->modulus_size = bits;
+
+        RSA_get0_key(rsa, &modulus, &pub_exp, NULL);
+        if (BN_bn2lebinpad(pub_exp, (uint8_t *)&cert->pub_exp, bits/8) <= 0)
+            break;
+        if (BN_bn2lebinpad(modulus, (uint8_t *)&cert->modulus, bits/8) <= 0)
+            break;
+
+        // The signature covers the fixed fields, pub_exp and modulus
+        memcpy(msg, cert, fixed_offset);
+        memcpy(msg + fixed_offset, &cert->pub_exp, bits/8);
+        memcpy(msg + fixed_offset + bits/8, &cert->modulus, bits/8);
+        if (!rsa_pss_sign((uint8_t *)&cert->sig, sizeof(cert->sig),
+                          parent ? parent_key : key, msg, fixed_offset + 2*bits/8))
+            break;
+
+        ret = true;
+    } while (0);
+
+    RSA_free(rsa);
+    return ret;
+}
+
+/**
+ * Generates the ARK/ASK pair that stands in for the AMD root of trust, and
+ * the ASK-signed copy of the CEK that the KDS serves. The ARK uses AMD's
+ * real key ID so the tool's root key check passes.
+ */
+bool SEVSimBackend::create_amd_chain(void)
+{
+    bool ret = false;
+    int bits = (int)((m_device_type == PSP_DEVICE_TYPE_NAPLES) ? AMD_CERT_KEY_BITS_2K
+                                                               : AMD_CERT_KEY_BITS_4K);
+    const uint8_t *ark_id = (m_device_type == PSP_DEVICE_TYPE_NAPLES) ? amd_root_key_id_naples
+                                                                      : amd_root_key_id_rome;
+    uint8_t ask_id[AMD_CERT_ID_SIZE_BYTES];
+    uint32_t ask_algo = (m_device_type == PSP_DEVICE_TYPE_NAPLES) ? SEV_SIG_ALGO_RSA_SHA256
+                                                                  : SEV_SIG_ALGO_RSA_SHA384;
+
+    do {
+        if (m_amd_chain_valid) {
+            ret = true;
+            break;
+        }
+
+        EVP_PKEY_free(m_ark_key);
+        EVP_PKEY_free(m_ask_key);
+        m_ark_key = NULL;
+        m_ask_key = NULL;
+
+        if (!generate_rsa_key_pair(&m_ark_key, bits) || !generate_rsa_key_pair(&m_ask_key, bits))
+            break;
+        if (RAND_bytes(ask_id, sizeof(ask_id)) != 1)
+            break;
+
+        if (!create_amd_cert(&m_ark, m_ark_key, ark_id, AMD_USAGE_ARK, NULL, NULL))
+            break;
+        if (!create_amd_cert(&m_ask, m_ask_key, ask_id, AMD_USAGE_ASK, &m_ark, m_ark_key))
+            break;
+
+        memcpy(&m_cek_signed, &m_cek, sizeof(sev_cert));
+        if (!sign_sev_cert(&m_cek_signed, 1, m_ask_key, SEV_USAGE_ASK, ask_algo))
+            break;
+
+        m_amd_chain_valid = true;
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+/**
+ * New self-signed OCA and a new PEK signed by the OCA and CEK. The platform
+ * goes back to self-owned and a new PDH is generated.
+ */
+bool SEVSimBackend::regen_oca_pek(void)
+{
+    bool ret = false;
+
+    do {
+        EVP_PKEY_free(m_oca_key);
+        EVP_PKEY_free(m_pek_key);
+        m_oca_key = NULL;
+        m_pek_key = NULL;
+
+        if (!generate_ecdh_key_pair(&m_oca_key))
+            break;
+        if (!create_sev_cert(&m_oca, m_oca_key, SEV_USAGE_OCA, SEV_SIG_ALGO_ECDSA_SHA256))
+            break;
+        if (!sign_sev_cert(&m_oca, 1, m_oca_key, SEV_USAGE_OCA, SEV_SIG_ALGO_ECDSA_SHA256))
+            break;
+
+        if (!generate_ecdh_key_pair(&m_pek_key))
+            break;
+        if (!create_sev_cert(&m_pek, m_pek_key, SEV_USAGE_PEK, SEV_SIG_ALGO_ECDSA_SHA256))
+            break;
+        if (!sign_sev_cert(&m_pek, 1, m_oca_key, SEV_USAGE_OCA, SEV_SIG_ALGO_ECDSA_SHA256))
+            break;
+        if (!sign_sev_cert(&m_pek, 2, m_cek_key, SEV_USAGE_CEK, SEV_SIG_ALGO_ECDSA_SHA256))
+            break;
+
+        m_flags &= ~PLAT_STAT_OWNER_MASK;
+
+        ret = regen_pdh();
+    } while (0);
+
+    return ret;
+}
+
+bool SEVSimBackend::regen_pdh(void)
+{
+    EVP_PKEY_free(m_pdh_key);
+    m_pdh_key = NULL;
+
+    if (!generate_ecdh_key_pair(&m_pdh_key))
+        return false;
+    if (!create_sev_cert(&m_pdh, m_pdh_key, SEV_USAGE_PDH, SEV_SIG_ALGO_ECDH_SHA256))
+        return false;
+    return sign_sev_cert(&m_pdh, 1, m_pek_key, SEV_USAGE_PEK, SEV_SIG_ALGO_ECDSA_SHA256);
+}
+
+int SEVSimBackend::issue_cmd(int cmd, void *data, int *cmd_ret)
+{
+    int status = SEV_RET_INVALID_COMMAND;
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    inject_latency(cmd);
+
+    if (!data) {
+        *cmd_ret = SEV_RET_INVALID_ADDRESS;
+        return -1;
+    }
+
+    switch (cmd) {
+        case SEV_FACTORY_RESET:   status = sim_factory_reset();         break;
+        case SEV_PLATFORM_STATUS: status = sim_platform_status(data);   break;
+        case SEV_PEK_GEN:         status = sim_pek_gen();               break;
+        case SEV_PEK_CSR:         status = sim_pek_csr(data);           break;
+        case SEV_PDH_GEN:         status = sim_pdh_gen();               break;
+        case SEV_PDH_CERT_EXPORT: status = sim_pdh_cert_export(data);   break;
+        case SEV_PEK_CERT_IMPORT: status = sim_pek_cert_import(data);   break;
+        case SEV_GET_ID:          status = sim_get_id(data);            break;
+        default:                  status = SEV_RET_INVALID_COMMAND;     break;
+    }
+
+    *cmd_ret = status;
+    return (status == SEV_RET_SUCCESS) ? 0 : -1;
+}
+
+int SEVSimBackend::sim_factory_reset(void)
+{
+    if (m_state == SEV_PLATFORM_WORKING)
+        return SEV_RET_INVALID_PLATFORM_STATE;
+
+    EVP_PKEY_free(m_csr_key);
+    m_csr_key = NULL;
+
+    return regen_oca_pek() ? SEV_RET_SUCCESS : SEV_RET_HWSEV_RET_PLATFORM;
+}
+
+int SEVSimBackend::sim_platform_status(void *data)
+{
+    sev_user_data_status *status = (sev_user_data_status *)data;
+
+    status->api_major = SIM_API_MAJOR;
+    status->api_minor = api_minor();
+    status->state = m_state;
+    status->flags = m_flags;
+    status->build = SIM_BUILD_ID;
+    status->guest_count = m_guest_count;
+
+    return SEV_RET_SUCCESS;
+}
+
+int SEVSimBackend::sim_pek_gen(void)
+{
+    if (m_state == SEV_PLATFORM_WORKING)
+        return SEV_RET_INVALID_PLATFORM_STATE;
+
+    return regen_oca_pek() ? SEV_RET_SUCCESS : SEV_RET_HWSEV_RET_PLATFORM;
+}
+
+/**
+ * Generates the key pair that a later PEK_CERT_IMPORT has to match, and
+ * returns the unsigned CSR for it
+ */
+int SEVSimBackend::sim_pek_csr(void *data)
+{
+    sev_user_data_pek_csr *csr = (sev_user_data_pek_csr *)data;
+    sev_cert csr_cert;
+
+    if (m_state == SEV_PLATFORM_WORKING)
+        return SEV_RET_INVALID_PLATFORM_STATE;
+
+    if (csr->length < sizeof(sev_cert) || csr->address == 0) {
+        csr->length = sizeof(sev_cert);     // Tell the caller the size it needs
+        return SEV_RET_INVALID_LEN;
+    }
+
+    EVP_PKEY_free(m_csr_key);
+    m_csr_key = NULL;
+    if (!generate_ecdh_key_pair(&m_csr_key))
+        return SEV_RET_HWSEV_RET_PLATFORM;
+    if (!create_sev_cert(&csr_cert, m_csr_key, SEV_USAGE_PEK, SEV_SIG_ALGO_ECDSA_SHA256))
+        return SEV_RET_HWSEV_RET_PLATFORM;
+
+    memcpy((void *)csr->address, &csr_cert, sizeof(sev_cert));
+    csr->length = sizeof(sev_cert);
+
+    return SEV_RET_SUCCESS;
+}
+
+int SEVSimBackend::sim_pdh_gen(void)
+{
+    return regen_pdh() ? SEV_RET_SUCCESS : SEV_RET_HWSEV_RET_PLATFORM;
+}
+
+int SEVSimBackend::sim_pdh_cert_export(void *data)
+{
+    sev_user_data_pdh_cert_export *export_buf = (sev_user_data_pdh_cert_export *)data;
+    sev_cert_chain_buf *cert_chain = NULL;
+
+    if (export_buf->pdh_cert_len < sizeof(sev_cert) ||
+        export_buf->cert_chain_len < sizeof(sev_cert_chain_buf)) {
+        export_buf->pdh_cert_len = sizeof(sev_cert);
+        export_buf->cert_chain_len = sizeof(sev_cert_chain_buf);
+        return SEV_RET_INVALID_LEN;
+    }
+    if (export_buf->pdh_cert_address == 0 || export_buf->cert_chain_address == 0)
+        return SEV_RET_INVALID_ADDRESS;
+
+    cert_chain = (sev_cert_chain_buf *)export_buf->cert_chain_address;
+    memcpy((void *)export_buf->pdh_cert_address, &m_pdh, sizeof(sev_cert));
+    memcpy(PEK_IN_CERT_CHAIN(cert_chain), &m_pek, sizeof(sev_cert));
+    memcpy(OCA_IN_CERT_CHAIN(cert_chain), &m_oca, sizeof(sev_cert));
+    memcpy(CEK_IN_CERT_CHAIN(cert_chain), &m_cek, sizeof(sev_cert));
+    export_buf->pdh_cert_len = sizeof(sev_cert);
+    export_buf->cert_chain_len = sizeof(sev_cert_chain_buf);
+
+    return SEV_RET_SUCCESS;
+}
+
+/**
+ * Takes the PEK signed by the OCA (from the CSR) and the self-signed OCA. The
+ * firmware adds the CEK signature, takes on the new OCA and becomes
+ * externally-owned
+ */
+int SEVSimBackend::sim_pek_cert_import(void *data)
+{
+    sev_user_data_pek_cert_import *import = (sev_user_data_pek_cert_import *)data;
+    sev_cert pek;
+    sev_cert oca;
+    sev_cert expected;
+
+    if (m_state == SEV_PLATFORM_WORKING)
+        return SEV_RET_INVALID_PLATFORM_STATE;
+    if (m_flags & PLAT_STAT_OWNER_MASK)
+        return SEV_RET_ALREADY_OWNED;
+    if (import->pek_cert_len != sizeof(sev_cert) || import->oca_cert_len != sizeof(sev_cert))
+        return SEV_RET_INVALID_LEN;
+    if (import->pek_cert_address == 0 || import->oca_cert_address == 0)
+        return SEV_RET_INVALID_ADDRESS;
+    if (!m_csr_key)
+        return SEV_RET_INVALID_CERTIFICATE;    // No outstanding PEK_CSR
+
+    memcpy(&pek, (void *)import->pek_cert_address, sizeof(sev_cert));
+    memcpy(&oca, (void *)import->oca_cert_address, sizeof(sev_cert));
+
+    // The OCA must be self-signed and the PEK signed by it
+    SEVCert oca_obj(oca);
+    SEVCert pek_obj(pek);
+    if (oca.pub_key_usage != SEV_USAGE_OCA || oca_obj.verify_sev_cert(&oca) != STATUS_SUCCESS)
+        return SEV_RET_INVALID_CERTIFICATE;
+    if (pek.pub_key_usage != SEV_USAGE_PEK || pek_obj.verify_sev_cert(&oca) != STATUS_SUCCESS)
+        return SEV_RET_INVALID_CERTIFICATE;
+
+    // and it has to be for the key from the CSR
+    if (!create_sev_cert(&expected, m_csr_key, SEV_USAGE_PEK, SEV_SIG_ALGO_ECDSA_SHA256))
+        return SEV_RET_HWSEV_RET_PLATFORM;
+    if (memcmp(&expected.pub_key, &pek.pub_key, sizeof(sev_pubkey)) != 0)
+        return SEV_RET_INVALID_CERTIFICATE;
+
+    if (!sign_sev_cert(&pek, 2, m_cek_key, SEV_USAGE_CEK, SEV_SIG_ALGO_ECDSA_SHA256))
+        return SEV_RET_HWSEV_RET_PLATFORM;
+
+    EVP_PKEY_free(m_oca_key);
+    EVP_PKEY_free(m_pek_key);
+    m_oca_key = NULL;               // Only the owner has the OCA private key
+    m_pek_key = m_csr_key;
+    m_csr_key = NULL;
+    memcpy(&m_oca, &oca, sizeof(sev_cert));
+    memcpy(&m_pek, &pek, sizeof(sev_cert));
+    m_flags |= PLAT_STAT_OWNER_MASK;
+
+    return regen_pdh() ? SEV_RET_SUCCESS : SEV_RET_HWSEV_RET_PLATFORM;
+}
+
+int SEVSimBackend::sim_get_id(void *data)
+{
+    sev_user_data_get_id *id = (sev_user_data_get_id *)data;
+
+    memset(id, 0, sizeof(sev_user_data_get_id));
+    memcpy(id->socket1, m_chip_id, sizeof(id->socket1));
+
+    return SEV_RET_SUCCESS;
+}
+
+int SEVSimBackend::kds_get_cek(const uint8_t *id, size_t id_length, sev_cert *cek)
+{
+    // The network round trip doesn't hold up the firmware
+    if (m_kds_latency_us != 0)
+        usleep(m_kds_latency_us);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+
+    // The KDS only knows about this chip
+    if (!id || !cek || id_length != sizeof(m_chip_id) ||
+        memcmp(id, m_chip_id, sizeof(m_chip_id)) != 0)
+        return ERROR_INVALID_PARAM;
+
+    if (!create_amd_chain())
+        return ERROR_INVALID_CERTIFICATE;
+
+    memcpy(cek, &m_cek_signed, sizeof(sev_cert));
+    return STATUS_SUCCESS;
+}
+
+/**
+ * Writes the ASK followed by the ARK, each in its variable-size on-disk
+ * format, the same as the ask_ark file on the AMD developer site
+ */
+int SEVSimBackend::kds_get_ask_ark(uint8_t *buf, size_t buf_length,
+                                   size_t *ask_ark_length)
+{
+    if (m_kds_latency_us != 0)
+        usleep(m_kds_latency_us);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    const amd_cert *certs[] = {&m_ask, &m_ark};
+    uint32_t fixed_offset = offsetof(amd_cert, pub_exp);    // 64 bytes
+    size_t offset = 0;
+
+    if (!buf || !ask_ark_length)
+        return ERROR_INVALID_PARAM;
+
+    if (!create_amd_chain())
+        return ERROR_INVALID_CERTIFICATE;
+
+    for (size_t i = 0; i < sizeof(certs)/sizeof(certs[0]); i++) {
+        const amd_cert *cert = certs[i];
+        size_t key_bytes = cert->modulus_size/8;
+        if (offset + fixed_offset + 3*key_bytes > buf_length)
+            return ERROR_INVALID_LENGTH;
+
+        memcpy(buf + offset, cert, fixed_offset);
+        offset += fixed_offset;
+        memcpy(buf + offset, &cert->pub_exp, cert->pub_exp_size/8);
+        offset += cert->pub_exp_size/8;
+        memcpy(buf + offset, &cert->modulus, key_bytes);
+        offset += key_bytes;
+        memcpy(buf + offset, &cert->sig, key_bytes);
+        offset += key_bytes;
+    }
+
+    *ask_ark_length = offset;
+    return STATUS_SUCCESS;
+}
+
+/**
+ * The VCEK is derived from the chip secret and the reported TCB, so it's
+ * the same key every time for a given TCB, and the KDS signs it with the ASK
+ */
+int SEVSimBackend::kds_get_vcek(const uint8_t *chip_id, size_t id_length,
+                                uint64_t tcb, sev_cert *vcek)
+{
+    if (m_kds_latency_us != 0)
+        usleep(m_kds_latency_us);
+
+    std::lock_guard<std::mutex> lock(m_mutex);
+    uint32_t ask_algo = (m_device_type == PSP_DEVICE_TYPE_NAPLES) ? SEV_SIG_ALGO_RSA_SHA256
+                                                                  : SEV_SIG_ALGO_RSA_SHA384;
+    EVP_PKEY *vcek_key = NULL;
+    int cmd_ret = ERROR_INVALID_CERTIFICATE;
+
+    if (!chip_id || !vcek || id_length != sizeof(m_chip_id) ||
+        memcmp(chip_id, m_chip_id, sizeof(m_chip_id)) != 0)
+        return ERROR_INVALID_PARAM;
+
+    do {
+        if (!create_amd_chain())
+            break;
+        if (!derive_ec_key(&vcek_key, SEV_VCEK_LABEL, (const uint8_t *)&tcb, sizeof(tcb)))
+            break;
+        if (!create_sev_cert(vcek, vcek_key, SEV_USAGE_CEK, SEV_SIG_ALGO_ECDSA_SHA384))
+            break;
+        if (!sign_sev_cert(vcek, 1, m_ask_key, SEV_USAGE_ASK, ask_algo))
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    EVP_PKEY_free(vcek_key);
+    return cmd_ret;
+}
+
+int SEVSimBackend::snp_guest_report(const uint8_t report_data[64],
+                                    const uint8_t measurement[48],
+                                    uint64_t tcb, snp_attestation_report *report)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    EVP_PKEY *vcek_key = NULL;
+    int cmd_ret = ERROR_INVALID_PARAM;
+
+    if (!report_data || !measurement || !report)
+        return ERROR_INVALID_PARAM;
+
+    memset(report, 0, sizeof(snp_attestation_report));
+    report->version = SNP_REPORT_MIN_VERSION;
+    report->policy = 0x30000;               // SMT allowed, reserved bit 17 set
+    report->signature_algo = SNP_REPORT_SIG_ALGO;
+    report->current_tcb.raw = tcb;
+    report->reported_tcb.raw = tcb;
+    report->committed_tcb.raw = tcb;
+    report->launch_tcb.raw = tcb;
+    report->current_build = report->committed_build = SIM_BUILD_ID;
+    report->current_minor = report->committed_minor = api_minor();
+    report->current_major = report->committed_major = SIM_API_MAJOR;
+    memcpy(report->report_data, report_data, sizeof(report->report_data));
+    memcpy(report->measurement, measurement, sizeof(report->measurement));
+    memcpy(report->chip_id, m_chip_id, sizeof(report->chip_id));
+
+    do {
+        if (RAND_bytes(report->report_id, sizeof(report->report_id)) != 1)
+            break;
+        if (!derive_ec_key(&vcek_key, SEV_VCEK_LABEL, (const uint8_t *)&tcb, sizeof(tcb)))
+            break;
+        if (!sign_message(&report->signature, &vcek_key, (const uint8_t *)report,
+                          SNP_REPORT_SIGNED_SIZE, SEV_SIG_ALGO_ECDSA_SHA384))
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    EVP_PKEY_free(vcek_key);
+    return cmd_ret;
+}
+
+
+/**
+ * What the firmware does for LAUNCH_START: unwraps the TEK/TIK with the PDH
+ * private key and checks the session MACs. Called with the mutex held
+ */
+int SEVSimBackend::unwrap_tk(const sev_cert *godh_cert, const sev_session_buf *session,
+                             uint32_t policy, tek_tik *tk)
+{
+    int cmd_ret = ERROR_BAD_MEASUREMENT;
+    aes_128_key master_secret;
+    aes_128_key kek;
+    hmac_key_128 kik;
+    hmac_sha_256 mac;
+
+    do {
+        // ECDH is symmetric, so the PDH private key and GODH public key
+        // give the same master secret as the guest owner got
+        if (!derive_master_secret(master_secret, m_pdh_key, godh_cert, session->nonce))
+            break;
+        if (!derive_kek(kek, master_secret) || !derive_kik(kik, master_secret))
+            break;
+
+        if (!gen_hmac(&mac, kik, (uint8_t *)&session->wrap_tk, sizeof(session->wrap_tk)))
+            break;
+        if (CRYPTO_memcmp(mac, session->wrap_mac, sizeof(mac)) != 0)
+            break;
+        // AES-128-CTR, so decrypting is encrypting again
+        if (!encrypt((uint8_t *)tk, (const uint8_t *)&session->wrap_tk, sizeof(*tk),
+                     kek, session->wrap_iv))
+            break;
+
+        if (!gen_hmac(&mac, tk->tik, (uint8_t *)&policy, sizeof(policy)))
+            break;
+        if (CRYPTO_memcmp(mac, session->policy_mac, sizeof(mac)) != 0) {
+            cmd_ret = ERROR_POLICY_FAILURE;
+            break;
+        }
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    OPENSSL_cleanse(master_secret, sizeof(master_secret));
+    OPENSSL_cleanse(kek, sizeof(kek));
+    OPENSSL_cleanse(kik, sizeof(kik));
+
+    return cmd_ret;
+}
+
+/**
+ * LAUNCH_START then LAUNCH_MEASURE, for testing the guest owner side.
+ * Returns the measurement of a guest whose memory hashed to digest
+ */
+int SEVSimBackend::launch_measure(const sev_cert *godh_cert,
+                                  const sev_session_buf *session,
+                                  uint32_t policy, const uint8_t digest[32],
+                                  sev_measure_buf *measure)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int cmd_ret = ERROR_INVALID_PARAM;
+    tek_tik tk;
+
+    if (!godh_cert || !session || !digest || !measure)
+        return cmd_ret;
+
+    do {
+        cmd_ret = unwrap_tk(godh_cert, session, policy, &tk);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        // 0x04 || API_MAJOR || API_MINOR || BUILD || GCTX.POLICY || GCTX.LD || MNONCE
+        cmd_ret = ERROR_BAD_MEASUREMENT;
+        RAND_bytes(measure->m_nonce, sizeof(measure->m_nonce));
+        if (!calc_launch_measurement(&measure->measurement, tk.tik, 0x04, SIM_API_MAJOR,
+                                     api_minor(), SIM_BUILD_ID, policy, digest,
+                                     measure->m_nonce, api_minor() >= 17))
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    OPENSSL_cleanse(&tk, sizeof(tk));
+
+    return cmd_ret;
+}
+
+/**
+ * LAUNCH_SECRET for a guest started with session: checks the header MAC
+ * against measurement and decrypts the secret into out
+ */
+int SEVSimBackend::launch_secret(const sev_cert *godh_cert,
+                                 const sev_session_buf *session, uint32_t policy,
+                                 const hmac_sha_256 measurement, const sev_hdr_buf *header,
+                                 const uint8_t *packaged, size_t size, uint8_t *out)
+{
+    std::lock_guard<std::mutex> lock(m_mutex);
+    int cmd_ret = ERROR_INVALID_PARAM;
+    tek_tik tk;
+    hmac_sha_256 mac;
+
+    if (!godh_cert || !session || !measurement || !header || !packaged || !out)
+        return cmd_ret;
+
+    do {
+        cmd_ret = unwrap_tk(godh_cert, session, policy, &tk);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        // 0x01 || FLAGS || IV || GUEST_LENGTH || TRANS_LENGTH || DATA || MEASURE
+        cmd_ret = ERROR_BAD_MEASUREMENT;
+        if (!sev::launch_secret_mac(tk.tik, measurement, api_minor(), header,
+                                    packaged, size, mac))
+            break;
+        if (CRYPTO_memcmp(mac, header->mac, sizeof(mac)) != 0)
+            break;
+
+        if (!encrypt(out, packaged, size, tk.tek, header->iv))
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    OPENSSL_cleanse(&tk, sizeof(tk));
+
+    return cmd_ret;
+}
+
+#endif
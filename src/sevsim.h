@@ -0,0 +1,139 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef SEVSIM_H
+#define SEVSIM_H
+
+#include "sevbackend.h"
+#include "sevcore.h"        // for ePSP_DEVICE_TYPE
+#include <mutex>
+#include <openssl/evp.h>
+
+constexpr uint8_t  SIM_API_MAJOR         = 0;
+constexpr uint8_t  SIM_API_MINOR_NAPLES  = 17;
+constexpr uint8_t  SIM_API_MINOR_ROME    = 22;
+constexpr uint8_t  SIM_BUILD_ID          = 48;
+constexpr uint32_t SIM_ID_LENGTH         = 64;      // Bytes per socket, as on real parts
+constexpr uint32_t SIM_MAX_CMD           = 16;      // Upper bound on psp-sev.h command ids
+constexpr char     SIM_KDS_LATENCY_NAME[] = "kds";  // SEV_SIM_LATENCY_ENV key for the KDS stand-in
+
+/**
+ * In-process software model of the PSP SEV firmware, behind the same
+ * interface as /dev/sev. It keeps the platform state (owner, OCA/PEK/PDH
+ * keys, pending CSR) and produces real signed certs:
+ *   ARK (self-signed) -> ASK -> CEK -> PEK <- OCA, PEK -> PDH
+ * The CEK is derived from a chip secret (SEV_SIM_SEED_ENV) so it stays the
+ * same between runs, like on hardware. The ARK/ASK keys only exist for the
+ * life of the process and are generated the first time the KDS stand-in is
+ * used. All commands are serialized, like the real PSP, and each one can be
+ * delayed by a configurable number of microseconds.
+ */
+class SEVSimBackend : public SEVBackend {
+private:
+    std::mutex m_mutex;
+    uint32_t m_latency_us[SIM_MAX_CMD];
+    uint32_t m_kds_latency_us;
+    ePSP_DEVICE_TYPE m_device_type;
+
+    // Platform state reported by PLATFORM_STATUS
+    uint8_t  m_state;
+    uint32_t m_flags;
+    uint32_t m_guest_count;
+
+    uint8_t  m_chip_secret[32];
+    uint8_t  m_chip_id[SIM_ID_LENGTH];
+
+    EVP_PKEY *m_cek_key;
+    EVP_PKEY *m_oca_key;
+    EVP_PKEY *m_pek_key;
+    EVP_PKEY *m_pdh_key;
+    EVP_PKEY *m_csr_key;            // PEK waiting for PEK_CERT_IMPORT
+    sev_cert m_cek;
+    sev_cert m_oca;
+    sev_cert m_pek;
+    sev_cert m_pdh;
+
+    EVP_PKEY *m_ark_key;
+    EVP_PKEY *m_ask_key;
+    amd_cert m_ark;
+    amd_cert m_ask;
+    sev_cert m_cek_signed;          // What the KDS hands out (signed by the ASK)
+    bool m_amd_chain_valid;
+
+    uint8_t api_minor(void);
+    void inject_latency(int cmd);
+    bool derive_ec_key(EVP_PKEY **key, const char *label,
+                       const uint8_t *context, size_t context_length);
+    bool derive_cek(void);
+    bool create_sev_cert(sev_cert *cert, EVP_PKEY *key, uint32_t usage,
+                         uint32_t algo);
+    bool sign_sev_cert(sev_cert *cert, int sig_index, EVP_PKEY *signer,
+                       uint32_t signer_usage, uint32_t signer_algo);
+    bool rsa_pss_sign(uint8_t *sig, size_t sig_length, EVP_PKEY *rsa_key,
+                      const uint8_t *msg, size_t msg_length);
+    bool create_amd_cert(amd_cert *cert, EVP_PKEY *key, const uint8_t *key_id,
+                         AMD_SIG_USAGE usage, const amd_cert *parent,
+                         EVP_PKEY *parent_key);
+    bool create_amd_chain(void);
+    bool regen_oca_pek(void);
+    bool regen_pdh(void);
+    int unwrap_tk(const sev_cert *godh_cert, const sev_session_buf *session,
+                  uint32_t policy, tek_tik *tk);
+
+    int sim_factory_reset(void);
+    int sim_platform_status(void *data);
+    int sim_pek_gen(void);
+    int sim_pek_csr(void *data);
+    int sim_pdh_gen(void);
+    int sim_pdh_cert_export(void *data);
+    int sim_pek_cert_import(void *data);
+    int sim_get_id(void *data);
+
+    SEVSimBackend(const SEVSimBackend&) = delete;
+    SEVSimBackend& operator=(const SEVSimBackend&) = delete;
+
+public:
+    SEVSimBackend(void);
+    ~SEVSimBackend(void);
+
+    static ePSP_DEVICE_TYPE configured_device_type(void);
+
+    std::string name(void) { return SEV_BACKEND_NAME_SIM; }
+    bool open_device(void);
+    int issue_cmd(int cmd, void *data, int *cmd_ret);
+    int kds_get_cek(const uint8_t *id, size_t id_length, sev_cert *cek);
+    int kds_get_ask_ark(uint8_t *buf, size_t buf_length,
+                        size_t *ask_ark_length);
+    int kds_get_vcek(const uint8_t *chip_id, size_t id_length,
+                     uint64_t tcb, sev_cert *vcek);
+
+    // The guest side of a launch, for testing the guest owner side
+    int launch_measure(const sev_cert *godh_cert, const sev_session_buf *session,
+                       uint32_t policy, const uint8_t digest[32],
+                       sev_measure_buf *measure);
+    int launch_secret(const sev_cert *godh_cert, const sev_session_buf *session,
+                      uint32_t policy, const hmac_sha_256 measurement,
+                      const sev_hdr_buf *header, const uint8_t *packaged,
+                      size_t size, uint8_t *out);
+    // An SEV-SNP guest's attestation report, signed by the VCEK for tcb
+    int snp_guest_report(const uint8_t report_data[64], const uint8_t measurement[48],
+                         uint64_t tcb, snp_attestation_report *report);
+
+    void set_latency_us(int cmd, uint32_t usec);
+    bool parse_latency_spec(const std::string spec);
+};
+
+#endif /* SEVSIM_H */
@@ -0,0 +1,297 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#include "snpverify.h"
+#include "crypto.h"             // for digest_sha, ecdsa_verify
+#include "metrics.h"
+#include "sevcert.h"
+#include <algorithm>            // for std::min
+#include <cstring>
+#include <thread>
+
+sev::SNPReportVerifier::SNPReportVerifier(SEVBackend *kds)
+                      : m_kds(kds),
+                        m_chain_valid(false),
+                        m_entries(0),
+                        m_clock(0),
+                        m_fetches(0),
+                        m_hits(0)
+{
+    memset(&m_ask_pubkey, 0, sizeof(m_ask_pubkey));
+    memset(m_cache, 0, sizeof(m_cache));
+}
+
+sev::SNPReportVerifier::~SNPReportVerifier()
+{
+    for (uint32_t i = 0; i < m_entries; i++)
+        EVP_PKEY_free(m_cache[i].key);
+}
+
+int sev::SNPReportVerifier::set_amd_chain(const amd_cert *ask, const amd_cert *ark)
+{
+    SEV_ERROR_CODE cmd_ret = ERROR_INVALID_CERTIFICATE;
+    AMDCert tmp_amd;
+
+    m_chain_valid = false;
+
+    do {
+        if (!ask || !ark)
+            break;
+
+        cmd_ret = tmp_amd.amd_cert_validate_ark(ark);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+        cmd_ret = tmp_amd.amd_cert_validate_ask(ask, ark);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        // verify_sev_cert wants the parent as an sev_cert
+        cmd_ret = tmp_amd.amd_cert_export_pub_key(ask, &m_ask_pubkey);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        m_chain_valid = true;
+    } while (0);
+
+    return (int)cmd_ret;
+}
+
+/**
+ * Gets the VCEK from the KDS and checks it was signed by the ASK. Called
+ * without the mutex held
+ */
+int sev::SNPReportVerifier::fetch_vcek(const uint8_t *chip_id, uint64_t tcb, EVP_PKEY **key)
+{
+    int cmd_ret = ERROR_UNSUPPORTED;
+    sev_cert vcek;
+
+    do {
+        if (!m_kds)
+            break;
+
+        {
+            SEV_TRACE_SCOPE(METRIC_CAT_KDS, "vcek");
+            cmd_ret = m_kds->kds_get_vcek(chip_id, SNP_CHIP_ID_SIZE, tcb, &vcek);
+        }
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        cmd_ret = ERROR_INVALID_CERTIFICATE;
+        if (vcek.pub_key_usage != SEV_USAGE_CEK ||
+            vcek.pub_key_algo != SEV_SIG_ALGO_ECDSA_SHA384)
+            break;
+        SEVCert tmp_vcek(vcek);
+        if (tmp_vcek.verify_sev_cert(&m_ask_pubkey) != STATUS_SUCCESS)
+            break;
+
+        if (!(*key = EVP_PKEY_new()))
+            break;
+        if (tmp_vcek.compile_public_key_from_certificate(&vcek, *key) != STATUS_SUCCESS) {
+            EVP_PKEY_free(*key);
+            *key = NULL;
+            break;
+        }
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    return cmd_ret;
+}
+
+/**
+ * The public VCEK for the report's chip and reported TCB, with a reference
+ * the caller frees, so it stays valid if the entry is evicted meanwhile
+ */
+int sev::SNPReportVerifier::get_vcek(const snp_attestation_report *report, EVP_PKEY **key)
+{
+    std::unique_lock<std::mutex> lock(m_mutex);
+    uint64_t tcb = report->reported_tcb.raw;
+    vcek_entry *entry = NULL;
+
+    while (true) {
+        entry = NULL;
+        // A fetch that failed leaves its slot with no key, which isn't a hit
+        for (uint32_t i = 0; i < m_entries; i++) {
+            if (m_cache[i].tcb == tcb && (m_cache[i].pending || m_cache[i].key) &&
+                memcmp(m_cache[i].chip_id, report->chip_id, SNP_CHIP_ID_SIZE) == 0) {
+                entry = &m_cache[i];
+                break;
+            }
+        }
+        if (!entry || !entry->pending)
+            break;
+        // Someone else is fetching it. Look again after, it may have been
+        // evicted by then
+        m_fetched.wait(lock, [entry]() { return !entry->pending; });
+    }
+
+    if (entry) {
+        m_hits++;
+    }
+    else {
+        if (m_entries < VCEK_CACHE_ENTRIES) {
+            entry = &m_cache[m_entries++];
+        }
+        else {
+            // Evict the least recently used one that's not being fetched
+            for (uint32_t i = 0; i < m_entries; i++) {
+                if (!m_cache[i].pending &&
+                    (!entry || m_cache[i].last_used < entry->last_used))
+                    entry = &m_cache[i];
+            }
+            if (!entry)
+                return ERROR_RESOURCE_LIMIT;
+            EVP_PKEY_free(entry->key);
+        }
+        memcpy(entry->chip_id, report->chip_id, SNP_CHIP_ID_SIZE);
+        entry->tcb = tcb;
+        entry->key = NULL;
+        entry->pending = true;
+        m_fetches++;
+
+        lock.unlock();
+        EVP_PKEY *fetched = NULL;
+        int result = fetch_vcek(report->chip_id, tcb, &fetched);
+        lock.lock();
+
+        entry->key = fetched;
+        entry->result = result;
+        entry->pending = false;
+        m_fetched.notify_all();
+
+        // Not cached, so the next report from this chip and TCB fetches
+        // again, and the slot is the first to go
+        if (result != STATUS_SUCCESS) {
+            entry->last_used = 0;
+            return result;
+        }
+    }
+
+    entry->last_used = ++m_clock;
+    if (entry->result != STATUS_SUCCESS)
+        return entry->result;
+    if (EVP_PKEY_up_ref(entry->key) != 1)
+        return ERROR_RESOURCE_LIMIT;
+    *key = entry->key;
+    return STATUS_SUCCESS;
+}
+
+int sev::SNPReportVerifier::verify(const snp_attestation_report *report)
+{
+    int cmd_ret = ERROR_INVALID_PARAM;
+    EVP_PKEY *vcek_key = NULL;
+    uint8_t digest[DIGEST_SHA384_SIZE_BYTES];
+    sev_sig sig;
+
+    do {
+        if (!report)
+            break;
+        cmd_ret = ERROR_INVALID_CERTIFICATE;
+        if (!m_chain_valid)
+            break;
+        cmd_ret = ERROR_UNSUPPORTED;
+        if (report->version < SNP_REPORT_MIN_VERSION ||
+            report->signature_algo != SNP_REPORT_SIG_ALGO)
+            break;
+
+        cmd_ret = get_vcek(report, &vcek_key);
+        if (cmd_ret != STATUS_SUCCESS)
+            break;
+
+        cmd_ret = ERROR_BAD_SIGNATURE;
+        if (!digest_sha(report, SNP_REPORT_SIGNED_SIZE, digest, sizeof(digest), SHA_TYPE_384))
+            break;
+        memcpy(&sig, &report->signature, sizeof(sig));      // ecdsa_verify isn't const
+        if (!ecdsa_verify(&sig, &vcek_key, digest, sizeof(digest)))
+            break;
+
+        cmd_ret = STATUS_SUCCESS;
+    } while (0);
+
+    EVP_PKEY_free(vcek_key);
+    return cmd_ret;
+}
+
+namespace {
+struct snp_verify_job {
+    sev::SNPReportVerifier *verifier;
+    const snp_attestation_report *reports;
+    size_t count;
+    int *results;
+    std::atomic<size_t> next;           // First report of the next batch
+    std::atomic<uint64_t> verified;
+};
+}
+
+static void verify_reports(snp_verify_job *job)
+{
+    while (true) {
+        size_t first = job->next.fetch_add(sev::SNP_VERIFY_BATCH);
+        if (first >= job->count)
+            return;
+        size_t last = std::min(first + sev::SNP_VERIFY_BATCH, job->count);
+        uint64_t verified = 0;
+        for (size_t i = first; i < last; i++) {
+            job->results[i] = job->verifier->verify(&job->reports[i]);
+            if (job->results[i] == STATUS_SUCCESS)
+                verified++;
+        }
+        job->verified += verified;
+    }
+}
+
+int sev::SNPReportVerifier::verify_batch(const snp_attestation_report *reports, size_t count,
+                                         int *results, uint32_t threads, snp_verify_stats *stats)
+{
+    if ((!reports && count != 0) || (!results && count != 0) || !stats)
+        return ERROR_INVALID_PARAM;
+
+    uint64_t start = Metrics::now_ns();
+    uint64_t fetches = m_fetches;
+    uint64_t hits = m_hits;
+
+    if (threads == 0)
+        threads = std::thread::hardware_concurrency();
+    threads = std::max(1u, std::min(threads, SNP_VERIFY_MAX_THREADS));
+    threads = (uint32_t)std::max((size_t)1, std::min((size_t)threads,
+                                 (count + SNP_VERIFY_BATCH - 1) / SNP_VERIFY_BATCH));
+
+    snp_verify_job job;
+    job.verifier = this;
+    job.reports = reports;
+    job.count = count;
+    job.results = results;
+    job.next = 0;
+    job.verified = 0;
+    std::thread workers[SNP_VERIFY_MAX_THREADS];
+    for (uint32_t i = 1; i < threads; i++)
+        workers[i] = std::thread(verify_reports, &job);
+    verify_reports(&job);
+    for (uint32_t i = 1; i < threads; i++)
+        workers[i].join();
+
+    uint64_t elapsed = Metrics::now_ns() - start;
+    memset(stats, 0, sizeof(*stats));
+    stats->reports = count;
+    stats->verified = job.verified;
+    stats->failed = count - stats->verified;
+    stats->vcek_fetches = m_fetches - fetches;
+    stats->vcek_hits = m_hits - hits;
+    stats->threads = threads;
+    stats->reports_per_sec = elapsed ? (double)count * 1e9 / (double)elapsed : 0;
+
+    return stats->failed == 0 ? STATUS_SUCCESS : ERROR_BAD_SIGNATURE;
+}
@@ -0,0 +1,113 @@
+/**************************************************************************
+ * Copyright 2018 Advanced Micro Devices, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ * http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ **************************************************************************/
+
+#ifndef SNPVERIFY_H
+#define SNPVERIFY_H
+
+#include "amdcert.h"        // for amd_cert
+#include "sevapi.h"         // for snp_attestation_report, sev_cert
+#include "sevbackend.h"
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <openssl/evp.h>
+
+namespace sev
+{
+    constexpr uint32_t VCEK_CACHE_ENTRIES     = 64;     // (chip, TCB) pairs
+    constexpr uint32_t SNP_VERIFY_BATCH       = 16;     // Reports a worker takes at a time
+    constexpr uint32_t SNP_VERIFY_MAX_THREADS = 64;
+
+    struct snp_verify_stats {
+        uint64_t reports;
+        uint64_t verified;
+        uint64_t failed;
+        uint64_t vcek_fetches;          // From the KDS, during this batch
+        uint64_t vcek_hits;             // From the cache, during this batch
+        uint32_t threads;
+        double   reports_per_sec;
+    };
+
+    /**
+     * Verifies SEV-SNP attestation reports against the VCEK for the chip
+     * and reported TCB in each one. The ARK and ASK are validated once, in
+     * set_amd_chain(). VCEKs come from the backend's KDS stand-in the first
+     * time a (chip_id, reported_tcb) pair is seen, are checked against the
+     * ASK, and are kept in an LRU cache of VCEK_CACHE_ENTRIES public keys.
+     * Threads that miss on a VCEK that's already being fetched wait for that
+     * fetch instead of starting another one. A fetch that fails isn't
+     * cached, so a KDS that was briefly unreachable doesn't fail that chip
+     * and TCB for the rest of the run; the next report fetches again.
+     *
+     * Reports are checked where they are (in a mapped file, say), never
+     * copied. verify() is thread safe.
+     */
+    class SNPReportVerifier {
+    private:
+        struct vcek_entry {
+            uint8_t  chip_id[SNP_CHIP_ID_SIZE];
+            uint64_t tcb;
+            EVP_PKEY *key;              // NULL while pending or if the fetch failed
+            int      result;            // Of the fetch
+            bool     pending;
+            uint64_t last_used;
+        };
+
+        SEVBackend *m_kds;
+        sev_cert m_ask_pubkey;          // The ASK's key, to check VCEKs with
+        bool m_chain_valid;
+
+        std::mutex m_mutex;
+        std::condition_variable m_fetched;
+        vcek_entry m_cache[VCEK_CACHE_ENTRIES];
+        uint32_t m_entries;
+        uint64_t m_clock;               // For LRU
+        std::atomic<uint64_t> m_fetches;
+        std::atomic<uint64_t> m_hits;
+
+        int fetch_vcek(const uint8_t *chip_id, uint64_t tcb, EVP_PKEY **key);
+        int get_vcek(const snp_attestation_report *report, EVP_PKEY **key);
+
+        SNPReportVerifier(const SNPReportVerifier&) = delete;
+        SNPReportVerifier& operator=(const SNPReportVerifier&) = delete;
+
+    public:
+        SNPReportVerifier(SEVBackend *kds);
+        ~SNPReportVerifier();
+
+        // Validates the ARK and ASK. Must succeed before anything verifies
+        int set_amd_chain(const amd_cert *ask, const amd_cert *ark);
+
+        /**
+         * STATUS_SUCCESS if the report is signed by its VCEK, otherwise
+         * ERROR_BAD_SIGNATURE, ERROR_UNSUPPORTED (version or algorithm), or
+         * the VCEK fetch or validation error
+         */
+        int verify(const snp_attestation_report *report);
+
+        /**
+         * Verifies count reports on up to threads threads (0 for one per
+         * core). results gets verify()'s return value for each report.
+         * STATUS_SUCCESS if every report verified
+         */
+        int verify_batch(const snp_attestation_report *reports, size_t count,
+                         int *results, uint32_t threads, snp_verify_stats *stats);
+    };
+}
+
+#endif /* SNPVERIFY_H */
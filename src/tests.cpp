@@ -15,15 +15,90 @@
  **************************************************************************/
 
 #include "amdcert.h"
+#ifdef __linux__
+#include "attestserver.h"
+#include "psp-sev.h"
+#include "sevsim.h"
+#include "snpverify.h"
+#endif
+#include "certformat.h"
 #include "commands.h"
 #include "crypto.h"
+#include "csprng.h"
+#include "launchdigest.h"
+#include "libsevtool.h"  // for sevtool_validate_cert_chain
+#include "measurematch.h"
 #include "sevapi.h"
 #include "sevcert.h"
+#include "migration.h"
+#include "secretpack.h"
+#include "securemem.h"
+#include "serializer.h"
+#include "sessionstore.h"
 #include "tests.h"
+#include "metrics.h"    // for Metrics::now_ns
 #include "utilities.h"  // for read_file
+#include <algorithm>    // for std::max
+#include <atomic>
+#include <chrono>       // for sleep_for
 #include <cstring>      // For memcmp
+#include <ftw.h>        // for nftw
+#include <openssl/hmac.h> // for HMAC
 #include <stdio.h>      // prboolf
-#include <stdlib.h>     // malloc
+#include <set>          // for std::set
+#include <stdlib.h>     // malloc, mkdtemp
+#include <thread>
+#ifdef __linux__
+#include <poll.h>       // for poll
+#include <signal.h>     // for kill
+#include <sys/wait.h>   // for waitpid
+#include <unistd.h>     // for fork, pipe
+#endif
+
+struct test_case {
+    const char *name;
+    bool (Tests::*fn)(void);
+    bool mutates_platform;      // Changes the owner, PEK, PDH or pending CSR
+};
+
+struct test_result {
+    bool passed;
+    uint64_t duration_ns;
+    std::string folder;         // Only set if the folder was kept
+};
+
+static const test_case test_cases[] = {
+    {"factory_reset",        &Tests::test_factory_reset,        true},
+    {"platform_status",      &Tests::test_platform_status,      false},
+    {"pek_gen",              &Tests::test_pek_gen,              true},
+    {"pek_csr",              &Tests::test_pek_csr,              true},
+    {"pdh_gen",              &Tests::test_pdh_gen,              true},
+    {"pdh_cert_export",      &Tests::test_pdh_cert_export,      false},
+    {"pek_cert_import",      &Tests::test_pek_cert_import,      true},
+    {"get_id",               &Tests::test_get_id,               false},
+    {"set_self_owned",       &Tests::test_set_self_owned,       true},
+    {"set_externally_owned", &Tests::test_set_externally_owned, true},
+    {"generate_cek_ask",     &Tests::test_generate_cek_ask,     false},
+    {"get_ask_ark",          &Tests::test_get_ask_ark,          false},
+    {"export_cert_chain",    &Tests::test_export_cert_chain,    false},
+    {"calc_measurement",     &Tests::test_calc_measurement,     false},
+    {"calc_launch_digest",   &Tests::test_calc_launch_digest,   false},
+    {"validate_cert_chain",  &Tests::test_validate_cert_chain,  false},
+    {"generate_launch_blob", &Tests::test_generate_launch_blob, false},
+    {"secure_arena",         &Tests::test_secure_arena,         false},
+    {"package_secret",       &Tests::test_package_secret,       false},
+    {"package_secret_table", &Tests::test_package_secret_table, false},
+    {"package_secret_fanout", &Tests::test_package_secret_fanout, false},
+    {"package_migration",    &Tests::test_package_migration,    false},
+    {"verify_migration",     &Tests::test_verify_migration,     false},
+#ifdef __linux__
+    {"attest_server",        &Tests::test_attest_server,        false},
+    {"verify_snp_reports",   &Tests::test_verify_snp_reports,   false},
+    {"csprng",               &Tests::test_csprng,               false},
+#endif
+};
+
+std::shared_mutex Tests::m_device_lock;
 
 Tests::Tests(std::string output_folder, int verbose_flag)
      : m_output_folder(output_folder),
@@ -32,18 +107,6 @@ Tests::Tests(std::string output_folder, int verbose_flag)
     // Intentionally Empty
 }
 
-bool Tests::clear_output_folder()
-{
-    printf("*Clearing output folder %s\n", m_output_folder.c_str());
-
-    std::string cmd = "rm -rf " + m_output_folder + "*";
-    // std::string cmd = "find " + m_output_folder + " -type f \\( -name \\*.cert -o -name \\*.txt -o -name \\*.pem -o -name \\*.bin \\) -delete";
-    std::string output = "";
-    if (!sev::execute_system_command(cmd, &output))
-        return false;
-    return true;
-}
-
 /**
  * The only way to change from externally-owned to self-owned is through a
  * factory reset. So, the best way to test that a factory reset actually worked
@@ -597,6 +660,17 @@ bool Tests::test_get_ask_ark()
             break;
         }
 
+        // Writing the certs back out has to give the downloaded bytes
+        uint8_t cert_buf[sizeof(amd_cert)];
+        size_t ark_size = tmp_amd.amd_cert_get_size(&ark);
+        if (sev::write_amd_cert_binary(cert_buf, sizeof(cert_buf), &ask) != ask_size ||
+            memcmp(cert_buf, ask_ark_buf, ask_size) != 0 ||
+            sev::write_amd_cert_binary(cert_buf, sizeof(cert_buf), &ark) != ark_size ||
+            memcmp(cert_buf, ask_ark_buf + ask_size, ark_size) != 0) {
+            printf("Error: ASK/ARK written as binary don't match the ask_ark\n");
+            break;
+        }
+
         ret = true;
     } while (0);
 
@@ -614,6 +688,21 @@ bool Tests::test_export_cert_chain()
         if (cmd.export_cert_chain() != STATUS_SUCCESS)
             break;
 
+        // Nothing rotated, so the second export shouldn't write anything
+        if (cmd.export_cert_chain() != STATUS_NO_CHANGE) {
+            printf("Error: second export_cert_chain didn't report no change\n");
+            break;
+        }
+
+        // A missing member gets rewritten
+        std::remove((m_output_folder + PEK_FILENAME).c_str());
+        if (cmd.export_cert_chain() != STATUS_SUCCESS)
+            break;
+        if (sev::get_file_size(m_output_folder + PEK_FILENAME) != sizeof(sev_cert)) {
+            printf("Error: export_cert_chain didn't rewrite %s\n", PEK_FILENAME.c_str());
+            break;
+        }
+
         ret = true;
     } while (0);
 
@@ -657,9 +746,451 @@ bool Tests::test_calc_measurement()
         if (memcmp(expected_output.c_str(), actual_output, sizeof(hmac_sha_256)) != 0)
             break;
 
+        // Same measurement with --format json, and with cbor, where it's
+        // the byte string after the "measurement" key
+        uint8_t doc_buf[1024];
+        sev::Serializer json(doc_buf, sizeof(doc_buf), sev::OUTPUT_FORMAT_JSON);
+        Command json_cmd(m_output_folder, m_verbose_flag, &json);
+        if (json_cmd.calc_measurement(&data) != STATUS_SUCCESS || !json.ok())
+            break;
+        std::string json_doc((const char *)json.data(), json.size());
+        if (json_doc.find("\"measurement\":\"" + expected_output + "\"") == std::string::npos) {
+            printf("Error: measurement not in the JSON output\n%s\n", json_doc.c_str());
+            break;
+        }
+
+        sev::Serializer cbor(doc_buf, sizeof(doc_buf), sev::OUTPUT_FORMAT_CBOR);
+        Command cbor_cmd(m_output_folder, m_verbose_flag, &cbor);
+        if (cbor_cmd.calc_measurement(&data) != STATUS_SUCCESS || !cbor.ok())
+            break;
+        uint8_t expected_cbor[1 + 11 + 2 + sizeof(hmac_sha_256)] = {0x6B};  // text(11)
+        memcpy(expected_cbor + 1, "measurement", 11);
+        expected_cbor[12] = 0x58;                                           // bytes(uint8 length)
+        expected_cbor[13] = sizeof(hmac_sha_256);
+        sev::str_to_array(expected_output, expected_cbor + 14, sizeof(hmac_sha_256));
+        std::string cbor_doc((const char *)cbor.data(), cbor.size());
+        if (cbor_doc.find(std::string((const char *)expected_cbor, sizeof(expected_cbor))) == std::string::npos) {
+            printf("Error: measurement not in the CBOR output\n");
+            break;
+        }
+
+        // The midstate matcher finds the same measurement among many
+        // candidates, and says which one it was
+        uint8_t candidates[64][sev::MEASURE_DIGEST_SIZE];
+        uint8_t expected_meas[sizeof(hmac_sha_256)];
+        sev::str_to_array(expected_output, expected_meas, sizeof(expected_meas));
+        for (size_t i = 0; i < 64; i++) {
+            memcpy(candidates[i], data.digest, sizeof(candidates[i]));
+            candidates[i][31] = (uint8_t)(candidates[i][31] ^ (i + 1));
+        }
+        sev::MeasurementMatcher matcher(data.tik, sizeof(data.tik), data.meas_ctx,
+                                        data.api_major, data.api_minor, data.build_id,
+                                        data.policy);
+        if (matcher.match(candidates, 64, data.mnonce, expected_meas) != -1)
+            break;
+        memcpy(candidates[41], data.digest, sizeof(candidates[41]));
+        memcpy(candidates[50], data.digest, sizeof(candidates[50]));
+        if (matcher.match(candidates, 64, data.mnonce, expected_meas) != 41) {
+            printf("Error: the matcher didn't find the approved digest\n");
+            break;
+        }
+
+        // Before API 0.17 only the policy, digest and mnonce are in the HMAC
+        uint8_t old_input[sizeof(data.policy) + sizeof(data.digest) + sizeof(data.mnonce)];
+        uint8_t old_meas[sizeof(hmac_sha_256)];
+        uint8_t matcher_meas[sizeof(hmac_sha_256)];
+        memcpy(old_input, &data.policy, sizeof(data.policy));
+        memcpy(old_input + sizeof(data.policy), data.digest, sizeof(data.digest));
+        memcpy(old_input + sizeof(data.policy) + sizeof(data.digest), data.mnonce, sizeof(data.mnonce));
+        if (!HMAC(EVP_sha256(), data.tik, sizeof(data.tik), old_input, sizeof(old_input),
+                  old_meas, NULL))
+            break;
+        sev::MeasurementMatcher old_matcher(data.tik, sizeof(data.tik), data.meas_ctx,
+                                            data.api_major, 16, data.build_id, data.policy);
+        if (!old_matcher.measure(data.digest, data.mnonce, matcher_meas) ||
+            memcmp(matcher_meas, old_meas, sizeof(old_meas)) != 0) {
+            printf("Error: the matcher's pre-0.17 measurement is wrong\n");
+            break;
+        }
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+/**
+ * A made up OVMF image with just the footer table, and a kernel and initrd
+ * of random bytes. The expected digests are worked out in one go, from the
+ * whole of what QEMU would measure, VMSAs included
+ */
+bool Tests::test_calc_launch_digest()
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag);
+    const size_t ovmf_size = 2*sev::LAUNCH_HASH_CHUNK + PAGE_SIZE_4K;
+    const size_t kernel_size = 3*1024*1024;
+    const size_t initrd_size = 100*1024;
+    const uint32_t es_vcpus = 8;
+    const uint32_t es_ap_eip = 0xFFFFB00C;
+    const uint32_t snp_table_gpa = 0x80C400;
+    const uint32_t snp_vcpus = 4;
+    uint8_t *ovmf = new uint8_t[ovmf_size];
+    uint8_t *kernel = new uint8_t[kernel_size + 1];
+    uint8_t *initrd = new uint8_t[initrd_size];
+    uint8_t *measured = new uint8_t[ovmf_size + sizeof(sev::sev_hash_table) +
+                                    es_vcpus*PAGE_SIZE_4K];
+    std::string ovmf_full = m_output_folder + "ovmf.fd";
+    std::string plain_ovmf_full = m_output_folder + "ovmf_no_hashes.fd";
+    std::string kernel_full = m_output_folder + "vmlinuz";
+    std::string initrd_full = m_output_folder + "initrd.img";
+    const std::string cmdline = "console=ttyS0 root=/dev/vda1";
+
+    // The SEV metadata entry (its offset from the end), the
+    // SEV_ES_RESET_BLOCK_GUID entry (AP reset address), the
+    // SEV_HASH_TABLE_RV_GUID entry (GPA and size), then the footer entry
+    auto build_ovmf = [&](bool with_hashes) {
+        sev::gen_random_bytes(ovmf, ovmf_size);
+        size_t end = ovmf_size - 32;
+        uint16_t footer_size = (uint16_t)(18 + (with_hashes ? 26 + 22 + 22 : 0));
+        memcpy(ovmf + end - 16, sev::OVMF_TABLE_FOOTER_GUID, 16);
+        memcpy(ovmf + end - 18, &footer_size, 2);
+        if (with_hashes) {
+            uint16_t rv_size = 26;
+            uint32_t rv[2] = {snp_table_gpa, 0x400};
+            memcpy(ovmf + end - 34, sev::SEV_HASH_TABLE_RV_GUID, 16);
+            memcpy(ovmf + end - 36, &rv_size, 2);
+            memcpy(ovmf + end - 44, rv, sizeof(rv));
+            uint16_t reset_size = 22;
+            memcpy(ovmf + end - 60, sev::SEV_ES_RESET_BLOCK_GUID, 16);
+            memcpy(ovmf + end - 62, &reset_size, 2);
+            memcpy(ovmf + end - 66, &es_ap_eip, 4);
+            uint16_t meta_size = 22;
+            uint32_t meta_offset = 0x3000;
+            memcpy(ovmf + end - 82, sev::SEV_METADATA_GUID, 16);
+            memcpy(ovmf + end - 84, &meta_size, 2);
+            memcpy(ovmf + end - 88, &meta_offset, 4);
+            uint32_t meta[4 + 3*4] = {0x56455341, 16 + 4*12, 1, 4,
+                                      0x800000, 0x3000, 1,      // Zeroed
+                                      0x803000, 0x1000, 2,      // Secrets
+                                      0x804000, 0x1000, 3,      // CPUID
+                                      0x80C000, 0x1000, 0x10};  // Hashes table
+            memcpy(ovmf + ovmf_size - meta_offset, meta, sizeof(meta));
+        }
+    };
+    // A link of the SNP launch digest chain, by offset into PAGE_INFO
+    auto snp_update = [&](uint8_t *ld, const uint8_t *contents, uint8_t type, uint64_t gpa) {
+        uint8_t info[0x70] = {0};
+        uint16_t length = 0x70;
+        memcpy(info, ld, 48);
+        if (contents)
+            memcpy(info + 48, contents, 48);
+        memcpy(info + 96, &length, 2);
+        info[98] = type;
+        memcpy(info + 104, &gpa, 8);
+        return digest_sha(info, sizeof(info), ld, 48, SHA_TYPE_384);
+    };
+    // A VMSA at reset, by offset into the page (AMD APM vol 2, table B-4)
+    auto build_vmsa = [&](uint8_t *page, uint32_t eip, uint64_t signature, uint64_t features) {
+        auto put = [&](size_t offset, uint64_t value, size_t size) {
+            memcpy(page + offset, &value, size);
+        };
+        const uint16_t attribs[10] = {0x93, 0x9B, 0x93, 0x93, 0x93, 0x93, 0, 0x82, 0, 0x8B};
+        memset(page, 0, PAGE_SIZE_4K);
+        for (size_t seg = 0; seg < 10; seg++) {      // es cs ss ds fs gs gdtr ldtr idtr tr
+            put(seg*16 + 2, attribs[seg], 2);
+            put(seg*16 + 4, 0xFFFF, 4);
+        }
+        put(1*16, 0xF000, 2);
+        put(1*16 + 8, eip & 0xFFFF0000, 8);
+        put(0xD0, 0x1000, 8);                       // efer
+        put(0x148, 0x40, 8);                        // cr4
+        put(0x158, 0x10, 8);                        // cr0
+        put(0x160, 0x400, 8);                       // dr7
+        put(0x168, 0xFFFF0FF0, 8);                  // dr6
+        put(0x170, 0x2, 8);                         // rflags
+        put(0x178, eip & 0xFFFF, 8);                // rip
+        put(0x268, 0x0007040600070406ULL, 8);       // g_pat
+        put(0x310, signature, 8);                   // rdx
+        put(0x3B0, features, 8);                    // sev_features
+        put(0x3E8, 0x1, 8);                         // xcr0
+        put(0x408, 0x1F80, 4);                      // mxcsr
+        put(0x410, 0x37F, 2);                       // x87_fcw
+    };
+    auto expected_digest = [&](size_t kernel_length, uint8_t *digest) {
+        sev::sev_hash_table table;
+        memset(&table, 0, sizeof(table));
+        memcpy(table.guid, sev::SEV_HASH_TABLE_GUID, 16);
+        table.length = 168;
+        sev::sev_hash_table_entry *entries[3] = {&table.cmdline, &table.initrd, &table.kernel};
+        const uint8_t *guids[3] = {sev::SEV_CMDLINE_ENTRY_GUID, sev::SEV_INITRD_ENTRY_GUID,
+                                   sev::SEV_KERNEL_ENTRY_GUID};
+        for (size_t i = 0; i < 3; i++) {
+            memcpy(entries[i]->guid, guids[i], 16);
+            entries[i]->length = 50;
+        }
+        digest_sha(cmdline.c_str(), cmdline.size() + 1, table.cmdline.hash, 32, SHA_TYPE_256);
+        digest_sha(initrd, initrd_size, table.initrd.hash, 32, SHA_TYPE_256);
+        digest_sha(kernel, kernel_length, table.kernel.hash, 32, SHA_TYPE_256);
+        memcpy(measured, ovmf, ovmf_size);
+        memcpy(measured + ovmf_size, &table, sizeof(table));
+        return digest_sha(measured, ovmf_size + sizeof(table), digest, 32, SHA_TYPE_256);
+    };
+
+    do {
+        printf("*Starting calc_launch_digest tests\n");
+
+        sev::gen_random_bytes(kernel, kernel_size + 1);
+        sev::gen_random_bytes(initrd, initrd_size);
+        build_ovmf(false);
+        if (sev::write_file(plain_ovmf_full, ovmf, ovmf_size) != ovmf_size)
+            break;
+        build_ovmf(true);
+        if (sev::write_file(ovmf_full, ovmf, ovmf_size) != ovmf_size ||
+            sev::write_file(kernel_full, kernel, kernel_size) != kernel_size ||
+            sev::write_file(initrd_full, initrd, initrd_size) != initrd_size)
+            break;
+
+        // Just the firmware, through the command
+        uint8_t expected[32];
+        char expected_hex[2*sizeof(expected) + 1];
+        char actual_hex[2*sizeof(expected)];
+        if (!digest_sha(ovmf, ovmf_size, expected, sizeof(expected), SHA_TYPE_256))
+            break;
+        for (size_t i = 0; i < sizeof(expected); i++)
+            sprintf(expected_hex + 2*i, "%02x", expected[i]);
+        if (cmd.calc_launch_digest(ovmf_full, "", "", "") != STATUS_SUCCESS)
+            break;
+        if (sev::read_file(m_output_folder + LAUNCH_DIGEST_FILENAME, actual_hex,
+                           sizeof(actual_hex)) != sizeof(actual_hex) ||
+            memcmp(actual_hex, expected_hex, sizeof(actual_hex)) != 0) {
+            printf("Error: launch digest of the OVMF image is wrong\n");
+            break;
+        }
+
+        // Measured direct boot. The OVMF image is already in the cache
+        sev::LaunchDigestCache cache;
+        sev::launch_digest_input input = {ovmf_full, kernel_full, initrd_full, cmdline};
+        sev::launch_digest_stats stats;
+        uint8_t digest[32];
+        cache.load(m_output_folder + LAUNCH_DIGEST_CACHE_FILENAME);
+        if (!expected_digest(kernel_size, expected))
+            break;
+        if (sev::calc_sev_launch_digest(&input, &cache, digest, &stats) != STATUS_SUCCESS ||
+            memcmp(digest, expected, sizeof(digest)) != 0) {
+            printf("Error: measured direct boot launch digest is wrong\n");
+            break;
+        }
+        if (stats.cache_hits != 1 || stats.bytes_hashed != kernel_size + initrd_size)
+            break;
+
+        // Again, all from the cache, including after a save and load
+        if (!cache.save(m_output_folder + LAUNCH_DIGEST_CACHE_FILENAME))
+            break;
+        sev::LaunchDigestCache reloaded;
+        reloaded.load(m_output_folder + LAUNCH_DIGEST_CACHE_FILENAME);
+        if (sev::calc_sev_launch_digest(&input, &reloaded, digest, &stats) != STATUS_SUCCESS ||
+            memcmp(digest, expected, sizeof(digest)) != 0 ||
+            stats.cache_hits != 3 || stats.bytes_hashed != 0) {
+            printf("Error: launch digest didn't come from the cache\n");
+            break;
+        }
+
+        // A changed kernel is hashed again, and nothing else is
+        if (sev::write_file(kernel_full, kernel, kernel_size + 1) != kernel_size + 1)
+            break;
+        if (!expected_digest(kernel_size + 1, expected))
+            break;
+        if (sev::calc_sev_launch_digest(&input, &reloaded, digest, &stats) != STATUS_SUCCESS ||
+            memcmp(digest, expected, sizeof(digest)) != 0 ||
+            stats.cache_hits != 2 || stats.bytes_hashed != kernel_size + 1) {
+            printf("Error: changed kernel wasn't hashed again\n");
+            break;
+        }
+
+        // SEV-ES, for 1 to 8 EPYC-v4 vCPUs in one go: the BSP's VMSA, then
+        // one per AP
+        uint32_t signature = 0;
+        if (!sev::vcpu_signature("EPYC-v4", &signature) || signature != 0x800F12 ||
+            !sev::vcpu_signature("EPYC-Milan", &signature) || signature != 0xA00F11 ||
+            !sev::vcpu_signature("a00f11", &signature) || signature != 0xA00F11 ||
+            sev::vcpu_signature("Opteron_G5", &signature)) {
+            printf("Error: wrong vCPU signature\n");
+            break;
+        }
+        sev::launch_vcpus vcpus = {1, es_vcpus, 0x800F12, 0};
+        uint8_t es_digests[es_vcpus][32];
+        if (sev::calc_sev_es_launch_digests(&input, &reloaded, &vcpus, es_digests,
+                                            &stats) != STATUS_SUCCESS ||
+            stats.bytes_hashed != 0)
+            break;
+        uint8_t *vmsas = measured + ovmf_size + sizeof(sev::sev_hash_table);
+        build_vmsa(vmsas, sev::SEV_BSP_RESET_EIP, vcpus.signature, 0);
+        bool es_ok = true;
+        for (uint32_t n = 1; n <= es_vcpus; n++) {
+            if (n > 1)
+                build_vmsa(vmsas + (n - 1)*PAGE_SIZE_4K, es_ap_eip, vcpus.signature, 0);
+            if (!digest_sha(measured, ovmf_size + sizeof(sev::sev_hash_table) + n*PAGE_SIZE_4K,
+                            expected, sizeof(expected), SHA_TYPE_256) ||
+                memcmp(es_digests[n - 1], expected, sizeof(expected)) != 0)
+                es_ok = false;
+        }
+        if (!es_ok) {
+            printf("Error: SEV-ES launch digest is wrong\n");
+            break;
+        }
+
+        // And through the command, for 7 and 8: a line per vCPU count
+        char es_hex[2][2*32 + 1];
+        for (size_t n = 0; n < 2; n++) {
+            for (size_t i = 0; i < 32; i++)
+                sprintf(es_hex[n] + 2*i, "%02x", es_digests[es_vcpus - 2 + n][i]);
+        }
+        std::string es_expected = std::to_string(es_vcpus - 1) + " " + es_hex[0] + "\n" +
+                                  std::to_string(es_vcpus) + " " + es_hex[1];
+        char es_actual[256];
+        if (cmd.calc_launch_digest(ovmf_full, kernel_full, initrd_full, cmdline, es_vcpus - 1,
+                                   es_vcpus, 0x800F12) != STATUS_SUCCESS)
+            break;
+        if (sev::read_file(m_output_folder + LAUNCH_DIGEST_FILENAME, es_actual,
+                           sizeof(es_actual)) != es_expected.size() ||
+            memcmp(es_actual, es_expected.c_str(), es_expected.size()) != 0) {
+            printf("Error: SEV-ES launch digests from the command are wrong\n");
+            break;
+        }
+
+        // SEV-SNP, for 1 to 4 vCPUs: the OVMF pages, the metadata sections
+        // and the VMSAs, each a PAGE_INFO in the chain. The hashes table
+        // page is the measured part of the chain that isn't in the image
+        sev::launch_vcpus snp = {1, snp_vcpus, 0x800F12, sev::SNP_SEV_FEATURES};
+        uint8_t snp_digests[snp_vcpus][sev::SNP_DIGEST_SIZE];
+        uint8_t snp_expected[snp_vcpus][48];
+        uint8_t ld[48] = {0};
+        uint8_t contents[48];
+        uint8_t *page = vmsas;      // Reused for one page at a time
+        bool snp_ok = true;
+        for (size_t i = 0; i < ovmf_size / PAGE_SIZE_4K; i++) {
+            snp_ok &= digest_sha(ovmf + i*PAGE_SIZE_4K, PAGE_SIZE_4K, contents, 48, SHA_TYPE_384) &&
+                      snp_update(ld, contents, 1, (1ULL << 32) - ovmf_size + i*PAGE_SIZE_4K);
+        }
+        for (uint64_t gpa = 0x800000; gpa < 0x803000; gpa += PAGE_SIZE_4K)
+            snp_ok &= snp_update(ld, NULL, 3, gpa);
+        snp_ok &= snp_update(ld, NULL, 5, 0x803000) && snp_update(ld, NULL, 6, 0x804000);
+        memset(page, 0, PAGE_SIZE_4K);
+        memcpy(page + 0x400, measured + ovmf_size, sizeof(sev::sev_hash_table));
+        snp_ok &= digest_sha(page, PAGE_SIZE_4K, contents, 48, SHA_TYPE_384) &&
+                  snp_update(ld, contents, 1, 0x80C000);
+        for (uint32_t n = 1; n <= snp_vcpus; n++) {
+            build_vmsa(page, n == 1 ? sev::SEV_BSP_RESET_EIP : es_ap_eip, snp.signature,
+                       sev::SNP_SEV_FEATURES);
+            snp_ok &= digest_sha(page, PAGE_SIZE_4K, contents, 48, SHA_TYPE_384) &&
+                      snp_update(ld, contents, 2, 0xFFFFFFFFF000ULL);
+            memcpy(snp_expected[n - 1], ld, 48);
+        }
+        if (!snp_ok)
+            break;
+        sev::snp_launch_stats snp_stats;
+        for (uint32_t threads = 1; threads <= 3; threads += 2) {
+            memset(snp_digests, 0, sizeof(snp_digests));
+            if (sev::calc_snp_launch_digests(&input, &reloaded, &snp, threads, snp_digests,
+                                             &snp_stats) != STATUS_SUCCESS ||
+                memcmp(snp_digests, snp_expected, sizeof(snp_expected)) != 0 ||
+                snp_stats.threads != threads ||
+                snp_stats.pages != ovmf_size / PAGE_SIZE_4K + 3 + 2 + 1 + snp_vcpus) {
+                printf("Error: SEV-SNP launch digest on %u thread(s) is wrong\n", threads);
+                snp_ok = false;
+                break;
+            }
+        }
+        if (!snp_ok)
+            break;
+
+        // With a manifest, the first time every page is hashed. After a
+        // save and load, only a page that changed is, and the digest is the
+        // same as hashing all of it
+        const size_t ovmf_pages = ovmf_size / PAGE_SIZE_4K;
+        std::string pages_full = m_output_folder + LAUNCH_DIGEST_PAGES_FILENAME;
+        sev::LaunchPageManifest manifest;
+        if (sev::calc_snp_launch_digests(&input, &reloaded, &snp, 2, snp_digests, &snp_stats,
+                                         &manifest) != STATUS_SUCCESS ||
+            memcmp(snp_digests, snp_expected, sizeof(snp_expected)) != 0 ||
+            snp_stats.pages_reused != 0 || !manifest.save(pages_full))
+            break;
+        ovmf[5*PAGE_SIZE_4K + 7] ^= 0xFF;
+        if (sev::write_file(ovmf_full, ovmf, ovmf_size) != ovmf_size)
+            break;
+        if (sev::calc_snp_launch_digests(&input, &reloaded, &snp, 1, snp_expected,
+                                         &snp_stats) != STATUS_SUCCESS ||
+            memcmp(snp_expected, snp_digests, sizeof(snp_expected)) == 0)
+            break;
+        sev::LaunchPageManifest loaded;
+        loaded.load(pages_full);
+        if (loaded.size() != ovmf_size ||
+            sev::calc_snp_launch_digests(&input, &reloaded, &snp, 2, snp_digests, &snp_stats,
+                                         &loaded) != STATUS_SUCCESS ||
+            memcmp(snp_digests, snp_expected, sizeof(snp_expected)) != 0 ||
+            snp_stats.pages_reused != ovmf_pages - 1 || snp_stats.pages_hashed != 1 + 1 + 2) {
+            printf("Error: SEV-SNP launch digest from the manifest is wrong\n");
+            break;
+        }
+
+        // A damaged manifest isn't used
+        size_t pages_size = 48 + ovmf_pages*48 + ovmf_size;
+        uint8_t *pages_file = new uint8_t[pages_size];
+        bool damaged_ok = sev::read_file(pages_full, pages_file, pages_size) == pages_size;
+        pages_file[48 + 3*48] ^= 0x01;
+        damaged_ok &= sev::write_file(pages_full, pages_file, pages_size) == pages_size;
+        delete[] pages_file;
+        loaded.load(pages_full);
+        if (!damaged_ok || loaded.image() != NULL || loaded.hashes() != NULL)
+            break;
+
+        // FAILURE tests: firmware that can't check a kernel, an initrd
+        // without a kernel, a missing file, and firmware without SEV-ES
+        // or SNP
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        sev::launch_digest_input bad = {plain_ovmf_full, kernel_full, "", ""};
+        if (sev::calc_sev_launch_digest(&bad, NULL, digest, &stats) != ERROR_UNSUPPORTED)
+            break;
+        bad = {ovmf_full, "", initrd_full, ""};
+        if (sev::calc_sev_launch_digest(&bad, NULL, digest, &stats) != ERROR_INVALID_PARAM)
+            break;
+        bad = {m_output_folder + "missing.fd", "", "", ""};
+        if (sev::calc_sev_launch_digest(&bad, &reloaded, digest, &stats) != ERROR_INVALID_PARAM)
+            break;
+        bad = {plain_ovmf_full, "", "", ""};
+        if (sev::calc_sev_es_launch_digests(&bad, NULL, &vcpus, es_digests,
+                                            &stats) != ERROR_UNSUPPORTED)
+            break;
+        if (sev::calc_snp_launch_digests(&bad, NULL, &snp, 0, snp_digests,
+                                         &snp_stats) != ERROR_UNSUPPORTED)
+            break;
+
+        // FAILURE tests: SEV metadata that's shorter than its header, runs
+        // past the end of the image, or has more descriptors than fit
+        uint8_t *meta = ovmf + ovmf_size - 0x3000;
+        const uint32_t bad_meta[3][2] = {{4, 8}, {4, 0x3001}, {12, 5}};   // Offset, value
+        uint8_t meta_header[16];
+        memcpy(meta_header, meta, sizeof(meta_header));
+        bad = {ovmf_full, "", "", ""};
+        bool meta_ok = true;
+        for (size_t i = 0; i < 3 && meta_ok; i++) {
+            memcpy(meta + bad_meta[i][0], &bad_meta[i][1], 4);
+            meta_ok = sev::write_file(ovmf_full, ovmf, ovmf_size) == ovmf_size &&
+                      sev::calc_snp_launch_digests(&bad, NULL, &snp, 1, snp_digests,
+                                                   &snp_stats) == ERROR_INVALID_PARAM;
+            memcpy(meta, meta_header, sizeof(meta_header));
+        }
+        if (!meta_ok)
+            break;
+
         ret = true;
     } while (0);
 
+    delete[] measured;
+    delete[] initrd;
+    delete[] kernel;
+    delete[] ovmf;
     return ret;
 }
 
@@ -671,6 +1202,10 @@ bool Tests::test_validate_cert_chain()
     do {
         printf("*Starting validate_cert_chain tests\n");
 
+        // Export the certs to validate into this test's folder
+        if (cmd.generate_all_certs() != STATUS_SUCCESS)
+            break;
+
         if (cmd.validate_cert_chain() != STATUS_SUCCESS)
             break;
 
@@ -690,6 +1225,10 @@ bool Tests::test_generate_launch_blob()
     do {
         printf("*Starting generate_launch_blob tests\n");
 
+        // Export the PDH cert to be read in during generate_launch_blob
+        if (cmd.pdh_cert_export() != STATUS_SUCCESS)
+            break;
+
         if (cmd.generate_launch_blob(policy) != STATUS_SUCCESS)
             break;
 
@@ -699,13 +1238,51 @@ bool Tests::test_generate_launch_blob()
     return ret;
 }
 
+bool Tests::test_secure_arena()
+{
+    bool ret = false;
+
+    do {
+        printf("*Starting secure_arena tests\n");
+
+        // The key material comes from the secure arena. A small one, so it
+        // can be filled: blocks spill up to the next class, and come back
+        // wiped
+        uint32_t counts[sev::SECURE_ARENA_CLASSES] = {2, 1, 0, 0, 0, 0};
+        sev::SecureArena arena(counts);
+        sev::secure_arena_stats stats;
+        uint8_t *key_a = (uint8_t *)arena.alloc(16);
+        uint8_t *key_b = (uint8_t *)arena.alloc(16);
+        uint8_t *key_c = (uint8_t *)arena.alloc(16);    // From the 32 byte class
+        if (!key_a || !key_b || !key_c || arena.alloc(16) || arena.alloc(64))   // fail, full
+            break;
+        memset(key_a, 0xA5, 16);
+        if (!arena.free(key_a) || arena.free(key_a) || arena.free(key_a + 1))   // fail, not allocated
+            break;
+        if (key_a[0] != 0 || key_a[15] != 0)            // Wiped
+            break;
+        if (arena.alloc(16) != key_a)                   // Reused
+            break;
+        arena.stats(0, &stats);
+        if (stats.block_size != 16 || stats.capacity != 2 || stats.in_use != 2 ||
+            stats.peak != 2 || stats.allocs != 3 || stats.failures != 1)
+            break;
+        arena.stats(1, &stats);
+        if (stats.in_use != 1 || stats.allocs != 1)
+            break;
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
 bool Tests::test_package_secret()
 {
     bool ret = false;
     Command cmd(m_output_folder, m_verbose_flag);
     uint32_t policy = 0;
-    std::string sys_cmd = "";
-    std::string output = "";
+    std::string secret_full = m_output_folder + SECRET_FILENAME;
 
     do {
         printf("*Starting package_secret tests\n");
@@ -718,107 +1295,1172 @@ bool Tests::test_package_secret()
         if (cmd.generate_launch_blob(policy) != STATUS_SUCCESS)
             break;
 
+        // The TK is kept in memory too, so package_secret doesn't need the
+        // files generate_launch_blob wrote
+        sev::session_keys keys;
+        tek_tik tk_file;
+        std::string tk_full = m_output_folder + GUEST_TK_FILENAME;
+        if (!sev::SessionStore::global().get(m_output_folder, &keys))
+            break;
+        if (sev::read_file(tk_full, &tk_file, sizeof(tk_file)) != sizeof(tk_file) ||
+            memcmp(&tk_file, &keys.tk, sizeof(tk_file)) != 0)
+            break;
+        if (std::remove(tk_full.c_str()) != 0 ||
+            std::remove((m_output_folder + LAUNCH_BLOB_FILENAME).c_str()) != 0)
+            break;
+
         // Export a 'calculated measurement' that package_secret can read in for the header
-        sys_cmd = "echo 6faab2daae389bcd3405a05d6cafe33c0414f7bedd0bae19ba5f38b7fd1664ea > " + m_output_folder + CALC_MEASUREMENT_FILENAME;
-        if (!sev::execute_system_command(sys_cmd, &output))
-            return false;
+        std::string meas = "6faab2daae389bcd3405a05d6cafe33c0414f7bedd0bae19ba5f38b7fd1664ea\n";
+        if (sev::write_file(m_output_folder + CALC_MEASUREMENT_FILENAME, meas.c_str(), meas.size()) != meas.size())
+            break;
 
         // FAILURE test: Try a secrets file that's less than 8 bytes
         printf("Running a negative/failure test. Should print an 'Error'\n");
-        sys_cmd = "echo HELLO > " + m_output_folder + SECRET_FILENAME;
-        if (!sev::execute_system_command(sys_cmd, &output))
-            return false;
+        std::string secret = "HELLO\n";
+        if (sev::write_file(secret_full, secret.c_str(), secret.size()) != secret.size())
+            break;
         if (cmd.package_secret() == STATUS_SUCCESS)   // fail
             break;
 
         // Try a secrets file of 8 bytes
-        sys_cmd = "echo HELLOooo > " + m_output_folder + SECRET_FILENAME;
-        if (!sev::execute_system_command(sys_cmd, &output))
-            return false;
+        secret = "HELLOooo\n";
+        if (sev::write_file(secret_full, secret.c_str(), secret.size()) != secret.size())
+            break;
         if (cmd.package_secret() != STATUS_SUCCESS)
             break;
 
         // Try a longer secrets file (use the readable cert_chain file from pdh_cert_export)
-        sys_cmd = "cp " + m_output_folder + CERT_CHAIN_READABLE_FILENAME + " " + m_output_folder + SECRET_FILENAME;
-        if (!sev::execute_system_command(sys_cmd, &output))
-            return false;
+        std::string chain_readable = m_output_folder + CERT_CHAIN_READABLE_FILENAME;
+        size_t chain_size = sev::get_file_size(chain_readable);
+        if (chain_size == 0)
+            break;
+        uint8_t *chain_buf = new uint8_t[chain_size];
+        bool copied = (sev::read_file(chain_readable, chain_buf, chain_size) == chain_size) &&
+                      (sev::write_file(secret_full, chain_buf, chain_size) == chain_size);
+        delete[] chain_buf;
+        if (!copied)
+            break;
         if (cmd.package_secret() != STATUS_SUCCESS)
             break;
 
+        // Sessions go when the store is full or they time out
+        sev::SessionStore store(2, 50);
+        sev_session_buf session;
+        hmac_sha_256 meas_bytes;
+        memset(&session, 0, sizeof(session));
+        memset(meas_bytes, 0xA5, sizeof(meas_bytes));
+        if (!store.put("a", &keys.tk, &session) || !store.put("b", &keys.tk, &session))
+            break;
+        if (store.put("c", &keys.tk, &session))         // fail, full
+            break;
+        if (!store.put("a", &keys.tk, &session))        // Replaces the old "a"
+            break;
+        if (!store.set_measurement("b", meas_bytes) || store.set_measurement("c", meas_bytes))
+            break;
+        sev::session_keys stored;
+        if (!store.get("b", &stored) || !stored.has_measurement ||
+            memcmp(stored.measurement, meas_bytes, sizeof(meas_bytes)) != 0)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(100));
+        if (store.get("a", &stored) || store.count() != 0 || !store.put("c", &keys.tk, &session))
+            break;
+
         ret = true;
     } while (0);
 
     return ret;
 }
 
-bool Tests::test_all()
+/**
+ * Whether header's MAC is HMAC(TIK, 0x01 | flags | iv | length | length |
+ * packet [| measurement]), worked out here the long way
+ */
+static bool secret_header_ok(const tek_tik *tk, const hmac_sha_256 measurement,
+                             const sev_hdr_buf *header, const uint8_t *packet, size_t size)
+{
+    uint8_t status_data[sizeof(sev_platform_status_cmd_buf)];
+    if (SEVDevice::get_sev_device().platform_status(status_data) != STATUS_SUCCESS)
+        return false;
+    uint8_t api_minor = ((sev_platform_status_cmd_buf *)status_data)->api_minor;
+
+    uint32_t size32 = (uint32_t)size;
+    size_t mac_len = 1 + sizeof(header->flags) + sizeof(header->iv) + 8 + size +
+                     (api_minor >= 17 ? sizeof(hmac_sha_256) : 0);
+    uint8_t *mac_msg = new uint8_t[mac_len];
+    uint8_t *m = mac_msg;
+    *m++ = 0x01;
+    memcpy(m, &header->flags, sizeof(header->flags)); m += sizeof(header->flags);
+    memcpy(m, header->iv, sizeof(header->iv)); m += sizeof(header->iv);
+    memcpy(m, &size32, 4); m += 4;
+    memcpy(m, &size32, 4); m += 4;
+    memcpy(m, packet, size); m += size;
+    if (api_minor >= 17)
+        memcpy(m, measurement, sizeof(hmac_sha_256));
+
+    hmac_sha_256 mac;
+    bool ok = HMAC(EVP_sha256(), tk->tik, sizeof(tk->tik), mac_msg, mac_len, mac, NULL) &&
+              memcmp(mac, header->mac, sizeof(mac)) == 0;
+    delete[] mac_msg;
+    return ok;
+}
+
+/**
+ * Packages three secrets as one table, then decrypts the packet with the TEK
+ * and checks the layout, and checks the header MAC is over the ciphertext the
+ * same way as package_secret's. The third secret is big enough to be
+ * encrypted in more than one chunk
+ */
+bool Tests::test_package_secret_table()
 {
     bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag);
+    const std::string ssh_guid = "5e6b5c1a-3a38-4b6c-9d2e-2c1b5a7d9e01";
+    std::string disk_file = m_output_folder + "disk.key";
+    std::string ssh_file = m_output_folder + "ssh.key";
+    std::string big_file = m_output_folder + "big.bin";
+    const char disk_key[] = "correct horse battery staple";
+    const size_t ssh_size = 300;
+    const size_t big_size = sev::SECRET_PACK_CHUNK + 1000;
+    uint8_t *ssh_key = new uint8_t[ssh_size];
+    uint8_t *big = new uint8_t[big_size];
+    uint8_t *packaged = NULL;
+    uint8_t *plain = NULL;
 
     do {
-        printf("Starting self-tests\n");
-        printf("Note: Positive and negative self-tests will be run,\n" \
-               "      The word 'Error' is part of some negative tests.\n" \
-               "      If any test fails, the tests immediately stop and \n" \
-               "      no other tests are run. A successful run will say \n" \
-               "      'All tests Succeeded' at the bottom.\n");
+        printf("*Starting package_secret_table tests\n");
 
-        clear_output_folder();
+        if (cmd.pdh_cert_export() != STATUS_SUCCESS)
+            break;
+        if (cmd.generate_launch_blob(0) != STATUS_SUCCESS)
+            break;
+        sev::session_keys keys;
+        if (!sev::SessionStore::global().get(m_output_folder, &keys))
+            break;
+        hmac_sha_256 measurement;
+        sev::gen_random_bytes(measurement, sizeof(measurement));
+        if (sev::write_file(m_output_folder + CALC_MEASUREMENT_FILENAME, measurement,
+                            sizeof(measurement)) != sizeof(measurement))
+            break;
 
-        if (!test_factory_reset())
+        sev::gen_random_bytes(ssh_key, ssh_size);
+        sev::gen_random_bytes(big, big_size);
+        if (sev::write_file(disk_file, disk_key, sizeof(disk_key) - 1) != sizeof(disk_key) - 1 ||
+            sev::write_file(ssh_file, ssh_key, ssh_size) != ssh_size ||
+            sev::write_file(big_file, big, big_size) != big_size)
             break;
 
-        if (!test_platform_status())
+        // FAILURE tests: not a GUID, the same GUID twice, no such file
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        if (cmd.package_secret_table("5e6b5c1a-3a38-4b6c-9d2e=" + ssh_file) == STATUS_SUCCESS)
+            break;
+        if (cmd.package_secret_table("disk=" + disk_file + ",disk=" + ssh_file) == STATUS_SUCCESS)
+            break;
+        if (cmd.package_secret_table("disk=" + m_output_folder + "none") == STATUS_SUCCESS)
             break;
 
-        if (!test_pek_gen())
+        std::string secrets = "disk=" + disk_file + "," + ssh_guid + "=" + ssh_file +
+                              ",00000000-0000-0000-0000-000000000001=" + big_file;
+        if (cmd.package_secret_table(secrets) != STATUS_SUCCESS)
             break;
 
-        if (!test_pek_csr())
+        size_t length = sizeof(sev::secret_table_header)*4 + sizeof(disk_key) - 1 + ssh_size + big_size;
+        size_t size = (length + 15) & ~(size_t)15;
+        sev_hdr_buf header;
+        packaged = new uint8_t[size + 1];
+        plain = new uint8_t[size];
+        if (sev::read_file(m_output_folder + PACKAGED_SECRET_FILENAME, packaged, size + 1) != size)
+            break;
+        if (sev::read_file(m_output_folder + PACKAGED_SECRET_HEADER_FILENAME, &header,
+                           sizeof(header)) != sizeof(header))
+            break;
+        if (!encrypt(plain, packaged, size, keys.tk.tek, header.iv))   // CTR decrypts too
             break;
 
-        if (!test_pdh_gen())
+        // header | disk entry | ssh entry | big entry | zeros
+        uint8_t guid[16];
+        const uint8_t *p = plain;
+        sev::secret_table_header entry;
+        memcpy(&entry, p, sizeof(entry));
+        if (memcmp(entry.guid, sev::SECRET_TABLE_HEADER_GUID, 16) != 0 || entry.length != length)
+            break;
+        p += sizeof(entry);
+        memcpy(&entry, p, sizeof(entry));
+        if (memcmp(entry.guid, sev::SECRET_DISK_PASSPHRASE_GUID, 16) != 0 ||
+            entry.length != sizeof(entry) + sizeof(disk_key) - 1 ||
+            memcmp(p + sizeof(entry), disk_key, sizeof(disk_key) - 1) != 0)
+            break;
+        p += entry.length;
+        memcpy(&entry, p, sizeof(entry));
+        if (!sev::str_to_guid(ssh_guid, guid) || memcmp(entry.guid, guid, 16) != 0 ||
+            guid[0] != 0x1a || guid[3] != 0x5e || guid[4] != 0x38 || guid[8] != 0x9d ||
+            entry.length != sizeof(entry) + ssh_size ||
+            memcmp(p + sizeof(entry), ssh_key, ssh_size) != 0)
+            break;
+        p += entry.length;
+        memcpy(&entry, p, sizeof(entry));
+        if (entry.guid[0] != 0 || entry.guid[15] != 1 || entry.length != sizeof(entry) + big_size ||
+            memcmp(p + sizeof(entry), big, big_size) != 0)
+            break;
+        p += entry.length;
+        bool padded = true;
+        for (; p < plain + size; p++)
+            padded = padded && *p == 0;
+        if (!padded)
             break;
 
-        if (!test_pdh_cert_export())
+        if (!secret_header_ok(&keys.tk, measurement, &header, packaged, size))
             break;
 
-        if (!test_pek_cert_import())
+        ret = true;
+    } while (0);
+
+    delete[] plain;
+    delete[] packaged;
+    delete[] big;
+    delete[] ssh_key;
+
+    return ret;
+}
+
+/**
+ * Packages the same secret for more sessions than one worker batch, then
+ * checks each one decrypts to the secret with its own TEK and has its own
+ * IV and a good MAC. Then again with a secret and a sessions file that are
+ * both bigger than the secure arena's biggest block, which still have to
+ * be kept in locked memory
+ */
+bool Tests::test_package_secret_fanout()
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag);
+    std::string session_file = m_output_folder + "sessions.bin";
+    const size_t counts[2] = {sev::SECRET_FANOUT_BATCH*3 + 5, 300};
+    const size_t secret_sizes[2] = {100, 20*1024};
+    const size_t max_count = counts[1];
+    const size_t max_secret_size = secret_sizes[1];
+    uint8_t *secret = new uint8_t[max_secret_size];
+    sev::secret_session *sessions = new sev::secret_session[max_count];
+    uint8_t *packaged = new uint8_t[max_count*max_secret_size + 1];
+    sev_hdr_buf *headers = new sev_hdr_buf[max_count + 1];
+    uint8_t *plain = new uint8_t[max_secret_size];
+
+    do {
+        printf("*Starting package_secret_fanout tests\n");
+
+        sev::gen_random_bytes(secret, max_secret_size);
+        sev::gen_random_bytes(sessions, max_count*sizeof(sev::secret_session));
+        if (sev::write_file(m_output_folder + SECRET_FILENAME, secret, secret_sizes[0]) != secret_sizes[0])
             break;
 
-        if (!test_get_id())
+        // FAILURE test: a partial session
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        if (sev::write_file(session_file, sessions, sizeof(sev::secret_session) + 1) !=
+            sizeof(sev::secret_session) + 1)
+            break;
+        if (cmd.package_secret_fanout(session_file) == STATUS_SUCCESS)
+            break;
+
+        bool failed = false;
+        for (size_t round = 0; round < 2 && !failed; round++) {
+            const size_t count = counts[round];
+            const size_t secret_size = secret_sizes[round];
+            failed = true;
+            if (sev::write_file(m_output_folder + SECRET_FILENAME, secret, secret_size) != secret_size)
+                break;
+            if (sev::write_file(session_file, sessions, count*sizeof(sev::secret_session)) !=
+                count*sizeof(sev::secret_session))
+                break;
+            uint64_t fallbacks = sev::secure_fallbacks();
+            if (cmd.package_secret_fanout(session_file, 4) != STATUS_SUCCESS)
+                break;
+            if (sev::secure_fallbacks() != fallbacks) {
+                printf("Error: %zu byte secret wasn't kept in locked memory\n", secret_size);
+                break;
+            }
+
+            if (sev::read_file(m_output_folder + PACKAGED_SECRETS_FILENAME, packaged,
+                               count*secret_size + 1) != count*secret_size)
+                break;
+            if (sev::read_file(m_output_folder + PACKAGED_SECRET_HEADERS_FILENAME, headers,
+                               (count + 1)*sizeof(sev_hdr_buf)) != count*sizeof(sev_hdr_buf))
+                break;
+
+            failed = false;
+            for (size_t i = 0; i < count && !failed; i++) {
+                const uint8_t *packet = packaged + i*secret_size;
+                failed = !encrypt(plain, packet, secret_size, sessions[i].tk.tek, headers[i].iv) ||
+                         memcmp(plain, secret, secret_size) != 0 ||
+                         !secret_header_ok(&sessions[i].tk, sessions[i].measurement, &headers[i],
+                                           packet, secret_size) ||
+                         (i > 0 && memcmp(headers[i].iv, headers[i - 1].iv, sizeof(iv_128)) == 0);
+                if (failed)
+                    printf("Error: session %zu didn't package right\n", i);
+            }
+        }
+        if (failed)
             break;
 
-        if (!test_set_self_owned())
+        ret = true;
+    } while (0);
+
+    delete[] plain;
+    delete[] headers;
+    delete[] packaged;
+    delete[] sessions;
+    delete[] secret;
+
+    return ret;
+}
+
+/**
+ * Packages an image that doesn't end on a page boundary, then checks the
+ * first and last packets by hand: the MAC is over the flags, IV and
+ * transport data, and the transport data decrypts to the page with the TEK
+ */
+bool Tests::test_package_migration()
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag);
+    std::string image_file = m_output_folder + "guest.img";
+    const size_t pages = sev::MIGRATION_BATCH*2 + 3;
+    const size_t image_size = pages*sev::MIGRATION_PAGE_SIZE - 100;
+    const size_t stream_size = pages*sev::MIGRATION_PACKET_STRIDE - 100;
+    uint8_t *image = new uint8_t[image_size];
+    uint8_t *stream = new uint8_t[stream_size + 1];
+    uint8_t page[sev::MIGRATION_PAGE_SIZE];
+
+    do {
+        printf("*Starting package_migration tests\n");
+
+        if (cmd.pdh_cert_export() != STATUS_SUCCESS)
+            break;
+        if (cmd.generate_launch_blob(0) != STATUS_SUCCESS)
+            break;
+        sev::session_keys keys;
+        if (!sev::SessionStore::global().get(m_output_folder, &keys))
             break;
 
-        if (!test_set_externally_owned())
+        sev::gen_random_bytes(image, image_size);
+        if (sev::write_file(image_file, image, image_size) != image_size)
             break;
 
-        if (!test_generate_cek_ask())
+        // FAILURE test: no image
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        if (cmd.package_migration(m_output_folder + "none") == STATUS_SUCCESS)
+            break;
+
+        if (cmd.package_migration(image_file, 0x100000, 3) != STATUS_SUCCESS)
+            break;
+        if (sev::migration_stream_size(image_size) != stream_size ||
+            sev::read_file(m_output_folder + MIGRATION_STREAM_FILENAME, stream,
+                           stream_size + 1) != stream_size)
+            break;
+
+        // The stream goes to the file a window at a time. A window needn't
+        // start on a page, and a file that isn't committed isn't replaced
+        std::string mapped_file = m_output_folder + "mapped.bin";
+        const size_t mapped_size = 3*sev::MIGRATION_PAGE_SIZE + 100;
+        const size_t split = 5000;
+        sev::FileMapWriter writer;
+        uint8_t *window = NULL;
+        if (!writer.open(mapped_file, mapped_size) || !(window = writer.map(0, split)))
+            break;
+        memcpy(window, image, split);
+        if (!(window = writer.map(split, mapped_size - split)) || writer.map(split, mapped_size))
+            break;
+        if (!(window = writer.map(split, mapped_size - split)))
+            break;
+        memcpy(window, image + split, mapped_size - split);
+        if (!writer.commit())
+            break;
+        if (!writer.open(mapped_file, 100) || !(window = writer.map(0, 100)))
+            break;
+        memset(window, 0, 100);
+        writer.discard();
+        if (sev::read_file(mapped_file, stream, stream_size) != mapped_size ||
+            memcmp(stream, image, mapped_size) != 0)
+            break;
+        if (sev::read_file(m_output_folder + MIGRATION_STREAM_FILENAME, stream,
+                           stream_size + 1) != stream_size)
+            break;
+
+        bool failed = false;
+        const size_t checked[2] = {0, pages - 1};
+        for (size_t c = 0; c < 2 && !failed; c++) {
+            size_t i = checked[c];
+            size_t length = i + 1 == pages ? sev::MIGRATION_PAGE_SIZE - 100 : sev::MIGRATION_PAGE_SIZE;
+            sev::migration_packet packet;
+            memcpy(&packet, stream + i*sev::MIGRATION_PACKET_STRIDE, sizeof(packet));
+            const uint8_t *trans = stream + i*sev::MIGRATION_PACKET_STRIDE + sizeof(packet);
+
+            // HMAC(TIK, flags | iv | trans)
+            uint8_t *mac_msg = new uint8_t[sizeof(packet.hdr.flags) + sizeof(packet.hdr.iv) + length];
+            memcpy(mac_msg, &packet.hdr.flags, sizeof(packet.hdr.flags));
+            memcpy(mac_msg + sizeof(packet.hdr.flags), packet.hdr.iv, sizeof(packet.hdr.iv));
+            memcpy(mac_msg + sizeof(packet.hdr.flags) + sizeof(packet.hdr.iv), trans, length);
+            hmac_sha_256 mac;
+            failed = packet.gpa != 0x100000 + i*sev::MIGRATION_PAGE_SIZE ||
+                     packet.length != length || packet.hdr.flags != 0 ||
+                     !HMAC(EVP_sha256(), keys.tk.tik, sizeof(keys.tk.tik), mac_msg,
+                           sizeof(packet.hdr.flags) + sizeof(packet.hdr.iv) + length, mac, NULL) ||
+                     memcmp(mac, packet.hdr.mac, sizeof(mac)) != 0 ||
+                     !encrypt(page, trans, length, keys.tk.tek, packet.hdr.iv) ||
+                     memcmp(page, image + i*sev::MIGRATION_PAGE_SIZE, length) != 0;
+            delete[] mac_msg;
+            if (failed)
+                printf("Error: packet %zu isn't right\n", i);
+        }
+        if (failed)
             break;
 
-        if (!test_get_ask_ark())
+        ret = true;
+    } while (0);
+
+    delete[] stream;
+    delete[] image;
+
+    return ret;
+}
+
+/**
+ * Verifies a good stream, with and without the image, then one with a
+ * flipped bit, one that's cut short, and one checked against another image
+ */
+bool Tests::test_verify_migration()
+{
+    bool ret = false;
+    Command cmd(m_output_folder, m_verbose_flag);
+    std::string image_file = m_output_folder + "guest.img";
+    std::string other_file = m_output_folder + "other.img";
+    std::string stream_file = m_output_folder + MIGRATION_STREAM_FILENAME;
+    std::string bad_file = m_output_folder + "bad_stream.bin";
+    const size_t image_size = (sev::MIGRATION_BATCH*2 + 3)*sev::MIGRATION_PAGE_SIZE;
+    const size_t stream_size = sev::migration_stream_size(image_size);
+    uint8_t *image = new uint8_t[image_size];
+    uint8_t *stream = new uint8_t[stream_size];
+
+    do {
+        printf("*Starting verify_migration tests\n");
+
+        if (cmd.pdh_cert_export() != STATUS_SUCCESS)
+            break;
+        if (cmd.generate_launch_blob(0) != STATUS_SUCCESS)
             break;
 
-        if (!test_export_cert_chain())
+        sev::gen_random_bytes(image, image_size);
+        if (sev::write_file(image_file, image, image_size) != image_size)
+            break;
+        if (cmd.package_migration(image_file) != STATUS_SUCCESS)
+            break;
+        if (cmd.verify_migration(stream_file, "") != STATUS_SUCCESS)
+            break;
+        if (cmd.verify_migration(stream_file, image_file, 2) != STATUS_SUCCESS)
             break;
 
-        if (!test_calc_measurement())
+        if (sev::read_file(stream_file, stream, stream_size) != stream_size)
             break;
 
-        if (!test_validate_cert_chain())
+        // FAILURE tests
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        stream[100*sev::MIGRATION_PACKET_STRIDE + sizeof(sev::migration_packet) + 7] ^= 1;
+        if (sev::write_file(bad_file, stream, stream_size) != stream_size)
+            break;
+        if (cmd.verify_migration(bad_file, "") != ERROR_BAD_MEASUREMENT)
+            break;
+        if (sev::write_file(bad_file, stream, sizeof(sev::migration_packet)) != sizeof(sev::migration_packet))
+            break;
+        if (cmd.verify_migration(bad_file, "") == STATUS_SUCCESS)
+            break;
+        image[5*sev::MIGRATION_PAGE_SIZE] ^= 1;
+        if (sev::write_file(other_file, image, image_size) != image_size)
+            break;
+        if (cmd.verify_migration(stream_file, other_file) != ERROR_BAD_MEASUREMENT)
             break;
 
-        if (!test_generate_launch_blob())
+        ret = true;
+    } while (0);
+
+    delete[] stream;
+    delete[] image;
+
+    return ret;
+}
+
+#ifdef __linux__
+/**
+ * Fills in req with sim's cert chain, like export_cert_chain and the KDS
+ * get it. The ask_ark is the KDS download, for the server to trust
+ */
+static bool attest_start_chain(SEVSimBackend *sim, sev::attest_start_req *req,
+                               uint8_t *ask_ark, size_t *ask_ark_length)
+{
+    bool ret = false;
+    int cmd_ret = -1;
+
+    do {
+        if (!sim->open_device())
+            break;
+        sev_user_data_pdh_cert_export export_buf;
+        sev_cert_chain_buf chain;
+        memset(&export_buf, 0, sizeof(export_buf));
+        export_buf.pdh_cert_address = (uint64_t)&req->pdh;
+        export_buf.pdh_cert_len = sizeof(req->pdh);
+        export_buf.cert_chain_address = (uint64_t)&chain;
+        export_buf.cert_chain_len = sizeof(chain);
+        if (sim->issue_cmd(SEV_PDH_CERT_EXPORT, &export_buf, &cmd_ret) != 0)
             break;
+        memcpy(&req->pek, &chain.pek_cert, sizeof(sev_cert));
+        memcpy(&req->oca, &chain.oca_cert, sizeof(sev_cert));
 
-        if (!test_package_secret())
+        sev_user_data_get_id id;
+        if (sim->issue_cmd(SEV_GET_ID, &id, &cmd_ret) != 0)
+            break;
+        if (sim->kds_get_cek(id.socket1, sizeof(id.socket1), &req->cek) != STATUS_SUCCESS)
+            break;
+
+        amd_cert ask;
+        AMDCert tmp_amd;
+        if (sim->kds_get_ask_ark(ask_ark, sizeof(amd_cert)*2, ask_ark_length) != STATUS_SUCCESS)
+            break;
+        if (tmp_amd.amd_cert_init(&ask, ask_ark) != STATUS_SUCCESS)
+            break;
+        req->ask_size = (uint32_t)tmp_amd.amd_cert_get_size(&ask);
+        req->ark_size = (uint32_t)(*ask_ark_length - req->ask_size);
+        if (req->ark_size > sizeof(req->ark))
+            break;
+        memcpy(req->ask, ask_ark, req->ask_size);
+        memcpy(req->ark, ask_ark + req->ask_size, req->ark_size);
+
+        ret = true;
+    } while (0);
+
+    return ret;
+}
+
+/**
+ * Runs the attestation server on a Unix socket and launches guests against
+ * it with AttestClient, using a simulator of its own as the firmware so the
+ * LAUNCH_MEASURE and LAUNCH_SECRET steps are real
+ */
+bool Tests::test_attest_server()
+{
+    static constexpr uint32_t NUM_SESSIONS = 200;
+    static constexpr uint32_t NUM_CLIENTS = 4;
+    bool ret = false;
+    SEVSimBackend sim;
+    SEVSimBackend forger;
+    sev::attest_start_req *req = new sev::attest_start_req;
+    sev::attest_start_req *forged = new sev::attest_start_req;
+    uint8_t ask_ark[sizeof(amd_cert)*2];
+    size_t ask_ark_length = 0;
+    uint8_t forged_ask_ark[sizeof(amd_cert)*2];
+    size_t forged_ask_ark_length = 0;
+    sev::attest_launch_blob *blobs = new sev::attest_launch_blob[NUM_SESSIONS];
+    uint8_t (*session_ids)[sev::ATTEST_SESSION_ID_SIZE] = new uint8_t[NUM_SESSIONS][sev::ATTEST_SESSION_ID_SIZE];
+    sev::AttestClient clients[NUM_CLIENTS];
+    sev::attest_server_config config;
+    sev::attest_server_config short_config;
+    sev::AttestServer *server = NULL;
+    sev::AttestServer *short_server = NULL;
+    std::thread poller;
+    std::thread short_poller;
+    const char secret[] = "attest_server test secret, more than 8 bytes";
+    uint8_t approved[3][32];    // Guests are launched with all three
+    int cmd_ret = -1;
+
+    memset(req, 0, sizeof(*req));
+    memset(forged, 0, sizeof(*forged));
+
+    do {
+        printf("*Starting attest_server tests\n");
+
+        // The platform's cert chain, like export_cert_chain gets it
+        if (!attest_start_chain(&sim, req, ask_ark, &ask_ark_length))
+            break;
+
+        sev_user_data_status status;
+        if (sim.issue_cmd(SEV_PLATFORM_STATUS, &status, &cmd_ret) != 0)
+            break;
+
+        // Exactly NUM_SESSIONS at once, so the next START is refused
+        sev::attest_server_defaults(&config);
+        config.listen = m_output_folder + "attest.sock";
+        config.policy = 0x1;
+        sev::gen_random_bytes(approved, sizeof(approved));
+        config.digests = approved;
+        config.digest_count = 3;
+        config.secret = (const uint8_t *)secret;
+        config.secret_size = sizeof(secret);
+        config.ask = ask_ark;
+        config.ask_size = req->ask_size;
+        config.ark = ask_ark + req->ask_size;
+        config.ark_size = req->ark_size;
+        config.max_sessions = NUM_SESSIONS;
+        server = new sev::AttestServer(&config);
+        if (!server->open())
+            break;
+        poller = std::thread([server]() { server->run(); });
+
+        bool failed = false;
+        for (uint32_t i = 0; i < NUM_CLIENTS && !failed; i++)
+            failed = !clients[i].connect(config.listen);
+        if (failed)
+            break;
+
+        // Every session is open before any is measured
+        for (uint32_t i = 0; i < NUM_SESSIONS && !failed; i++) {
+            failed = clients[i % NUM_CLIENTS].start(req, &blobs[i], session_ids[i]) != STATUS_SUCCESS ||
+                     blobs[i].policy != config.policy;
+        }
+        if (failed)
+            break;
+        sev::attest_launch_blob extra;
+        uint8_t extra_id[sev::ATTEST_SESSION_ID_SIZE];
+        if (clients[0].start(req, &extra, extra_id) != ERROR_RESOURCE_LIMIT)
+            break;
+
+        // The MEASURE doesn't have to come over the START's connection
+        sev::attest_measure_req measure;
+        sev_hdr_buf header;
+        uint8_t packaged[sizeof(secret)];
+        uint8_t decrypted[sizeof(secret)];
+        memset(&measure, 0, sizeof(measure));
+        measure.api_major = status.api_major;
+        measure.api_minor = status.api_minor;
+        measure.build_id = status.build;
+        for (uint32_t i = 3; i < NUM_SESSIONS && !failed; i++) {
+            sev::AttestClient *client = &clients[(i + 1) % NUM_CLIENTS];
+            uint16_t digest_index = 0xFFFF;
+            failed = sim.launch_measure(&blobs[i].godh_cert, &blobs[i].session, blobs[i].policy,
+                                        approved[i % 3], &measure.measure) != STATUS_SUCCESS ||
+                     client->measure(session_ids[i], &measure, &header, packaged,
+                                     sizeof(packaged), &digest_index) != STATUS_SUCCESS ||
+                     digest_index != i % 3 ||
+                     sim.launch_secret(&blobs[i].godh_cert, &blobs[i].session, blobs[i].policy,
+                                       measure.measure.measurement, &header, packaged,
+                                       sizeof(packaged), decrypted) != STATUS_SUCCESS ||
+                     memcmp(decrypted, secret, sizeof(secret)) != 0;
+        }
+        if (failed)
+            break;
+
+        // FAILURE tests: the guest memory isn't what was expected, a
+        // session can only be measured once, and an unknown session
+        uint8_t wrong_digest[sizeof(approved[0])];
+        memcpy(wrong_digest, approved[0], sizeof(wrong_digest));
+        wrong_digest[0] ^= 0xFF;
+        if (sim.launch_measure(&blobs[0].godh_cert, &blobs[0].session, blobs[0].policy,
+                               wrong_digest, &measure.measure) != STATUS_SUCCESS)
+            break;
+        if (clients[0].measure(session_ids[0], &measure, &header, packaged,
+                               sizeof(packaged)) != ERROR_BAD_MEASUREMENT)
+            break;
+        if (clients[0].measure(session_ids[0], &measure, &header, packaged,
+                               sizeof(packaged)) != ERROR_INVALID_GUEST)
+            break;
+        if (clients[1].measure(session_ids[3], &measure, &header, packaged,
+                               sizeof(packaged)) != ERROR_INVALID_GUEST)
+            break;
+        session_ids[1][sev::ATTEST_SESSION_ID_SIZE - 1] ^= 0xFF;
+        if (clients[1].measure(session_ids[1], &measure, &header, packaged,
+                               sizeof(packaged)) != ERROR_INVALID_GUEST)
+            break;
+        session_ids[1][sev::ATTEST_SESSION_ID_SIZE - 1] ^= 0xFF;
+        if (sim.launch_measure(&blobs[1].godh_cert, &blobs[1].session, blobs[1].policy,
+                               approved[1], &measure.measure) != STATUS_SUCCESS)
+            break;
+        if (clients[1].measure(session_ids[1], &measure, &header, packaged,
+                               sizeof(packaged)) != STATUS_SUCCESS)
+            break;
+
+        // A chain that doesn't validate
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        req->pdh.sig_1.ecdsa.r[0] ^= 0xFF;
+        if (clients[3].start(req, &extra, extra_id) == STATUS_SUCCESS)
+            break;
+        req->pdh.sig_1.ecdsa.r[0] ^= 0xFF;
+
+        // A whole chain under a self-signed ARK of the host's own, with
+        // AMD's key id, that validates by itself
+        if (!attest_start_chain(&forger, forged, forged_ask_ark, &forged_ask_ark_length))
+            break;
+        struct sevtool_cert_chain forged_chain;
+        memcpy(forged_chain.pdh, &forged->pdh, sizeof(sev_cert));
+        memcpy(forged_chain.pek, &forged->pek, sizeof(sev_cert));
+        memcpy(forged_chain.oca, &forged->oca, sizeof(sev_cert));
+        memcpy(forged_chain.cek, &forged->cek, sizeof(sev_cert));
+        memcpy(forged_chain.ask, forged->ask, sizeof(forged_chain.ask));
+        memcpy(forged_chain.ark, forged->ark, sizeof(forged_chain.ark));
+        forged_chain.ask_size = forged->ask_size;
+        forged_chain.ark_size = forged->ark_size;
+        if (sevtool_validate_cert_chain(&forged_chain) != STATUS_SUCCESS)
+            break;
+        if (clients[3].start(forged, &extra, extra_id) != ERROR_INVALID_CERTIFICATE)
+            break;
+        // Or just the ARK swapped out, or cut short
+        memcpy(forged->ark, req->ark, sizeof(forged->ark));
+        if (clients[3].start(forged, &extra, extra_id) != ERROR_INVALID_CERTIFICATE)
+            break;
+        memcpy(forged, req, sizeof(*forged));
+        memcpy(forged->ark, forged_ask_ark + forged->ask_size, forged->ark_size);
+        if (clients[3].start(forged, &extra, extra_id) != ERROR_INVALID_CERTIFICATE)
+            break;
+        forged->ark_size = req->ark_size - 1;
+        memcpy(forged->ark, req->ark, sizeof(forged->ark));
+        if (clients[3].start(forged, &extra, extra_id) != ERROR_INVALID_CERTIFICATE)
+            break;
+
+        // A server with no ASK/ARK to check against doesn't start
+        short_config = config;
+        short_config.ark = NULL;
+        short_server = new sev::AttestServer(&short_config);
+        if (short_server->open())
+            break;
+        delete short_server;
+        short_server = NULL;
+
+        // A session that isn't measured in time is gone
+        short_config = config;
+        short_config.listen = m_output_folder + "attest_short.sock";
+        short_config.session_timeout_ms = 100;
+        short_server = new sev::AttestServer(&short_config);
+        if (!short_server->open())
+            break;
+        short_poller = std::thread([short_server]() { short_server->run(); });
+        sev::AttestClient short_client;
+        if (!short_client.connect(short_config.listen))
+            break;
+        if (short_client.start(req, &extra, extra_id) != STATUS_SUCCESS)
+            break;
+        if (sim.launch_measure(&extra.godh_cert, &extra.session, extra.policy,
+                               approved[1], &measure.measure) != STATUS_SUCCESS)
+            break;
+        std::this_thread::sleep_for(std::chrono::milliseconds(300));
+        if (short_client.measure(extra_id, &measure, &header, packaged,
+                                 sizeof(packaged)) != ERROR_INVALID_GUEST)
             break;
 
-        printf("All tests Succeeded!\n");
         ret = true;
     } while (0);
 
+    if (poller.joinable()) {
+        server->stop();
+        poller.join();
+    }
+    if (short_poller.joinable()) {
+        short_server->stop();
+        short_poller.join();
+    }
+    delete short_server;
+    delete server;
+    delete[] session_ids;
+    delete[] blobs;
+    delete forged;
+    delete req;
+
     return ret;
-}
\ No newline at end of file
+}
+
+/**
+ * Has a simulator of its own sign reports at three TCBs, and checks them
+ * with SNPReportVerifier and then the command. The command's device is a
+ * different simulator instance, but with the same chip secret, so it
+ * serves the same VCEKs
+ */
+bool Tests::test_verify_snp_reports()
+{
+    static constexpr uint32_t NUM_REPORTS = 96;
+    static constexpr size_t TAMPERED = 5;
+    static constexpr size_t BAD_ALGO = 7;
+    static constexpr size_t BAD_CHIP = 9;
+    bool ret = false;
+    SEVSimBackend sim;
+    snp_attestation_report *reports = new snp_attestation_report[NUM_REPORTS];
+    int results[NUM_REPORTS];
+    const uint64_t tcbs[3] = {0x0800000000000003ULL, 0x1100000000000003ULL, 0x1400000000000003ULL};
+    uint8_t ask_ark[sizeof(amd_cert)*2];
+    size_t ask_ark_length = 0;
+    amd_cert ask;
+    amd_cert ark;
+    AMDCert tmp_amd;
+    sev::snp_verify_stats stats;
+
+    do {
+        printf("*Starting verify_snp_reports tests\n");
+
+        if (!sim.open_device())
+            break;
+        uint8_t report_data[64];
+        uint8_t measurement[48];
+        memset(measurement, 0x5A, sizeof(measurement));
+        bool failed = false;
+        for (uint32_t i = 0; i < NUM_REPORTS && !failed; i++) {
+            sev::gen_random_bytes(report_data, sizeof(report_data));
+            failed = sim.snp_guest_report(report_data, measurement, tcbs[i % 3],
+                                          &reports[i]) != STATUS_SUCCESS;
+        }
+        if (failed)
+            break;
+        reports[TAMPERED].measurement[0] ^= 0x01;
+        reports[BAD_ALGO].signature_algo = 2;
+        reports[BAD_CHIP].chip_id[0] ^= 0x01;
+
+        if (sim.kds_get_ask_ark(ask_ark, sizeof(ask_ark), &ask_ark_length) != STATUS_SUCCESS)
+            break;
+        if (tmp_amd.amd_cert_init(&ask, ask_ark) != STATUS_SUCCESS)
+            break;
+        if (tmp_amd.amd_cert_init(&ark, ask_ark + tmp_amd.amd_cert_get_size(&ask)) != STATUS_SUCCESS)
+            break;
+
+        // Nothing verifies without a valid ASK
+        sev::SNPReportVerifier verifier(&sim);
+        if (verifier.verify(&reports[0]) != ERROR_INVALID_CERTIFICATE)
+            break;
+        ask.sig.short_len[0] ^= 0xFF;
+        if (verifier.set_amd_chain(&ask, &ark) == STATUS_SUCCESS)
+            break;
+        ask.sig.short_len[0] ^= 0xFF;
+        if (verifier.set_amd_chain(&ask, &ark) != STATUS_SUCCESS)
+            break;
+
+        // One VCEK fetch per TCB, plus the unknown chip's, however many
+        // threads want it at once
+        if (verifier.verify_batch(reports, NUM_REPORTS, results, 4, &stats) == STATUS_SUCCESS)
+            break;
+        for (size_t i = 0; i < NUM_REPORTS && !failed; i++) {
+            int expected = (i == TAMPERED) ? ERROR_BAD_SIGNATURE :
+                           (i == BAD_ALGO) ? ERROR_UNSUPPORTED :
+                           (i == BAD_CHIP) ? ERROR_INVALID_PARAM : STATUS_SUCCESS;
+            failed = results[i] != expected;
+        }
+        if (failed)
+            break;
+        if (stats.reports != NUM_REPORTS || stats.verified != NUM_REPORTS - 3 ||
+            stats.failed != 3 || stats.vcek_fetches != 4 || stats.threads != 4)
+            break;
+
+        // All from the cache the second time, except the unknown chip's.
+        // Its fetch failed, so it isn't cached
+        if (verifier.verify_batch(reports, NUM_REPORTS, results, 2, &stats) == STATUS_SUCCESS)
+            break;
+        if (stats.verified != NUM_REPORTS - 3 || stats.vcek_fetches != 1 ||
+            stats.vcek_hits != NUM_REPORTS - 2)
+            break;
+
+        // The command needs the simulator's KDS for the VCEKs
+        if (SEVDevice::get_backend_type() != SEV_BACKEND_SIM) {
+            ret = true;
+            break;
+        }
+        Command cmd(m_output_folder, m_verbose_flag);
+        std::string report_file = m_output_folder + "snp_reports.bin";
+        std::string results_file = m_output_folder + SNP_VERIFY_FILENAME;
+        char results_buf[16*NUM_REPORTS];
+        if (sev::write_file(report_file, reports, 8*sizeof(snp_attestation_report)) !=
+            8*sizeof(snp_attestation_report))
+            break;
+        if (cmd.verify_snp_reports(report_file) == STATUS_SUCCESS)
+            break;
+        size_t length = sev::read_file(results_file, results_buf, sizeof(results_buf) - 1);
+        results_buf[length] = '\0';
+        if (!strstr(results_buf, "5 fail 0x0a\n") || !strstr(results_buf, "7 fail 0x15\n") ||
+            !strstr(results_buf, "6 ok 0x00\n"))
+            break;
+
+        if (sev::write_file(report_file, reports, 5*sizeof(snp_attestation_report)) !=
+            5*sizeof(snp_attestation_report))
+            break;
+        if (cmd.verify_snp_reports(report_file, 3) != STATUS_SUCCESS)
+            break;
+
+        printf("Running a negative/failure test. Should print an 'Error'\n");
+        if (sev::write_file(report_file, reports, 100) != 100)
+            break;
+        if (cmd.verify_snp_reports(report_file) != ERROR_INVALID_LENGTH)
+            break;
+
+        ret = true;
+    } while (0);
+
+    delete[] reports;
+
+    return ret;
+}
+
+// No 16 byte piece of bytes turns up twice
+static bool all_distinct(const uint8_t *bytes, size_t size)
+{
+    std::set<std::string> seen;
+    for (size_t i = 0; i + 16 <= size; i += 16) {
+        if (!seen.insert(std::string((const char *)bytes + i, 16)).second)
+            return false;
+    }
+    return true;
+}
+
+// A forked child's draw, and how many times it had seeded by then
+static bool csprng_child(int fd)
+{
+    uint8_t out[32 + sizeof(uint64_t)];
+    sev::csprng_stats stats;
+
+    if (!sev::random_bytes(out, 32))
+        return false;
+    sev::csprng_get_stats(&stats);
+    memcpy(out + 32, &stats.reseeds, sizeof(stats.reseeds));
+    return write(fd, out, sizeof(out)) == (ssize_t)sizeof(out);
+}
+
+// Needs a thread of its own: the stats are this thread's, from zero
+static bool csprng_checks(void)
+{
+    bool ret = false;
+    const size_t draws_size = 4*sev::CSPRNG_BLOCK_SIZE;
+    const size_t bulk_size = 1024*1024;
+    uint8_t *draws = new uint8_t[draws_size];
+    uint8_t *bulk = new uint8_t[bulk_size];
+    sev::csprng_stats stats;
+    size_t used = 0;
+    int fds[2] = {-1, -1};
+    pid_t pid = -1;
+
+    do {
+        // The first draw seeds it and fills a block, and the small draws
+        // after it are copies out of the same block
+        bool failed = false;
+        for (size_t i = 0; i < 64 && !failed; i++, used += 16)
+            failed = !sev::random_bytes(draws + used, 16);
+        sev::csprng_get_stats(&stats);
+        if (failed || stats.reseeds != 1 || stats.refills != 1 || stats.bytes != used)
+            break;
+
+        // A batch is generated straight into the caller's buffer, and the
+        // small draws after it carry on from the block, into a new one
+        if (!sev::random_bytes(draws + used, 2*sev::CSPRNG_BLOCK_SIZE))
+            break;
+        used += 2*sev::CSPRNG_BLOCK_SIZE;
+        sev::csprng_get_stats(&stats);
+        if (stats.refills != 1)
+            break;
+        for (size_t i = 0; i < 200 && !failed; i++, used += 16)
+            failed = !sev::random_bytes(draws + used, 16);
+        sev::csprng_get_stats(&stats);
+        if (failed || stats.refills != 2 || stats.bytes != used)
+            break;
+        if (!all_distinct(draws, used))
+            break;
+
+        // Reseeded from the OS once CSPRNG_RESEED_BYTES have been served
+        // since the last seed, and not before
+        while (stats.bytes < sev::CSPRNG_RESEED_BYTES && !failed) {
+            size_t size = (size_t)std::min((uint64_t)bulk_size, sev::CSPRNG_RESEED_BYTES - stats.bytes);
+            failed = !sev::random_bytes(bulk, size);
+            sev::csprng_get_stats(&stats);
+        }
+        if (failed || stats.reseeds != 1)
+            break;
+        if (!sev::random_bytes(draws, 16))
+            break;
+        sev::csprng_get_stats(&stats);
+        if (stats.reseeds != 2)
+            break;
+
+        // The child reseeds before its first draw, so it can't hand out
+        // what the parent does next
+        if (pipe(fds) != 0)
+            break;
+        pid = fork();
+        if (pid == 0)
+            _exit(csprng_child(fds[1]) ? 0 : 1);
+        if (pid < 0)
+            break;
+        close(fds[1]);
+        fds[1] = -1;
+        uint8_t parent[32];
+        uint8_t child[32 + sizeof(uint64_t)];
+        uint64_t child_reseeds = 0;
+        if (!sev::random_bytes(parent, sizeof(parent)))
+            break;
+        struct pollfd pfd = {fds[0], POLLIN, 0};
+        if (poll(&pfd, 1, 10000) != 1 || read(fds[0], child, sizeof(child)) != (ssize_t)sizeof(child))
+            break;
+        memcpy(&child_reseeds, child + 32, sizeof(child_reseeds));
+        if (memcmp(parent, child, sizeof(parent)) == 0 || child_reseeds != stats.reseeds + 1)
+            break;
+        sev::csprng_get_stats(&stats);
+        if (stats.reseeds != 2)
+            break;
+
+        ret = true;
+    } while (0);
+
+    if (pid > 0) {
+        int status = 0;
+        kill(pid, SIGKILL);     // If it's stuck. It's finished otherwise
+        waitpid(pid, &status, 0);
+    }
+    if (fds[0] >= 0)
+        close(fds[0]);
+    if (fds[1] >= 0)
+        close(fds[1]);
+    delete[] bulk;
+    delete[] draws;
+    return ret;
+}
+
+/**
+ * The CSPRNG behind gen_random_bytes: small draws come out of a block,
+ * batches skip it, nothing repeats between the two, it reseeds after
+ * CSPRNG_RESEED_BYTES, and a forked child never repeats its parent
+ */
+bool Tests::test_csprng()
+{
+    bool ret = false;
+
+    printf("*Starting csprng tests\n");
+
+    // On a new thread, so its stats only count these draws
+    std::thread checks([&ret]() { ret = csprng_checks(); });
+    checks.join();
+
+    return ret;
+}
+#endif
+
+/**
+ * Creates a scratch folder for one test inside the --ofolder folder.
+ * Returns the path with a trailing '/', or "" if it couldn't be made
+ */
+static std::string make_test_folder(const std::string base, const char *test_name)
+{
+    std::string path = base + "sevtool_" + test_name + ".XXXXXX";
+    char *buf = new char[path.size() + 1];
+    memcpy(buf, path.c_str(), path.size() + 1);
+
+    std::string folder = "";
+    if (mkdtemp(buf))
+        folder = std::string(buf) + "/";
+    delete[] buf;
+    return folder;
+}
+
+static int remove_entry(const char *path, const struct stat *sb, int type, struct FTW *ftw)
+{
+    (void)sb; (void)type; (void)ftw;
+    return remove(path);
+}
+
+// Deletes a test's scratch folder and everything in it
+static bool remove_test_folder(const std::string folder)
+{
+    return nftw(folder.c_str(), remove_entry, 16, FTW_DEPTH | FTW_PHYS) == 0;
+}
+
+/**
+ * Runs one test in its own scratch folder, which is deleted afterwards if
+ * the test passed (and kept for debugging if it didn't)
+ */
+static void run_test(const test_case *test, test_result *result,
+                     const std::string base_folder, int verbose_flag)
+{
+    uint64_t start = sev::Metrics::now_ns();
+
+    result->passed = false;
+    result->folder = make_test_folder(base_folder, test->name);
+    if (result->folder.empty()) {
+        printf("Error: unable to create a scratch folder for %s in %s\n",
+               test->name, base_folder.c_str());
+    }
+    else {
+        Tests tests(result->folder, verbose_flag);
+        result->passed = (tests.*(test->fn))();
+        if (result->passed && remove_test_folder(result->folder))
+            result->folder = "";
+    }
+
+    result->duration_ns = sev::Metrics::now_ns() - start;
+}
+
+/**
+ * Tests that change the Platform state (owner, PEK, PDH, pending CSR) run one
+ * at a time, in order, while holding the device lock exclusively. Everything
+ * else only reads from the Platform, so it runs in parallel on the worker
+ * threads, each holding the lock shared
+ */
+bool Tests::test_all()
+{
+    bool ret = false;
+    test_result results[sizeof(test_cases)/sizeof(test_cases[0])];
+    size_t num_tests = sizeof(test_cases)/sizeof(test_cases[0]);
+    std::atomic<size_t> next_test(0);
+    unsigned int num_workers = std::max(2u, std::thread::hardware_concurrency());
+
+    printf("Starting self-tests\n");
+    printf("Note: Positive and negative self-tests will be run,\n" \
+           "      The word 'Error' is part of some negative tests.\n" \
+           "      Tests that don't change the Platform state run in \n" \
+           "      parallel, so their output may be interleaved. Each \n" \
+           "      test gets its own folder in the output folder, which \n" \
+           "      is kept if the test fails. A successful run will say \n" \
+           "      'All tests Succeeded' at the bottom.\n");
+
+    uint64_t start = sev::Metrics::now_ns();
+
+    // The Platform-mutating tests, in order, behind the device lock
+    std::thread mutator([&]() {
+        for (size_t i = 0; i < num_tests; i++) {
+            if (!test_cases[i].mutates_platform)
+                continue;
+            std::unique_lock<std::shared_mutex> lock(m_device_lock);
+            run_test(&test_cases[i], &results[i], m_output_folder, m_verbose_flag);
+        }
+    });
+
+    // Everything else, on whichever worker is free
+    std::thread *workers = new std::thread[num_workers];
+    for (unsigned int w = 0; w < num_workers; w++) {
+        workers[w] = std::thread([&]() {
+            size_t i;
+            while ((i = next_test.fetch_add(1)) < num_tests) {
+                if (test_cases[i].mutates_platform)
+                    continue;
+                std::shared_lock<std::shared_mutex> lock(m_device_lock);
+                run_test(&test_cases[i], &results[i], m_output_folder, m_verbose_flag);
+            }
+        });
+    }
+
+    mutator.join();
+    for (unsigned int w = 0; w < num_workers; w++)
+        workers[w].join();
+    delete[] workers;
+
+    uint64_t wall_ns = sev::Metrics::now_ns() - start;
+    uint64_t test_ns = 0;
+    size_t failures = 0;
+
+    printf("\n%-24s %-10s %10s\n", "test", "result", "time(s)");
+    for (size_t i = 0; i < num_tests; i++) {
+        test_ns += results[i].duration_ns;
+        if (!results[i].passed)
+            failures++;
+        printf("%-24s %-10s %10.3f%s%s\n", test_cases[i].name,
+               results[i].passed ? "passed" : "FAILED",
+               (double)results[i].duration_ns / 1e9,
+               results[i].folder.empty() ? "" : "  kept ",
+               results[i].folder.c_str());
+    }
+    printf("Suite wall time: %.3f s (%.3f s of tests, %u workers + 1 for the " \
+           "Platform-mutating tests)\n", (double)wall_ns / 1e9, (double)test_ns / 1e9,
+           num_workers);
+
+    if (failures == 0) {
+        printf("All tests Succeeded!\n");
+        ret = true;
+    }
+    else {
+        printf("%zu test(s) failed\n", failures);
+    }
+
+    return ret;
+}
@@ -17,12 +17,18 @@
 #ifndef TESTS_H
 #define TESTS_H
 
+#include <shared_mutex>
+#include <string>
+
 class Tests {
 private:
     std::string m_output_folder = "";
     int m_verbose_flag = 0;
 
-    bool clear_output_folder();
+    // Held exclusively by the tests that change the Platform state, and
+    // shared by the ones that only read it, so nothing reads the Platform
+    // while a PEK/PDH is being rotated
+    static std::shared_mutex m_device_lock;
 
 public:
     Tests(std::string output_folder, int verbose_flag);
@@ -42,9 +48,20 @@ public:
     bool test_get_ask_ark(void);
     bool test_export_cert_chain(void);
     bool test_calc_measurement(void);
+    bool test_calc_launch_digest(void);
     bool test_validate_cert_chain(void);
     bool test_generate_launch_blob(void);
+    bool test_secure_arena(void);
     bool test_package_secret(void);
+    bool test_package_secret_table(void);
+    bool test_package_secret_fanout(void);
+    bool test_package_migration(void);
+    bool test_verify_migration(void);
+#ifdef __linux__
+    bool test_attest_server(void);
+    bool test_verify_snp_reports(void);
+    bool test_csprng(void);
+#endif
     bool test_all();
 };
 
@@ -15,10 +15,23 @@
  **************************************************************************/
 
 #include "utilities.h"
+#include "csprng.h"
+#include <atomic>
+#include <cerrno>
 #include <climits>
-#include <fstream>
-#include <stdio.h>
 #include <cstring>      // memcpy
+#include <fcntl.h>      // for open
+#include <stdio.h>
+#include <sys/mman.h>   // for mmap
+#include <sys/stat.h>   // for fstat
+#include <unistd.h>     // for pwrite, fsync
+#include <openssl/crypto.h> // for OPENSSL_cleanse
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#endif
+#endif
 
 bool sev::execute_system_command(const std::string cmd, std::string *log)
 {
@@ -48,54 +61,40 @@ bool sev::execute_system_command(const std::string cmd, std::string *log)
  */
 size_t sev::read_file(const std::string file_name, void *buffer, size_t len)
 {
-    std::ifstream file(file_name, std::ios::binary);
-    if (len > INT_MAX) {
-        printf("read_file Error: Input length too long\n");
+    int fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "read_file Error: Could not open file. "
+                        "Ensure directory and file exists\n"
+                        "  file_name: %s\n", file_name.c_str());
         return 0;
     }
-    std::streamsize slen = (std::streamsize)len;
 
-    if (!file.is_open()) {
-        printf("read_file Error: Could not open file. "
-               "Ensure directory and file exists\n"
-               "  file_name: %s\n", file_name.c_str());
-        return 0;
+    size_t count = 0;
+    while (count < len) {
+        ssize_t ret = ::read(fd, (uint8_t *)buffer + count, len - count);
+        if (ret < 0 && errno == EINTR)
+            continue;
+        if (ret <= 0)
+            break;
+        count += (size_t)ret;
     }
-
-    file.read((char *)buffer, slen);
-    size_t count = (size_t)file.gcount();
-    file.close();
+    ::close(fd);
 
     return count;
 }
 
 /**
- * Writes len bytes from the beginning of a file. Does NOT append
- * Returns number of bytes written, or 0 if the file couldn't be opened.
- * ostream CANNOT create a folder, so it has to exist already, to succeed
+ * Replaces the file with len bytes of buffer. Does NOT append
+ * Returns number of bytes written, or 0 if the file couldn't be written.
+ * The folder has to exist already, to succeed
  */
 size_t sev::write_file(const std::string file_name, const void *buffer, size_t len)
 {
-    std::ofstream file(file_name, std::ofstream::out);
-    if (len > INT_MAX) {
-        printf("write_file Error: Input length too long\n");
-        return 0;
-    }
-    std::streamsize slen = (std::streamsize)len;
+    FileWriteBatch batch;
 
-    if (!file.is_open()) {
-        printf("write_file Error: Could not open/create file. " \
-               "Ensure directory exists\n" \
-               "  Filename: %s\n", file_name.c_str());
+    if (!batch.add(file_name, buffer, len) || !batch.commit())
         return 0;
-    }
-    printf("Writing to file: %s\n", file_name.c_str());
-
-    file.write((char *)buffer, slen);
-    size_t count = (size_t)file.tellp();
-    file.close();
-
-    return count;
+    return len;
 }
 
 /**
@@ -104,24 +103,458 @@ size_t sev::write_file(const std::string file_name, const void *buffer, size_t l
  */
 size_t sev::get_file_size(const std::string file_name)
 {
-    std::ifstream file(file_name, std::ios::binary | std::ios::ate);
+    struct stat file_stat;
 
-    if (!file.is_open()) {
+    if (stat(file_name.c_str(), &file_stat) != 0)
         return 0;
+
+    return (size_t)file_stat.st_size;
+}
+
+static void stat_to_identity(const struct stat *file_stat, sev::file_identity *id)
+{
+    id->device = (uint64_t)file_stat->st_dev;
+    id->inode = (uint64_t)file_stat->st_ino;
+    id->size = (uint64_t)file_stat->st_size;
+    id->mtime_ns = (int64_t)file_stat->st_mtim.tv_sec * 1000000000LL + file_stat->st_mtim.tv_nsec;
+}
+
+bool sev::get_file_identity(const std::string file_name, file_identity *id)
+{
+    struct stat file_stat;
+
+    if (stat(file_name.c_str(), &file_stat) != 0 || !S_ISREG(file_stat.st_mode))
+        return false;
+    stat_to_identity(&file_stat, id);
+    return true;
+}
+
+bool sev::FileView::open(const std::string file_name)
+{
+    struct stat file_stat;
+    bool ret = false;
+
+    close();
+
+    int fd = ::open(file_name.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        fprintf(stderr, "Error: Could not open file %s\n", file_name.c_str());
+        return false;
     }
 
-    size_t count = (size_t)file.tellg();
-    file.close();
+    do {
+        if (fstat(fd, &file_stat) != 0)
+            break;
+        stat_to_identity(&file_stat, &m_identity);
+        m_size = (size_t)file_stat.st_size;
+        if (m_size == 0) {
+            ret = true;
+            break;
+        }
 
-    return count;
+        if (m_size >= FILE_MMAP_THRESHOLD) {
+            void *map = mmap(NULL, m_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (map == MAP_FAILED)
+                break;
+            m_data = (uint8_t *)map;
+            m_mapped = true;
+            ret = true;
+            break;
+        }
+
+        m_data = new uint8_t[m_size];
+        size_t count = 0;
+        while (count < m_size) {
+            ssize_t read_ret = ::read(fd, m_data + count, m_size - count);
+            if (read_ret < 0 && errno == EINTR)
+                continue;
+            if (read_ret <= 0)
+                break;
+            count += (size_t)read_ret;
+        }
+        ret = (count == m_size);
+    } while (0);
+
+    ::close(fd);
+    if (!ret)
+        close();
+    return ret;
+}
+
+void sev::FileView::close(void)
+{
+    if (m_mapped) {
+        munmap(m_data, m_size);
+    }
+    else if (m_data) {
+        // Small files are read into a copy, which may hold a secret
+        OPENSSL_cleanse(m_data, m_size);
+        delete[] m_data;
+    }
+    m_data = NULL;
+    m_size = 0;
+    m_mapped = false;
+}
+
+bool sev::FileMapWriter::open(const std::string file_name, size_t size)
+{
+    static std::atomic<uint32_t> temp_counter(0);
+
+    discard();
+    m_file_name = file_name;
+    m_temp_name = file_name + ".tmp." + std::to_string(getpid()) + ".m" +
+                  std::to_string(temp_counter++);
+    m_fd = ::open(m_temp_name.c_str(), O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+    if (m_fd < 0) {
+        fprintf(stderr, "write_file Error: Could not open/create file. " \
+                        "Ensure directory exists\n" \
+                        "  Filename: %s\n", file_name.c_str());
+        m_temp_name = "";
+        return false;
+    }
+    if (size > 0 && posix_fallocate(m_fd, 0, (off_t)size) != 0) {
+        fprintf(stderr, "write_file Error: No room for %zu bytes of %s\n", size, file_name.c_str());
+        discard();
+        return false;
+    }
+    m_size = size;
+    return true;
+}
+
+void sev::FileMapWriter::unmap(void)
+{
+    if (m_map)
+        munmap(m_map, m_map_size);
+    m_map = NULL;
+    m_map_size = 0;
+}
+
+uint8_t *sev::FileMapWriter::map(size_t offset, size_t len)
+{
+    const size_t page_size = (size_t)sysconf(_SC_PAGESIZE);
+
+    unmap();
+    if (m_fd < 0 || len == 0 || offset > m_size || len > m_size - offset)
+        return NULL;
+
+    // mmap wants a page aligned offset, so map from the page the window is in
+    size_t start = offset - offset % page_size;
+    void *map = mmap(NULL, len + (offset - start), PROT_READ | PROT_WRITE, MAP_SHARED,
+                     m_fd, (off_t)start);
+    if (map == MAP_FAILED)
+        return NULL;
+    m_map = (uint8_t *)map;
+    m_map_size = len + (offset - start);
+    return m_map + (offset - start);
+}
+
+bool sev::FileMapWriter::commit(void)
+{
+    bool ret = false;
+
+    unmap();
+    if (m_fd < 0)
+        return false;
+
+    do {
+        if (fsync(m_fd) != 0)
+            break;
+        ::close(m_fd);
+        m_fd = -1;
+        if (rename(m_temp_name.c_str(), m_file_name.c_str()) != 0) {
+            fprintf(stderr, "write_file Error: Could not replace %s\n", m_file_name.c_str());
+            break;
+        }
+        m_temp_name = "";
+
+        // Make the rename durable
+        size_t slash = m_file_name.find_last_of('/');
+        std::string folder = (slash == std::string::npos) ? "." : m_file_name.substr(0, slash + 1);
+        int dir_fd = ::open(folder.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            ::close(dir_fd);
+        }
+        ret = true;
+    } while (0);
+
+    discard();
+    return ret;
+}
+
+/**
+ * Removes the temp file, if it wasn't renamed
+ */
+void sev::FileMapWriter::discard(void)
+{
+    unmap();
+    if (m_fd >= 0)
+        ::close(m_fd);
+    if (!m_temp_name.empty())
+        unlink(m_temp_name.c_str());
+    m_fd = -1;
+    m_size = 0;
+    m_temp_name = "";
+}
+
+bool sev::FileWriteBatch::add(const std::string file_name, const void *buffer, size_t len)
+{
+    if (m_count == FILE_BATCH_MAX_WRITES) {
+        fprintf(stderr, "write_file Error: Too many files in one batch\n");
+        return false;
+    }
+
+    pending_write *write = &m_writes[m_count];
+    write->file_name = file_name;
+    write->temp_name = "";
+    write->data = new uint8_t[len ? len : 1];
+    write->len = len;
+    write->fd = -1;
+    if (len)
+        memcpy(write->data, buffer, len);
+    m_count++;
+
+    return true;
+}
+
+/**
+ * Plain write + fsync of every temp file. Also the fallback when io_uring
+ * isn't there, so it always starts from the beginning of each file
+ */
+bool sev::FileWriteBatch::write_all(void)
+{
+    for (size_t i = 0; i < m_count; i++) {
+        pending_write *write = &m_writes[i];
+        size_t count = 0;
+        while (count < write->len) {
+            ssize_t ret = pwrite(write->fd, write->data + count, write->len - count, (off_t)count);
+            if (ret < 0 && errno == EINTR)
+                continue;
+            if (ret <= 0)
+                return false;
+            count += (size_t)ret;
+        }
+        if (fsync(write->fd) != 0)
+            return false;
+    }
+    return true;
+}
+
+#if defined(__linux__) && defined(IORING_FEAT_RW_CUR_POS)     // IORING_OP_WRITE, Linux 5.6
+/**
+ * Queues a write linked to an fsync for every temp file, submits them all
+ * with one io_uring_enter and waits for the completions. Returns false if
+ * io_uring isn't available or anything failed, and the caller falls back
+ * to write_all()
+ */
+bool sev::FileWriteBatch::write_all_io_uring(void)
+{
+    struct io_uring_params params;
+    unsigned entries = (unsigned)(m_count*2);
+    bool ret = false;
+
+    for (size_t i = 0; i < m_count; i++) {
+        if (m_writes[i].len > UINT32_MAX)
+            return false;
+    }
+
+    memset(&params, 0, sizeof(params));
+    int ring_fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+    if (ring_fd < 0)
+        return false;
+
+    size_t sq_length = params.sq_off.array + params.sq_entries*sizeof(unsigned);
+    size_t cq_length = params.cq_off.cqes + params.cq_entries*sizeof(struct io_uring_cqe);
+    bool single_mmap = (params.features & IORING_FEAT_SINGLE_MMAP) != 0;
+    if (single_mmap && cq_length > sq_length)
+        sq_length = cq_length;
+    size_t sqes_length = params.sq_entries*sizeof(struct io_uring_sqe);
+
+    uint8_t *sq_ring = (uint8_t *)mmap(NULL, sq_length, PROT_READ | PROT_WRITE,
+                                       MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQ_RING);
+    uint8_t *cq_ring = (uint8_t *)MAP_FAILED;
+    struct io_uring_sqe *sqes = (struct io_uring_sqe *)MAP_FAILED;
+
+    do {
+        if (sq_ring == (uint8_t *)MAP_FAILED)
+            break;
+        cq_ring = single_mmap ? sq_ring :
+                  (uint8_t *)mmap(NULL, cq_length, PROT_READ | PROT_WRITE,
+                                  MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_CQ_RING);
+        if (cq_ring == (uint8_t *)MAP_FAILED)
+            break;
+        sqes = (struct io_uring_sqe *)mmap(NULL, sqes_length, PROT_READ | PROT_WRITE,
+                                           MAP_SHARED | MAP_POPULATE, ring_fd, IORING_OFF_SQES);
+        if (sqes == (struct io_uring_sqe *)MAP_FAILED)
+            break;
+
+        unsigned *sq_tail  = (unsigned *)(sq_ring + params.sq_off.tail);
+        unsigned *sq_mask  = (unsigned *)(sq_ring + params.sq_off.ring_mask);
+        unsigned *sq_array = (unsigned *)(sq_ring + params.sq_off.array);
+        unsigned *cq_head  = (unsigned *)(cq_ring + params.cq_off.head);
+        unsigned *cq_tail  = (unsigned *)(cq_ring + params.cq_off.tail);
+        unsigned *cq_mask  = (unsigned *)(cq_ring + params.cq_off.ring_mask);
+        struct io_uring_cqe *cqes = (struct io_uring_cqe *)(cq_ring + params.cq_off.cqes);
+
+        // user_data is the index into m_writes, times 2, +1 for the fsync
+        unsigned tail = *sq_tail;
+        for (size_t i = 0; i < m_count; i++) {
+            for (unsigned op = 0; op < 2; op++) {
+                unsigned index = tail & *sq_mask;
+                struct io_uring_sqe *sqe = &sqes[index];
+                memset(sqe, 0, sizeof(*sqe));
+                sqe->fd = m_writes[i].fd;
+                sqe->user_data = i*2 + op;
+                if (op == 0) {
+                    sqe->opcode = IORING_OP_WRITE;
+                    sqe->flags = IOSQE_IO_LINK;     // The fsync waits for the write
+                    sqe->addr = (uint64_t)(uintptr_t)m_writes[i].data;
+                    sqe->len = (uint32_t)m_writes[i].len;
+                }
+                else {
+                    sqe->opcode = IORING_OP_FSYNC;
+                }
+                sq_array[index] = index;
+                tail++;
+            }
+        }
+        __atomic_store_n(sq_tail, tail, __ATOMIC_RELEASE);
+
+        if (syscall(__NR_io_uring_enter, ring_fd, entries, entries,
+                    IORING_ENTER_GETEVENTS, NULL, 0) != (long)entries)
+            break;
+
+        unsigned completed = 0;
+        bool failed = false;
+        while (completed < entries) {
+            unsigned head = *cq_head;
+            if (head == __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE)) {
+                if (syscall(__NR_io_uring_enter, ring_fd, 0, entries - completed,
+                            IORING_ENTER_GETEVENTS, NULL, 0) < 0 && errno != EINTR) {
+                    failed = true;
+                    break;
+                }
+                continue;
+            }
+            struct io_uring_cqe *cqe = &cqes[head & *cq_mask];
+            size_t write_index = (size_t)(cqe->user_data/2);
+            bool is_write = (cqe->user_data % 2) == 0;
+            if ((is_write && cqe->res != (int32_t)m_writes[write_index].len) ||
+                (!is_write && cqe->res != 0))
+                failed = true;
+            __atomic_store_n(cq_head, head + 1, __ATOMIC_RELEASE);
+            completed++;
+        }
+        ret = !failed;
+    } while (0);
+
+    if (sqes != (struct io_uring_sqe *)MAP_FAILED)
+        munmap(sqes, sqes_length);
+    if (!single_mmap && cq_ring != (uint8_t *)MAP_FAILED)
+        munmap(cq_ring, cq_length);
+    if (sq_ring != (uint8_t *)MAP_FAILED)
+        munmap(sq_ring, sq_length);
+    ::close(ring_fd);
+
+    return ret;
+}
+#else
+bool sev::FileWriteBatch::write_all_io_uring(void)
+{
+    return false;
+}
+#endif
+
+bool sev::FileWriteBatch::commit(void)
+{
+    static std::atomic<uint32_t> temp_counter(0);
+    bool ret = true;
+
+    // Temp files go next to the real ones, so the rename stays in one folder
+    for (size_t i = 0; i < m_count && ret; i++) {
+        pending_write *write = &m_writes[i];
+        write->temp_name = write->file_name + ".tmp." + std::to_string(getpid()) +
+                           "." + std::to_string(temp_counter++);
+        write->fd = ::open(write->temp_name.c_str(),
+                           O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0644);
+        if (write->fd < 0) {
+            fprintf(stderr, "write_file Error: Could not open/create file. " \
+                            "Ensure directory exists\n" \
+                            "  Filename: %s\n", write->file_name.c_str());
+            write->temp_name = "";
+            ret = false;
+        }
+    }
+
+    if (ret && !(m_count >= FILE_BATCH_URING_MIN && write_all_io_uring()))
+        ret = write_all();
+
+    for (size_t i = 0; i < m_count; i++) {
+        if (m_writes[i].fd >= 0)
+            ::close(m_writes[i].fd);
+        m_writes[i].fd = -1;
+    }
+
+    for (size_t i = 0; i < m_count && ret; i++) {
+        if (rename(m_writes[i].temp_name.c_str(), m_writes[i].file_name.c_str()) != 0) {
+            fprintf(stderr, "write_file Error: Could not replace %s\n", m_writes[i].file_name.c_str());
+            ret = false;
+            break;
+        }
+        m_writes[i].temp_name = "";
+    }
+
+    // Make the renames durable, once per folder
+    for (size_t i = 0; i < m_count && ret; i++) {
+        size_t slash = m_writes[i].file_name.find_last_of('/');
+        std::string folder = (slash == std::string::npos) ? "." :
+                             m_writes[i].file_name.substr(0, slash + 1);
+        bool seen = false;
+        for (size_t j = 0; j < i && !seen; j++) {
+            size_t prev_slash = m_writes[j].file_name.find_last_of('/');
+            std::string prev_folder = (prev_slash == std::string::npos) ? "." :
+                                      m_writes[j].file_name.substr(0, prev_slash + 1);
+            seen = (prev_folder == folder);
+        }
+        if (seen)
+            continue;
+
+        int dir_fd = ::open(folder.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (dir_fd >= 0) {
+            fsync(dir_fd);
+            ::close(dir_fd);
+        }
+    }
+
+    discard();
+    return ret;
 }
 
-void sev::gen_random_bytes(void *bytes, size_t num_bytes)
+/**
+ * Removes any temp files that weren't renamed and drops the pending writes
+ */
+void sev::FileWriteBatch::discard(void)
 {
-    uint8_t *addr = (uint8_t *)bytes;
-    while (num_bytes--) {
-        *addr++ = (uint8_t)(rand() & 0xff);
+    for (size_t i = 0; i < m_count; i++) {
+        if (m_writes[i].fd >= 0)
+            ::close(m_writes[i].fd);
+        if (!m_writes[i].temp_name.empty())
+            unlink(m_writes[i].temp_name.c_str());
+        // The payloads can be key material (tmp_tk.bin) or secrets, so
+        // they don't go back to the heap as they are
+        if (m_writes[i].data)
+            OPENSSL_cleanse(m_writes[i].data, m_writes[i].len);
+        delete[] m_writes[i].data;
+        m_writes[i].data = NULL;
+        m_writes[i].temp_name = "";
+        m_writes[i].fd = -1;
     }
+    m_count = 0;
+}
+
+bool sev::gen_random_bytes(void *bytes, size_t num_bytes)
+{
+    return random_bytes(bytes, num_bytes);
 }
 
 bool sev::verify_access(uint8_t *buf, size_t len)
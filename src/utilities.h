@@ -17,6 +17,8 @@
 #ifndef UTILITIES_H
 #define UTILITIES_H
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
 namespace sev
@@ -74,8 +76,8 @@ namespace sev
     size_t read_file(const std::string file_name, void *buffer, size_t len);
 
     /**
-     * Truncate and write (not append) a file from the beginning
-     * Returns number of bytes written
+     * Replace a file with len bytes of buffer, atomically (a FileWriteBatch
+     * of one file). Returns number of bytes written
      */
     size_t write_file(const std::string file_name, const void *buffer, size_t len);
 
@@ -85,10 +87,126 @@ namespace sev
      */
     size_t get_file_size(const std::string file_name);
 
+    constexpr size_t FILE_MMAP_THRESHOLD   = 64*1024;   // FileView mmaps files this big or bigger
+    constexpr size_t FILE_BATCH_MAX_WRITES = 16;
+    constexpr size_t FILE_BATCH_URING_MIN  = 2;         // Fewer writes than this skip io_uring
+
+    // Which file, and which version of it, for caching things worked out from its contents
+    struct file_identity {
+        uint64_t device;
+        uint64_t inode;
+        uint64_t size;
+        int64_t  mtime_ns;
+    };
+
+    bool get_file_identity(const std::string file_name, file_identity *id);
+
+    /**
+     * A whole file, read only, from a single open+fstat. Files of at least
+     * FILE_MMAP_THRESHOLD bytes are mmap'd, smaller ones are read in.
+     * Ex) FileView secret; if (secret.open(name)) use(secret.data(), secret.size());
+     */
+    class FileView {
+    private:
+        uint8_t *m_data;
+        size_t m_size;
+        bool m_mapped;
+        file_identity m_identity;
+
+        FileView(const FileView&) = delete;
+        FileView& operator=(const FileView&) = delete;
+
+    public:
+        FileView(void) : m_data(NULL), m_size(0), m_mapped(false), m_identity() {}
+        ~FileView(void) { close(); }
+
+        bool open(const std::string file_name);
+        void close(void);
+        const uint8_t *data(void) const { return m_data; }
+        size_t size(void) const { return m_size; }
+        bool mapped(void) const { return m_mapped; }
+        // As of the open, so it matches the data
+        const file_identity &identity(void) const { return m_identity; }
+    };
+
+    /**
+     * A new file of a known size, written in place through a shared mapping
+     * of one window of it at a time, so it never has to fit in memory. The
+     * space is allocated up front, so a full disk fails open() instead of
+     * faulting on a write. It's a temp file next to file_name until
+     * commit() fsyncs it and renames it over file_name; otherwise it's
+     * removed.
+     * Ex) FileMapWriter out; out.open(name, size);
+     *     uint8_t *window = out.map(offset, len); fill(window, len);
+     *     out.commit();
+     */
+    class FileMapWriter {
+    private:
+        std::string m_file_name;
+        std::string m_temp_name;
+        int m_fd;
+        size_t m_size;
+        uint8_t *m_map;             // Page aligned, at or before the window
+        size_t m_map_size;
+
+        void unmap(void);
+
+        FileMapWriter(const FileMapWriter&) = delete;
+        FileMapWriter& operator=(const FileMapWriter&) = delete;
+
+    public:
+        FileMapWriter(void) : m_fd(-1), m_size(0), m_map(NULL), m_map_size(0) {}
+        ~FileMapWriter(void) { discard(); }
+
+        bool open(const std::string file_name, size_t size);
+        // len bytes at offset, which needn't be aligned. Unmaps the last window
+        uint8_t *map(size_t offset, size_t len);
+        bool commit(void);
+        void discard(void);
+    };
+
+    /**
+     * The files one command writes, written together. add() only copies the
+     * data. commit() writes each file to a temp file next to it, fsyncs it
+     * and renames it over the real name, then fsyncs each folder once. If
+     * the kernel has io_uring, all the writes and fsyncs go in with a single
+     * system call. No file is replaced unless every write succeeded, and a
+     * batch that isn't committed leaves nothing behind. The copies are
+     * wiped when the batch is done with them, committed or not.
+     */
+    class FileWriteBatch {
+    private:
+        struct pending_write {
+            std::string file_name;
+            std::string temp_name;
+            uint8_t *data;
+            size_t len;
+            int fd;
+        };
+        pending_write m_writes[FILE_BATCH_MAX_WRITES];
+        size_t m_count;
+
+        bool write_all(void);
+        bool write_all_io_uring(void);
+        void discard(void);
+
+        FileWriteBatch(const FileWriteBatch&) = delete;
+        FileWriteBatch& operator=(const FileWriteBatch&) = delete;
+
+    public:
+        FileWriteBatch(void) : m_count(0) {}
+        ~FileWriteBatch(void) { discard(); }
+
+        bool add(const std::string file_name, const void *buffer, size_t len);
+        bool commit(void);
+        size_t count(void) const { return m_count; }
+    };
+
     /**
-     * Generate some random bytes
+     * Generate some random bytes, from this thread's CSPRNG (see csprng.h).
+     * False if it couldn't be seeded
      */
-    void gen_random_bytes(void *bytes, size_t num_bytes);
+    bool gen_random_bytes(void *bytes, size_t num_bytes);
 
     /**
      * Verify read/write access to an area of memory.